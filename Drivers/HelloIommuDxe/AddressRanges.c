@@ -0,0 +1,333 @@
+#include "HelloIommuDxe.h"
+
+/**
+ * @brief Returns the copy of the current UEFI memory map allocated from pool.
+ *
+ * @note The caller must free the copy with FreePool.
+ */
+static
+EFI_STATUS
+GetMemoryMapCopy (
+    OUT EFI_MEMORY_DESCRIPTOR** MemoryMap,
+    OUT UINTN* MemoryMapSize,
+    OUT UINTN* DescriptorSize
+    )
+{
+    EFI_STATUS status;
+    EFI_MEMORY_DESCRIPTOR* memoryMap;
+    UINTN memoryMapSize;
+    UINTN mapKey;
+    UINT32 descriptorVersion;
+
+    memoryMap = NULL;
+    memoryMapSize = 0;
+
+    status = gBS->GetMemoryMap(&memoryMapSize,
+                               NULL,
+                               &mapKey,
+                               DescriptorSize,
+                               &descriptorVersion);
+    if (status != EFI_BUFFER_TOO_SMALL)
+    {
+        DEBUG((DEBUG_ERROR, "GetMemoryMap failed : %r\n", status));
+        status = EFI_ERROR(status) ? status : EFI_NOT_FOUND;
+        goto Exit;
+    }
+
+    //
+    // Allocating the buffer may split an existing descriptor. Reserve room for
+    // a few more descriptors.
+    //
+    memoryMapSize += *DescriptorSize * 8;
+    memoryMap = AllocatePool(memoryMapSize);
+    if (memoryMap == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    status = gBS->GetMemoryMap(&memoryMapSize,
+                               memoryMap,
+                               &mapKey,
+                               DescriptorSize,
+                               &descriptorVersion);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "GetMemoryMap failed : %r\n", status));
+        goto Exit;
+    }
+
+    *MemoryMap = memoryMap;
+    *MemoryMapSize = memoryMapSize;
+
+Exit:
+    if (EFI_ERROR(status) && (memoryMap != NULL))
+    {
+        FreePool(memoryMap);
+    }
+    return status;
+}
+
+/**
+ * @brief Collects the memory apertures of all PCI root bridges.
+ *
+ * @details The apertures are reported by each root bridge once PCI resources
+ *          are allocated. Nothing is collected for a root bridge not reporting
+ *          them yet.
+ *
+ * @param Ranges - The array to receive the apertures, or NULL to only count.
+ * @return The number of apertures.
+ */
+static
+UINT64
+GetPciMmioApertures (
+    IN CONST EFI_HANDLE* Handles,
+    IN UINTN HandleCount,
+    OUT DMAR_ADDRESS_RANGE* Ranges OPTIONAL
+    )
+{
+    UINT64 apertureCount;
+
+    apertureCount = 0;
+    for (UINTN i = 0; i < HandleCount; ++i)
+    {
+        EFI_STATUS status;
+        EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL* rootBridgeIo;
+        EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR* descriptor;
+
+        status = gBS->HandleProtocol(Handles[i],
+                                     &gEfiPciRootBridgeIoProtocolGuid,
+                                     (VOID**)&rootBridgeIo);
+        if (EFI_ERROR(status))
+        {
+            continue;
+        }
+
+        status = rootBridgeIo->Configuration(rootBridgeIo, (VOID**)&descriptor);
+        if (EFI_ERROR(status))
+        {
+            continue;
+        }
+
+        for (; descriptor->Desc == ACPI_ADDRESS_SPACE_DESCRIPTOR; ++descriptor)
+        {
+            if ((descriptor->ResType != ACPI_ADDRESS_SPACE_TYPE_MEM) ||
+                (descriptor->AddrLen == 0))
+            {
+                continue;
+            }
+
+            if (Ranges != NULL)
+            {
+                Ranges[apertureCount].Base = descriptor->AddrRangeMin;
+                Ranges[apertureCount].End = descriptor->AddrRangeMin + descriptor->AddrLen;
+            }
+            apertureCount++;
+        }
+    }
+    return apertureCount;
+}
+
+/**
+ * @brief Sorts the ranges by the base address and merges overlapping and
+ *        adjacent ones in place.
+ *
+ * @return The number of ranges after merging.
+ */
+static
+UINT64
+SortAndMergeRanges (
+    IN OUT DMAR_ADDRESS_RANGE* Ranges,
+    IN UINT64 RangeCount
+    )
+{
+    UINT64 mergedCount;
+
+    //
+    // Insertion sort. The number of ranges is small, and the memory map is
+    // mostly sorted already.
+    //
+    for (UINT64 i = 1; i < RangeCount; ++i)
+    {
+        DMAR_ADDRESS_RANGE range;
+        UINT64 j;
+
+        range = Ranges[i];
+        for (j = i; (j > 0) && (Ranges[j - 1].Base > range.Base); --j)
+        {
+            Ranges[j] = Ranges[j - 1];
+        }
+        Ranges[j] = range;
+    }
+
+    mergedCount = 0;
+    for (UINT64 i = 0; i < RangeCount; ++i)
+    {
+        if ((mergedCount != 0) && (Ranges[i].Base <= Ranges[mergedCount - 1].End))
+        {
+            Ranges[mergedCount - 1].End = MAX(Ranges[mergedCount - 1].End, Ranges[i].End);
+            continue;
+        }
+        Ranges[mergedCount] = Ranges[i];
+        mergedCount++;
+    }
+    return mergedCount;
+}
+
+/**
+ * @brief Returns the end of the highest range reported in the UEFI memory map,
+ *        or zero on error.
+ */
+UINT64
+GetTopOfSystemMemory (
+    VOID
+    )
+{
+    EFI_STATUS status;
+    EFI_MEMORY_DESCRIPTOR* memoryMap;
+    EFI_MEMORY_DESCRIPTOR* descriptor;
+    UINTN memoryMapSize;
+    UINTN descriptorSize;
+    UINT64 topOfMemory;
+
+    topOfMemory = 0;
+
+    status = GetMemoryMapCopy(&memoryMap, &memoryMapSize, &descriptorSize);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    for (descriptor = memoryMap;
+         (UINT64)descriptor < (UINT64)Add2Ptr(memoryMap, memoryMapSize);
+         descriptor = NEXT_MEMORY_DESCRIPTOR(descriptor, descriptorSize))
+    {
+        topOfMemory = MAX(topOfMemory,
+                          descriptor->PhysicalStart + EFI_PAGES_TO_SIZE(descriptor->NumberOfPages));
+    }
+    FreePool(memoryMap);
+
+Exit:
+    return topOfMemory;
+}
+
+/**
+ * @brief Returns the sorted, non-overlapping ranges devices may access, that
+ *        is, all ranges in the UEFI memory map and the memory apertures of PCI
+ *        root bridges, below Limit.
+ *
+ * @details Holes in the physical address space are excluded so that they can
+ *          be left non-present in the translations.
+ *
+ * @param Limit - The address above which ranges are discarded.
+ * @param Ranges - The array of ranges allocated from pool. The caller must free
+ *                 it with FreePool.
+ * @param RangeCount - The number of entries in Ranges.
+ */
+EFI_STATUS
+GetDmaAccessibleRanges (
+    IN UINT64 Limit,
+    OUT DMAR_ADDRESS_RANGE** Ranges,
+    OUT UINT64* RangeCount
+    )
+{
+    EFI_STATUS status;
+    EFI_MEMORY_DESCRIPTOR* memoryMap;
+    EFI_MEMORY_DESCRIPTOR* descriptor;
+    UINTN memoryMapSize;
+    UINTN descriptorSize;
+    EFI_HANDLE* handles;
+    UINTN handleCount;
+    DMAR_ADDRESS_RANGE* ranges;
+    UINT64 rangeCount;
+    UINT64 clippedCount;
+
+    memoryMap = NULL;
+    handles = NULL;
+    handleCount = 0;
+    ranges = NULL;
+
+    status = GetMemoryMapCopy(&memoryMap, &memoryMapSize, &descriptorSize);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // No root bridge is not an error. Only the memory map is used then.
+    //
+    status = gBS->LocateHandleBuffer(ByProtocol,
+                                     &gEfiPciRootBridgeIoProtocolGuid,
+                                     NULL,
+                                     &handleCount,
+                                     &handles);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_WARN, "No PCI root bridge found : %r\n", status));
+        handles = NULL;
+        handleCount = 0;
+    }
+
+    rangeCount = (memoryMapSize / descriptorSize) +
+                 GetPciMmioApertures(handles, handleCount, NULL);
+    ranges = AllocatePool(rangeCount * sizeof(*ranges));
+    if (ranges == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    rangeCount = GetPciMmioApertures(handles, handleCount, ranges);
+    for (descriptor = memoryMap;
+         (UINT64)descriptor < (UINT64)Add2Ptr(memoryMap, memoryMapSize);
+         descriptor = NEXT_MEMORY_DESCRIPTOR(descriptor, descriptorSize))
+    {
+        ranges[rangeCount].Base = descriptor->PhysicalStart;
+        ranges[rangeCount].End = descriptor->PhysicalStart +
+                                 EFI_PAGES_TO_SIZE(descriptor->NumberOfPages);
+        rangeCount++;
+    }
+
+    rangeCount = SortAndMergeRanges(ranges, rangeCount);
+
+    //
+    // Align each range to the page boundaries and discard what is above Limit.
+    // Ranges that overlap after alignment are merged again.
+    //
+    clippedCount = 0;
+    for (UINT64 i = 0; i < rangeCount; ++i)
+    {
+        UINT64 base;
+        UINT64 end;
+
+        base = ranges[i].Base & ~(UINT64)(SIZE_4KB - 1);
+        end = MIN(ALIGN_VALUE(ranges[i].End, SIZE_4KB), Limit);
+        if (base >= end)
+        {
+            continue;
+        }
+        ranges[clippedCount].Base = base;
+        ranges[clippedCount].End = end;
+        clippedCount++;
+    }
+    rangeCount = SortAndMergeRanges(ranges, clippedCount);
+
+    *Ranges = ranges;
+    *RangeCount = rangeCount;
+    status = EFI_SUCCESS;
+
+Exit:
+    if (EFI_ERROR(status) && (ranges != NULL))
+    {
+        FreePool(ranges);
+    }
+    if (handles != NULL)
+    {
+        FreePool(handles);
+    }
+    if (memoryMap != NULL)
+    {
+        FreePool(memoryMap);
+    }
+    return status;
+}
@@ -0,0 +1,254 @@
+#include "HelloIommuDxe.h"
+
+//
+// The number of size classes, from 4KB (order 0) up to 64KB (order 4). Larger
+// buffers are allocated from boot services each time.
+//
+#define BOUNCE_BUFFER_CLASS_COUNT   5
+
+//
+// The header written into the first bytes of a buffer in a free list.
+//
+typedef struct _FREE_BOUNCE_BUFFER
+{
+    struct _FREE_BOUNCE_BUFFER* Next;
+} FREE_BOUNCE_BUFFER;
+
+//
+// The reservation below 4GB buffers are carved out from, and the index of the
+// lowest page never carved out.
+//
+static EFI_PHYSICAL_ADDRESS mBounceBufferPoolBase;
+static UINT64 mBounceBufferPoolPageCount;
+static UINT64 mUnusedPageIndex;
+
+//
+// The buffers returned to the pool for each size class. Buffers are reused in
+// LIFO order so that the most recently used one, whose paging structures are
+// in place and cache lines are likely hot, is picked first.
+//
+static FREE_BOUNCE_BUFFER* mFreeLists[BOUNCE_BUFFER_CLASS_COUNT];
+
+static DMAR_BOUNCE_BUFFER_STATISTICS mBounceBufferStatistics;
+static EFI_EVENT mExitBootServicesEvent;
+
+/**
+ * @brief Returns the size class of the number of pages, that is, the order of
+ *        the smallest power of two not less than it.
+ */
+static
+UINT64
+GetSizeClass (
+    IN UINTN Pages
+    )
+{
+    return (Pages <= 1) ? 0 : (UINT64)HighBitSet64(Pages - 1) + 1;
+}
+
+/**
+ * @brief Tests whether the address is within the reservation.
+ */
+static
+BOOLEAN
+IsBounceBufferPoolAddress (
+    IN EFI_PHYSICAL_ADDRESS Address
+    )
+{
+    return ((Address >= mBounceBufferPoolBase) &&
+            (Address < (mBounceBufferPoolBase + EFI_PAGES_TO_SIZE(mBounceBufferPoolPageCount))));
+}
+
+/**
+ * @brief Logs the statistics before the OS takes over.
+ */
+static
+VOID
+EFIAPI
+HandleExitBootServices (
+    IN EFI_EVENT Event,
+    IN VOID* Context
+    )
+{
+    DEBUG((DEBUG_INFO,
+           "Bounce buffers: %llu hits, %llu misses, %llu fallbacks, %llu of %llu pages carved out\n",
+           mBounceBufferStatistics.Hits,
+           mBounceBufferStatistics.Misses,
+           mBounceBufferStatistics.Fallbacks,
+           mUnusedPageIndex,
+           mBounceBufferPoolPageCount));
+}
+
+/**
+ * @brief Reserves PcdBounceBufferPoolPageCount pages below 4GB for bounce
+ *        buffers.
+ *
+ * @details Failure is not fatal. Bounce buffers are allocated from boot
+ *          services each time if the reservation is not available.
+ */
+EFI_STATUS
+InitializeBounceBufferPool (
+    VOID
+    )
+{
+    EFI_STATUS status;
+    EFI_PHYSICAL_ADDRESS base;
+
+    status = gBS->CreateEvent(EVT_SIGNAL_EXIT_BOOT_SERVICES,
+                              TPL_CALLBACK,
+                              HandleExitBootServices,
+                              NULL,
+                              &mExitBootServicesEvent);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "CreateEvent failed : %r\n", status));
+        goto Exit;
+    }
+
+    base = SIZE_4GB - 1;
+    status = gBS->AllocatePages(AllocateMaxAddress,
+                                EfiBootServicesData,
+                                PcdGet32(PcdBounceBufferPoolPageCount),
+                                &base);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "AllocatePages failed : %r\n", status));
+        goto Exit;
+    }
+
+    mBounceBufferPoolBase = base;
+    mBounceBufferPoolPageCount = PcdGet32(PcdBounceBufferPoolPageCount);
+    DEBUG((DEBUG_INFO,
+           "Reserved %llu pages for bounce buffers at %p\n",
+           mBounceBufferPoolPageCount,
+           mBounceBufferPoolBase));
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Releases the event and the reservation made by
+ *        InitializeBounceBufferPool, if any.
+ *
+ * @note No buffer may be in use.
+ */
+VOID
+FreeBounceBufferPool (
+    VOID
+    )
+{
+    if (mExitBootServicesEvent != NULL)
+    {
+        gBS->CloseEvent(mExitBootServicesEvent);
+        mExitBootServicesEvent = NULL;
+    }
+    if (mBounceBufferPoolPageCount != 0)
+    {
+        gBS->FreePages(mBounceBufferPoolBase, mBounceBufferPoolPageCount);
+        mBounceBufferPoolBase = 0;
+        mBounceBufferPoolPageCount = 0;
+    }
+    mUnusedPageIndex = 0;
+    ZeroMem(mFreeLists, sizeof(mFreeLists));
+}
+
+/**
+ * @brief Allocates the buffer of the pages below 4GB.
+ *
+ * @details The buffer is taken from the free list of the size class if any
+ *          (hit), or carved out from the reservation (miss). If neither is
+ *          possible, or the size exceeds the largest class, it is allocated
+ *          from boot services (fallback).
+ *
+ * @return The buffer, or NULL if out of resources.
+ */
+VOID*
+AllocateBounceBuffer (
+    IN UINTN Pages
+    )
+{
+    EFI_STATUS status;
+    EFI_TPL oldTpl;
+    UINT64 sizeClass;
+    EFI_PHYSICAL_ADDRESS address;
+    VOID* buffer;
+
+    buffer = NULL;
+    sizeClass = GetSizeClass(Pages);
+
+    oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+    if (sizeClass < BOUNCE_BUFFER_CLASS_COUNT)
+    {
+        if (mFreeLists[sizeClass] != NULL)
+        {
+            buffer = mFreeLists[sizeClass];
+            mFreeLists[sizeClass] = mFreeLists[sizeClass]->Next;
+            mBounceBufferStatistics.Hits++;
+        }
+        else if ((mUnusedPageIndex + LShiftU64(1, (UINTN)sizeClass)) <= mBounceBufferPoolPageCount)
+        {
+            buffer = (VOID*)(UINTN)(mBounceBufferPoolBase + EFI_PAGES_TO_SIZE(mUnusedPageIndex));
+            mUnusedPageIndex += LShiftU64(1, (UINTN)sizeClass);
+            mBounceBufferStatistics.Misses++;
+        }
+    }
+    gBS->RestoreTPL(oldTpl);
+
+    if (buffer == NULL)
+    {
+        address = SIZE_4GB - 1;
+        status = gBS->AllocatePages(AllocateMaxAddress, EfiBootServicesData, Pages, &address);
+        if (EFI_ERROR(status))
+        {
+            DEBUG((DEBUG_ERROR, "AllocatePages failed : %r\n", status));
+            goto Exit;
+        }
+        buffer = (VOID*)(UINTN)address;
+        mBounceBufferStatistics.Fallbacks++;
+    }
+
+Exit:
+    return buffer;
+}
+
+/**
+ * @brief Returns the buffer allocated with AllocateBounceBuffer.
+ *
+ * @param Pages - The same value given to AllocateBounceBuffer.
+ */
+VOID
+FreeBounceBuffer (
+    IN VOID* Buffer,
+    IN UINTN Pages
+    )
+{
+    EFI_TPL oldTpl;
+    UINT64 sizeClass;
+    FREE_BOUNCE_BUFFER* freeBuffer;
+
+    if (IsBounceBufferPoolAddress((EFI_PHYSICAL_ADDRESS)(UINTN)Buffer) == FALSE)
+    {
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)Buffer, Pages);
+        return;
+    }
+
+    sizeClass = GetSizeClass(Pages);
+    ASSERT(sizeClass < BOUNCE_BUFFER_CLASS_COUNT);
+
+    oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+    freeBuffer = (FREE_BOUNCE_BUFFER*)Buffer;
+    freeBuffer->Next = mFreeLists[sizeClass];
+    mFreeLists[sizeClass] = freeBuffer;
+    gBS->RestoreTPL(oldTpl);
+}
+
+/**
+ * @brief Returns the counters of bounce buffer allocations.
+ */
+VOID
+GetBounceBufferStatistics (
+    OUT DMAR_BOUNCE_BUFFER_STATISTICS* Statistics
+    )
+{
+    *Statistics = mBounceBufferStatistics;
+}
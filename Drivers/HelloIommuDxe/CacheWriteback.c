@@ -0,0 +1,142 @@
+#include "HelloIommuDxe.h"
+
+//
+// The granularity dirty lines are tracked in. Writing back a 64-byte range
+// covers the whole line even on processors with larger cache lines.
+//
+#define CACHE_LINE_SIZE     64
+
+/**
+ * @brief Decides whether paging structures need to be written back to RAM for
+ *        the hardware units.
+ *
+ * @details Writeback is skipped only when all units walk paging structures
+ *          coherently (ECAP.C is set), as the structures are shared by all
+ *          units and the least coherent unit decides. See 10.4.3 Extended
+ *          Capability Register.
+ */
+VOID
+InitializeCacheWriteback (
+    OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount
+    )
+{
+    ZeroMem(Writeback, sizeof(*Writeback));
+
+    Writeback->Coherent = TRUE;
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        if (DmarUnits[i].ExtendedCapability.Bits.C == FALSE)
+        {
+            Writeback->Coherent = FALSE;
+        }
+    }
+
+    DEBUG((DEBUG_INFO,
+           "Paging structures are %a written back to RAM\n",
+           (Writeback->Coherent != FALSE) ? "not" : "explicitly"));
+}
+
+/**
+ * @brief Writes back the range of paging structures to RAM immediately, unless
+ *        all hardware units are coherent.
+ *
+ * @details This is for a new table that must reach RAM before the entry
+ *          pointing to it is published.
+ */
+VOID
+WriteBackPagingStructure (
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN CONST VOID* Address,
+    IN UINT64 Length
+    )
+{
+    UINT64 lineCount;
+
+    lineCount = (ALIGN_VALUE((UINT64)Address + Length, CACHE_LINE_SIZE) -
+                 ((UINT64)Address & ~(UINT64)(CACHE_LINE_SIZE - 1))) / CACHE_LINE_SIZE;
+    if (Writeback->Coherent != FALSE)
+    {
+        Writeback->SkippedLineCount += lineCount;
+        return;
+    }
+
+    WriteBackDataCacheRange((VOID*)Address, (UINTN)Length);
+    Writeback->WrittenBackLineCount += lineCount;
+}
+
+/**
+ * @brief Records that the range of paging structures was modified, so that each
+ *        cache line in it is written back once by CommitPagingStructureWriteback.
+ *
+ * @details If more lines than DMAR_MAX_DIRTY_CACHE_LINES are recorded, the lines
+ *          recorded so far are written back to make room.
+ */
+VOID
+MarkPagingStructureDirty (
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN CONST VOID* Address,
+    IN UINT64 Length
+    )
+{
+    UINT64 line;
+    UINT64 end;
+
+    line = (UINT64)Address & ~(UINT64)(CACHE_LINE_SIZE - 1);
+    end = (UINT64)Address + Length;
+    for (; line < end; line += CACHE_LINE_SIZE)
+    {
+        BOOLEAN recorded;
+
+        if (Writeback->Coherent != FALSE)
+        {
+            Writeback->SkippedLineCount++;
+            continue;
+        }
+
+        //
+        // Search from the most recent one, as updates tend to be clustered.
+        //
+        recorded = FALSE;
+        for (UINT64 i = Writeback->LineCount; i > 0; --i)
+        {
+            if (Writeback->Lines[i - 1] == line)
+            {
+                recorded = TRUE;
+                break;
+            }
+        }
+        if (recorded != FALSE)
+        {
+            Writeback->DeduplicatedLineCount++;
+            continue;
+        }
+
+        if (Writeback->LineCount == ARRAY_SIZE(Writeback->Lines))
+        {
+            CommitPagingStructureWriteback(Writeback);
+        }
+        Writeback->Lines[Writeback->LineCount] = line;
+        Writeback->LineCount++;
+    }
+}
+
+/**
+ * @brief Writes back all cache lines recorded with MarkPagingStructureDirty.
+ *
+ * @note This must be done before invalidating caches of hardware for the
+ *       modification.
+ */
+VOID
+CommitPagingStructureWriteback (
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback
+    )
+{
+    for (UINT64 i = 0; i < Writeback->LineCount; ++i)
+    {
+        WriteBackDataCacheRange((VOID*)Writeback->Lines[i], CACHE_LINE_SIZE);
+    }
+    Writeback->WrittenBackLineCount += Writeback->LineCount;
+    Writeback->LineCount = 0;
+}
@@ -0,0 +1,873 @@
+#include "HelloIommuDxe.h"
+
+//
+// The offsets of the bus number registers in the type 1 (PCI-to-PCI bridge)
+// configuration space header.
+//
+#define PCI_BRIDGE_SECONDARY_BUS_OFFSET     0x19
+#define PCI_BRIDGE_SUBORDINATE_BUS_OFFSET   0x1a
+
+/**
+ * @brief Returns the topology of the segment, or NULL if no hardware unit is
+ *        reported for it.
+ */
+static
+DMAR_SEGMENT_TOPOLOGY*
+FindSegmentTopology (
+    IN CONST DMAR_TOPOLOGY* Topology,
+    IN UINT16 Segment
+    )
+{
+    //
+    // Segments are few, typically one per socket at most.
+    //
+    for (UINT64 i = 0; i < Topology->SegmentCount; ++i)
+    {
+        if (Topology->Segments[i].Segment == Segment)
+        {
+            return &Topology->Segments[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the PCI root bridge I/O protocol of the segment, or NULL if
+ *        not found.
+ */
+static
+EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL*
+FindRootBridgeIoOfSegment (
+    IN CONST EFI_HANDLE* Handles,
+    IN UINTN HandleCount,
+    IN UINT16 Segment
+    )
+{
+    for (UINTN i = 0; i < HandleCount; ++i)
+    {
+        EFI_STATUS status;
+        EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL* rootBridgeIo;
+
+        status = gBS->HandleProtocol(Handles[i],
+                                     &gEfiPciRootBridgeIoProtocolGuid,
+                                     (VOID**)&rootBridgeIo);
+        if (!EFI_ERROR(status) && (rootBridgeIo->SegmentNumber == Segment))
+        {
+            return rootBridgeIo;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads the 8-bit register of the PCI configuration space of the
+ *        function in the segment.
+ */
+static
+EFI_STATUS
+ReadPciConfig8 (
+    IN CONST DMAR_SEGMENT_TOPOLOGY* SegmentTopology,
+    IN UINT8 Bus,
+    IN UINT8 DevFn,
+    IN UINT8 Offset,
+    OUT UINT8* Value
+    )
+{
+    if (SegmentTopology->RootBridgeIo == NULL)
+    {
+        return EFI_NOT_FOUND;
+    }
+    return SegmentTopology->RootBridgeIo->Pci.Read(SegmentTopology->RootBridgeIo,
+                                                   EfiPciWidthUint8,
+                                                   EFI_PCI_ADDRESS(Bus, DevFn >> 3, DevFn & 0x7, Offset),
+                                                   1,
+                                                   Value);
+}
+
+/**
+ * @brief Returns the table of unit indexes of the bus, allocating it as needed.
+ */
+static
+UINT8*
+GetOrAllocateBusTable (
+    IN OUT DMAR_SEGMENT_TOPOLOGY* SegmentTopology,
+    IN UINT8 Bus
+    )
+{
+    if (SegmentTopology->UnitIndexes[Bus] == NULL)
+    {
+        SegmentTopology->UnitIndexes[Bus] = AllocatePool(DMAR_DEVFN_COUNT);
+        if (SegmentTopology->UnitIndexes[Bus] != NULL)
+        {
+            SetMem(SegmentTopology->UnitIndexes[Bus], DMAR_DEVFN_COUNT, DMAR_UNIT_INDEX_NONE);
+        }
+    }
+    return SegmentTopology->UnitIndexes[Bus];
+}
+
+/**
+ * @brief Resolves the PCI path of the device scope to the bus and device-
+ *        function number of the function at the end of it, reading the
+ *        secondary bus number of each bridge along the path.
+ *
+ * @return The number of path entries, zero if the scope is not a PCI
+ *         function, or MAX_UINT64 if the path cannot be resolved.
+ */
+static
+UINT64
+ResolveDeviceScope (
+    IN CONST DMAR_SEGMENT_TOPOLOGY* SegmentTopology,
+    IN CONST EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER* Scope,
+    OUT UINT8* Bus,
+    OUT UINT8* DevFn
+    )
+{
+    CONST EFI_ACPI_DMAR_PCI_PATH* path;
+    UINT64 pathCount;
+
+    if ((Scope->Type != EFI_ACPI_DEVICE_SCOPE_ENTRY_TYPE_PCI_ENDPOINT) &&
+        (Scope->Type != EFI_ACPI_DEVICE_SCOPE_ENTRY_TYPE_PCI_BRIDGE) &&
+        (Scope->Type != EFI_ACPI_DEVICE_SCOPE_ENTRY_TYPE_IOAPIC) &&
+        (Scope->Type != EFI_ACPI_DEVICE_SCOPE_ENTRY_TYPE_MSI_CAPABLE_HPET))
+    {
+        return 0;
+    }
+
+    path = (CONST EFI_ACPI_DMAR_PCI_PATH*)(Scope + 1);
+    pathCount = (Scope->Length - sizeof(*Scope)) / sizeof(*path);
+    if (pathCount == 0)
+    {
+        return MAX_UINT64;
+    }
+
+    *Bus = Scope->StartBusNumber;
+    for (UINT64 i = 0; i < pathCount; ++i)
+    {
+        *DevFn = (UINT8)((path[i].Device << 3) | (path[i].Function & 0x7));
+        if ((i + 1) < pathCount)
+        {
+            if (EFI_ERROR(ReadPciConfig8(SegmentTopology, *Bus, *DevFn, PCI_BRIDGE_SECONDARY_BUS_OFFSET, Bus)))
+            {
+                return MAX_UINT64;
+            }
+        }
+    }
+    return pathCount;
+}
+
+/**
+ * @brief Records the unit as the owner of the devices the scope describes.
+ *        For a bridge, all buses below it are owned too.
+ */
+static
+EFI_STATUS
+AddDeviceScopeOfUnit (
+    IN OUT DMAR_SEGMENT_TOPOLOGY* SegmentTopology,
+    IN CONST EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER* Scope,
+    IN UINT8 UnitIndex
+    )
+{
+    UINT8 bus;
+    UINT8 devFn;
+    UINT8 secondaryBus;
+    UINT8 subordinateBus;
+    UINT8* busTable;
+    UINT64 pathCount;
+
+    pathCount = ResolveDeviceScope(SegmentTopology, Scope, &bus, &devFn);
+    if (pathCount == 0)
+    {
+        return EFI_SUCCESS;
+    }
+    if (pathCount == MAX_UINT64)
+    {
+        DEBUG((DEBUG_WARN,
+               "Failed to resolve the device scope at bus %02x on segment %u\n",
+               Scope->StartBusNumber,
+               SegmentTopology->Segment));
+        return EFI_SUCCESS;
+    }
+
+    busTable = GetOrAllocateBusTable(SegmentTopology, bus);
+    if (busTable == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    busTable[devFn] = UnitIndex;
+
+    if (Scope->Type != EFI_ACPI_DEVICE_SCOPE_ENTRY_TYPE_PCI_BRIDGE)
+    {
+        return EFI_SUCCESS;
+    }
+    if (EFI_ERROR(ReadPciConfig8(SegmentTopology, bus, devFn, PCI_BRIDGE_SECONDARY_BUS_OFFSET, &secondaryBus)) ||
+        EFI_ERROR(ReadPciConfig8(SegmentTopology, bus, devFn, PCI_BRIDGE_SUBORDINATE_BUS_OFFSET, &subordinateBus)) ||
+        (secondaryBus == 0) ||
+        (secondaryBus > subordinateBus))
+    {
+        DEBUG((DEBUG_WARN,
+               "Bus numbers of the bridge %02x:%02x.%x are not assigned\n",
+               bus,
+               devFn >> 3,
+               devFn & 0x7));
+        return EFI_SUCCESS;
+    }
+    for (UINT64 b = secondaryBus; b <= subordinateBus; ++b)
+    {
+        busTable = GetOrAllocateBusTable(SegmentTopology, (UINT8)b);
+        if (busTable == NULL)
+        {
+            return EFI_OUT_OF_RESOURCES;
+        }
+        SetMem(busTable, DMAR_DEVFN_COUNT, UnitIndex);
+    }
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Parses the DRHD structure at the index of DmarUnits.
+ */
+static
+EFI_STATUS
+ProcessDrhd (
+    IN OUT DMAR_TOPOLOGY* Topology,
+    IN CONST EFI_ACPI_DMAR_DRHD_HEADER* Drhd,
+    IN UINT8 UnitIndex,
+    IN CONST EFI_HANDLE* Handles,
+    IN UINTN HandleCount
+    )
+{
+    EFI_STATUS status;
+    DMAR_SEGMENT_TOPOLOGY* segmentTopology;
+    CONST EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER* scope;
+
+    segmentTopology = FindSegmentTopology(Topology, Drhd->SegmentNumber);
+    if (segmentTopology == NULL)
+    {
+        segmentTopology = &Topology->Segments[Topology->SegmentCount];
+        Topology->SegmentCount++;
+        segmentTopology->Segment = Drhd->SegmentNumber;
+        segmentTopology->IncludeAllUnitIndex = DMAR_UNIT_INDEX_NONE;
+        segmentTopology->RootBridgeIo = FindRootBridgeIoOfSegment(Handles,
+                                                                  HandleCount,
+                                                                  Drhd->SegmentNumber);
+    }
+
+    if ((Drhd->Flags & EFI_ACPI_DMAR_DRHD_FLAGS_INCLUDE_PCI_ALL) != 0)
+    {
+        //
+        // The unit owns all devices on the segment not listed by other units.
+        // Its device scope, if any, only lists I/O APICs and HPETs.
+        //
+        segmentTopology->IncludeAllUnitIndex = UnitIndex;
+    }
+
+    status = EFI_SUCCESS;
+    for (scope = (CONST EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER*)(Drhd + 1);
+         (UINT64)scope < (UINT64)Add2Ptr(Drhd, ((CONST EFI_ACPI_DMAR_STRUCTURE_HEADER*)Drhd)->Length);
+         scope = Add2Ptr(scope, scope->Length))
+    {
+        if (scope->Length < sizeof(*scope))
+        {
+            break;
+        }
+        status = AddDeviceScopeOfUnit(segmentTopology, scope, UnitIndex);
+        if (EFI_ERROR(status))
+        {
+            break;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Parses the RMRR structure into the next entry of the reserved memory
+ *        list.
+ *
+ * @return The number of entries of SourceIds used.
+ */
+static
+UINT64
+ProcessRmrr (
+    IN OUT DMAR_TOPOLOGY* Topology,
+    IN CONST EFI_ACPI_DMAR_RMRR_HEADER* Rmrr,
+    IN OUT UINT16* SourceIds
+    )
+{
+    DMAR_RESERVED_MEMORY* reservedMemory;
+    DMAR_SEGMENT_TOPOLOGY* segmentTopology;
+    CONST EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER* scope;
+
+    //
+    // The region must be aligned to 4KB. See 8.4 Reserved Memory Region
+    // Reporting Structure.
+    //
+    if (((Rmrr->ReservedMemoryRegionBaseAddress % SIZE_4KB) != 0) ||
+        (((Rmrr->ReservedMemoryRegionLimitAddress + 1) % SIZE_4KB) != 0) ||
+        (Rmrr->ReservedMemoryRegionBaseAddress > Rmrr->ReservedMemoryRegionLimitAddress))
+    {
+        DEBUG((DEBUG_WARN,
+               "Ignoring the malformed RMRR %llx-%llx\n",
+               Rmrr->ReservedMemoryRegionBaseAddress,
+               Rmrr->ReservedMemoryRegionLimitAddress));
+        return 0;
+    }
+
+    reservedMemory = &Topology->ReservedMemory[Topology->ReservedMemoryCount];
+    Topology->ReservedMemoryCount++;
+    reservedMemory->Segment = Rmrr->SegmentNumber;
+    reservedMemory->Base = Rmrr->ReservedMemoryRegionBaseAddress;
+    reservedMemory->End = Rmrr->ReservedMemoryRegionLimitAddress + 1;
+    reservedMemory->SourceIds = SourceIds;
+    reservedMemory->SourceIdCount = 0;
+
+    segmentTopology = FindSegmentTopology(Topology, Rmrr->SegmentNumber);
+    for (scope = (CONST EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER*)(Rmrr + 1);
+         (UINT64)scope < (UINT64)Add2Ptr(Rmrr, ((CONST EFI_ACPI_DMAR_STRUCTURE_HEADER*)Rmrr)->Length);
+         scope = Add2Ptr(scope, scope->Length))
+    {
+        UINT8 bus;
+        UINT8 devFn;
+        UINT64 pathCount;
+
+        if (scope->Length < sizeof(*scope))
+        {
+            break;
+        }
+        if (segmentTopology == NULL)
+        {
+            continue;
+        }
+        pathCount = ResolveDeviceScope(segmentTopology, scope, &bus, &devFn);
+        if ((pathCount == 0) || (pathCount == MAX_UINT64))
+        {
+            continue;
+        }
+        reservedMemory->SourceIds[reservedMemory->SourceIdCount] = (UINT16)((bus << 8) | devFn);
+        reservedMemory->SourceIdCount++;
+    }
+
+    DEBUG((DEBUG_VERBOSE,
+           "RMRR %llx-%llx on segment %u for %llu devices\n",
+           reservedMemory->Base,
+           reservedMemory->End,
+           reservedMemory->Segment,
+           reservedMemory->SourceIdCount));
+    return reservedMemory->SourceIdCount;
+}
+
+/**
+ * @brief Builds the topology of hardware units, reserved memory regions and
+ *        proximity domains from the DMAR table.
+ *
+ * @details The table is walked twice: once to count structures and device
+ *          scopes to size all arrays, and once to fill them out. The owner of
+ *          each source-id is then looked up in constant time with
+ *          GetDmarUnitIndexOfDevice, instead of scanning the device scopes of
+ *          all units.
+ *
+ * @param DmarUnits - The units collected from the same table, in the order of
+ *                    DRHD structures.
+ */
+EFI_STATUS
+BuildDmarTopology (
+    IN CONST EFI_ACPI_DMAR_HEADER* DmarTable,
+    IN UINT64 DmarUnitCount,
+    OUT DMAR_TOPOLOGY* Topology
+    )
+{
+    EFI_STATUS status;
+    UINT64 endOfDmar;
+    CONST EFI_ACPI_DMAR_STRUCTURE_HEADER* dmarHeader;
+    UINT64 drhdCount;
+    UINT64 rmrrCount;
+    UINT64 rmrrScopeCount;
+    UINT64 rhsaCount;
+    UINT16* sourceIds;
+    EFI_HANDLE* handles;
+    UINTN handleCount;
+
+    ZeroMem(Topology, sizeof(*Topology));
+    handles = NULL;
+    handleCount = 0;
+
+    //
+    // Count the structures to size the arrays.
+    //
+    drhdCount = 0;
+    rmrrCount = 0;
+    rmrrScopeCount = 0;
+    rhsaCount = 0;
+    endOfDmar = (UINT64)Add2Ptr(DmarTable, DmarTable->Header.Length);
+    for (dmarHeader = (CONST EFI_ACPI_DMAR_STRUCTURE_HEADER*)(DmarTable + 1);
+         (UINT64)dmarHeader < endOfDmar;
+         dmarHeader = Add2Ptr(dmarHeader, dmarHeader->Length))
+    {
+        if (dmarHeader->Length < sizeof(*dmarHeader))
+        {
+            status = EFI_INVALID_PARAMETER;
+            goto Exit;
+        }
+        if (dmarHeader->Type == EFI_ACPI_DMAR_TYPE_DRHD)
+        {
+            drhdCount++;
+        }
+        else if (dmarHeader->Type == EFI_ACPI_DMAR_TYPE_RMRR)
+        {
+            rmrrCount++;
+            rmrrScopeCount += (dmarHeader->Length - sizeof(EFI_ACPI_DMAR_RMRR_HEADER)) /
+                              sizeof(EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER);
+        }
+        else if (dmarHeader->Type == EFI_ACPI_DMAR_TYPE_RHSA)
+        {
+            rhsaCount++;
+        }
+    }
+    ASSERT(drhdCount == DmarUnitCount);
+
+    Topology->Segments = AllocateZeroPool(drhdCount * sizeof(*Topology->Segments));
+    Topology->ReservedMemory = AllocateZeroPool(rmrrCount * sizeof(*Topology->ReservedMemory) +
+                                                rmrrScopeCount * sizeof(UINT16));
+    Topology->Affinities = AllocateZeroPool(rhsaCount * sizeof(*Topology->Affinities));
+    if ((Topology->Segments == NULL) ||
+        (Topology->ReservedMemory == NULL) ||
+        (Topology->Affinities == NULL))
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    sourceIds = Add2Ptr(Topology->ReservedMemory, rmrrCount * sizeof(*Topology->ReservedMemory));
+
+    //
+    // Bridges on the paths of device scopes are read through the root bridges.
+    // Without them, only scopes directly on the start bus are resolved.
+    //
+    status = gBS->LocateHandleBuffer(ByProtocol,
+                                     &gEfiPciRootBridgeIoProtocolGuid,
+                                     NULL,
+                                     &handleCount,
+                                     &handles);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_WARN, "LocateHandleBuffer failed : %r\n", status));
+        handles = NULL;
+        handleCount = 0;
+    }
+
+    //
+    // Fill out the topology. RMRRs and RHSAs follow all DRHDs in the table.
+    //
+    status = EFI_SUCCESS;
+    drhdCount = 0;
+    for (dmarHeader = (CONST EFI_ACPI_DMAR_STRUCTURE_HEADER*)(DmarTable + 1);
+         (UINT64)dmarHeader < endOfDmar;
+         dmarHeader = Add2Ptr(dmarHeader, dmarHeader->Length))
+    {
+        if (dmarHeader->Type == EFI_ACPI_DMAR_TYPE_DRHD)
+        {
+            status = ProcessDrhd(Topology,
+                                 (CONST EFI_ACPI_DMAR_DRHD_HEADER*)dmarHeader,
+                                 (UINT8)drhdCount,
+                                 handles,
+                                 handleCount);
+            if (EFI_ERROR(status))
+            {
+                goto Exit;
+            }
+            drhdCount++;
+        }
+        else if (dmarHeader->Type == EFI_ACPI_DMAR_TYPE_RMRR)
+        {
+            sourceIds += ProcessRmrr(Topology, (CONST EFI_ACPI_DMAR_RMRR_HEADER*)dmarHeader, sourceIds);
+        }
+        else if (dmarHeader->Type == EFI_ACPI_DMAR_TYPE_RHSA)
+        {
+            CONST EFI_ACPI_DMAR_RHSA_HEADER* rhsa;
+
+            rhsa = (CONST EFI_ACPI_DMAR_RHSA_HEADER*)dmarHeader;
+            Topology->Affinities[Topology->AffinityCount].RegisterBase = rhsa->RegisterBaseAddress;
+            Topology->Affinities[Topology->AffinityCount].ProximityDomain = rhsa->ProximityDomain;
+            Topology->AffinityCount++;
+        }
+    }
+
+    DEBUG((DEBUG_INFO,
+           "DMAR topology: %llu segments, %llu RMRRs, %llu RHSAs\n",
+           Topology->SegmentCount,
+           Topology->ReservedMemoryCount,
+           Topology->AffinityCount));
+
+Exit:
+    if (handles != NULL)
+    {
+        FreePool(handles);
+    }
+    if (EFI_ERROR(status))
+    {
+        FreeDmarTopology(Topology);
+    }
+    return status;
+}
+
+/**
+ * @brief Frees everything BuildDmarTopology allocated.
+ */
+VOID
+FreeDmarTopology (
+    IN OUT DMAR_TOPOLOGY* Topology
+    )
+{
+    if (Topology->Segments != NULL)
+    {
+        for (UINT64 i = 0; i < Topology->SegmentCount; ++i)
+        {
+            for (UINT64 bus = 0; bus < ARRAY_SIZE(Topology->Segments[i].UnitIndexes); ++bus)
+            {
+                if (Topology->Segments[i].UnitIndexes[bus] != NULL)
+                {
+                    FreePool(Topology->Segments[i].UnitIndexes[bus]);
+                }
+            }
+        }
+        FreePool(Topology->Segments);
+    }
+    if (Topology->ReservedMemory != NULL)
+    {
+        FreePool(Topology->ReservedMemory);
+    }
+    if (Topology->Affinities != NULL)
+    {
+        FreePool(Topology->Affinities);
+    }
+    ZeroMem(Topology, sizeof(*Topology));
+}
+
+/**
+ * @brief Inserts the reserved memory region in the ranges of the device in the
+ *        order of the base.
+ *
+ * @return The number of entries in Ranges after insertion. The region is
+ *         dropped with a warning if there are DMAR_MAX_RESERVED_RANGES already.
+ */
+static
+UINT64
+InsertReservedRange (
+    IN OUT DMAR_ADDRESS_RANGE* Ranges,
+    IN UINT64 RangeCount,
+    IN UINT16 SourceId,
+    IN CONST DMAR_RESERVED_MEMORY* ReservedMemory
+    )
+{
+    UINT64 insertAt;
+
+    if (RangeCount == DMAR_MAX_RESERVED_RANGES)
+    {
+        DEBUG((DEBUG_WARN,
+               "Too many reserved memory regions for %04x. Dropping %llx-%llx\n",
+               SourceId,
+               ReservedMemory->Base,
+               ReservedMemory->End));
+        return RangeCount;
+    }
+
+    //
+    // Lists are short.
+    //
+    for (insertAt = RangeCount; (insertAt > 0) && (Ranges[insertAt - 1].Base > ReservedMemory->Base); --insertAt)
+    {
+        Ranges[insertAt] = Ranges[insertAt - 1];
+    }
+    Ranges[insertAt].Base = ReservedMemory->Base;
+    Ranges[insertAt].End = ReservedMemory->End;
+    return RangeCount + 1;
+}
+
+/**
+ * @brief Merges the sorted ranges overlapping or adjacent to the previous one.
+ *
+ * @return The number of entries in Ranges after merging.
+ */
+static
+UINT64
+MergeReservedRanges (
+    IN OUT DMAR_ADDRESS_RANGE* Ranges,
+    IN UINT64 RangeCount
+    )
+{
+    UINT64 mergedCount;
+
+    if (RangeCount == 0)
+    {
+        return 0;
+    }
+
+    mergedCount = 1;
+    for (UINT64 i = 1; i < RangeCount; ++i)
+    {
+        if (Ranges[i].Base <= Ranges[mergedCount - 1].End)
+        {
+            Ranges[mergedCount - 1].End = MAX(Ranges[mergedCount - 1].End, Ranges[i].End);
+            continue;
+        }
+        Ranges[mergedCount] = Ranges[i];
+        mergedCount++;
+    }
+    return mergedCount;
+}
+
+/**
+ * @brief Returns the reserved memory regions reported for the device, sorted,
+ *        with overlapping and adjacent regions merged.
+ *
+ * @param Ranges - The buffer of DMAR_MAX_RESERVED_RANGES entries to receive
+ *                 the regions.
+ *
+ * @return The number of entries written to Ranges. Regions beyond
+ *         DMAR_MAX_RESERVED_RANGES are dropped with a warning.
+ */
+UINT64
+GetReservedMemoryOfDevice (
+    IN CONST DMAR_TOPOLOGY* Topology,
+    IN UINT16 Segment,
+    IN UINT16 SourceId,
+    OUT DMAR_ADDRESS_RANGE* Ranges
+    )
+{
+    UINT64 rangeCount;
+
+    rangeCount = 0;
+    for (UINT64 i = 0; i < Topology->ReservedMemoryCount; ++i)
+    {
+        CONST DMAR_RESERVED_MEMORY* reservedMemory;
+
+        reservedMemory = &Topology->ReservedMemory[i];
+        if (reservedMemory->Segment != Segment)
+        {
+            continue;
+        }
+        for (UINT64 j = 0; j < reservedMemory->SourceIdCount; ++j)
+        {
+            if (reservedMemory->SourceIds[j] == SourceId)
+            {
+                rangeCount = InsertReservedRange(Ranges, rangeCount, SourceId, reservedMemory);
+                break;
+            }
+        }
+    }
+    return MergeReservedRanges(Ranges, rangeCount);
+}
+
+/**
+ * @brief Computes the number of table pages needed to map the reserved memory
+ *        regions of all devices in their own domains, not counting their
+ *        PML4s, and logs it.
+ *
+ * @details The device scopes of the regions are grouped by source-id with a
+ *          counting sort for each segment, so that the regions of every device
+ *          are collected in a single pass over the scopes, instead of looking
+ *          them up for each device.
+ *
+ * @param Use1GbPages - Whether the regions are mapped with 1GB pages where
+ *                      possible.
+ * @param PageCount - The number of table pages needed.
+ */
+EFI_STATUS
+GetReservedMemoryTablePageCount (
+    IN CONST DMAR_TOPOLOGY* Topology,
+    IN BOOLEAN Use1GbPages,
+    OUT UINT64* PageCount
+    )
+{
+    EFI_STATUS status;
+    UINT32* scopeEnds;
+    UINT32* regionIndexes;
+    UINT64 scopeCount;
+    UINT64 pageCount;
+    UINT64 deviceCount;
+
+    pageCount = 0;
+    deviceCount = 0;
+    regionIndexes = NULL;
+
+    //
+    // scopeEnds[SourceId] is first the number of scopes listing the source-id,
+    // then the index in regionIndexes where the regions of the source-id end.
+    //
+    scopeEnds = AllocatePool(sizeof(*scopeEnds) * (MAX_UINT16 + 1));
+    if (scopeEnds == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    scopeCount = 0;
+    for (UINT64 i = 0; i < Topology->ReservedMemoryCount; ++i)
+    {
+        scopeCount += Topology->ReservedMemory[i].SourceIdCount;
+    }
+    if (scopeCount > MAX_UINT32)
+    {
+        status = EFI_UNSUPPORTED;
+        goto Exit;
+    }
+    regionIndexes = AllocatePool(sizeof(*regionIndexes) * MAX(scopeCount, 1));
+    if (regionIndexes == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    for (UINT64 i = 0; i < Topology->ReservedMemoryCount; ++i)
+    {
+        UINT16 segment;
+        BOOLEAN segmentCounted;
+        UINT32 offset;
+        UINT32 start;
+
+        //
+        // Process each segment once, at the first region in it.
+        //
+        segment = Topology->ReservedMemory[i].Segment;
+        segmentCounted = FALSE;
+        for (UINT64 k = 0; k < i; ++k)
+        {
+            if (Topology->ReservedMemory[k].Segment == segment)
+            {
+                segmentCounted = TRUE;
+                break;
+            }
+        }
+        if (segmentCounted != FALSE)
+        {
+            continue;
+        }
+
+        ZeroMem(scopeEnds, sizeof(*scopeEnds) * (MAX_UINT16 + 1));
+        for (UINT64 k = i; k < Topology->ReservedMemoryCount; ++k)
+        {
+            CONST DMAR_RESERVED_MEMORY* reservedMemory;
+
+            reservedMemory = &Topology->ReservedMemory[k];
+            if (reservedMemory->Segment != segment)
+            {
+                continue;
+            }
+            for (UINT64 j = 0; j < reservedMemory->SourceIdCount; ++j)
+            {
+                scopeEnds[reservedMemory->SourceIds[j]]++;
+            }
+        }
+
+        //
+        // Turn the counts into the start of each source-id, then place the
+        // region indexes, which leaves each entry at the end of the source-id.
+        // Regions stay in the order of the table within each source-id.
+        //
+        offset = 0;
+        for (UINT64 sourceId = 0; sourceId <= MAX_UINT16; ++sourceId)
+        {
+            UINT32 count;
+
+            count = scopeEnds[sourceId];
+            scopeEnds[sourceId] = offset;
+            offset += count;
+        }
+        for (UINT64 k = i; k < Topology->ReservedMemoryCount; ++k)
+        {
+            CONST DMAR_RESERVED_MEMORY* reservedMemory;
+
+            reservedMemory = &Topology->ReservedMemory[k];
+            if (reservedMemory->Segment != segment)
+            {
+                continue;
+            }
+            for (UINT64 j = 0; j < reservedMemory->SourceIdCount; ++j)
+            {
+                regionIndexes[scopeEnds[reservedMemory->SourceIds[j]]++] = (UINT32)k;
+            }
+        }
+
+        start = 0;
+        for (UINT64 sourceId = 0; sourceId <= MAX_UINT16; ++sourceId)
+        {
+            DMAR_ADDRESS_RANGE ranges[DMAR_MAX_RESERVED_RANGES];
+            UINT64 rangeCount;
+
+            if (start == scopeEnds[sourceId])
+            {
+                continue;
+            }
+
+            rangeCount = 0;
+            for (UINT32 j = start; j < scopeEnds[sourceId]; ++j)
+            {
+                //
+                // A region listing the device more than once counts once.
+                //
+                if ((j != start) && (regionIndexes[j] == regionIndexes[j - 1]))
+                {
+                    continue;
+                }
+                rangeCount = InsertReservedRange(ranges,
+                                                 rangeCount,
+                                                 (UINT16)sourceId,
+                                                 &Topology->ReservedMemory[regionIndexes[j]]);
+            }
+            rangeCount = MergeReservedRanges(ranges, rangeCount);
+            start = scopeEnds[sourceId];
+
+            //
+            // The root table, context table and PML4 are not for the regions.
+            //
+            pageCount += GetPassthroughTranslationsPageCount(ranges, rangeCount, Use1GbPages) - 3;
+            deviceCount++;
+        }
+    }
+
+    DEBUG((DEBUG_INFO,
+           "Reserved memory regions of %llu devices cost %llu table pages\n",
+           deviceCount,
+           pageCount));
+    *PageCount = pageCount;
+    status = EFI_SUCCESS;
+
+Exit:
+    if (regionIndexes != NULL)
+    {
+        FreePool(regionIndexes);
+    }
+    if (scopeEnds != NULL)
+    {
+        FreePool(scopeEnds);
+    }
+    return status;
+}
+
+/**
+ * @brief Returns the index of the unit the device is under the scope of.
+ *
+ * @return The index into the units given to BuildDmarTopology, or
+ *         DMAR_UNIT_INDEX_NONE if no unit covers the device.
+ */
+UINT8
+GetDmarUnitIndexOfDevice (
+    IN CONST DMAR_TOPOLOGY* Topology,
+    IN UINT16 Segment,
+    IN UINT16 SourceId
+    )
+{
+    CONST DMAR_SEGMENT_TOPOLOGY* segmentTopology;
+    CONST UINT8* busTable;
+
+    segmentTopology = FindSegmentTopology(Topology, Segment);
+    if (segmentTopology == NULL)
+    {
+        return DMAR_UNIT_INDEX_NONE;
+    }
+
+    busTable = segmentTopology->UnitIndexes[(SourceId >> 8) & 0xff];
+    if ((busTable != NULL) && (busTable[SourceId & 0xff] != DMAR_UNIT_INDEX_NONE))
+    {
+        return busTable[SourceId & 0xff];
+    }
+    return segmentTopology->IncludeAllUnitIndex;
+}
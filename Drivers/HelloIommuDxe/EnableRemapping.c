@@ -0,0 +1,248 @@
+#include "HelloIommuDxe.h"
+
+//
+// The sequence of enabling DMA-remapping on hardware units. This is separate
+// from the entry point so that it can run against simulated registers.
+//
+
+//
+// The value of DMAR_UNIT_INFORMATION.EnableStageMicroseconds while the unit is
+// yet to complete the stage.
+//
+#define ENABLE_STAGE_PENDING    MAX_UINT64
+
+/**
+ * @brief Issues the command through the Global Command Register without waiting
+ *        for completion.
+ *
+ * @note Features already enabled remain enabled. See 10.4.4 Global Command
+ *       Register.
+ */
+VOID
+IssueGlobalCommand (
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT32 Command
+    )
+{
+    UINT32 currentStatus;
+
+    currentStatus = ReadDmarRegister32(DmarUnit->RegisterBaseVa, R_GSTS_REG);
+    WriteDmarRegister32(DmarUnit->RegisterBaseVa,
+                        R_GCMD_REG,
+                        (currentStatus & B_GMCD_REG_PERSISTENT_MASK) | Command);
+}
+
+/**
+ * @brief Waits until all units pending in the stage reflect the status in the
+ *        Global Status Register, and records when each of them did.
+ *
+ * @details Units are polled in turn so that the time each unit completes is
+ *          observed regardless of the others. The wait is also recorded in
+ *          WaitTimings of each unit, as the kind of Wait.
+ */
+static
+VOID
+WaitForGlobalStatusOfAllUnits (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN UINT64 Stage,
+    IN UINT64 Wait,
+    IN UINT32 Status,
+    IN UINT64 StartTimestamp
+    )
+{
+    UINT64 pendingCount;
+    UINT64 spinCount;
+
+    spinCount = 0;
+    do
+    {
+        pendingCount = 0;
+        spinCount++;
+        for (UINT64 i = 0; i < DmarUnitCount; ++i)
+        {
+            if (DmarUnits[i].EnableStageMicroseconds[Stage] != ENABLE_STAGE_PENDING)
+            {
+                continue;
+            }
+            if ((ReadDmarRegister32(DmarUnits[i].RegisterBaseVa, R_GSTS_REG) & Status) == 0)
+            {
+                pendingCount++;
+                continue;
+            }
+            DmarUnits[i].EnableStageMicroseconds[Stage] = GetElapsedMicroseconds(StartTimestamp);
+            RecordTiming(&DmarUnits[i].WaitTimings[Wait], StartTimestamp, spinCount);
+        }
+
+        if (pendingCount != 0)
+        {
+            CpuPause();
+        }
+    } while (pendingCount != 0);
+}
+
+/**
+ * @brief Enables DMA-remapping for all hardware units using the given
+ *        translations.
+ *
+ * @details Each stage of enabling is started on all units first, and then,
+ *          completion is waited for on all of them before moving on to the next
+ *          stage. This way, the latencies of the units overlap, and the cost is
+ *          roughly that of the slowest unit, instead of the sum of all units.
+ *          The time each unit took to complete each stage is recorded in
+ *          EnableStageMicroseconds.
+ *
+ * @note If invalidation fails on any unit, no unit is enabled.
+ */
+EFI_STATUS
+EnableDmaRemappingForAllUnits (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount
+    )
+{
+    EFI_STATUS status;
+    VTD_ROOT_TABLE_ADDRESS_REGISTER rootTableAddressReg;
+    UINT64 enableStartTimestamp;
+    UINT64 stageStartTimestamp;
+
+    enableStartTimestamp = GetTimestamp();
+
+    //
+    // Set the Root Table Pointer. This is equivalent to setting CR3 conceptually.
+    // After setting the "SRTP: Set Root Table Pointer" bit, software must wait
+    // completion of it. See 10.4.5 Global Status Register. Each unit uses the
+    // translations, or the replica of them, in its proximity domain.
+    //
+    stageStartTimestamp = GetTimestamp();
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        DEBUG((DEBUG_INFO,
+               "Setting the root table pointer of the remapping unit at %p to %p\n",
+               DmarUnits[i].RegisterBasePa,
+               DmarUnits[i].Translations->RootTable));
+        rootTableAddressReg.AsUInt64 = 0;
+        rootTableAddressReg.Bits.TranslationTableMode = (DmarUnits[i].Translations->ScalableMode != FALSE) ?
+            V_RTADDR_REG_TTM_SCALABLE :
+            V_RTADDR_REG_TTM_LEGACY;
+        rootTableAddressReg.Bits.RootTable = (UINT64)DmarUnits[i].Translations->RootTable >> 12;
+        WriteDmarRegister64(DmarUnits[i].RegisterBaseVa, R_RTADDR_REG, rootTableAddressReg.AsUInt64);
+        IssueGlobalCommand(&DmarUnits[i], B_GMCD_REG_SRTP);
+        DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_ROOT_TABLE] = ENABLE_STAGE_PENDING;
+    }
+    WaitForGlobalStatusOfAllUnits(DmarUnits,
+                                  DmarUnitCount,
+                                  DMAR_ENABLE_STAGE_ROOT_TABLE,
+                                  HELLO_IOMMU_WAIT_ROOT_TABLE_POINTER,
+                                  B_GSTS_REG_RTPS,
+                                  stageStartTimestamp);
+
+    //
+    // Switch to queued invalidation if supported. From this point, the context-
+    // cache and IOTLB invalidations below are queued and submitted at once.
+    //
+    stageStartTimestamp = GetTimestamp();
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_QUEUED_INVALIDATION] =
+            (EnableQueuedInvalidation(&DmarUnits[i]) != FALSE) ? ENABLE_STAGE_PENDING : 0;
+    }
+    WaitForGlobalStatusOfAllUnits(DmarUnits,
+                                  DmarUnitCount,
+                                  DMAR_ENABLE_STAGE_QUEUED_INVALIDATION,
+                                  HELLO_IOMMU_WAIT_QUEUED_INVALIDATION_ENABLE,
+                                  B_GSTS_REG_QIES,
+                                  stageStartTimestamp);
+
+    //
+    // Then, invalidate cache that may exists as requested by the specification.
+    //
+    // "After a ‘Set Root Table Pointer’ operation, software must perform global
+    //  invalidations on the context-cache, pasid-cache, and IOTLB, in that order."
+    // See 10.4.4 Global Command Register
+    //
+    // Units using register-based invalidation complete synchronously here. The
+    // pasid-cache exists only in scalable mode, which requires queued
+    // invalidation.
+    //
+    DEBUG((DEBUG_INFO, "Invalidating context-cache, pasid-cache and IOTLB globally\n"));
+    stageStartTimestamp = GetTimestamp();
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        InvalidateContextCache(&DmarUnits[i], DMAR_GRANULARITY_GLOBAL, 0, 0);
+        if (DmarUnits[i].Translations->ScalableMode != FALSE)
+        {
+            InvalidatePasidCache(&DmarUnits[i], DMAR_PASID_GRANULARITY_GLOBAL, 0, 0);
+        }
+        InvalidateIotlb(&DmarUnits[i], DMAR_GRANULARITY_GLOBAL, 0, 0, 0);
+        SubmitInvalidations(&DmarUnits[i]);
+        if (DmarUnits[i].InvalidationQueue.Descriptors == NULL)
+        {
+            DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_INVALIDATION] =
+                GetElapsedMicroseconds(stageStartTimestamp);
+        }
+    }
+    status = EFI_SUCCESS;
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        EFI_STATUS waitStatus;
+
+        if (DmarUnits[i].InvalidationQueue.Descriptors == NULL)
+        {
+            continue;
+        }
+        waitStatus = WaitForInvalidations(&DmarUnits[i]);
+        DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_INVALIDATION] =
+            GetElapsedMicroseconds(stageStartTimestamp);
+        if (EFI_ERROR(waitStatus))
+        {
+            DEBUG((DEBUG_ERROR, "WaitForInvalidations failed : %r\n", waitStatus));
+            status = waitStatus;
+        }
+    }
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Enabling DMA-remapping. See 10.4.4 Global Command Register.
+    //
+    DEBUG((DEBUG_INFO, "Enabling DMA-remapping\n"));
+    stageStartTimestamp = GetTimestamp();
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        IssueGlobalCommand(&DmarUnits[i], B_GMCD_REG_TE);
+        DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_TRANSLATION] = ENABLE_STAGE_PENDING;
+    }
+    WaitForGlobalStatusOfAllUnits(DmarUnits,
+                                  DmarUnitCount,
+                                  DMAR_ENABLE_STAGE_TRANSLATION,
+                                  HELLO_IOMMU_WAIT_TRANSLATION_ENABLE,
+                                  B_GSTS_REG_TE,
+                                  stageStartTimestamp);
+
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        DmarUnits[i].DmaRemappingEnabled = TRUE;
+        DEBUG((DEBUG_INFO,
+               "Unit at %p: SRTP %llu us, QIE %llu us, invalidation %llu us, TE %llu us\n",
+               DmarUnits[i].RegisterBasePa,
+               DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_ROOT_TABLE],
+               DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_QUEUED_INVALIDATION],
+               DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_INVALIDATION],
+               DmarUnits[i].EnableStageMicroseconds[DMAR_ENABLE_STAGE_TRANSLATION]));
+        DEBUG((DEBUG_INFO,
+               "%llu invalidations in %llu batches with %llu MMIO reads and %llu MMIO writes\n",
+               DmarUnits[i].InvalidationStatistics.Invalidations,
+               DmarUnits[i].InvalidationStatistics.Batches,
+               DmarUnits[i].InvalidationStatistics.MmioReads,
+               DmarUnits[i].InvalidationStatistics.MmioWrites));
+    }
+    DEBUG((DEBUG_INFO,
+           "Enabled DMA-remapping on %llu units in %llu us\n",
+           DmarUnitCount,
+           GetElapsedMicroseconds(enableStartTimestamp)));
+
+Exit:
+    return status;
+}
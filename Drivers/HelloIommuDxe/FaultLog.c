@@ -0,0 +1,557 @@
+#include "HelloIommuDxe.h"
+
+//
+// The number of records the queue holds. Must be a power of two.
+//
+#define FAULT_QUEUE_SIZE    256
+
+//
+// The number of source-ids whose statistics are tracked, as the power of two.
+//
+#define FAULT_STATISTICS_INDEX_BITS     6
+#define FAULT_STATISTICS_ENTRY_COUNT    (1 << FAULT_STATISTICS_INDEX_BITS)
+
+//
+// The subset of DMAR_UNIT_INFORMATION needed to drain faults, kept after the
+// entry point returns.
+//
+typedef struct _FAULT_LOG_UNIT
+{
+    UINT64 RegisterBasePa;
+    UINT64 RegisterBaseVa;
+    UINT64 FaultRecordingRegisterOffset;
+    UINT64 FaultRecordingRegisterCount;
+} FAULT_LOG_UNIT;
+
+static FAULT_LOG_UNIT* mFaultLogUnits;
+static UINT64 mFaultLogUnitCount;
+static EFI_EVENT mFaultDrainEvent;
+static HELLO_IOMMU_FAULT_SUMMARY mFaultSummary;
+static HELLO_IOMMU_FAULT_STATISTICS_TABLE* mFaultStatistics;
+
+//
+// The token bucket limiting the rate of fault messages. A message consumes a
+// token, and tokens are refilled at PcdFaultLogRatePerSecond up to
+// PcdFaultLogBurst.
+//
+static UINT64 mLogTokens;
+static UINT64 mLogTokenRefillTimestamp;
+static UINT64 mSuppressedLogCount;
+
+//
+// The single-producer, multi-consumer queue of records. Only the drain, which
+// runs at TPL_CALLBACK, advances the head. Consumers claim the record at the
+// tail by advancing it with compare-exchange. Both indexes only increase, and
+// the slot is the index modulo FAULT_QUEUE_SIZE.
+//
+static HELLO_IOMMU_FAULT_RECORD mFaultQueue[FAULT_QUEUE_SIZE];
+static volatile UINT64 mFaultQueueHead;
+static volatile UINT64 mFaultQueueTail;
+
+/**
+ * @brief Adds the record to the queue, or counts it as dropped if the queue is
+ *        full.
+ *
+ * @details The record is written into the slot before the head is advanced, so
+ *          that consumers never observe a partially written record.
+ */
+static
+VOID
+PushFaultRecord (
+    IN CONST HELLO_IOMMU_FAULT_RECORD* Record
+    )
+{
+    UINT64 head;
+
+    head = mFaultQueueHead;
+    if ((head - mFaultQueueTail) == FAULT_QUEUE_SIZE)
+    {
+        mFaultSummary.DroppedRecords++;
+        return;
+    }
+
+    mFaultQueue[head % FAULT_QUEUE_SIZE] = *Record;
+    MemoryFence();
+    mFaultQueueHead = head + 1;
+}
+
+/**
+ * @brief Returns the statistics entry of the source-id, or NULL if not found.
+ *
+ * @details The table is open-addressed with linear probing. The home slot is
+ *          chosen with Fibonacci hashing so that devices on the same bus spread
+ *          out. Entries are never removed.
+ *
+ * @param Add - TRUE to claim an unused entry for the source-id if not found.
+ */
+static
+HELLO_IOMMU_SOURCE_FAULT_STATISTICS*
+FindSourceStatistics (
+    IN UINT16 SourceId,
+    IN BOOLEAN Add
+    )
+{
+    UINT64 index;
+
+    if (mFaultStatistics == NULL)
+    {
+        return NULL;
+    }
+
+    index = ((SourceId * 40503u) & MAX_UINT16) >> (16 - FAULT_STATISTICS_INDEX_BITS);
+    for (UINT64 i = 0; i < FAULT_STATISTICS_ENTRY_COUNT; ++i)
+    {
+        HELLO_IOMMU_SOURCE_FAULT_STATISTICS* entry;
+
+        entry = &mFaultStatistics->Entries[(index + i) % FAULT_STATISTICS_ENTRY_COUNT];
+        if (entry->Count == 0)
+        {
+            if (Add == FALSE)
+            {
+                return NULL;
+            }
+            entry->SourceId = SourceId;
+            return entry;
+        }
+        if (entry->SourceId == SourceId)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Aggregates the record into the statistics of its source-id.
+ */
+static
+VOID
+UpdateSourceStatistics (
+    IN CONST HELLO_IOMMU_FAULT_RECORD* Record
+    )
+{
+    HELLO_IOMMU_SOURCE_FAULT_STATISTICS* entry;
+
+    entry = FindSourceStatistics(Record->SourceId, TRUE);
+    if (entry == NULL)
+    {
+        if (mFaultStatistics != NULL)
+        {
+            mFaultStatistics->UntrackedFaults++;
+        }
+        return;
+    }
+
+    if (entry->Count == 0)
+    {
+        entry->FirstAddress = Record->Address;
+    }
+    entry->Count++;
+    entry->LastAddress = Record->Address;
+    entry->LastReason = Record->Reason;
+}
+
+/**
+ * @brief Takes a token from the bucket for a message, refilling it for the time
+ *        elapsed since the last refill.
+ *
+ * @return FALSE if the message should be suppressed.
+ */
+static
+BOOLEAN
+ConsumeLogToken (
+    VOID
+    )
+{
+    UINT64 refillCount;
+
+    refillCount = DivU64x32(MultU64x32(GetElapsedMicroseconds(mLogTokenRefillTimestamp),
+                                       PcdGet32(PcdFaultLogRatePerSecond)),
+                            1000000);
+    if (refillCount != 0)
+    {
+        mLogTokens = MIN(mLogTokens + refillCount, PcdGet32(PcdFaultLogBurst));
+        mLogTokenRefillTimestamp = GetTimestamp();
+    }
+
+    if (mLogTokens == 0)
+    {
+        return FALSE;
+    }
+    mLogTokens--;
+    return TRUE;
+}
+
+/**
+ * @brief Logs the fault, unless messages exceed the rate limit. The number of
+ *        messages suppressed is reported with the next message logged.
+ */
+static
+VOID
+LogFault (
+    IN CONST HELLO_IOMMU_FAULT_RECORD* Record
+    )
+{
+    if (ConsumeLogToken() == FALSE)
+    {
+        mSuppressedLogCount++;
+        return;
+    }
+
+    if (mSuppressedLogCount != 0)
+    {
+        DEBUG((DEBUG_WARN, "%llu fault messages suppressed\n", mSuppressedLogCount));
+        mSuppressedLogCount = 0;
+    }
+    DEBUG((DEBUG_WARN,
+           "DMA %a fault by %02x:%02x.%x at %p with reason %x on the unit at %p\n",
+           (Record->Read != FALSE) ? "read" : "write",
+           (UINT32)((Record->SourceId >> 8) & 0xff),
+           (UINT32)((Record->SourceId >> 3) & 0x1f),
+           (UINT32)(Record->SourceId & 0x7),
+           Record->Address,
+           (UINT32)Record->Reason,
+           Record->RegisterBase));
+}
+
+/**
+ * @brief Moves all primary fault records of the unit into the queue and clears
+ *        them, as well as the overflow status. See 7.3.1 Primary Fault Logging.
+ *
+ * @details Only the Fault Status Register is read if no fault is pending.
+ */
+static
+VOID
+DrainFaultsOfUnit (
+    IN CONST FAULT_LOG_UNIT* Unit
+    )
+{
+    UINT32 faultStatus;
+    UINT64 index;
+
+    faultStatus = ReadDmarRegister32(Unit->RegisterBaseVa, R_FSTS_REG);
+    if ((faultStatus & B_FSTS_REG_PPF) != 0)
+    {
+        //
+        // Records are processed from the one FRI indicates, until the one whose
+        // F: Fault bit is clear, wrapping around the registers.
+        //
+        index = (faultStatus & B_FSTS_REG_FRI_MASK) >> B_FSTS_REG_FRI_SHIFT;
+        for (UINT64 i = 0; i < Unit->FaultRecordingRegisterCount; ++i)
+        {
+            VTD_FRCD_REG faultRecord;
+            HELLO_IOMMU_FAULT_RECORD record;
+            UINT64 registerOffset;
+
+            registerOffset = Unit->FaultRecordingRegisterOffset + index * sizeof(VTD_FRCD_REG);
+            faultRecord.Uint64[1] = ReadDmarRegister64(Unit->RegisterBaseVa,
+                                                       registerOffset + sizeof(UINT64));
+            if (faultRecord.Bits.F == 0)
+            {
+                break;
+            }
+            faultRecord.Uint64[0] = ReadDmarRegister64(Unit->RegisterBaseVa, registerOffset);
+
+            //
+            // Clear the F bit (RW1C) to free up the register for hardware. Other
+            // fields in the upper dword are read-only.
+            //
+            WriteDmarRegister32(Unit->RegisterBaseVa,
+                                registerOffset + sizeof(UINT64) + sizeof(UINT32),
+                                BIT31);
+
+            record.RegisterBase = Unit->RegisterBasePa;
+            record.Address = faultRecord.Uint64[0] & ~(UINT64)(SIZE_4KB - 1);
+            record.SourceId = (UINT16)faultRecord.Bits.SID;
+            record.Reason = (UINT8)faultRecord.Bits.FR;
+            record.Read = (faultRecord.Bits.T != 0);
+            mFaultSummary.TotalFaults++;
+            PushFaultRecord(&record);
+            UpdateSourceStatistics(&record);
+            LogFault(&record);
+
+            index = (index + 1) % Unit->FaultRecordingRegisterCount;
+        }
+    }
+
+    //
+    // Hardware could not record some faults as all registers were in use.
+    // Those are lost, but the fact is counted.
+    //
+    if ((faultStatus & B_FSTS_REG_PFO) != 0)
+    {
+        WriteDmarRegister32(Unit->RegisterBaseVa, R_FSTS_REG, B_FSTS_REG_PFO);
+        mFaultSummary.HardwareOverflows++;
+    }
+}
+
+/**
+ * @brief Drains faults of all hardware units.
+ *
+ * @note The caller must be at TPL_CALLBACK so that the drain does not run
+ *       concurrently with itself.
+ */
+static
+VOID
+DrainFaults (
+    VOID
+    )
+{
+    for (UINT64 i = 0; i < mFaultLogUnitCount; ++i)
+    {
+        DrainFaultsOfUnit(&mFaultLogUnits[i]);
+    }
+}
+
+/**
+ * @brief Drains faults periodically.
+ */
+static
+VOID
+EFIAPI
+HandleFaultDrainTimer (
+    IN EFI_EVENT Event,
+    IN VOID* Context
+    )
+{
+    DrainFaults();
+}
+
+/**
+ * @brief Implements HELLO_IOMMU_FAULT_LOG_PROTOCOL.Drain.
+ */
+static
+EFI_STATUS
+EFIAPI
+FaultLogDrain (
+    IN HELLO_IOMMU_FAULT_LOG_PROTOCOL* This
+    )
+{
+    EFI_TPL oldTpl;
+
+    oldTpl = gBS->RaiseTPL(TPL_CALLBACK);
+    DrainFaults();
+    gBS->RestoreTPL(oldTpl);
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Implements HELLO_IOMMU_FAULT_LOG_PROTOCOL.GetRecord.
+ *
+ * @details The record is copied out before the tail is advanced. If another
+ *          consumer advanced it first, the copy may be stale and is discarded
+ *          by the failing compare-exchange, and the next record is tried.
+ */
+static
+EFI_STATUS
+EFIAPI
+FaultLogGetRecord (
+    IN HELLO_IOMMU_FAULT_LOG_PROTOCOL* This,
+    OUT HELLO_IOMMU_FAULT_RECORD* Record
+    )
+{
+    UINT64 tail;
+    HELLO_IOMMU_FAULT_RECORD record;
+
+    if (Record == NULL)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    for (;;)
+    {
+        tail = mFaultQueueTail;
+        MemoryFence();
+        if (tail == mFaultQueueHead)
+        {
+            return EFI_NOT_FOUND;
+        }
+
+        record = mFaultQueue[tail % FAULT_QUEUE_SIZE];
+        MemoryFence();
+        if (InterlockedCompareExchange64(&mFaultQueueTail, tail, tail + 1) == tail)
+        {
+            *Record = record;
+            return EFI_SUCCESS;
+        }
+    }
+}
+
+/**
+ * @brief Implements HELLO_IOMMU_FAULT_LOG_PROTOCOL.GetSummary.
+ */
+static
+EFI_STATUS
+EFIAPI
+FaultLogGetSummary (
+    IN HELLO_IOMMU_FAULT_LOG_PROTOCOL* This,
+    OUT HELLO_IOMMU_FAULT_SUMMARY* Summary
+    )
+{
+    if (Summary == NULL)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    *Summary = mFaultSummary;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Implements HELLO_IOMMU_FAULT_LOG_PROTOCOL.GetSourceStatistics.
+ */
+static
+EFI_STATUS
+EFIAPI
+FaultLogGetSourceStatistics (
+    IN HELLO_IOMMU_FAULT_LOG_PROTOCOL* This,
+    IN UINT16 SourceId,
+    OUT HELLO_IOMMU_SOURCE_FAULT_STATISTICS* Statistics
+    )
+{
+    EFI_TPL oldTpl;
+    HELLO_IOMMU_SOURCE_FAULT_STATISTICS* entry;
+
+    if (Statistics == NULL)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    //
+    // Keep the drain from updating the entry while it is copied.
+    //
+    oldTpl = gBS->RaiseTPL(TPL_CALLBACK);
+    entry = FindSourceStatistics(SourceId, FALSE);
+    if (entry != NULL)
+    {
+        *Statistics = *entry;
+    }
+    gBS->RestoreTPL(oldTpl);
+
+    return (entry != NULL) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+static HELLO_IOMMU_FAULT_LOG_PROTOCOL mFaultLogProtocol =
+{
+    HELLO_IOMMU_FAULT_LOG_PROTOCOL_REVISION,
+    FaultLogDrain,
+    FaultLogGetRecord,
+    FaultLogGetSummary,
+    FaultLogGetSourceStatistics,
+};
+
+/**
+ * @brief Starts draining faults of the hardware units periodically, and
+ *        installs HELLO_IOMMU_FAULT_LOG_PROTOCOL to hand them out.
+ *
+ * @details Faults already recorded are drained first. The period is
+ *          PcdFaultDrainPeriod. Draining stops at ExitBootServices as timer
+ *          events do. Per source-id statistics are also installed as a
+ *          configuration table in runtime memory, so that they can be inspected
+ *          after boot.
+ */
+EFI_STATUS
+InitializeFaultLog (
+    IN EFI_HANDLE ImageHandle,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount
+    )
+{
+    EFI_STATUS status;
+
+    ASSERT(mFaultLogUnits == NULL);
+
+    mFaultLogUnits = AllocateZeroPool(DmarUnitCount * sizeof(*mFaultLogUnits));
+    if (mFaultLogUnits == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        mFaultLogUnits[i].RegisterBasePa = DmarUnits[i].RegisterBasePa;
+        mFaultLogUnits[i].RegisterBaseVa = DmarUnits[i].RegisterBaseVa;
+        mFaultLogUnits[i].FaultRecordingRegisterOffset = (UINT64)DmarUnits[i].Capability.Bits.FRO * 16;
+        mFaultLogUnits[i].FaultRecordingRegisterCount = (UINT64)DmarUnits[i].Capability.Bits.NFR + 1;
+    }
+    mFaultLogUnitCount = DmarUnitCount;
+
+    mFaultStatistics = AllocateRuntimeZeroPool(OFFSET_OF(HELLO_IOMMU_FAULT_STATISTICS_TABLE, Entries) +
+                                               FAULT_STATISTICS_ENTRY_COUNT * sizeof(mFaultStatistics->Entries[0]));
+    if (mFaultStatistics == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    mFaultStatistics->Signature = HELLO_IOMMU_FAULT_STATISTICS_TABLE_SIGNATURE;
+    mFaultStatistics->Version = HELLO_IOMMU_FAULT_STATISTICS_TABLE_VERSION;
+    mFaultStatistics->EntryCount = FAULT_STATISTICS_ENTRY_COUNT;
+
+    mLogTokens = PcdGet32(PcdFaultLogBurst);
+    mLogTokenRefillTimestamp = GetTimestamp();
+
+    status = FaultLogDrain(&mFaultLogProtocol);
+    ASSERT_EFI_ERROR(status);
+    if (mFaultSummary.TotalFaults != 0)
+    {
+        DEBUG((DEBUG_WARN, "%llu faults were recorded already.\n", mFaultSummary.TotalFaults));
+    }
+
+    status = gBS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                              TPL_CALLBACK,
+                              HandleFaultDrainTimer,
+                              NULL,
+                              &mFaultDrainEvent);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "CreateEvent failed : %r\n", status));
+        goto Exit;
+    }
+
+    status = gBS->SetTimer(mFaultDrainEvent, TimerPeriodic, PcdGet64(PcdFaultDrainPeriod));
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "SetTimer failed : %r\n", status));
+        goto Exit;
+    }
+
+    status = gBS->InstallConfigurationTable(&gHelloIommuFaultStatisticsTableGuid, mFaultStatistics);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "InstallConfigurationTable failed : %r\n", status));
+        goto Exit;
+    }
+
+    status = gBS->InstallMultipleProtocolInterfaces(&ImageHandle,
+                                                    &gHelloIommuFaultLogProtocolGuid,
+                                                    &mFaultLogProtocol,
+                                                    NULL);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "InstallMultipleProtocolInterfaces failed : %r\n", status));
+        (VOID)gBS->InstallConfigurationTable(&gHelloIommuFaultStatisticsTableGuid, NULL);
+        goto Exit;
+    }
+
+Exit:
+    if (EFI_ERROR(status))
+    {
+        if (mFaultDrainEvent != NULL)
+        {
+            gBS->CloseEvent(mFaultDrainEvent);
+            mFaultDrainEvent = NULL;
+        }
+        if (mFaultStatistics != NULL)
+        {
+            FreePool(mFaultStatistics);
+            mFaultStatistics = NULL;
+        }
+        if (mFaultLogUnits != NULL)
+        {
+            FreePool(mFaultLogUnits);
+            mFaultLogUnits = NULL;
+        }
+        mFaultLogUnitCount = 0;
+    }
+    return status;
+}
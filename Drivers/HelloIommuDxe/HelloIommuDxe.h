@@ -0,0 +1,1247 @@
+#ifndef __HELLO_IOMMU_DXE_H__
+#define __HELLO_IOMMU_DXE_H__
+
+#include <Uefi.h>
+#include <Guid/Acpi.h>
+#include <Guid/HelloIommuBootTiming.h>
+#include <Guid/HelloIommuSnapshot.h>
+#include <IndustryStandard/Acpi.h>
+#include <IndustryStandard/DmaRemappingReportingTable.h>
+#include <IndustryStandard/Vtd.h>       // taken from edk2-platforms
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/CacheMaintenanceLib.h>
+#include <Library/DebugLib.h>
+#include <Library/IoLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+#include <Library/UefiRuntimeLib.h>
+#include <Protocol/HelloIommuFaultLog.h>
+#include <Protocol/HelloIommuPasid.h>
+#include <Protocol/IoMmu.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/PciIo.h>
+#include <Protocol/PciRootBridgeIo.h>
+
+#define Add2Ptr(Ptr, Value)     ((VOID*)((UINT8*)(Ptr) + (Value)))
+#define UEFI_DOMAIN_ID          1
+#define V_IOTLB_REG_DR          BIT48
+#define V_IOTLB_REG_DW          BIT49
+
+//
+// The values of the TT: Translation Type field of the context entry.
+//
+#define V_CONTEXT_ENTRY_TT_UNTRANSLATED 0
+#define V_CONTEXT_ENTRY_TT_PASSTHROUGH  2
+
+//
+// The value of the AW: Address Width field of the context entry and PASID entry
+// for 4-level paging structures, the only format the driver builds.
+//
+#define V_CONTEXT_ENTRY_AW_48BIT    2
+#define V_PASID_ENTRY_AW_48BIT      2
+
+//
+// The number of entries in each second-level paging structure, and the paging
+// structure levels. Level 1 is the page table (PT) and level 4 is the PML4.
+//
+#define SL_ENTRY_COUNT      512
+#define SL_LEVEL_PT         1
+#define SL_LEVEL_PD         2
+#define SL_LEVEL_PDPT       3
+#define SL_LEVEL_PML4       4
+
+//
+// The bits of the Global Command Register that enable features (TE, QIE, IRE
+// and CFI), as opposed to one-shot commands. When issuing a command, those bits
+// must be written with the current status reported by the Global Status
+// Register, or the features are disabled. See 10.4.4 Global Command Register.
+//
+#define B_GMCD_REG_PERSISTENT_MASK  (B_GMCD_REG_TE | B_GMCD_REG_QIE | BIT25 | BIT23)
+
+//
+// The granularity of invalidation requests. Those values are encoded into the
+// CIRG and IIRG fields of the registers, and into the G field of invalidation
+// descriptors, as-is.
+//
+#define DMAR_GRANULARITY_GLOBAL     1
+#define DMAR_GRANULARITY_DOMAIN     2
+#define DMAR_GRANULARITY_DEVICE     3   // Context-cache only
+#define DMAR_GRANULARITY_PAGE       3   // IOTLB only
+
+//
+// The granularity of PASID-cache invalidation requests, encoded differently
+// from the above. See 6.5.2.6 PASID-cache Invalidate Descriptor.
+//
+#define DMAR_PASID_GRANULARITY_DOMAIN   V_INV_DESC_PASID_CACHE_G_DOMAIN
+#define DMAR_PASID_GRANULARITY_PASID    V_INV_DESC_PASID_CACHE_G_PASID
+#define DMAR_PASID_GRANULARITY_GLOBAL   V_INV_DESC_PASID_CACHE_G_GLOBAL
+
+//
+// The access permissions of translations.
+//
+#define DMAR_ACCESS_READ            BIT0
+#define DMAR_ACCESS_WRITE           BIT1
+
+//
+// The maximum number of domains managed, including the one for UEFI, and the
+// special domain ID to invalidate IOTLB entries of all domains with. The
+// domain ID 0 is never allocated.
+//
+#define DMAR_MAX_DOMAIN_COUNT       512
+#define DMAR_DOMAIN_ID_ALL          0
+
+//
+// The maximum number of ranges tracked for page-selective invalidation, and the
+// number of page-selective invalidations above which a single domain-selective
+// invalidation is issued instead.
+//
+#define DMAR_MAX_DIRTY_RANGES                   64
+#define DMAR_MAX_PAGE_SELECTIVE_INVALIDATIONS   16
+#define DMAR_MAX_DIRTY_CACHE_LINES              128
+
+//
+// The number of orders of I/O virtual address ranges cached in magazines, that
+// is, 4KB to 32KB, and the number of ranges each magazine holds.
+//
+#define DMAR_IOVA_MAGAZINE_ORDER_COUNT          4
+#define DMAR_IOVA_MAGAZINE_SIZE                 16
+
+//
+// The stages of enabling DMA-remapping, each of which is started on all
+// hardware units before waiting for any of them.
+//
+#define DMAR_ENABLE_STAGE_ROOT_TABLE            0
+#define DMAR_ENABLE_STAGE_QUEUED_INVALIDATION   1
+#define DMAR_ENABLE_STAGE_INVALIDATION          2
+#define DMAR_ENABLE_STAGE_TRANSLATION           3
+#define DMAR_ENABLE_STAGE_COUNT                 4
+
+//
+// The numbers of buses on a segment and device-function numbers on a bus, and
+// the unit index of devices not under the scope of any hardware unit.
+//
+#define DMAR_BUS_COUNT                          256
+#define DMAR_DEVFN_COUNT                        256
+#define DMAR_UNIT_INDEX_NONE                    MAX_UINT8
+
+//
+// The maximum number of reserved memory regions mapped for a device.
+//
+#define DMAR_MAX_RESERVED_RANGES                8
+
+//
+// The PASID used for requests without PASID in scalable mode (RID_PASID), and
+// the maximum number of PASIDs managed, that is, those a single page of PASID
+// directory covers. See 9.4 Scalable-Mode Context-Entry for encoding of PDTS.
+//
+#define DMAR_RID_PASID                          0
+#define DMAR_MAX_PASID_COUNT                    (VTD_PASID_DIRECTORY_ENTRY_NUMBER * VTD_SM_PASID_ENTRY_NUMBER)
+#define DMAR_PASID_DIRECTORY_SIZE               2
+
+//
+// The number of pages the PASID directory and PASID table shared by all
+// devices take in scalable mode, in addition to the tables of legacy mode.
+//
+#define DMAR_SCALABLE_MODE_EXTRA_PAGE_COUNT     2
+
+//
+// 10.4.6 Root Table Address Register
+//
+typedef union _VTD_ROOT_TABLE_ADDRESS_REGISTER
+{
+    struct
+    {
+        UINT64 Reserved_1 : 10;             // [9:0]
+        UINT64 TranslationTableMode : 2;    // [11:10]
+        UINT64 RootTable : 52;              // [63:12]
+    } Bits;
+    UINT64 AsUInt64;
+} VTD_ROOT_TABLE_ADDRESS_REGISTER;
+STATIC_ASSERT(sizeof(VTD_ROOT_TABLE_ADDRESS_REGISTER) == sizeof(UINT64), "Unexpected size");
+
+//
+// 10.4.23 Invalidation Queue Address Register
+//
+typedef union _VTD_INVALIDATION_QUEUE_ADDRESS_REGISTER
+{
+    struct
+    {
+        UINT64 QueueSize : 3;               // [2:0]
+        UINT64 Reserved_3 : 8;              // [10:3]
+        UINT64 DescriptorWidth : 1;         // [11]
+        UINT64 InvalidationQueueBase : 52;  // [63:12]
+    } Bits;
+    UINT64 AsUInt64;
+} VTD_INVALIDATION_QUEUE_ADDRESS_REGISTER;
+STATIC_ASSERT(sizeof(VTD_INVALIDATION_QUEUE_ADDRESS_REGISTER) == sizeof(UINT64), "Unexpected size");
+
+//
+// The pool of 4KB pages hardware references, that is, paging structures and
+// invalidation queues. All pages are carved out from a single runtime memory
+// reservation so that the OS-visible memory map gets only one descriptor for
+// them and allocation does not go through boot services.
+//
+typedef struct _DMAR_PAGE_TABLE_POOL
+{
+    //
+    // The reservation and its size in pages.
+    //
+    VOID* Base;
+    UINT64 PageCount;
+
+    //
+    // The index of the lowest page never allocated, and the list of pages freed.
+    //
+    UINT64 UnusedPageIndex;
+    VOID* FreeList;
+    UINT64 FreePageCount;
+
+    //
+    // The number of paging-structure entries referencing each page, indexed by
+    // the page index. Located at the end of the reservation, that is made up of
+    // MetadataPageCount pages in addition to PageCount.
+    //
+    UINT16* ShareCounts;
+    UINT64 MetadataPageCount;
+
+    //
+    // The usage counters to size the pool. See PcdPageTablePoolExtraPageCount.
+    //
+    UINT64 PeakUsedPageCount;
+    UINT64 AllocationCount;
+    UINT64 FreeCount;
+    UINT64 AllocationFailureCount;
+} DMAR_PAGE_TABLE_POOL;
+
+//
+// The cache lines of paging structures modified but not written back to RAM
+// yet. Nothing is tracked if Coherent is TRUE, that is, all hardware units
+// walk paging structures coherently with processor caches.
+//
+typedef struct _DMAR_CACHE_WRITEBACK
+{
+    BOOLEAN Coherent;
+    UINT64 LineCount;
+    UINT64 Lines[DMAR_MAX_DIRTY_CACHE_LINES];
+
+    //
+    // Statistics. Lines written back, lines not written back thanks to
+    // coherency, and lines modified multiple times but written back once.
+    //
+    UINT64 WrittenBackLineCount;
+    UINT64 SkippedLineCount;
+    UINT64 DeduplicatedLineCount;
+} DMAR_CACHE_WRITEBACK;
+
+//
+// Collection of data structures used by hardware to perform DMA-remapping
+// translation.
+//
+typedef struct _DMAR_TRANSLATIONS
+{
+    //
+    // The root table is only for each hardware unit and made up of 256 entries.
+    //
+    VTD_ROOT_ENTRY* RootTable;
+
+    //
+    // The context table shared by all buses by default. Root entries of buses
+    // with a device given its own domain point to a private copy of this table
+    // instead. This table is made up of 256 entries, or in scalable mode, of 128
+    // VTD_SM_CONTEXT_ENTRY referenced as both the lower and upper halves.
+    //
+    VTD_CONTEXT_ENTRY* ContextTable;
+
+    //
+    // TRUE if the tables are in the scalable-mode format, selected before the
+    // tables are built. Root entries are then in the VTD_EXT_ROOT_ENTRY format,
+    // and the translation type, domain ID and second-level PML4 of each device
+    // are held in the PASID entry for DMAR_RID_PASID instead of the context
+    // entry.
+    //
+    BOOLEAN ScalableMode;
+
+    //
+    // The PASID directory and PASID table shared by all devices by default in
+    // scalable mode. Only the entry for DMAR_RID_PASID is present. A device
+    // given its own domain, or an address space for a PASID, gets a private
+    // copy of the directory, and of the table for the range of 64 PASIDs that
+    // changed, while everything else remains shared. PasidLimit is the number
+    // of PASIDs all hardware units support, up to DMAR_MAX_PASID_COUNT.
+    //
+    VTD_PASID_DIRECTORY_ENTRY* PasidDirectory;
+    VTD_SM_PASID_ENTRY* PasidTable;
+    UINT32 PasidLimit;
+
+    //
+    // TRUE if all hardware units support 1GB pages, as given to
+    // BuildPassthroughTranslations. Reserved memory regions of device domains
+    // are mapped with 1GB pages where aligned only then.
+    //
+    BOOLEAN Use1GbPages;
+
+    //
+    // The second-level PML4 of UEFI_DOMAIN_ID, the domain all devices belong to
+    // by default. This table is made up of 512 entries. PDPTs, PDs and PTs below
+    // it are allocated as needed.
+    //
+    VTD_SECOND_LEVEL_PAGING_ENTRY* SlPml4;
+
+    //
+    // The second-level PML4 of each domain, indexed by the domain ID, or NULL if
+    // the ID is not allocated. The PML4 of a device domain starts as a copy of
+    // SlPml4, sharing all tables below it until modified. DomainIdLimit is the
+    // number of domain IDs all hardware units support (ND), up to
+    // DMAR_MAX_DOMAIN_COUNT.
+    //
+    VTD_SECOND_LEVEL_PAGING_ENTRY* DomainSlPml4s[DMAR_MAX_DOMAIN_COUNT];
+    UINT64 DomainIdLimit;
+    UINT64 DomainCount;
+
+    //
+    // The domain ID shared by all pass-through devices, or zero if none is
+    // configured yet. No PML4 exists for this domain.
+    //
+    UINT16 PassthroughDomainId;
+
+    //
+    // The pool all the tables are allocated from.
+    //
+    DMAR_PAGE_TABLE_POOL Pool;
+
+    //
+    // The tracker of modified cache lines of the tables. Initialized with
+    // InitializeCacheWriteback before the tables are built.
+    //
+    DMAR_CACHE_WRITEBACK Writeback;
+
+    //
+    // The next replica of the translations made with CopyTranslations, or NULL.
+    // Changes must be applied to every replica in the list to keep them the
+    // same. ProximityDomain is the one the pool is in, or MAX_UINT32 if unknown.
+    //
+    struct _DMAR_TRANSLATIONS* NextReplica;
+    UINT32 ProximityDomain;
+} DMAR_TRANSLATIONS;
+
+//
+// The invalidation queue of a hardware unit. See 6.5.2 Queued Invalidation
+// Interface.
+//
+typedef struct _DMAR_INVALIDATION_QUEUE
+{
+    //
+    // The ring of EntryCount descriptors (4KB). NULL if the unit does not support
+    // queued invalidation, in which case, register-based invalidation is used
+    // instead. Those are 256 128-bit descriptors, or in scalable mode, 128
+    // 256-bit descriptors. DescriptorShift is log2 of the size of each.
+    //
+    VTD_INVALIDATION_DESCRIPTOR* Descriptors;
+    UINT64 DescriptorShift;
+    UINT64 EntryCount;
+
+    //
+    // The index of the descriptor to be written next, and the number of
+    // descriptors written since the last submission.
+    //
+    UINT64 Tail;
+    UINT64 PendingCount;
+
+    //
+    // The location hardware writes WaitStatusData into when it processes the
+    // invalidation wait descriptor of the last submission. InFlight is TRUE
+    // while software has not observed it yet.
+    //
+    volatile UINT32 WaitStatus;
+    UINT32 WaitStatusData;
+    BOOLEAN InFlight;
+
+    //
+    // When the last submission was made, to measure how long it takes.
+    //
+    UINT64 SubmitTimestamp;
+} DMAR_INVALIDATION_QUEUE;
+
+//
+// The counters of invalidation requests and the register accesses spent for
+// them. Used to compare cost of the queued and register-based invalidation.
+//
+typedef struct _DMAR_INVALIDATION_STATISTICS
+{
+    UINT64 Invalidations;
+    UINT64 Batches;
+    UINT64 MmioReads;
+    UINT64 MmioWrites;
+} DMAR_INVALIDATION_STATISTICS;
+
+//
+// The ranges of addresses whose translations were modified and need to be
+// invalidated from the IOTLB. If more ranges than DMAR_MAX_DIRTY_RANGES are
+// added, Overflowed is set and the whole domain is invalidated.
+//
+typedef struct _DMAR_DIRTY_RANGES
+{
+    UINT64 Count;
+    BOOLEAN Overflowed;
+    struct
+    {
+        UINT64 Base;
+        UINT64 Length;
+    } Ranges[DMAR_MAX_DIRTY_RANGES];
+} DMAR_DIRTY_RANGES;
+
+//
+// The representation of each DMA-remapping hardware unit.
+//
+typedef struct _DMAR_UNIT_INFORMATION
+{
+    UINT64 RegisterBasePa;
+    UINT64 RegisterBaseVa;
+    VTD_CAP_REG Capability;
+    VTD_ECAP_REG ExtendedCapability;
+    DMAR_TRANSLATIONS* Translations;
+    DMAR_INVALIDATION_QUEUE InvalidationQueue;
+    DMAR_INVALIDATION_STATISTICS InvalidationStatistics;
+    BOOLEAN DmaRemappingEnabled;
+
+    //
+    // The microseconds the unit took to complete each stage of enabling, from
+    // the start of the stage. Zero for a stage not applicable to the unit.
+    //
+    UINT64 EnableStageMicroseconds[DMAR_ENABLE_STAGE_COUNT];
+
+    //
+    // The time spent in each kind of wait for MMIO operations on the unit.
+    //
+    HELLO_IOMMU_TIMING_RECORD WaitTimings[HELLO_IOMMU_WAIT_COUNT];
+} DMAR_UNIT_INFORMATION;
+
+//
+// The cache of free I/O virtual address ranges of a single order.
+//
+typedef struct _DMAR_IOVA_MAGAZINE
+{
+    UINT64 Count;
+    UINT64 Iovas[DMAR_IOVA_MAGAZINE_SIZE];
+} DMAR_IOVA_MAGAZINE;
+
+//
+// The allocator of I/O virtual addresses within a window. Ranges are tracked
+// with a bitmap of pages, and small ranges freed are cached in the magazine of
+// their order in front of it.
+//
+// Unlike allocators of operating systems, there is a single set of magazines
+// rather than one per processor, as the allocator is only used by the IoMmu
+// protocol, which runs on the BSP and is serialized by raising TPL.
+// Per-processor caches would only add the cost of looking up the processor.
+//
+typedef struct _DMAR_IOVA_ALLOCATOR
+{
+    //
+    // The window, and the bitmap of its pages with a bit set for each page
+    // allocated or cached in the magazines.
+    //
+    UINT64 Base;
+    UINT64 PageCount;
+    UINT64* Bitmap;
+
+    //
+    // The index of the page the next bitmap search starts at, below which no
+    // page is free, and the number of pages clear in the bitmap.
+    //
+    UINT64 NextIndex;
+    UINT64 FreePageCount;
+
+    DMAR_IOVA_MAGAZINE Magazines[DMAR_IOVA_MAGAZINE_ORDER_COUNT];
+
+    //
+    // Statistics.
+    //
+    UINT64 AllocationCount;
+    UINT64 MagazineHitCount;
+    UINT64 AllocationFailureCount;
+} DMAR_IOVA_ALLOCATOR;
+
+//
+// The counters of bounce buffer allocations. Hits are buffers reused from the
+// free lists, misses are buffers newly carved out from the reservation, and
+// fallbacks are buffers allocated from boot services.
+//
+typedef struct _DMAR_BOUNCE_BUFFER_STATISTICS
+{
+    UINT64 Hits;
+    UINT64 Misses;
+    UINT64 Fallbacks;
+} DMAR_BOUNCE_BUFFER_STATISTICS;
+
+//
+// The result of translating a device address with the software walk. PageSize
+// is the size of the leaf entry, or zero for pass-through. EntriesRead is the
+// number of root, context, PASID directory, PASID table and paging-structure
+// entries read for the walk, of which PagingEntriesRead are paging-structure
+// entries.
+//
+typedef struct _DMAR_WALK_RESULT
+{
+    UINT64 HostAddress;
+    UINT64 PageSize;
+    UINT64 EntriesRead;
+    UINT64 PagingEntriesRead;
+    UINT16 DomainId;
+    UINT8 Permissions;
+    BOOLEAN Passthrough;
+} DMAR_WALK_RESULT;
+
+//
+// The set-associative cache with LRU replacement, modelling the IOTLB or a
+// paging-structure cache of a hardware unit. Entries are SetCount * WayCount.
+//
+typedef struct _DMAR_CACHE_MODEL_ENTRY
+{
+    UINT64 Tag;
+    UINT64 LastUse;
+    BOOLEAN Valid;
+} DMAR_CACHE_MODEL_ENTRY;
+
+typedef struct _DMAR_CACHE_MODEL
+{
+    DMAR_CACHE_MODEL_ENTRY* Entries;
+    UINT64 SetCount;
+    UINT64 WayCount;
+    UINT64 UseCounter;
+    UINT64 Lookups;
+    UINT64 Hits;
+} DMAR_CACHE_MODEL;
+
+//
+// The model of the translation caches of a hardware unit, used to estimate how
+// translations affect the IOTLB reach for a DMA address trace.
+//
+typedef struct _DMAR_IOTLB_MODEL
+{
+    DMAR_CACHE_MODEL Iotlb;
+    DMAR_CACHE_MODEL PdeCache;
+    UINT64 Accesses;
+    UINT64 Faults;
+    UINT64 PassthroughAccesses;
+    UINT64 EntriesRead;
+} DMAR_IOTLB_MODEL;
+
+//
+// The range of physical addresses, from Base up to, but not including, End.
+//
+typedef struct _DMAR_ADDRESS_RANGE
+{
+    UINT64 Base;
+    UINT64 End;
+} DMAR_ADDRESS_RANGE;
+
+//
+// The owners of devices on a PCI segment. UnitIndexes is indexed with a bus
+// number, then a device-function number, and gives the index of the hardware
+// unit with the device in its scope. The table of a bus is allocated only when
+// any device scope refers to it; devices on other buses, and those marked
+// DMAR_UNIT_INDEX_NONE, belong to the INCLUDE_PCI_ALL unit if any.
+//
+typedef struct _DMAR_SEGMENT_TOPOLOGY
+{
+    UINT16 Segment;
+    UINT8 IncludeAllUnitIndex;
+    EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL* RootBridgeIo;
+    UINT8* UnitIndexes[DMAR_BUS_COUNT];
+} DMAR_SEGMENT_TOPOLOGY;
+
+//
+// The reserved memory region reported by RMRR, from Base up to, but not
+// including, End, and the source-ids of the devices that may access it.
+//
+typedef struct _DMAR_RESERVED_MEMORY
+{
+    UINT16 Segment;
+    UINT64 Base;
+    UINT64 End;
+    UINT16* SourceIds;
+    UINT64 SourceIdCount;
+} DMAR_RESERVED_MEMORY;
+
+//
+// The proximity domain of the hardware unit reported by RHSA.
+//
+typedef struct _DMAR_RESOURCE_AFFINITY
+{
+    UINT64 RegisterBase;
+    UINT32 ProximityDomain;
+} DMAR_RESOURCE_AFFINITY;
+
+//
+// The structures parsed from the DMAR table.
+//
+typedef struct _DMAR_TOPOLOGY
+{
+    DMAR_SEGMENT_TOPOLOGY* Segments;
+    UINT64 SegmentCount;
+    DMAR_RESERVED_MEMORY* ReservedMemory;
+    UINT64 ReservedMemoryCount;
+    DMAR_RESOURCE_AFFINITY* Affinities;
+    UINT64 AffinityCount;
+} DMAR_TOPOLOGY;
+
+//
+// The helper structure for translating the guest physical address to the
+// host physical address.
+//
+typedef union _ADDRESS_TRANSLATION_HELPER
+{
+    //
+    // Indexes to locate paging-structure entries corresponds to this virtual
+    // address.
+    //
+    struct
+    {
+        UINT64 Unused : 12;         //< [11:0]
+        UINT64 Pt : 9;              //< [20:12]
+        UINT64 Pd : 9;              //< [29:21]
+        UINT64 Pdpt : 9;            //< [38:30]
+        UINT64 Pml4 : 9;            //< [47:39]
+    } AsIndex;
+    UINT64 AsUInt64;
+} ADDRESS_TRANSLATION_HELPER;
+
+//
+// EnableRemapping.c
+//
+VOID
+IssueGlobalCommand (
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT32 Command
+    );
+
+EFI_STATUS
+EnableDmaRemappingForAllUnits (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount
+    );
+
+//
+// Registers.c
+//
+UINT32
+ReadDmarRegister32 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset
+    );
+
+UINT64
+ReadDmarRegister64 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset
+    );
+
+VOID
+WriteDmarRegister32 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset,
+    IN UINT32 Value
+    );
+
+VOID
+WriteDmarRegister64 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset,
+    IN UINT64 Value
+    );
+
+//
+// AddressRanges.c
+//
+UINT64
+GetTopOfSystemMemory (
+    VOID
+    );
+
+EFI_STATUS
+GetDmaAccessibleRanges (
+    IN UINT64 Limit,
+    OUT DMAR_ADDRESS_RANGE** Ranges,
+    OUT UINT64* RangeCount
+    );
+
+//
+// PageTablePool.c
+//
+EFI_STATUS
+InitializePageTablePool (
+    OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN UINT64 PageCount
+    );
+
+VOID
+FreePageTablePool (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    );
+
+VOID*
+AllocateUninitializedPageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    );
+
+VOID*
+AllocatePageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    );
+
+VOID
+FreePageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN VOID* Page
+    );
+
+VOID
+SharePageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN CONST VOID* Page
+    );
+
+VOID
+ReleasePageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN VOID* Page
+    );
+
+UINT64
+GetPageTableShareCount (
+    IN CONST DMAR_PAGE_TABLE_POOL* Pool,
+    IN CONST VOID* Page
+    );
+
+BOOLEAN
+IsPageTablePoolPage (
+    IN CONST DMAR_PAGE_TABLE_POOL* Pool,
+    IN CONST VOID* Page
+    );
+
+EFI_STATUS
+InitializePageTablePoolInRange (
+    OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN UINT64 PageCount,
+    IN CONST DMAR_ADDRESS_RANGE* Range
+    );
+
+VOID
+CopyPageTablePool (
+    IN OUT DMAR_PAGE_TABLE_POOL* Destination,
+    IN CONST DMAR_PAGE_TABLE_POOL* Source
+    );
+
+VOID
+DumpPageTablePoolUsage (
+    IN CONST DMAR_PAGE_TABLE_POOL* Pool
+    );
+
+//
+// BounceBuffer.c
+//
+EFI_STATUS
+InitializeBounceBufferPool (
+    VOID
+    );
+
+VOID
+FreeBounceBufferPool (
+    VOID
+    );
+
+VOID*
+AllocateBounceBuffer (
+    IN UINTN Pages
+    );
+
+VOID
+FreeBounceBuffer (
+    IN VOID* Buffer,
+    IN UINTN Pages
+    );
+
+VOID
+GetBounceBufferStatistics (
+    OUT DMAR_BOUNCE_BUFFER_STATISTICS* Statistics
+    );
+
+//
+// CacheWriteback.c
+//
+VOID
+InitializeCacheWriteback (
+    OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount
+    );
+
+VOID
+WriteBackPagingStructure (
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN CONST VOID* Address,
+    IN UINT64 Length
+    );
+
+VOID
+MarkPagingStructureDirty (
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN CONST VOID* Address,
+    IN UINT64 Length
+    );
+
+VOID
+CommitPagingStructureWriteback (
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback
+    );
+
+//
+// Translations.c
+//
+UINT64
+GetRegionSizeOfLevel (
+    IN UINT64 Level
+    );
+
+UINT64
+GetEntryAddress (
+    IN CONST VTD_SECOND_LEVEL_PAGING_ENTRY* Entry
+    );
+
+UINT64
+MakeLeafEntry (
+    IN UINT64 Address,
+    IN BOOLEAN Readable,
+    IN BOOLEAN Writable,
+    IN UINT64 Level
+    );
+
+VOID
+FillPagingEntries (
+    OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Entries,
+    IN UINT64 Count,
+    IN UINT64 Template,
+    IN UINT64 Increment
+    );
+
+UINT64
+GetPassthroughTranslationsPageCount (
+    IN CONST DMAR_ADDRESS_RANGE* Ranges,
+    IN UINT64 RangeCount,
+    IN BOOLEAN Use1GbPages
+    );
+
+EFI_STATUS
+BuildPassthroughTranslations (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN CONST DMAR_ADDRESS_RANGE* Ranges,
+    IN UINT64 RangeCount,
+    IN BOOLEAN Use1GbPages
+    );
+
+EFI_STATUS
+ChangePermissionOfRangeForAllDevices (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT64 Base,
+    IN UINT64 Length,
+    IN UINT64 Permissions,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    );
+
+EFI_STATUS
+AssignDeviceDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN BOOLEAN InheritTranslations,
+    IN CONST DMAR_ADDRESS_RANGE* ReservedRanges OPTIONAL,
+    IN UINT64 ReservedRangeCount,
+    OUT UINT16* DomainId,
+    OUT UINT16* PreviousDomainId,
+    OUT BOOLEAN* RootEntryUpdated
+    );
+
+EFI_STATUS
+AssignPasidDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN UINT32 Pasid,
+    OUT UINT16* DomainId,
+    OUT BOOLEAN* RootEntryUpdated
+    );
+
+EFI_STATUS
+SetDevicePassthrough (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN UINT8 AddressWidth,
+    OUT BOOLEAN* RootEntryUpdated
+    );
+
+EFI_STATUS
+ChangePermissionOfRangeForDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 DomainId,
+    IN UINT64 Base,
+    IN UINT64 Length,
+    IN UINT64 Permissions,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    );
+
+EFI_STATUS
+MapRangeForDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 DomainId,
+    IN UINT64 Base,
+    IN UINT64 Length,
+    IN UINT64 HostBase,
+    IN UINT64 Permissions,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    );
+
+EFI_STATUS
+CopyTranslations (
+    IN CONST DMAR_TRANSLATIONS* Source,
+    IN OUT DMAR_TRANSLATIONS* Destination
+    );
+
+//
+// PasidTables.c
+//
+VTD_SM_CONTEXT_ENTRY*
+GetScalableModeContextEntry (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId
+    );
+
+VTD_PASID_DIRECTORY_ENTRY*
+GetPasidDirectoryEntry (
+    IN CONST VTD_SM_CONTEXT_ENTRY* ContextEntry,
+    IN UINT32 Pasid
+    );
+
+VTD_SM_PASID_ENTRY*
+GetPasidTableEntry (
+    IN CONST VTD_PASID_DIRECTORY_ENTRY* DirectoryEntry,
+    IN UINT32 Pasid
+    );
+
+VOID
+MakePasidEntry (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 DomainId,
+    IN CONST VTD_SECOND_LEVEL_PAGING_ENTRY* Pml4 OPTIONAL,
+    OUT VTD_SM_PASID_ENTRY* PasidEntry
+    );
+
+EFI_STATUS
+BuildScalableModeTables (
+    IN OUT DMAR_TRANSLATIONS* Translations
+    );
+
+VTD_SM_PASID_ENTRY*
+GetPrivatePasidEntry (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN UINT32 Pasid,
+    OUT VTD_SM_CONTEXT_ENTRY** ContextEntry,
+    OUT BOOLEAN* RootEntryUpdated
+    );
+
+VOID
+WritePasidEntry (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN OUT VTD_SM_PASID_ENTRY* PasidEntry,
+    IN CONST VTD_SM_PASID_ENTRY* NewPasidEntry,
+    IN BOOLEAN ClearPresentFirst
+    );
+
+//
+// Invalidation.c
+//
+EFI_STATUS
+AllocateInvalidationQueue (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    );
+
+VOID
+FreeInvalidationQueue (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    );
+
+BOOLEAN
+EnableQueuedInvalidation (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit
+    );
+
+VOID
+InvalidateContextCache (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT64 Granularity,
+    IN UINT16 DomainId,
+    IN UINT16 SourceId
+    );
+
+VOID
+InvalidatePasidCache (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT64 Granularity,
+    IN UINT16 DomainId,
+    IN UINT32 Pasid
+    );
+
+VOID
+InvalidatePasidIotlb (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT16 DomainId,
+    IN UINT32 Pasid
+    );
+
+VOID
+InvalidateIotlb (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT64 Granularity,
+    IN UINT16 DomainId,
+    IN UINT64 Address,
+    IN UINT8 AddressMask
+    );
+
+VOID
+SubmitInvalidations (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit
+    );
+
+EFI_STATUS
+WaitForInvalidations (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit
+    );
+
+EFI_STATUS
+CommitInvalidations (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit
+    );
+
+VOID
+AddDirtyRange (
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges,
+    IN UINT64 Base,
+    IN UINT64 Length
+    );
+
+EFI_STATUS
+InvalidateContextCacheForDevice (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN UINT16 SourceId,
+    IN UINT16 DomainId,
+    IN BOOLEAN RootEntryUpdated,
+    IN BOOLEAN DomainLeft
+    );
+
+EFI_STATUS
+InvalidateDirtyRanges (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN UINT16 DomainId,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    );
+
+//
+// DmarTopology.c
+//
+EFI_STATUS
+BuildDmarTopology (
+    IN CONST EFI_ACPI_DMAR_HEADER* DmarTable,
+    IN UINT64 DmarUnitCount,
+    OUT DMAR_TOPOLOGY* Topology
+    );
+
+VOID
+FreeDmarTopology (
+    IN OUT DMAR_TOPOLOGY* Topology
+    );
+
+UINT64
+GetReservedMemoryOfDevice (
+    IN CONST DMAR_TOPOLOGY* Topology,
+    IN UINT16 Segment,
+    IN UINT16 SourceId,
+    OUT DMAR_ADDRESS_RANGE* Ranges
+    );
+
+EFI_STATUS
+GetReservedMemoryTablePageCount (
+    IN CONST DMAR_TOPOLOGY* Topology,
+    IN BOOLEAN Use1GbPages,
+    OUT UINT64* PageCount
+    );
+
+UINT8
+GetDmarUnitIndexOfDevice (
+    IN CONST DMAR_TOPOLOGY* Topology,
+    IN UINT16 Segment,
+    IN UINT16 SourceId
+    );
+
+//
+// FaultLog.c
+//
+EFI_STATUS
+InitializeFaultLog (
+    IN EFI_HANDLE ImageHandle,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount
+    );
+
+//
+// IommuProtocol.c
+//
+EFI_STATUS
+InitializeIommuProtocol (
+    IN EFI_HANDLE ImageHandle,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN CONST DMAR_TOPOLOGY* Topology OPTIONAL
+    );
+
+//
+// Iova.c
+//
+EFI_STATUS
+InitializeIovaAllocator (
+    OUT DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Base,
+    IN UINT64 Length
+    );
+
+VOID
+FreeIovaAllocator (
+    IN OUT DMAR_IOVA_ALLOCATOR* Allocator
+    );
+
+EFI_STATUS
+AllocateIova (
+    IN OUT DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Pages,
+    OUT UINT64* Iova
+    );
+
+VOID
+FreeIova (
+    IN OUT DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Iova,
+    IN UINT64 Pages
+    );
+
+//
+// NumaReplicas.c
+//
+EFI_STATUS
+BuildTranslationReplicas (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN CONST DMAR_TOPOLOGY* Topology OPTIONAL,
+    IN OUT DMAR_TRANSLATIONS* Translations
+    );
+
+VOID
+FreeTranslationReplicas (
+    IN OUT DMAR_TRANSLATIONS* Translations
+    );
+
+//
+// PageWalk.c
+//
+EFI_STATUS
+TranslateDmaAddress (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN UINT64 Address,
+    OUT DMAR_WALK_RESULT* Result
+    );
+
+EFI_STATUS
+InitializeIotlbModel (
+    OUT DMAR_IOTLB_MODEL* Model,
+    IN UINT64 IotlbSetCount,
+    IN UINT64 IotlbWayCount,
+    IN UINT64 PdeCacheSetCount,
+    IN UINT64 PdeCacheWayCount
+    );
+
+VOID
+FreeIotlbModel (
+    IN OUT DMAR_IOTLB_MODEL* Model
+    );
+
+VOID
+SimulateDmaTrace (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN OUT DMAR_IOTLB_MODEL* Model,
+    IN UINT16 SourceId,
+    IN CONST UINT64* Addresses,
+    IN UINT64 AddressCount
+    );
+
+VOID
+DumpIotlbModelStatistics (
+    IN CONST DMAR_IOTLB_MODEL* Model
+    );
+
+EFI_STATUS
+VerifyProtectedRange (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT64 Base,
+    IN UINT64 Length
+    );
+
+//
+// Snapshot.c
+//
+EFI_STATUS
+PublishSnapshotTable (
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN CONST DMAR_TRANSLATIONS* Translations
+    );
+
+//
+// Timing.c
+//
+VOID
+InitializeTiming (
+    VOID
+    );
+
+UINT64
+GetTimestamp (
+    VOID
+    );
+
+UINT64
+GetElapsedMicroseconds (
+    IN UINT64 StartTimestamp
+    );
+
+VOID
+RecordTiming (
+    IN OUT HELLO_IOMMU_TIMING_RECORD* Record,
+    IN UINT64 StartTimestamp,
+    IN UINT64 SpinIterations
+    );
+
+EFI_STATUS
+PublishBootTimingTable (
+    IN CONST HELLO_IOMMU_TIMING_RECORD* PhaseTimings,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount
+    );
+
+#endif
@@ -0,0 +1,899 @@
+#include "HelloIommuDxe.h"
+
+//
+// The number of descriptors that can be queued before the queue must be
+// submitted. One slot is reserved for the invalidation wait descriptor, and
+// another one is to distinguish the full queue from the empty queue.
+//
+#define MAX_PENDING_DESCRIPTORS(Queue)  ((Queue)->EntryCount - 2)
+
+//
+// The log2 of the size of 128-bit and 256-bit descriptors.
+//
+#define DESCRIPTOR_SHIFT_128BIT     4
+#define DESCRIPTOR_SHIFT_256BIT     5
+
+//
+// How often the Fault Status Register is checked while waiting for completion
+// of the queued invalidation. Hardware stops processing descriptors and never
+// writes the status data when it detects an error.
+//
+#define QUEUE_ERROR_CHECK_INTERVAL  0x10000
+
+/**
+ * @brief Allocates the invalidation queue from the pool if the unit supports
+ *        queued invalidation.
+ *
+ * @note The queue is not used until EnableQueuedInvalidation is called.
+ */
+EFI_STATUS
+AllocateInvalidationQueue (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    )
+{
+    DMAR_INVALIDATION_QUEUE* queue;
+
+    queue = &DmarUnit->InvalidationQueue;
+    ZeroMem(queue, sizeof(*queue));
+
+    if (DmarUnit->ExtendedCapability.Bits.QI == FALSE)
+    {
+        DEBUG((DEBUG_INFO,
+               "Unit at %p does not support queued invalidation. Using registers.\n",
+               DmarUnit->RegisterBasePa));
+        return EFI_SUCCESS;
+    }
+
+    //
+    // Scalable mode requires 256-bit descriptors. Only the lower halves are
+    // written, and the upper halves are left zero. See 6.5.2 Queued
+    // Invalidation Interface.
+    //
+    queue->Descriptors = AllocatePageTablePage(Pool);
+    if (queue->Descriptors == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    queue->DescriptorShift = (DmarUnit->Translations->ScalableMode != FALSE) ?
+        DESCRIPTOR_SHIFT_256BIT :
+        DESCRIPTOR_SHIFT_128BIT;
+    queue->EntryCount = SIZE_4KB >> queue->DescriptorShift;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Returns the descriptor at the index of the queue.
+ */
+static
+VTD_INVALIDATION_DESCRIPTOR*
+GetDescriptor (
+    IN CONST DMAR_INVALIDATION_QUEUE* Queue,
+    IN UINT64 Index
+    )
+{
+    return (VTD_INVALIDATION_DESCRIPTOR*)((UINT8*)Queue->Descriptors + (Index << Queue->DescriptorShift));
+}
+
+/**
+ * @brief Frees the invalidation queue allocated by AllocateInvalidationQueue.
+ */
+VOID
+FreeInvalidationQueue (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    )
+{
+    if (DmarUnit->InvalidationQueue.Descriptors != NULL)
+    {
+        FreePageTablePage(Pool, DmarUnit->InvalidationQueue.Descriptors);
+        DmarUnit->InvalidationQueue.Descriptors = NULL;
+    }
+}
+
+/**
+ * @brief Starts enabling queued invalidation for the hardware unit if the queue
+ *        is allocated.
+ *
+ * @note Once enabled, register-based invalidation must not be used for the unit.
+ *
+ * @return TRUE if enabling is started. The caller must wait for B_GSTS_REG_QIES
+ *         to be set before submitting invalidations.
+ */
+BOOLEAN
+EnableQueuedInvalidation (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit
+    )
+{
+    DMAR_INVALIDATION_QUEUE* queue;
+    VTD_INVALIDATION_QUEUE_ADDRESS_REGISTER queueAddressReg;
+
+    queue = &DmarUnit->InvalidationQueue;
+    if (queue->Descriptors == NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // Set up the queue with 256 entries of 128-bit descriptors, or 128 entries
+    // of 256-bit descriptors, reset the tail, and then, enable the queue. See
+    // 6.5.2 Queued Invalidation Interface.
+    //
+    DEBUG((DEBUG_INFO, "Enabling queued invalidation with the queue at %p\n", queue->Descriptors));
+    queueAddressReg.AsUInt64 = 0;
+    queueAddressReg.Bits.DescriptorWidth = (queue->DescriptorShift == DESCRIPTOR_SHIFT_256BIT);
+    queueAddressReg.Bits.InvalidationQueueBase = (UINT64)queue->Descriptors >> 12;
+    WriteDmarRegister64(DmarUnit->RegisterBaseVa, R_IQA_REG, queueAddressReg.AsUInt64);
+    WriteDmarRegister64(DmarUnit->RegisterBaseVa, R_IQT_REG, 0);
+    IssueGlobalCommand(DmarUnit, B_GMCD_REG_QIE);
+
+    queue->Tail = 0;
+    queue->PendingCount = 0;
+    queue->InFlight = FALSE;
+    return TRUE;
+}
+
+/**
+ * @brief Writes the descriptor into the invalidation queue without submitting it.
+ */
+static
+VOID
+QueueDescriptor (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT64 Low,
+    IN UINT64 High
+    )
+{
+    DMAR_INVALIDATION_QUEUE* queue;
+    VTD_INVALIDATION_DESCRIPTOR* descriptor;
+
+    queue = &DmarUnit->InvalidationQueue;
+
+    //
+    // Make room by processing pending descriptors if the queue is full. An error
+    // is reported by the function and no way to recover here. Keep queuing.
+    //
+    if (queue->PendingCount == MAX_PENDING_DESCRIPTORS(queue))
+    {
+        (VOID)CommitInvalidations(DmarUnit);
+    }
+
+    //
+    // Hardware may still be fetching descriptors submitted earlier. Wait for
+    // them before overwriting the slots.
+    //
+    if (queue->InFlight != FALSE)
+    {
+        (VOID)WaitForInvalidations(DmarUnit);
+    }
+
+    descriptor = GetDescriptor(queue, queue->Tail);
+    descriptor->Uint128.Uint64Lo = Low;
+    descriptor->Uint128.Uint64Hi = High;
+    queue->Tail = (queue->Tail + 1) % queue->EntryCount;
+    queue->PendingCount++;
+}
+
+/**
+ * @brief Invalidates the context-cache. See 6.5.1.1 Context-Cache Invalidation.
+ *
+ * @note With queued invalidation, the request is only queued and takes effect
+ *       when CommitInvalidations completes.
+ */
+VOID
+InvalidateContextCache (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT64 Granularity,
+    IN UINT16 DomainId,
+    IN UINT16 SourceId
+    )
+{
+    UINT64 command;
+    UINT64 startTimestamp;
+    UINT64 spinCount;
+
+    DmarUnit->InvalidationStatistics.Invalidations++;
+
+    if (DmarUnit->InvalidationQueue.Descriptors != NULL)
+    {
+        QueueDescriptor(DmarUnit,
+                        V_INV_DESC_TYPE_CONTEXT_CACHE |
+                        (Granularity << 4) |
+                        ((UINT64)DomainId << 16) |
+                        ((UINT64)SourceId << 32),
+                        0);
+        return;
+    }
+
+    //
+    // See 10.4.7 Context Command Register.
+    //
+    command = B_CCMD_REG_ICC | (Granularity << 61) | ((UINT64)SourceId << 16) | DomainId;
+    startTimestamp = GetTimestamp();
+    WriteDmarRegister64(DmarUnit->RegisterBaseVa, R_CCMD_REG, command);
+    DmarUnit->InvalidationStatistics.MmioWrites++;
+    for (spinCount = 1; ; ++spinCount)
+    {
+        DmarUnit->InvalidationStatistics.MmioReads++;
+        if ((ReadDmarRegister64(DmarUnit->RegisterBaseVa, R_CCMD_REG) & B_CCMD_REG_ICC) == 0)
+        {
+            break;
+        }
+        CpuPause();
+    }
+    RecordTiming(&DmarUnit->WaitTimings[HELLO_IOMMU_WAIT_CONTEXT_COMMAND], startTimestamp, spinCount);
+    DmarUnit->InvalidationStatistics.Batches++;
+}
+
+/**
+ * @brief Invalidates the PASID-cache. See 6.5.2.6 PASID-cache Invalidate
+ *        Descriptor.
+ *
+ * @note This is only queued, and takes effect when CommitInvalidations
+ *       completes. Scalable mode requires queued invalidation, and there is no
+ *       register-based equivalent.
+ *
+ * @param Granularity - One of DMAR_PASID_GRANULARITY_*.
+ * @param Pasid - The PASID for DMAR_PASID_GRANULARITY_PASID. Ignored otherwise.
+ */
+VOID
+InvalidatePasidCache (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT64 Granularity,
+    IN UINT16 DomainId,
+    IN UINT32 Pasid
+    )
+{
+    ASSERT(DmarUnit->InvalidationQueue.Descriptors != NULL);
+
+    DmarUnit->InvalidationStatistics.Invalidations++;
+    QueueDescriptor(DmarUnit,
+                    V_INV_DESC_TYPE_PASID_CACHE |
+                    (Granularity << 4) |
+                    ((UINT64)DomainId << 16) |
+                    ((UINT64)(Pasid & 0xfffff) << 32),
+                    0);
+}
+
+/**
+ * @brief Invalidates the IOTLB entries of the PASID in the domain. See the
+ *        PASID-based-IOTLB Invalidate Descriptor in 6.5.2.
+ *
+ * @note This is only queued, and takes effect when CommitInvalidations
+ *       completes. As with InvalidatePasidCache, scalable mode only.
+ */
+VOID
+InvalidatePasidIotlb (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT16 DomainId,
+    IN UINT32 Pasid
+    )
+{
+    ASSERT(DmarUnit->InvalidationQueue.Descriptors != NULL);
+
+    DmarUnit->InvalidationStatistics.Invalidations++;
+    QueueDescriptor(DmarUnit,
+                    V_INV_DESC_TYPE_PASID_IOTLB |
+                    (V_INV_DESC_PASID_IOTLB_G_PASID << 4) |
+                    ((UINT64)DomainId << 16) |
+                    ((UINT64)(Pasid & 0xfffff) << 32),
+                    0);
+}
+
+/**
+ * @brief Invalidates the IOTLB, and drains all read and write requests. See
+ *        6.5.1.2 IOTLB Invalidation.
+ *
+ * @details "Hardware implementations supporting DMA draining must drain any
+ *          inflight DMA read/write requests"
+ *
+ * @note With queued invalidation, the request is only queued and takes effect
+ *       when CommitInvalidations completes. Address and AddressMask are used
+ *       only for the page-selective invalidation.
+ */
+VOID
+InvalidateIotlb (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN UINT64 Granularity,
+    IN UINT16 DomainId,
+    IN UINT64 Address,
+    IN UINT8 AddressMask
+    )
+{
+    UINT64 iotlbRegOffset;
+    UINT64 command;
+    UINT64 invalidateAddress;
+    UINT64 startTimestamp;
+    UINT64 spinCount;
+
+    DmarUnit->InvalidationStatistics.Invalidations++;
+
+    invalidateAddress = 0;
+    if (Granularity == DMAR_GRANULARITY_PAGE)
+    {
+        ASSERT((Address & (LShiftU64(SIZE_4KB, AddressMask) - 1)) == 0);
+        invalidateAddress = Address | (AddressMask & B_IVA_REG_AM_MASK);
+    }
+
+    if (DmarUnit->InvalidationQueue.Descriptors != NULL)
+    {
+        QueueDescriptor(DmarUnit,
+                        V_INV_DESC_TYPE_IOTLB |
+                        (Granularity << 4) |
+                        B_INV_DESC_IOTLB_DW |
+                        B_INV_DESC_IOTLB_DR |
+                        ((UINT64)DomainId << 16),
+                        invalidateAddress);
+        return;
+    }
+
+    //
+    // See 10.4.8.1 IOTLB Invalidate Register and 10.4.8.2 Invalidate Address
+    // Register.
+    //
+    iotlbRegOffset = (UINT64)DmarUnit->ExtendedCapability.Bits.IRO * 16;
+    if (Granularity == DMAR_GRANULARITY_PAGE)
+    {
+        WriteDmarRegister64(DmarUnit->RegisterBaseVa, iotlbRegOffset + R_IVA_REG, invalidateAddress);
+        DmarUnit->InvalidationStatistics.MmioWrites++;
+    }
+    command = B_IOTLB_REG_IVT |
+              (Granularity << 60) |
+              V_IOTLB_REG_DR |
+              V_IOTLB_REG_DW |
+              ((UINT64)DomainId << 32);
+    startTimestamp = GetTimestamp();
+    WriteDmarRegister64(DmarUnit->RegisterBaseVa, iotlbRegOffset + R_IOTLB_REG, command);
+    DmarUnit->InvalidationStatistics.MmioWrites++;
+    for (spinCount = 1; ; ++spinCount)
+    {
+        DmarUnit->InvalidationStatistics.MmioReads++;
+        if ((ReadDmarRegister64(DmarUnit->RegisterBaseVa,
+                                iotlbRegOffset + R_IOTLB_REG) & B_IOTLB_REG_IVT) == 0)
+        {
+            break;
+        }
+        CpuPause();
+    }
+    RecordTiming(&DmarUnit->WaitTimings[HELLO_IOMMU_WAIT_IOTLB_INVALIDATE], startTimestamp, spinCount);
+    DmarUnit->InvalidationStatistics.Batches++;
+}
+
+/**
+ * @brief Submits all queued invalidation requests to the hardware with a single
+ *        write to the Invalidation Queue Tail Register.
+ *
+ * @note The invalidation wait descriptor is appended to learn completion of
+ *       all preceding descriptors. This is no-op with register-based invalidation.
+ */
+VOID
+SubmitInvalidations (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit
+    )
+{
+    DMAR_INVALIDATION_QUEUE* queue;
+    VTD_INVALIDATION_DESCRIPTOR* descriptor;
+
+    queue = &DmarUnit->InvalidationQueue;
+    if ((queue->Descriptors == NULL) || (queue->PendingCount == 0))
+    {
+        return;
+    }
+
+    //
+    // Request hardware to write the new status data once all preceding
+    // descriptors completed. The fence bit (FN) makes sure the descriptors
+    // that follow are not processed before that. See 6.5.2.8 Invalidation
+    // Wait Descriptor.
+    //
+    queue->WaitStatusData++;
+    descriptor = GetDescriptor(queue, queue->Tail);
+    descriptor->Uint128.Uint64Lo = V_INV_DESC_TYPE_WAIT |
+                                   B_INV_DESC_WAIT_SW |
+                                   B_INV_DESC_WAIT_FN |
+                                   ((UINT64)queue->WaitStatusData << 32);
+    descriptor->Uint128.Uint64Hi = (UINT64)&queue->WaitStatus;
+    queue->Tail = (queue->Tail + 1) % queue->EntryCount;
+
+    //
+    // Ring the doorbell. Hardware processes descriptors from the head to the
+    // new tail. The offset is in bytes, that is, in the unit of 128-bit, with
+    // bit 4 required to be zero for 256-bit descriptors. See 10.4.22
+    // Invalidation Queue Tail Register.
+    //
+    WriteDmarRegister64(DmarUnit->RegisterBaseVa, R_IQT_REG, queue->Tail << queue->DescriptorShift);
+    DmarUnit->InvalidationStatistics.MmioWrites++;
+    DmarUnit->InvalidationStatistics.Batches++;
+
+    queue->PendingCount = 0;
+    queue->InFlight = TRUE;
+    queue->SubmitTimestamp = GetTimestamp();
+}
+
+/**
+ * @brief Waits for completion of the invalidation requests submitted by
+ *        SubmitInvalidations.
+ *
+ * @note Completion is polled through memory and does not cost MMIO accesses,
+ *       except for occasional checks of the invalidation queue error.
+ */
+EFI_STATUS
+WaitForInvalidations (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit
+    )
+{
+    DMAR_INVALIDATION_QUEUE* queue;
+    UINT32 faultStatus;
+    UINT64 spinCount;
+
+    queue = &DmarUnit->InvalidationQueue;
+    if (queue->InFlight == FALSE)
+    {
+        return EFI_SUCCESS;
+    }
+
+    spinCount = 0;
+    for (UINT64 i = 1; queue->WaitStatus != queue->WaitStatusData; ++i)
+    {
+        spinCount = i;
+        if ((i % QUEUE_ERROR_CHECK_INTERVAL) == 0)
+        {
+            DmarUnit->InvalidationStatistics.MmioReads++;
+            faultStatus = ReadDmarRegister32(DmarUnit->RegisterBaseVa, R_FSTS_REG);
+            if ((faultStatus & B_FSTS_REG_IQE) != 0)
+            {
+                DEBUG((DEBUG_ERROR,
+                       "Invalidation queue error on the unit at %p : %08x\n",
+                       DmarUnit->RegisterBasePa,
+                       faultStatus));
+                WriteDmarRegister32(DmarUnit->RegisterBaseVa, R_FSTS_REG, B_FSTS_REG_IQE);
+                queue->InFlight = FALSE;
+                return EFI_DEVICE_ERROR;
+            }
+        }
+        CpuPause();
+    }
+
+    RecordTiming(&DmarUnit->WaitTimings[HELLO_IOMMU_WAIT_INVALIDATION_QUEUE],
+                 queue->SubmitTimestamp,
+                 spinCount);
+    queue->InFlight = FALSE;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Submits all queued invalidation requests and waits for completion of them.
+ */
+EFI_STATUS
+CommitInvalidations (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit
+    )
+{
+    SubmitInvalidations(DmarUnit);
+    return WaitForInvalidations(DmarUnit);
+}
+
+/**
+ * @brief Records that translations for the range were modified.
+ *
+ * @details The range is merged into the last recorded range if they are
+ *          adjacent or overlapping, which is the common case when a series of
+ *          pages are updated in order.
+ */
+VOID
+AddDirtyRange (
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges,
+    IN UINT64 Base,
+    IN UINT64 Length
+    )
+{
+    UINT64 end;
+    UINT64 lastEnd;
+
+    ASSERT((Base % SIZE_4KB) == 0);
+    ASSERT((Length % SIZE_4KB) == 0);
+
+    if ((DirtyRanges->Overflowed != FALSE) || (Length == 0))
+    {
+        return;
+    }
+
+    end = Base + Length;
+    if (DirtyRanges->Count != 0)
+    {
+        UINT64 last;
+
+        last = DirtyRanges->Count - 1;
+        lastEnd = DirtyRanges->Ranges[last].Base + DirtyRanges->Ranges[last].Length;
+        if ((Base <= lastEnd) && (end >= DirtyRanges->Ranges[last].Base))
+        {
+            DirtyRanges->Ranges[last].Base = MIN(Base, DirtyRanges->Ranges[last].Base);
+            DirtyRanges->Ranges[last].Length = MAX(end, lastEnd) - DirtyRanges->Ranges[last].Base;
+            return;
+        }
+    }
+
+    if (DirtyRanges->Count == ARRAY_SIZE(DirtyRanges->Ranges))
+    {
+        DirtyRanges->Overflowed = TRUE;
+        return;
+    }
+    DirtyRanges->Ranges[DirtyRanges->Count].Base = Base;
+    DirtyRanges->Ranges[DirtyRanges->Count].Length = Length;
+    DirtyRanges->Count++;
+}
+
+/**
+ * @brief Sorts the dirty ranges by the base address and merges adjacent or
+ *        overlapping ranges.
+ */
+static
+VOID
+NormalizeDirtyRanges (
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    )
+{
+    UINT64 mergedCount;
+
+    //
+    // Insertion sort. The number of ranges is small and they are mostly sorted
+    // already.
+    //
+    for (UINT64 i = 1; i < DirtyRanges->Count; ++i)
+    {
+        UINT64 base;
+        UINT64 length;
+        UINT64 j;
+
+        base = DirtyRanges->Ranges[i].Base;
+        length = DirtyRanges->Ranges[i].Length;
+        for (j = i; (j > 0) && (DirtyRanges->Ranges[j - 1].Base > base); --j)
+        {
+            DirtyRanges->Ranges[j] = DirtyRanges->Ranges[j - 1];
+        }
+        DirtyRanges->Ranges[j].Base = base;
+        DirtyRanges->Ranges[j].Length = length;
+    }
+
+    mergedCount = 0;
+    for (UINT64 i = 0; i < DirtyRanges->Count; ++i)
+    {
+        UINT64 mergedEnd;
+
+        if (mergedCount != 0)
+        {
+            mergedEnd = DirtyRanges->Ranges[mergedCount - 1].Base +
+                        DirtyRanges->Ranges[mergedCount - 1].Length;
+            if (DirtyRanges->Ranges[i].Base <= mergedEnd)
+            {
+                DirtyRanges->Ranges[mergedCount - 1].Length =
+                    MAX(mergedEnd, DirtyRanges->Ranges[i].Base + DirtyRanges->Ranges[i].Length) -
+                    DirtyRanges->Ranges[mergedCount - 1].Base;
+                continue;
+            }
+        }
+        DirtyRanges->Ranges[mergedCount] = DirtyRanges->Ranges[i];
+        mergedCount++;
+    }
+    DirtyRanges->Count = mergedCount;
+}
+
+/**
+ * @brief Invalidates the IOTLB for the range with the fewest page-selective
+ *        invalidations, or counts them without invalidating if DmarUnit is NULL.
+ *
+ * @details Each invalidation covers a naturally aligned, power-of-two number of
+ *          4KB pages specified by the address mask (AM). If a single block not
+ *          larger than twice of the range covers the range, it is used.
+ *          Otherwise, the range is decomposed into the largest aligned blocks
+ *          from the lowest address. See 6.5.1.2 IOTLB Invalidation.
+ *
+ * @return The number of page-selective invalidations.
+ */
+static
+UINT64
+InvalidateIotlbForRange (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnit OPTIONAL,
+    IN UINT16 DomainId,
+    IN UINT64 Base,
+    IN UINT64 Length,
+    IN UINT8 MaxAddressMask
+    )
+{
+    UINT64 end;
+    UINT64 invalidationCount;
+    UINT8 addressMask;
+
+    end = Base + Length;
+
+    //
+    // Find the smallest aligned block covering the whole range.
+    //
+    for (addressMask = 0; addressMask <= MaxAddressMask; ++addressMask)
+    {
+        UINT64 blockSize;
+        UINT64 blockBase;
+
+        blockSize = LShiftU64(SIZE_4KB, addressMask);
+        blockBase = Base & ~(blockSize - 1);
+        if ((blockBase + blockSize) >= end)
+        {
+            if (blockSize <= (Length * 2))
+            {
+                if (DmarUnit != NULL)
+                {
+                    InvalidateIotlb(DmarUnit, DMAR_GRANULARITY_PAGE, DomainId, blockBase, addressMask);
+                }
+                return 1;
+            }
+            break;
+        }
+    }
+
+    //
+    // Fall back to the exact decomposition.
+    //
+    invalidationCount = 0;
+    while (Base < end)
+    {
+        for (addressMask = 0; addressMask < MaxAddressMask; ++addressMask)
+        {
+            UINT64 nextBlockSize;
+
+            nextBlockSize = LShiftU64(SIZE_4KB, addressMask + 1);
+            if (((Base & (nextBlockSize - 1)) != 0) || ((Base + nextBlockSize) > end))
+            {
+                break;
+            }
+        }
+        if (DmarUnit != NULL)
+        {
+            InvalidateIotlb(DmarUnit, DMAR_GRANULARITY_PAGE, DomainId, Base, addressMask);
+        }
+        Base += LShiftU64(SIZE_4KB, addressMask);
+        invalidationCount++;
+    }
+    return invalidationCount;
+}
+
+/**
+ * @brief Invalidates the context-cache entry of the device on all hardware units
+ *        with DMA-remapping enabled, after its context entry is updated.
+ *
+ * @details The device-selective invalidation is used, unless the root entry of
+ *          the bus is also updated, in which case, the global invalidation is
+ *          used as required for modification of root entries. In scalable mode,
+ *          the PASID-cache is invalidated for the domain, or globally, as well,
+ *          since PASID entries are cached separately from context entries.
+ *
+ *          If the device left the domain, the IOTLB is invalidated for it
+ *          domain-selectively in the same batch, after the context-cache, so
+ *          that no translation the device used under the domain survives. In
+ *          scalable mode, the entries for DMAR_RID_PASID are also invalidated
+ *          with the PASID-based IOTLB invalidation.
+ *
+ * @param DomainId - The domain ID the device belonged to before the update, or
+ *                   of the PASID entry updated in scalable mode.
+ * @param DomainLeft - TRUE if the device moved from DomainId to another domain.
+ */
+EFI_STATUS
+InvalidateContextCacheForDevice (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN UINT16 SourceId,
+    IN UINT16 DomainId,
+    IN BOOLEAN RootEntryUpdated,
+    IN BOOLEAN DomainLeft
+    )
+{
+    EFI_STATUS status;
+
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        if (DmarUnits[i].DmaRemappingEnabled == FALSE)
+        {
+            continue;
+        }
+
+        if (RootEntryUpdated != FALSE)
+        {
+            InvalidateContextCache(&DmarUnits[i], DMAR_GRANULARITY_GLOBAL, 0, 0);
+        }
+        else
+        {
+            InvalidateContextCache(&DmarUnits[i], DMAR_GRANULARITY_DEVICE, DomainId, SourceId);
+        }
+        if (DmarUnits[i].Translations->ScalableMode != FALSE)
+        {
+            if (RootEntryUpdated != FALSE)
+            {
+                InvalidatePasidCache(&DmarUnits[i], DMAR_PASID_GRANULARITY_GLOBAL, 0, 0);
+            }
+            else
+            {
+                InvalidatePasidCache(&DmarUnits[i], DMAR_PASID_GRANULARITY_DOMAIN, DomainId, 0);
+            }
+        }
+        if (DomainLeft != FALSE)
+        {
+            InvalidateIotlb(&DmarUnits[i], DMAR_GRANULARITY_DOMAIN, DomainId, 0, 0);
+            if (DmarUnits[i].Translations->ScalableMode != FALSE)
+            {
+                InvalidatePasidIotlb(&DmarUnits[i], DomainId, DMAR_RID_PASID);
+            }
+        }
+        SubmitInvalidations(&DmarUnits[i]);
+    }
+
+    status = EFI_SUCCESS;
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        EFI_STATUS waitStatus;
+
+        waitStatus = WaitForInvalidations(&DmarUnits[i]);
+        if (EFI_ERROR(waitStatus))
+        {
+            status = waitStatus;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Invalidates the IOTLB of all hardware units with DMA-remapping enabled
+ *        for the dirty ranges of the domain, and resets the dirty ranges.
+ *
+ * @details Page-selective invalidation is used when the unit supports it and
+ *          the number of invalidations needed does not exceed
+ *          DMAR_MAX_PAGE_SELECTIVE_INVALIDATIONS. Otherwise, the domain-selective
+ *          invalidation is used. Paging-structure caches are invalidated too (IH
+ *          is not set), as the modification may include splitting large pages.
+ *
+ *          With DMAR_DOMAIN_ID_ALL, the same is done for each domain with
+ *          second-level tables, with the limit applying to the total number of
+ *          invalidations. Pass-through domains are skipped, as nothing of them
+ *          is cached in the IOTLB. The global invalidation is used only when
+ *          even the domain-selective invalidations exceed the limit.
+ *
+ *          Invalidations are submitted to all units first, then waited for, so
+ *          that the latencies of the units overlap.
+ *
+ * @param DomainId - The domain whose translations were modified, or
+ *                   DMAR_DOMAIN_ID_ALL for modification shared by all domains.
+ */
+EFI_STATUS
+InvalidateDirtyRanges (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN UINT16 DomainId,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    )
+{
+    EFI_STATUS status;
+
+    status = EFI_SUCCESS;
+
+    if ((DirtyRanges->Count == 0) && (DirtyRanges->Overflowed == FALSE))
+    {
+        goto Exit;
+    }
+
+    NormalizeDirtyRanges(DirtyRanges);
+
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        DMAR_UNIT_INFORMATION* dmarUnit;
+        CONST DMAR_TRANSLATIONS* translations;
+        UINT8 maxAddressMask;
+        UINT64 invalidationCount;
+        UINT64 domainCount;
+        UINT64 firstDomainId;
+        UINT64 lastDomainId;
+        UINT64 granularity;
+
+        //
+        // Nothing is cached by the unit if DMA-remapping is not enabled yet. The
+        // global invalidation at enabling takes care of it.
+        //
+        dmarUnit = &DmarUnits[i];
+        if (dmarUnit->DmaRemappingEnabled == FALSE)
+        {
+            continue;
+        }
+
+        //
+        // Count the domains to invalidate. Pass-through domains have no tables.
+        //
+        translations = dmarUnit->Translations;
+        if (DomainId == DMAR_DOMAIN_ID_ALL)
+        {
+            firstDomainId = UEFI_DOMAIN_ID;
+            lastDomainId = translations->DomainIdLimit - 1;
+            domainCount = 0;
+            for (UINT64 domainId = firstDomainId; domainId <= lastDomainId; ++domainId)
+            {
+                if (translations->DomainSlPml4s[domainId] != NULL)
+                {
+                    domainCount++;
+                }
+            }
+        }
+        else
+        {
+            firstDomainId = DomainId;
+            lastDomainId = DomainId;
+            domainCount = 1;
+        }
+
+        maxAddressMask = 0;
+        invalidationCount = MAX_UINT64;
+        if ((DirtyRanges->Overflowed == FALSE) && (dmarUnit->Capability.Bits.PSI != FALSE))
+        {
+            maxAddressMask = dmarUnit->Capability.Bits.MAMV;
+            invalidationCount = 0;
+            for (UINT64 j = 0; j < DirtyRanges->Count; ++j)
+            {
+                invalidationCount += InvalidateIotlbForRange(NULL,
+                                                             DomainId,
+                                                             DirtyRanges->Ranges[j].Base,
+                                                             DirtyRanges->Ranges[j].Length,
+                                                             maxAddressMask);
+            }
+        }
+
+        if ((invalidationCount <= DMAR_MAX_PAGE_SELECTIVE_INVALIDATIONS) &&
+            ((invalidationCount * domainCount) <= DMAR_MAX_PAGE_SELECTIVE_INVALIDATIONS))
+        {
+            granularity = DMAR_GRANULARITY_PAGE;
+        }
+        else if (domainCount <= DMAR_MAX_PAGE_SELECTIVE_INVALIDATIONS)
+        {
+            granularity = DMAR_GRANULARITY_DOMAIN;
+        }
+        else
+        {
+            InvalidateIotlb(dmarUnit, DMAR_GRANULARITY_GLOBAL, 0, 0, 0);
+            SubmitInvalidations(dmarUnit);
+            continue;
+        }
+
+        for (UINT64 domainId = firstDomainId; domainId <= lastDomainId; ++domainId)
+        {
+            if ((DomainId == DMAR_DOMAIN_ID_ALL) && (translations->DomainSlPml4s[domainId] == NULL))
+            {
+                continue;
+            }
+
+            if (granularity == DMAR_GRANULARITY_DOMAIN)
+            {
+                InvalidateIotlb(dmarUnit, DMAR_GRANULARITY_DOMAIN, (UINT16)domainId, 0, 0);
+                continue;
+            }
+            for (UINT64 j = 0; j < DirtyRanges->Count; ++j)
+            {
+                (VOID)InvalidateIotlbForRange(dmarUnit,
+                                              (UINT16)domainId,
+                                              DirtyRanges->Ranges[j].Base,
+                                              DirtyRanges->Ranges[j].Length,
+                                              maxAddressMask);
+            }
+        }
+        SubmitInvalidations(dmarUnit);
+    }
+
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        EFI_STATUS waitStatus;
+
+        waitStatus = WaitForInvalidations(&DmarUnits[i]);
+        if (EFI_ERROR(waitStatus))
+        {
+            status = waitStatus;
+        }
+    }
+
+    ZeroMem(DirtyRanges, sizeof(*DirtyRanges));
+
+Exit:
+    return status;
+}
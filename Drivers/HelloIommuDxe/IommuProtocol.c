@@ -0,0 +1,1029 @@
+#include "HelloIommuDxe.h"
+
+#define MAP_INFO_SIGNATURE      SIGNATURE_32('H', 'I', 'M', 'I')
+
+//
+// The number of MAP_INFO allocated at once when the free list is empty.
+//
+#define MAP_INFO_CHUNK_COUNT    64
+
+//
+// The state of each mapping, returned to the caller of Map as the opaque
+// Mapping value. BounceAddress is zero unless the mapping uses a bounce buffer.
+//
+typedef struct _MAP_INFO
+{
+    UINT32 Signature;
+    struct _MAP_INFO* Next;
+    EDKII_IOMMU_OPERATION Operation;
+    UINTN NumberOfBytes;
+    EFI_PHYSICAL_ADDRESS HostAddress;
+    EFI_PHYSICAL_ADDRESS BounceAddress;
+    EFI_PHYSICAL_ADDRESS DeviceAddress;
+
+    //
+    // The page-aligned range of device addresses SetAttribute updates, and the
+    // host pages it translates to, that is, of the bounce buffer if used. Those
+    // are the same unless PcdIovaMapping is set.
+    //
+    EFI_PHYSICAL_ADDRESS DevicePageBase;
+    EFI_PHYSICAL_ADDRESS HostPageBase;
+    UINTN NumberOfPages;
+} MAP_INFO;
+
+//
+// The copies of the hardware units and translations made at initialization,
+// which the protocol keeps updating after the entry point returns.
+//
+static DMAR_UNIT_INFORMATION* mIommuUnits;
+static UINT64 mIommuUnitCount;
+static DMAR_TRANSLATIONS* mIommuTranslations;
+
+//
+// The topology parsed from the DMAR table, or NULL if not available, in which
+// case invalidation is issued to all hardware units.
+//
+static DMAR_TOPOLOGY* mIommuTopology;
+
+//
+// TRUE if any hardware unit reports CAP.CM, that is, non-present entries may be
+// cached and granting access requires invalidation too.
+//
+static BOOLEAN mCachingMode;
+
+//
+// MAP_INFO not in use. Entries are recycled and never freed, so that Map and
+// Unmap do not call the memory allocation services in the common case.
+//
+static MAP_INFO* mFreeMapInfoList;
+
+//
+// The allocator of device addresses if PcdIovaMapping is set. A single window is
+// shared by all devices, as Map is not told which device the mapping is for.
+//
+static DMAR_IOVA_ALLOCATOR mIovaAllocator;
+
+static EFI_EVENT mReadyToBootEvent;
+
+/**
+ * @brief Returns MAP_INFO from the free list, refilling the list if empty.
+ */
+static
+MAP_INFO*
+AllocateMapInfo (
+    VOID
+    )
+{
+    EFI_TPL oldTpl;
+    MAP_INFO* mapInfo;
+
+    oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+    if (mFreeMapInfoList == NULL)
+    {
+        MAP_INFO* chunk;
+
+        chunk = AllocatePool(sizeof(*chunk) * MAP_INFO_CHUNK_COUNT);
+        if (chunk != NULL)
+        {
+            for (UINT64 i = 0; i < MAP_INFO_CHUNK_COUNT; ++i)
+            {
+                chunk[i].Signature = 0;
+                chunk[i].Next = mFreeMapInfoList;
+                mFreeMapInfoList = &chunk[i];
+            }
+        }
+    }
+
+    mapInfo = mFreeMapInfoList;
+    if (mapInfo != NULL)
+    {
+        mFreeMapInfoList = mapInfo->Next;
+        mapInfo->Signature = MAP_INFO_SIGNATURE;
+    }
+    gBS->RestoreTPL(oldTpl);
+    return mapInfo;
+}
+
+/**
+ * @brief Returns MAP_INFO to the free list.
+ */
+static
+VOID
+FreeMapInfo (
+    IN MAP_INFO* MapInfo
+    )
+{
+    EFI_TPL oldTpl;
+
+    oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+    MapInfo->Signature = 0;
+    MapInfo->Next = mFreeMapInfoList;
+    mFreeMapInfoList = MapInfo;
+    gBS->RestoreTPL(oldTpl);
+}
+
+/**
+ * @brief Tests whether the operation is for 32-bit bus master addresses.
+ */
+static
+BOOLEAN
+Is32BitOperation (
+    IN EDKII_IOMMU_OPERATION Operation
+    )
+{
+    return ((Operation == EdkiiIoMmuOperationBusMasterRead) ||
+            (Operation == EdkiiIoMmuOperationBusMasterWrite) ||
+            (Operation == EdkiiIoMmuOperationBusMasterCommonBuffer));
+}
+
+/**
+ * @brief Tests whether the buffer must be bounced for the operation, that is,
+ *        the buffer is above 4GB for a 32-bit operation while device addresses
+ *        are host addresses, or it is not aligned to pages and
+ *        PcdBounceUnalignedBuffers is set.
+ */
+static
+BOOLEAN
+NeedsBounceBuffer (
+    IN EDKII_IOMMU_OPERATION Operation,
+    IN EFI_PHYSICAL_ADDRESS HostAddress,
+    IN UINTN NumberOfBytes
+    )
+{
+    if ((FeaturePcdGet(PcdIovaMapping) == FALSE) &&
+        (Is32BitOperation(Operation) != FALSE) &&
+        ((HostAddress + NumberOfBytes) > SIZE_4GB))
+    {
+        return TRUE;
+    }
+
+    if ((FeaturePcdGet(PcdBounceUnalignedBuffers) != FALSE) &&
+        (Operation != EdkiiIoMmuOperationBusMasterCommonBuffer) &&
+        (Operation != EdkiiIoMmuOperationBusMasterCommonBuffer64) &&
+        (((HostAddress & EFI_PAGE_MASK) != 0) || ((NumberOfBytes & EFI_PAGE_MASK) != 0)))
+    {
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Returns the source-id of the PCI device the handle represents.
+ *
+ * @return EFI_UNSUPPORTED if the device is not a PCI device, or is on a
+ *         segment other than zero, which this project does not translate.
+ */
+static
+EFI_STATUS
+GetSourceIdOfDevice (
+    IN EFI_HANDLE DeviceHandle,
+    OUT UINT16* SourceId
+    )
+{
+    EFI_STATUS status;
+    EFI_PCI_IO_PROTOCOL* pciIo;
+    UINTN segment;
+    UINTN bus;
+    UINTN device;
+    UINTN function;
+
+    status = gBS->HandleProtocol(DeviceHandle, &gEfiPciIoProtocolGuid, (VOID**)&pciIo);
+    if (EFI_ERROR(status))
+    {
+        status = EFI_UNSUPPORTED;
+        goto Exit;
+    }
+
+    status = pciIo->GetLocation(pciIo, &segment, &bus, &device, &function);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+    if (segment != 0)
+    {
+        status = EFI_UNSUPPORTED;
+        goto Exit;
+    }
+
+    *SourceId = (UINT16)((bus << 8) | (device << 3) | function);
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Returns the hardware units the device is under the scope of, that is,
+ *        the one owning it, or all units if the owner is not known.
+ */
+static
+VOID
+GetDmarUnitsOfDevice (
+    IN UINT16 SourceId,
+    OUT DMAR_UNIT_INFORMATION** DmarUnits,
+    OUT UINT64* DmarUnitCount
+    )
+{
+    UINT8 unitIndex;
+
+    *DmarUnits = mIommuUnits;
+    *DmarUnitCount = mIommuUnitCount;
+    if (mIommuTopology == NULL)
+    {
+        return;
+    }
+
+    unitIndex = GetDmarUnitIndexOfDevice(mIommuTopology, 0, SourceId);
+    if (unitIndex < mIommuUnitCount)
+    {
+        *DmarUnits = &mIommuUnits[unitIndex];
+        *DmarUnitCount = 1;
+    }
+}
+
+/**
+ * @brief Applies the change SetAttribute made to the original translations to
+ *        their replicas, if any.
+ *
+ * @details Replicas are identical to the original, so the same domain ID is
+ *          expected to be assigned and the same entries to be updated, and the
+ *          dirty ranges recorded for the original to cover the replicas too.
+ *          The domain ID is verified, as invalidation for the original would
+ *          not cover a replica that diverged.
+ *
+ * @param Pasid - DMAR_RID_PASID for the domain of the device, or the PASID for
+ *                the address space given with AssignPasidDomain.
+ * @param ExpectedDomainId - The domain ID assigned in the original.
+ *
+ * @return EFI_DEVICE_ERROR if any replica assigned a different domain ID.
+ */
+static
+EFI_STATUS
+ApplyAttributeToReplicas (
+    IN UINT16 SourceId,
+    IN UINT32 Pasid,
+    IN CONST DMAR_ADDRESS_RANGE* ReservedRanges,
+    IN UINT64 ReservedRangeCount,
+    IN UINT64 DevicePageBase,
+    IN UINT64 HostPageBase,
+    IN UINT64 Length,
+    IN UINT64 IoMmuAccess,
+    IN UINT16 ExpectedDomainId
+    )
+{
+    EFI_STATUS status;
+    UINT16 domainId;
+    UINT16 previousDomainId;
+    BOOLEAN rootEntryUpdated;
+    DMAR_DIRTY_RANGES dirtyRanges;
+
+    status = EFI_SUCCESS;
+    for (DMAR_TRANSLATIONS* replica = mIommuTranslations->NextReplica;
+         replica != NULL;
+         replica = replica->NextReplica)
+    {
+        ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+        if (Pasid == DMAR_RID_PASID)
+        {
+            status = AssignDeviceDomain(replica,
+                                        SourceId,
+                                        FALSE,
+                                        ReservedRanges,
+                                        ReservedRangeCount,
+                                        &domainId,
+                                        &previousDomainId,
+                                        &rootEntryUpdated);
+        }
+        else
+        {
+            status = AssignPasidDomain(replica, SourceId, Pasid, &domainId, &rootEntryUpdated);
+        }
+        if (EFI_ERROR(status))
+        {
+            DEBUG((DEBUG_ERROR, "Assigning domain failed : %r\n", status));
+            break;
+        }
+        if (domainId != ExpectedDomainId)
+        {
+            DEBUG((DEBUG_ERROR,
+                   "Replica assigned domain %u instead of %u to %04x\n",
+                   domainId,
+                   ExpectedDomainId,
+                   SourceId));
+            ASSERT(FALSE);
+            status = EFI_DEVICE_ERROR;
+            break;
+        }
+        status = MapRangeForDomain(replica,
+                                   domainId,
+                                   DevicePageBase,
+                                   Length,
+                                   HostPageBase,
+                                   IoMmuAccess,
+                                   &dirtyRanges);
+        if (EFI_ERROR(status))
+        {
+            DEBUG((DEBUG_ERROR, "MapRangeForDomain failed : %r\n", status));
+            break;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Implements EDKII_IOMMU_PROTOCOL.SetAttribute.
+ *
+ * @details The device is given its own domain starting with no access on the
+ *          first call, and then, access to the pages of the mapping is granted
+ *          or revoked in that domain. Tables allocated for the mapping are kept,
+ *          so that mapping the same pages again only updates the leaf entries.
+ *
+ *          Granting access needs no IOTLB invalidation as non-present entries
+ *          are not cached, unless the unit reports CAP.CM. Revoking access
+ *          invalidates the pages of the mapping with a single batch submitted to
+ *          all units before returning.
+ *
+ * @note Devices configured as pass-through are not restricted, and the request
+ *       is ignored for them.
+ */
+static
+EFI_STATUS
+EFIAPI
+IommuSetAttribute (
+    IN EDKII_IOMMU_PROTOCOL* This,
+    IN EFI_HANDLE DeviceHandle,
+    IN VOID* Mapping,
+    IN UINT64 IoMmuAccess
+    )
+{
+    EFI_STATUS status;
+    EFI_STATUS invalidationStatus;
+    MAP_INFO* mapInfo;
+    UINT16 sourceId;
+    UINT16 domainId;
+    UINT16 previousDomainId;
+    BOOLEAN rootEntryUpdated;
+    EFI_TPL oldTpl;
+    DMAR_DIRTY_RANGES dirtyRanges;
+    DMAR_UNIT_INFORMATION* dmarUnits;
+    UINT64 dmarUnitCount;
+    DMAR_ADDRESS_RANGE reservedRanges[DMAR_MAX_RESERVED_RANGES];
+    UINT64 reservedRangeCount;
+
+    mapInfo = (MAP_INFO*)Mapping;
+    if ((mapInfo == NULL) ||
+        (mapInfo->Signature != MAP_INFO_SIGNATURE) ||
+        ((IoMmuAccess & ~(UINT64)(EDKII_IOMMU_ACCESS_READ | EDKII_IOMMU_ACCESS_WRITE)) != 0))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    status = GetSourceIdOfDevice(DeviceHandle, &sourceId);
+    if (EFI_ERROR(status))
+    {
+        return status;
+    }
+
+    GetDmarUnitsOfDevice(sourceId, &dmarUnits, &dmarUnitCount);
+
+    //
+    // Reserved memory regions of the device are mapped when its domain is
+    // created, so that it keeps working on them with the restricted access.
+    //
+    reservedRangeCount = 0;
+    if (mIommuTopology != NULL)
+    {
+        reservedRangeCount = GetReservedMemoryOfDevice(mIommuTopology, 0, sourceId, reservedRanges);
+    }
+
+    ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+    oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+
+    status = AssignDeviceDomain(mIommuTranslations,
+                                sourceId,
+                                FALSE,
+                                reservedRanges,
+                                reservedRangeCount,
+                                &domainId,
+                                &previousDomainId,
+                                &rootEntryUpdated);
+    if (status == EFI_UNSUPPORTED)
+    {
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "AssignDeviceDomain failed : %r\n", status));
+        goto Exit;
+    }
+
+    //
+    // EDKII_IOMMU_ACCESS_* are the same as DMAR_ACCESS_*.
+    //
+    status = MapRangeForDomain(mIommuTranslations,
+                               domainId,
+                               mapInfo->DevicePageBase,
+                               EFI_PAGES_TO_SIZE(mapInfo->NumberOfPages),
+                               mapInfo->HostPageBase,
+                               IoMmuAccess,
+                               &dirtyRanges);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "MapRangeForDomain failed : %r\n", status));
+    }
+    else
+    {
+        status = ApplyAttributeToReplicas(sourceId,
+                                          DMAR_RID_PASID,
+                                          reservedRanges,
+                                          reservedRangeCount,
+                                          mapInfo->DevicePageBase,
+                                          mapInfo->HostPageBase,
+                                          EFI_PAGES_TO_SIZE(mapInfo->NumberOfPages),
+                                          IoMmuAccess,
+                                          domainId);
+    }
+    if (mCachingMode != FALSE)
+    {
+        AddDirtyRange(&dirtyRanges,
+                      mapInfo->DevicePageBase,
+                      EFI_PAGES_TO_SIZE(mapInfo->NumberOfPages));
+    }
+
+    //
+    // Invalidate even on error, as the tables may be partially updated. If the
+    // domain is new, the device used to belong to the previous domain, whose
+    // translations granting all memory may still be in the IOTLB. Only the
+    // unit owning the device can have cached its translations.
+    //
+    if (domainId != previousDomainId)
+    {
+        invalidationStatus = InvalidateContextCacheForDevice(dmarUnits,
+                                                             dmarUnitCount,
+                                                             sourceId,
+                                                             previousDomainId,
+                                                             rootEntryUpdated,
+                                                             TRUE);
+        if (EFI_ERROR(invalidationStatus))
+        {
+            DEBUG((DEBUG_ERROR, "InvalidateContextCacheForDevice failed : %r\n", invalidationStatus));
+            status = invalidationStatus;
+        }
+    }
+    invalidationStatus = InvalidateDirtyRanges(dmarUnits, dmarUnitCount, domainId, &dirtyRanges);
+    if (EFI_ERROR(invalidationStatus))
+    {
+        DEBUG((DEBUG_ERROR, "InvalidateDirtyRanges failed : %r\n", invalidationStatus));
+        status = invalidationStatus;
+    }
+
+Exit:
+    gBS->RestoreTPL(oldTpl);
+    return status;
+}
+
+/**
+ * @brief Implements EDKII_IOMMU_PROTOCOL.Map.
+ *
+ * @details The device address is the same as the host address, unless
+ *          PcdIovaMapping is set, in which case, it is allocated from the I/O
+ *          virtual address window. For 32-bit operations on a buffer above 4GB
+ *          without PcdIovaMapping, and if PcdBounceUnalignedBuffers is set, for
+ *          buffers not aligned to pages, a bounce buffer is taken from the pool
+ *          instead. No access is granted until SetAttribute is called for the
+ *          mapping.
+ */
+static
+EFI_STATUS
+EFIAPI
+IommuMap (
+    IN EDKII_IOMMU_PROTOCOL* This,
+    IN EDKII_IOMMU_OPERATION Operation,
+    IN VOID* HostAddress,
+    IN OUT UINTN* NumberOfBytes,
+    OUT EFI_PHYSICAL_ADDRESS* DeviceAddress,
+    OUT VOID** Mapping
+    )
+{
+    EFI_STATUS status;
+    MAP_INFO* mapInfo;
+    EFI_PHYSICAL_ADDRESS hostAddress;
+    EFI_PHYSICAL_ADDRESS mappedAddress;
+    VOID* bounceBuffer;
+    EFI_TPL oldTpl;
+
+    mapInfo = NULL;
+    bounceBuffer = NULL;
+
+    if ((HostAddress == NULL) ||
+        (NumberOfBytes == NULL) ||
+        (*NumberOfBytes == 0) ||
+        (DeviceAddress == NULL) ||
+        (Mapping == NULL) ||
+        ((UINT32)Operation >= EdkiiIoMmuOperationMaximum))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    mapInfo = AllocateMapInfo();
+    if (mapInfo == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    hostAddress = (EFI_PHYSICAL_ADDRESS)(UINTN)HostAddress;
+    mappedAddress = hostAddress;
+    if (NeedsBounceBuffer(Operation, hostAddress, *NumberOfBytes) != FALSE)
+    {
+        //
+        // Common buffers cannot be bounced as both the processor and device
+        // access them at the same time. They are expected to be allocated below
+        // 4GB with AllocateBuffer.
+        //
+        if (Operation == EdkiiIoMmuOperationBusMasterCommonBuffer)
+        {
+            status = EFI_UNSUPPORTED;
+            goto Exit;
+        }
+
+        bounceBuffer = AllocateBounceBuffer(EFI_SIZE_TO_PAGES(*NumberOfBytes));
+        if (bounceBuffer == NULL)
+        {
+            status = EFI_OUT_OF_RESOURCES;
+            goto Exit;
+        }
+        mappedAddress = (EFI_PHYSICAL_ADDRESS)(UINTN)bounceBuffer;
+
+        //
+        // The buffer may hold data of its previous use. Clear what is not
+        // overwritten, as the device can read all of the pages.
+        //
+        if ((Operation == EdkiiIoMmuOperationBusMasterRead) ||
+            (Operation == EdkiiIoMmuOperationBusMasterRead64))
+        {
+            CopyMem(bounceBuffer, HostAddress, *NumberOfBytes);
+            ZeroMem(Add2Ptr(bounceBuffer, *NumberOfBytes),
+                    EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(*NumberOfBytes)) - *NumberOfBytes);
+        }
+    }
+
+    mapInfo->HostPageBase = mappedAddress & ~(UINT64)EFI_PAGE_MASK;
+    mapInfo->NumberOfPages = EFI_SIZE_TO_PAGES(mappedAddress + *NumberOfBytes - mapInfo->HostPageBase);
+    mapInfo->DevicePageBase = mapInfo->HostPageBase;
+    if (FeaturePcdGet(PcdIovaMapping) != FALSE)
+    {
+        oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+        status = AllocateIova(&mIovaAllocator, mapInfo->NumberOfPages, &mapInfo->DevicePageBase);
+        gBS->RestoreTPL(oldTpl);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+
+    mapInfo->Operation = Operation;
+    mapInfo->NumberOfBytes = *NumberOfBytes;
+    mapInfo->HostAddress = hostAddress;
+    mapInfo->BounceAddress = (EFI_PHYSICAL_ADDRESS)(UINTN)bounceBuffer;
+    mapInfo->DeviceAddress = mapInfo->DevicePageBase + (mappedAddress & EFI_PAGE_MASK);
+
+    *DeviceAddress = mapInfo->DeviceAddress;
+    *Mapping = mapInfo;
+    status = EFI_SUCCESS;
+
+Exit:
+    if (EFI_ERROR(status))
+    {
+        if (bounceBuffer != NULL)
+        {
+            FreeBounceBuffer(bounceBuffer, EFI_SIZE_TO_PAGES(*NumberOfBytes));
+        }
+        if (mapInfo != NULL)
+        {
+            FreeMapInfo(mapInfo);
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Implements EDKII_IOMMU_PROTOCOL.Unmap.
+ *
+ * @details Data a device wrote into the bounce buffer is copied back to the
+ *          host buffer. Access is expected to be revoked with SetAttribute
+ *          beforehand, as PCI I/O does.
+ */
+static
+EFI_STATUS
+EFIAPI
+IommuUnmap (
+    IN EDKII_IOMMU_PROTOCOL* This,
+    IN VOID* Mapping
+    )
+{
+    MAP_INFO* mapInfo;
+    EFI_TPL oldTpl;
+
+    mapInfo = (MAP_INFO*)Mapping;
+    if ((mapInfo == NULL) || (mapInfo->Signature != MAP_INFO_SIGNATURE))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    if (mapInfo->BounceAddress != 0)
+    {
+        if ((mapInfo->Operation == EdkiiIoMmuOperationBusMasterWrite) ||
+            (mapInfo->Operation == EdkiiIoMmuOperationBusMasterWrite64))
+        {
+            CopyMem((VOID*)(UINTN)mapInfo->HostAddress,
+                    (VOID*)(UINTN)mapInfo->BounceAddress,
+                    mapInfo->NumberOfBytes);
+        }
+        FreeBounceBuffer((VOID*)(UINTN)mapInfo->BounceAddress,
+                         EFI_SIZE_TO_PAGES(mapInfo->NumberOfBytes));
+    }
+
+    if (FeaturePcdGet(PcdIovaMapping) != FALSE)
+    {
+        oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+        FreeIova(&mIovaAllocator, mapInfo->DevicePageBase, mapInfo->NumberOfPages);
+        gBS->RestoreTPL(oldTpl);
+    }
+
+    FreeMapInfo(mapInfo);
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Implements EDKII_IOMMU_PROTOCOL.AllocateBuffer.
+ *
+ * @details The buffer is allocated below 4GB unless DUAL_ADDRESS_CYCLE is
+ *          requested, so that it can be mapped as a common buffer without
+ *          bouncing.
+ */
+static
+EFI_STATUS
+EFIAPI
+IommuAllocateBuffer (
+    IN EDKII_IOMMU_PROTOCOL* This,
+    IN EFI_ALLOCATE_TYPE Type,
+    IN EFI_MEMORY_TYPE MemoryType,
+    IN UINTN Pages,
+    IN OUT VOID** HostAddress,
+    IN UINT64 Attributes
+    )
+{
+    EFI_STATUS status;
+    EFI_PHYSICAL_ADDRESS physicalAddress;
+
+    if (HostAddress == NULL)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+    if ((MemoryType != EfiBootServicesData) && (MemoryType != EfiRuntimeServicesData))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+    if ((Attributes & EDKII_IOMMU_ATTRIBUTE_INVALID_FOR_ALLOCATE_BUFFER) != 0)
+    {
+        return EFI_UNSUPPORTED;
+    }
+
+    physicalAddress = ((Attributes & EDKII_IOMMU_ATTRIBUTE_DUAL_ADDRESS_CYCLE) != 0) ?
+                      MAX_UINT64 : (SIZE_4GB - 1);
+    status = gBS->AllocatePages(AllocateMaxAddress, MemoryType, Pages, &physicalAddress);
+    if (EFI_ERROR(status))
+    {
+        return status;
+    }
+
+    *HostAddress = (VOID*)(UINTN)physicalAddress;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Implements EDKII_IOMMU_PROTOCOL.FreeBuffer.
+ */
+static
+EFI_STATUS
+EFIAPI
+IommuFreeBuffer (
+    IN EDKII_IOMMU_PROTOCOL* This,
+    IN UINTN Pages,
+    IN VOID* HostAddress
+    )
+{
+    return gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)HostAddress, Pages);
+}
+
+static EDKII_IOMMU_PROTOCOL mIommuProtocol =
+{
+    EDKII_IOMMU_PROTOCOL_REVISION,
+    IommuSetAttribute,
+    IommuMap,
+    IommuUnmap,
+    IommuAllocateBuffer,
+    IommuFreeBuffer,
+};
+
+/**
+ * @brief Implements HELLO_IOMMU_PASID_PROTOCOL.SetAttribute.
+ *
+ * @details The device is given the address space for the PASID on the first
+ *          call with AssignPasidDomain, and then, access to the pages is
+ *          granted or revoked in it, the same as IommuSetAttribute does for the
+ *          domain of the device.
+ */
+static
+EFI_STATUS
+EFIAPI
+PasidSetAttribute (
+    IN HELLO_IOMMU_PASID_PROTOCOL* This,
+    IN EFI_HANDLE DeviceHandle,
+    IN UINT32 Pasid,
+    IN UINT64 DeviceAddress,
+    IN UINT64 HostAddress,
+    IN UINT64 NumberOfBytes,
+    IN UINT64 IoMmuAccess
+    )
+{
+    EFI_STATUS status;
+    EFI_STATUS invalidationStatus;
+    UINT16 sourceId;
+    UINT16 domainId;
+    UINT64 domainCount;
+    BOOLEAN rootEntryUpdated;
+    EFI_TPL oldTpl;
+    DMAR_DIRTY_RANGES dirtyRanges;
+    DMAR_UNIT_INFORMATION* dmarUnits;
+    UINT64 dmarUnitCount;
+
+    if (((DeviceAddress % SIZE_4KB) != 0) ||
+        ((HostAddress % SIZE_4KB) != 0) ||
+        ((NumberOfBytes % SIZE_4KB) != 0) ||
+        (NumberOfBytes == 0) ||
+        ((DeviceAddress + NumberOfBytes) > BIT48) ||
+        ((IoMmuAccess & ~(UINT64)(EDKII_IOMMU_ACCESS_READ | EDKII_IOMMU_ACCESS_WRITE)) != 0))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    status = GetSourceIdOfDevice(DeviceHandle, &sourceId);
+    if (EFI_ERROR(status))
+    {
+        return status;
+    }
+
+    GetDmarUnitsOfDevice(sourceId, &dmarUnits, &dmarUnitCount);
+
+    ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+    oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+
+    domainCount = mIommuTranslations->DomainCount;
+    status = AssignPasidDomain(mIommuTranslations, sourceId, Pasid, &domainId, &rootEntryUpdated);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "AssignPasidDomain failed : %r\n", status));
+        goto Exit;
+    }
+
+    status = MapRangeForDomain(mIommuTranslations,
+                               domainId,
+                               DeviceAddress,
+                               NumberOfBytes,
+                               HostAddress,
+                               IoMmuAccess,
+                               &dirtyRanges);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "MapRangeForDomain failed : %r\n", status));
+    }
+    else
+    {
+        status = ApplyAttributeToReplicas(sourceId,
+                                          Pasid,
+                                          NULL,
+                                          0,
+                                          DeviceAddress,
+                                          HostAddress,
+                                          NumberOfBytes,
+                                          IoMmuAccess,
+                                          domainId);
+    }
+    if (mCachingMode != FALSE)
+    {
+        AddDirtyRange(&dirtyRanges, DeviceAddress, NumberOfBytes);
+    }
+
+    //
+    // If the address space is new, the PASID entry was non-present, which is
+    // cached only with CAP.CM, and is invalidated for the new domain ID. No
+    // domain is left, and the IOTLB holds nothing for the PASID.
+    //
+    if (mIommuTranslations->DomainCount != domainCount)
+    {
+        invalidationStatus = InvalidateContextCacheForDevice(dmarUnits,
+                                                             dmarUnitCount,
+                                                             sourceId,
+                                                             domainId,
+                                                             rootEntryUpdated,
+                                                             FALSE);
+        if (EFI_ERROR(invalidationStatus))
+        {
+            DEBUG((DEBUG_ERROR, "InvalidateContextCacheForDevice failed : %r\n", invalidationStatus));
+            status = invalidationStatus;
+        }
+    }
+    invalidationStatus = InvalidateDirtyRanges(dmarUnits, dmarUnitCount, domainId, &dirtyRanges);
+    if (EFI_ERROR(invalidationStatus))
+    {
+        DEBUG((DEBUG_ERROR, "InvalidateDirtyRanges failed : %r\n", invalidationStatus));
+        status = invalidationStatus;
+    }
+
+Exit:
+    gBS->RestoreTPL(oldTpl);
+    return status;
+}
+
+static HELLO_IOMMU_PASID_PROTOCOL mPasidProtocol =
+{
+    HELLO_IOMMU_PASID_PROTOCOL_REVISION,
+    0,
+    PasidSetAttribute,
+};
+
+/**
+ * @brief Refreshes the snapshot with domains and mappings made through the
+ *        protocol, right before the OS loader starts.
+ */
+static
+VOID
+EFIAPI
+HandleReadyToBoot (
+    IN EFI_EVENT Event,
+    IN VOID* Context
+    )
+{
+    EFI_STATUS status;
+
+    status = PublishSnapshotTable(mIommuUnits, mIommuUnitCount, mIommuTranslations);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_WARN, "PublishSnapshotTable failed : %r\n", status));
+    }
+}
+
+/**
+ * @brief Installs EDKII_IOMMU_PROTOCOL, so that PCI I/O grants devices access
+ *        only to buffers mapped for them.
+ *
+ * @details The hardware units, translations and topology are copied so that
+ *          the protocol can keep using them after the entry point returns. The
+ *          caller must not use the originals once this function succeeds.
+ *
+ * @note This must be called after DMA-remapping is enabled on all units. On
+ *       failure, everything allocated or created here is released, and the
+ *       caller keeps the ownership of the originals.
+ */
+EFI_STATUS
+InitializeIommuProtocol (
+    IN EFI_HANDLE ImageHandle,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN CONST DMAR_TOPOLOGY* Topology OPTIONAL
+    )
+{
+    EFI_STATUS status;
+
+    mIommuUnits = AllocateCopyPool(sizeof(*DmarUnits) * DmarUnitCount, DmarUnits);
+    mIommuTranslations = AllocateCopyPool(sizeof(*Translations), Translations);
+    if ((mIommuUnits == NULL) || (mIommuTranslations == NULL))
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    mIommuUnitCount = DmarUnitCount;
+
+    if (Topology != NULL)
+    {
+        mIommuTopology = AllocateCopyPool(sizeof(*Topology), Topology);
+        if (mIommuTopology == NULL)
+        {
+            status = EFI_OUT_OF_RESOURCES;
+            goto Exit;
+        }
+    }
+
+    if (FeaturePcdGet(PcdIovaMapping) != FALSE)
+    {
+        status = InitializeIovaAllocator(&mIovaAllocator,
+                                         PcdGet64(PcdIovaWindowBase),
+                                         PcdGet64(PcdIovaWindowSize));
+        if (EFI_ERROR(status))
+        {
+            DEBUG((DEBUG_ERROR, "InitializeIovaAllocator failed : %r\n", status));
+            goto Exit;
+        }
+    }
+
+    //
+    // Bounce buffers are allocated from boot services each time if the
+    // reservation is not available. This is not fatal.
+    //
+    status = InitializeBounceBufferPool();
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_WARN, "InitializeBounceBufferPool failed : %r\n", status));
+    }
+
+    //
+    // The snapshot is refreshed at ReadyToBoot only if this succeeds. This is
+    // not fatal either, as the one published at the entry point remains.
+    //
+    status = EfiCreateEventReadyToBootEx(TPL_CALLBACK, HandleReadyToBoot, NULL, &mReadyToBootEvent);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_WARN, "EfiCreateEventReadyToBootEx failed : %r\n", status));
+        mReadyToBootEvent = NULL;
+    }
+
+    mCachingMode = FALSE;
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        if ((mIommuUnits[i].Translations == NULL) || (mIommuUnits[i].Translations == Translations))
+        {
+            mIommuUnits[i].Translations = mIommuTranslations;
+        }
+        if (mIommuUnits[i].Capability.Bits.CM != FALSE)
+        {
+            mCachingMode = TRUE;
+        }
+    }
+
+    //
+    // Install the protocols last, as they may be used as soon as installed.
+    //
+    status = gBS->InstallMultipleProtocolInterfaces(&ImageHandle,
+                                                    &gEdkiiIoMmuProtocolGuid,
+                                                    &mIommuProtocol,
+                                                    NULL);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "InstallMultipleProtocolInterfaces failed : %r\n", status));
+        goto Exit;
+    }
+
+    //
+    // Address spaces for PASIDs are available only in scalable mode, and with
+    // PASIDs all units support.
+    //
+    if ((mIommuTranslations->ScalableMode != FALSE) && (mIommuTranslations->PasidLimit > 1))
+    {
+        mPasidProtocol.MaxPasid = mIommuTranslations->PasidLimit;
+        status = gBS->InstallMultipleProtocolInterfaces(&ImageHandle,
+                                                        &gHelloIommuPasidProtocolGuid,
+                                                        &mPasidProtocol,
+                                                        NULL);
+        if (EFI_ERROR(status))
+        {
+            DEBUG((DEBUG_ERROR, "InstallMultipleProtocolInterfaces failed : %r\n", status));
+            gBS->UninstallMultipleProtocolInterfaces(ImageHandle,
+                                                     &gEdkiiIoMmuProtocolGuid,
+                                                     &mIommuProtocol,
+                                                     NULL);
+            goto Exit;
+        }
+    }
+
+Exit:
+    if (EFI_ERROR(status))
+    {
+        if (mReadyToBootEvent != NULL)
+        {
+            gBS->CloseEvent(mReadyToBootEvent);
+            mReadyToBootEvent = NULL;
+        }
+        FreeBounceBufferPool();
+        FreeIovaAllocator(&mIovaAllocator);
+        if (mIommuTopology != NULL)
+        {
+            FreePool(mIommuTopology);
+            mIommuTopology = NULL;
+        }
+        if (mIommuTranslations != NULL)
+        {
+            FreePool(mIommuTranslations);
+            mIommuTranslations = NULL;
+        }
+        if (mIommuUnits != NULL)
+        {
+            FreePool(mIommuUnits);
+            mIommuUnits = NULL;
+        }
+    }
+    return status;
+}
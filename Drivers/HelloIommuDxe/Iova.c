@@ -0,0 +1,295 @@
+#include "HelloIommuDxe.h"
+
+/**
+ * @brief Returns the order of the smallest power of two not less than Pages.
+ */
+static
+UINT64
+GetOrderOfPages (
+    IN UINT64 Pages
+    )
+{
+    return (Pages <= 1) ? 0 : (UINT64)HighBitSet64(Pages - 1) + 1;
+}
+
+/**
+ * @brief Tests whether the page at the index is allocated in the bitmap.
+ */
+static
+BOOLEAN
+IsIovaPageAllocated (
+    IN CONST DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Index
+    )
+{
+    return ((Allocator->Bitmap[Index / 64] & LShiftU64(1, (UINTN)(Index % 64))) != 0);
+}
+
+/**
+ * @brief Marks the pages allocated or free in the bitmap.
+ */
+static
+VOID
+UpdateIovaBitmap (
+    IN OUT DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Index,
+    IN UINT64 Pages,
+    IN BOOLEAN Allocated
+    )
+{
+    for (UINT64 i = Index; i < (Index + Pages); ++i)
+    {
+        if (Allocated != FALSE)
+        {
+            Allocator->Bitmap[i / 64] |= LShiftU64(1, (UINTN)(i % 64));
+        }
+        else
+        {
+            Allocator->Bitmap[i / 64] &= ~LShiftU64(1, (UINTN)(i % 64));
+        }
+    }
+}
+
+/**
+ * @brief Finds the free run of the pages aligned to Alignment pages in the
+ *        bitmap, from the index up to, but not including, End.
+ *
+ * @details Allocated pages are skipped up to the next free page in the 64-page
+ *          word at once.
+ *
+ * @return The index of the run, or MAX_UINT64 if not found.
+ */
+static
+UINT64
+FindFreeIovaRun (
+    IN CONST DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Index,
+    IN UINT64 End,
+    IN UINT64 Pages,
+    IN UINT64 Alignment
+    )
+{
+    UINT64 i;
+
+    Index = ALIGN_VALUE(Index, Alignment);
+    while ((Index + Pages) <= End)
+    {
+        UINT64 freePages;
+
+        //
+        // Skip the allocated pages from the index up to the next free page in
+        // the word, or to the next word if none is free.
+        //
+        freePages = RShiftU64(~Allocator->Bitmap[Index / 64], (UINTN)(Index % 64));
+        if (freePages == 0)
+        {
+            Index = ALIGN_VALUE(ALIGN_VALUE(Index + 1, 64), Alignment);
+            continue;
+        }
+        if ((freePages & 1) == 0)
+        {
+            Index = ALIGN_VALUE(Index + (UINT64)LowBitSet64(freePages), Alignment);
+            continue;
+        }
+
+        for (i = 1; i < Pages; ++i)
+        {
+            if (IsIovaPageAllocated(Allocator, Index + i) != FALSE)
+            {
+                break;
+            }
+        }
+        if (i == Pages)
+        {
+            return Index;
+        }
+        Index = ALIGN_VALUE(Index + i + 1, Alignment);
+    }
+    return MAX_UINT64;
+}
+
+/**
+ * @brief Initializes the allocator of I/O virtual addresses in the window.
+ *
+ * @param Base - The start of the window. Must be aligned to the largest range
+ *               naturally aligned by AllocateIova, that is, 4KB shifted by
+ *               DMAR_IOVA_MAGAZINE_ORDER_COUNT - 1.
+ * @param Length - The size of the window. Must be a multiple of 4KB.
+ */
+EFI_STATUS
+InitializeIovaAllocator (
+    OUT DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Base,
+    IN UINT64 Length
+    )
+{
+    UINT64 wordCount;
+
+    ZeroMem(Allocator, sizeof(*Allocator));
+
+    //
+    // Natural alignment is computed relative to the start of the window, so
+    // that is absolute only if the window is aligned to the largest order.
+    //
+    if ((Length == 0) ||
+        ((Base % LShiftU64(SIZE_4KB, DMAR_IOVA_MAGAZINE_ORDER_COUNT - 1)) != 0) ||
+        ((Length % SIZE_4KB) != 0))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    Allocator->Base = Base;
+    Allocator->PageCount = EFI_SIZE_TO_PAGES(Length);
+    wordCount = ALIGN_VALUE(Allocator->PageCount, 64) / 64;
+    Allocator->Bitmap = AllocateZeroPool(wordCount * sizeof(UINT64));
+    if (Allocator->Bitmap == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    //
+    // Mark the bits beyond the window allocated so that they are never found.
+    //
+    UpdateIovaBitmap(Allocator,
+                     Allocator->PageCount,
+                     wordCount * 64 - Allocator->PageCount,
+                     TRUE);
+    Allocator->FreePageCount = Allocator->PageCount;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Frees the bitmap allocated by InitializeIovaAllocator.
+ */
+VOID
+FreeIovaAllocator (
+    IN OUT DMAR_IOVA_ALLOCATOR* Allocator
+    )
+{
+    if (Allocator->Bitmap != NULL)
+    {
+        FreePool(Allocator->Bitmap);
+    }
+    ZeroMem(Allocator, sizeof(*Allocator));
+}
+
+/**
+ * @brief Allocates the range of I/O virtual addresses for the pages.
+ *
+ * @details Sizes up to DMAR_IOVA_MAGAZINE_ORDER_COUNT orders are rounded up to
+ *          the power of two and naturally aligned, so that the range can be
+ *          invalidated with a single page-selective invalidation. Those are
+ *          taken from the magazine of the order first, without searching the
+ *          bitmap. Otherwise, the lowest free run is taken (first fit), with
+ *          the search starting at the lowest page that may be free. Unlike
+ *          next fit, this keeps the free pages above the ranges in use
+ *          contiguous under interleaved allocations of mixed sizes, and the
+ *          tables MapRangeForDomain allocates for the window, which are never
+ *          freed, as few as the ranges in use need.
+ *
+ * @note The caller is responsible for serialization.
+ *
+ * @param Pages - The number of pages to allocate.
+ * @param Iova - The start of the range allocated.
+ */
+EFI_STATUS
+AllocateIova (
+    IN OUT DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Pages,
+    OUT UINT64* Iova
+    )
+{
+    UINT64 order;
+    UINT64 alignment;
+    UINT64 index;
+
+    if (Pages == 0)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    order = GetOrderOfPages(Pages);
+    alignment = 1;
+    if (order < DMAR_IOVA_MAGAZINE_ORDER_COUNT)
+    {
+        DMAR_IOVA_MAGAZINE* magazine;
+
+        magazine = &Allocator->Magazines[order];
+        if (magazine->Count != 0)
+        {
+            magazine->Count--;
+            *Iova = magazine->Iovas[magazine->Count];
+            Allocator->AllocationCount++;
+            Allocator->MagazineHitCount++;
+            return EFI_SUCCESS;
+        }
+        Pages = LShiftU64(1, (UINTN)order);
+        alignment = Pages;
+    }
+
+    index = FindFreeIovaRun(Allocator, Allocator->NextIndex, Allocator->PageCount, Pages, alignment);
+    if (index == MAX_UINT64)
+    {
+        Allocator->AllocationFailureCount++;
+        DEBUG((DEBUG_ERROR,
+               "No free I/O virtual address range of %llu pages (%llu pages free).\n",
+               Pages,
+               Allocator->FreePageCount));
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    UpdateIovaBitmap(Allocator, index, Pages, TRUE);
+    if (index == Allocator->NextIndex)
+    {
+        Allocator->NextIndex = index + Pages;
+    }
+    Allocator->FreePageCount -= Pages;
+    Allocator->AllocationCount++;
+    *Iova = Allocator->Base + EFI_PAGES_TO_SIZE(index);
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Returns the range allocated with AllocateIova.
+ *
+ * @details Small ranges are cached in the magazine of the order until it is
+ *          full, and are reused by the next allocation of the same order.
+ *
+ * @note The caller is responsible for serialization, and for revoking access to
+ *       the range beforehand.
+ *
+ * @param Pages - The same value given to AllocateIova.
+ */
+VOID
+FreeIova (
+    IN OUT DMAR_IOVA_ALLOCATOR* Allocator,
+    IN UINT64 Iova,
+    IN UINT64 Pages
+    )
+{
+    UINT64 order;
+    UINT64 index;
+
+    ASSERT((Iova >= Allocator->Base) &&
+           (Iova < (Allocator->Base + EFI_PAGES_TO_SIZE(Allocator->PageCount))));
+
+    order = GetOrderOfPages(Pages);
+    if (order < DMAR_IOVA_MAGAZINE_ORDER_COUNT)
+    {
+        DMAR_IOVA_MAGAZINE* magazine;
+
+        magazine = &Allocator->Magazines[order];
+        if (magazine->Count < DMAR_IOVA_MAGAZINE_SIZE)
+        {
+            magazine->Iovas[magazine->Count] = Iova;
+            magazine->Count++;
+            return;
+        }
+        Pages = LShiftU64(1, (UINTN)order);
+    }
+
+    index = EFI_SIZE_TO_PAGES(Iova - Allocator->Base);
+    UpdateIovaBitmap(Allocator, index, Pages, FALSE);
+    Allocator->NextIndex = MIN(Allocator->NextIndex, index);
+    Allocator->FreePageCount += Pages;
+}
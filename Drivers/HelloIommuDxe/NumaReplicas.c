@@ -0,0 +1,294 @@
+#include "HelloIommuDxe.h"
+
+#define PROXIMITY_DOMAIN_UNKNOWN    MAX_UINT32
+
+/**
+ * @brief Returns the proximity domain of the hardware unit reported by RHSA, or
+ *        PROXIMITY_DOMAIN_UNKNOWN.
+ */
+static
+UINT32
+GetProximityDomainOfUnit (
+    IN CONST DMAR_TOPOLOGY* Topology,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnit
+    )
+{
+    for (UINT64 i = 0; i < Topology->AffinityCount; ++i)
+    {
+        if (Topology->Affinities[i].RegisterBase == DmarUnit->RegisterBasePa)
+        {
+            return Topology->Affinities[i].ProximityDomain;
+        }
+    }
+    return PROXIMITY_DOMAIN_UNKNOWN;
+}
+
+/**
+ * @brief Returns the next enabled, non-hot-pluggable memory affinity structure
+ *        of the SRAT, or NULL if none.
+ */
+static
+CONST EFI_ACPI_4_0_MEMORY_AFFINITY_STRUCTURE*
+GetNextMemoryAffinity (
+    IN CONST EFI_ACPI_4_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* Srat,
+    IN CONST EFI_ACPI_4_0_MEMORY_AFFINITY_STRUCTURE* Previous OPTIONAL
+    )
+{
+    UINT64 endOfSrat;
+    CONST EFI_ACPI_4_0_MEMORY_AFFINITY_STRUCTURE* affinity;
+
+    //
+    // All structures start with the same Type and Length fields.
+    //
+    endOfSrat = (UINT64)Add2Ptr(Srat, Srat->Header.Length);
+    affinity = (Previous == NULL) ?
+        (CONST EFI_ACPI_4_0_MEMORY_AFFINITY_STRUCTURE*)(Srat + 1) :
+        Add2Ptr(Previous, Previous->Length);
+    for (; ((UINT64)affinity + 2) <= endOfSrat; affinity = Add2Ptr(affinity, affinity->Length))
+    {
+        if (affinity->Length < 2)
+        {
+            break;
+        }
+        if ((affinity->Type == EFI_ACPI_4_0_MEMORY_AFFINITY) &&
+            (affinity->Length >= sizeof(*affinity)) &&
+            ((affinity->Flags & EFI_ACPI_4_0_MEMORY_ENABLED) != 0) &&
+            ((affinity->Flags & EFI_ACPI_4_0_MEMORY_HOT_PLUGGABLE) == 0))
+        {
+            return affinity;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the range of the memory affinity structure.
+ */
+static
+VOID
+GetRangeOfMemoryAffinity (
+    IN CONST EFI_ACPI_4_0_MEMORY_AFFINITY_STRUCTURE* Affinity,
+    OUT DMAR_ADDRESS_RANGE* Range
+    )
+{
+    Range->Base = ((UINT64)Affinity->AddressBaseHigh << 32) | Affinity->AddressBaseLow;
+    Range->End = Range->Base + (((UINT64)Affinity->LengthHigh << 32) | Affinity->LengthLow);
+}
+
+/**
+ * @brief Returns the proximity domain the address belongs to, or
+ *        PROXIMITY_DOMAIN_UNKNOWN.
+ */
+static
+UINT32
+GetProximityDomainOfAddress (
+    IN CONST EFI_ACPI_4_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* Srat,
+    IN UINT64 Address
+    )
+{
+    for (CONST EFI_ACPI_4_0_MEMORY_AFFINITY_STRUCTURE* affinity = GetNextMemoryAffinity(Srat, NULL);
+         affinity != NULL;
+         affinity = GetNextMemoryAffinity(Srat, affinity))
+    {
+        DMAR_ADDRESS_RANGE range;
+
+        GetRangeOfMemoryAffinity(affinity, &range);
+        if ((Address >= range.Base) && (Address < range.End))
+        {
+            return affinity->ProximityDomain;
+        }
+    }
+    return PROXIMITY_DOMAIN_UNKNOWN;
+}
+
+/**
+ * @brief Reserves the pool of PageCount pages in the memory of the proximity
+ *        domain, trying its ranges from the largest.
+ */
+static
+EFI_STATUS
+InitializePageTablePoolInProximityDomain (
+    IN CONST EFI_ACPI_4_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* Srat,
+    IN UINT32 ProximityDomain,
+    IN UINT64 PageCount,
+    OUT DMAR_PAGE_TABLE_POOL* Pool
+    )
+{
+    DMAR_ADDRESS_RANGE tried;
+
+    //
+    // Ranges are tried in the descending order of size, each time picking the
+    // largest one smaller than the last tried. Systems have a few ranges for
+    // each proximity domain.
+    //
+    tried.Base = 0;
+    tried.End = MAX_UINT64;
+    for (;;)
+    {
+        DMAR_ADDRESS_RANGE largest;
+
+        largest.Base = largest.End = 0;
+        for (CONST EFI_ACPI_4_0_MEMORY_AFFINITY_STRUCTURE* affinity = GetNextMemoryAffinity(Srat, NULL);
+             affinity != NULL;
+             affinity = GetNextMemoryAffinity(Srat, affinity))
+        {
+            DMAR_ADDRESS_RANGE range;
+
+            if (affinity->ProximityDomain != ProximityDomain)
+            {
+                continue;
+            }
+            GetRangeOfMemoryAffinity(affinity, &range);
+            if (((range.End - range.Base) < (tried.End - tried.Base)) &&
+                ((range.End - range.Base) > (largest.End - largest.Base)))
+            {
+                largest = range;
+            }
+        }
+        if (largest.End == largest.Base)
+        {
+            return EFI_NOT_FOUND;
+        }
+        if (!EFI_ERROR(InitializePageTablePoolInRange(Pool, PageCount, &largest)))
+        {
+            return EFI_SUCCESS;
+        }
+        tried = largest;
+    }
+}
+
+/**
+ * @brief Makes a replica of the translations in the memory of each proximity
+ *        domain with hardware units, and points each unit to the one in its
+ *        domain. Translations of each unit must point to the original.
+ *
+ * @details The proximity domain of each unit is taken from RHSA, and the memory
+ *          of each domain from SRAT. Units in the domain the original
+ *          translations are in, units without RHSA, and units whose replica
+ *          cannot be made use the original. The replicas are linked from the
+ *          original with NextReplica.
+ *
+ * @note This must be called before anything other than the translations, such
+ *       as the invalidation queues, is allocated from the pool.
+ */
+EFI_STATUS
+BuildTranslationReplicas (
+    IN OUT DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN CONST DMAR_TOPOLOGY* Topology OPTIONAL,
+    IN OUT DMAR_TRANSLATIONS* Translations
+    )
+{
+    EFI_STATUS status;
+    CONST EFI_ACPI_4_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* srat;
+    DMAR_TRANSLATIONS** lastReplica;
+
+    Translations->ProximityDomain = PROXIMITY_DOMAIN_UNKNOWN;
+    srat = (CONST EFI_ACPI_4_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER*)EfiLocateFirstAcpiTable(
+                                EFI_ACPI_4_0_SYSTEM_RESOURCE_AFFINITY_TABLE_SIGNATURE);
+    if ((Topology == NULL) || (Topology->AffinityCount == 0) || (srat == NULL))
+    {
+        DEBUG((DEBUG_INFO, "No proximity domain is reported. Translations are not replicated.\n"));
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+
+    Translations->ProximityDomain = GetProximityDomainOfAddress(srat, (UINT64)Translations->Pool.Base);
+    lastReplica = &Translations->NextReplica;
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        UINT32 proximityDomain;
+        DMAR_TRANSLATIONS* replica;
+
+        proximityDomain = GetProximityDomainOfUnit(Topology, &DmarUnits[i]);
+        if (proximityDomain == PROXIMITY_DOMAIN_UNKNOWN)
+        {
+            continue;
+        }
+
+        for (replica = Translations; replica != NULL; replica = replica->NextReplica)
+        {
+            if (replica->ProximityDomain == proximityDomain)
+            {
+                break;
+            }
+        }
+        if (replica != NULL)
+        {
+            DmarUnits[i].Translations = replica;
+            continue;
+        }
+
+        replica = AllocateZeroPool(sizeof(*replica));
+        if (replica == NULL)
+        {
+            status = EFI_OUT_OF_RESOURCES;
+            goto Exit;
+        }
+        status = InitializePageTablePoolInProximityDomain(srat,
+                                                          proximityDomain,
+                                                          Translations->Pool.PageCount,
+                                                          &replica->Pool);
+        if (EFI_ERROR(status))
+        {
+            DEBUG((DEBUG_WARN,
+                   "No memory for translations in proximity domain %u : %r\n",
+                   proximityDomain,
+                   status));
+            FreePool(replica);
+            continue;
+        }
+        InitializeCacheWriteback(&replica->Writeback, DmarUnits, DmarUnitCount);
+        status = CopyTranslations(Translations, replica);
+        if (EFI_ERROR(status))
+        {
+            FreePageTablePool(&replica->Pool);
+            FreePool(replica);
+            goto Exit;
+        }
+        replica->ProximityDomain = proximityDomain;
+        *lastReplica = replica;
+        lastReplica = &replica->NextReplica;
+        DmarUnits[i].Translations = replica;
+
+        DEBUG((DEBUG_INFO,
+               "Replicated translations at %p for proximity domain %u\n",
+               replica->RootTable,
+               proximityDomain));
+    }
+    status = EFI_SUCCESS;
+
+Exit:
+    if (EFI_ERROR(status))
+    {
+        FreeTranslationReplicas(Translations);
+        for (UINT64 i = 0; i < DmarUnitCount; ++i)
+        {
+            DmarUnits[i].Translations = Translations;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Frees all replicas linked from the translations.
+ */
+VOID
+FreeTranslationReplicas (
+    IN OUT DMAR_TRANSLATIONS* Translations
+    )
+{
+    DMAR_TRANSLATIONS* replica;
+
+    replica = Translations->NextReplica;
+    while (replica != NULL)
+    {
+        DMAR_TRANSLATIONS* next;
+
+        next = replica->NextReplica;
+        FreePageTablePool(&replica->Pool);
+        FreePool(replica);
+        replica = next;
+    }
+    Translations->NextReplica = NULL;
+}
@@ -0,0 +1,345 @@
+#include "HelloIommuDxe.h"
+
+//
+// The header written into each freed page to link free pages together.
+//
+typedef struct _FREE_PAGE_HEADER
+{
+    struct _FREE_PAGE_HEADER* Next;
+} FREE_PAGE_HEADER;
+
+/**
+ * @brief Returns the index of the page in the pool.
+ */
+static
+UINT64
+GetPageIndex (
+    IN CONST DMAR_PAGE_TABLE_POOL* Pool,
+    IN CONST VOID* Page
+    )
+{
+    ASSERT(IsPageTablePoolPage(Pool, Page));
+    ASSERT(((UINT64)Page % SIZE_4KB) == 0);
+
+    return ((UINT64)Page - (UINT64)Pool->Base) / SIZE_4KB;
+}
+
+/**
+ * @brief Sets up the pool over the reservation of PageCount pages followed by
+ *        the pages for the share counts.
+ */
+static
+VOID
+InitializePageTablePoolAt (
+    OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN VOID* Base,
+    IN UINT64 PageCount,
+    IN UINT64 MetadataPageCount
+    )
+{
+    ZeroMem(Pool, sizeof(*Pool));
+    Pool->Base = Base;
+    Pool->PageCount = PageCount;
+    Pool->MetadataPageCount = MetadataPageCount;
+    Pool->ShareCounts = Add2Ptr(Pool->Base, PageCount * SIZE_4KB);
+    ZeroMem(Pool->ShareCounts, MetadataPageCount * SIZE_4KB);
+}
+
+/**
+ * @brief Reserves the contiguous runtime memory of the given number of pages
+ *        for the pool.
+ *
+ * @details Pages are handed out from the lowest address as the pool grows, and
+ *          freed pages are reused through the free list. Pages are not touched
+ *          until they are allocated. The share count of each page is kept at
+ *          the end of the same reservation.
+ */
+EFI_STATUS
+InitializePageTablePool (
+    OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN UINT64 PageCount
+    )
+{
+    UINT64 metadataPageCount;
+    VOID* base;
+
+    ZeroMem(Pool, sizeof(*Pool));
+
+    metadataPageCount = EFI_SIZE_TO_PAGES(PageCount * sizeof(*Pool->ShareCounts));
+    base = AllocateRuntimePages(PageCount + metadataPageCount);
+    if (base == NULL)
+    {
+        DEBUG((DEBUG_ERROR,
+               "Failed to allocate %llu runtime pages.\n",
+               PageCount + metadataPageCount));
+        return EFI_OUT_OF_RESOURCES;
+    }
+    InitializePageTablePoolAt(Pool, base, PageCount, metadataPageCount);
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Reserves the pool as InitializePageTablePool does, but within the
+ *        range, such as the memory of a proximity domain.
+ *
+ * @return EFI_NOT_FOUND if the range has no free memory large enough.
+ */
+EFI_STATUS
+InitializePageTablePoolInRange (
+    OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN UINT64 PageCount,
+    IN CONST DMAR_ADDRESS_RANGE* Range
+    )
+{
+    EFI_STATUS status;
+    UINT64 metadataPageCount;
+    EFI_PHYSICAL_ADDRESS address;
+
+    ZeroMem(Pool, sizeof(*Pool));
+
+    //
+    // Allocate the highest free pages below the end of the range, and give up
+    // if they fall below the base.
+    //
+    metadataPageCount = EFI_SIZE_TO_PAGES(PageCount * sizeof(*Pool->ShareCounts));
+    address = Range->End - 1;
+    status = gBS->AllocatePages(AllocateMaxAddress,
+                                EfiRuntimeServicesData,
+                                PageCount + metadataPageCount,
+                                &address);
+    if (EFI_ERROR(status))
+    {
+        return EFI_NOT_FOUND;
+    }
+    if (address < Range->Base)
+    {
+        gBS->FreePages(address, PageCount + metadataPageCount);
+        return EFI_NOT_FOUND;
+    }
+    InitializePageTablePoolAt(Pool, (VOID*)address, PageCount, metadataPageCount);
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Copies the pages allocated from the pool, their share counts and the
+ *        free list into another pool of the same size.
+ *
+ * @details Each page is at the same index in both pools. Pointers within the
+ *          pages, other than the free list, are not adjusted.
+ */
+VOID
+CopyPageTablePool (
+    IN OUT DMAR_PAGE_TABLE_POOL* Destination,
+    IN CONST DMAR_PAGE_TABLE_POOL* Source
+    )
+{
+    FREE_PAGE_HEADER** link;
+
+    ASSERT(Destination->PageCount == Source->PageCount);
+    ASSERT(Destination->UnusedPageIndex == 0);
+
+    CopyMem(Destination->Base, Source->Base, Source->UnusedPageIndex * SIZE_4KB);
+    CopyMem(Destination->ShareCounts,
+            Source->ShareCounts,
+            Source->PageCount * sizeof(*Source->ShareCounts));
+    Destination->UnusedPageIndex = Source->UnusedPageIndex;
+    Destination->FreePageCount = Source->FreePageCount;
+    Destination->PeakUsedPageCount = Source->PeakUsedPageCount;
+
+    //
+    // Relink the free list with the pages of the destination.
+    //
+    Destination->FreeList = NULL;
+    link = (FREE_PAGE_HEADER**)&Destination->FreeList;
+    for (CONST FREE_PAGE_HEADER* page = Source->FreeList; page != NULL; page = page->Next)
+    {
+        *link = Add2Ptr(Destination->Base, (UINT64)page - (UINT64)Source->Base);
+        link = &(*link)->Next;
+    }
+    *link = NULL;
+}
+
+/**
+ * @brief Frees the whole reservation of the pool. Any page allocated from it
+ *        becomes invalid.
+ */
+VOID
+FreePageTablePool (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    )
+{
+    if (Pool->Base != NULL)
+    {
+        FreePages(Pool->Base, Pool->PageCount + Pool->MetadataPageCount);
+    }
+    ZeroMem(Pool, sizeof(*Pool));
+}
+
+/**
+ * @brief Allocates a 4KB page from the pool without clearing it.
+ *
+ * @details This is for tables the caller fills out entirely, such as a split
+ *          large page or a copy of another table, to avoid writing the page
+ *          twice.
+ *
+ * @return The page, or NULL if the pool is exhausted.
+ */
+VOID*
+AllocateUninitializedPageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    )
+{
+    VOID* page;
+    UINT64 usedPageCount;
+
+    if (Pool->FreeList != NULL)
+    {
+        page = Pool->FreeList;
+        Pool->FreeList = ((FREE_PAGE_HEADER*)page)->Next;
+        Pool->FreePageCount--;
+    }
+    else if (Pool->UnusedPageIndex < Pool->PageCount)
+    {
+        page = Add2Ptr(Pool->Base, Pool->UnusedPageIndex * SIZE_4KB);
+        Pool->UnusedPageIndex++;
+    }
+    else
+    {
+        Pool->AllocationFailureCount++;
+        DEBUG((DEBUG_ERROR, "The page table pool of %llu pages is exhausted.\n", Pool->PageCount));
+        return NULL;
+    }
+
+    Pool->AllocationCount++;
+    usedPageCount = Pool->UnusedPageIndex - Pool->FreePageCount;
+    Pool->PeakUsedPageCount = MAX(Pool->PeakUsedPageCount, usedPageCount);
+
+    Pool->ShareCounts[GetPageIndex(Pool, page)] = 1;
+    return page;
+}
+
+/**
+ * @brief Allocates a zero-filled 4KB page from the pool.
+ *
+ * @return The page, or NULL if the pool is exhausted.
+ */
+VOID*
+AllocatePageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool
+    )
+{
+    VOID* page;
+
+    page = AllocateUninitializedPageTablePage(Pool);
+    if (page != NULL)
+    {
+        ZeroMem(page, SIZE_4KB);
+    }
+    return page;
+}
+
+/**
+ * @brief Returns the page allocated by AllocatePageTablePage to the pool.
+ */
+VOID
+FreePageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN VOID* Page
+    )
+{
+    ASSERT(Pool->ShareCounts[GetPageIndex(Pool, Page)] <= 1);
+
+    Pool->ShareCounts[GetPageIndex(Pool, Page)] = 0;
+    ((FREE_PAGE_HEADER*)Page)->Next = Pool->FreeList;
+    Pool->FreeList = Page;
+    Pool->FreePageCount++;
+    Pool->FreeCount++;
+}
+
+/**
+ * @brief Records that one more paging-structure entry references the page.
+ *
+ * @details A page referenced by multiple entries, typically, in tables of
+ *          different domains, is shared and must be copied before modified.
+ */
+VOID
+SharePageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN CONST VOID* Page
+    )
+{
+    UINT64 index;
+
+    index = GetPageIndex(Pool, Page);
+    ASSERT(Pool->ShareCounts[index] != 0);
+    ASSERT(Pool->ShareCounts[index] != MAX_UINT16);
+
+    Pool->ShareCounts[index]++;
+}
+
+/**
+ * @brief Records that one less paging-structure entry references the page,
+ *        and frees it when none does.
+ */
+VOID
+ReleasePageTablePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN VOID* Page
+    )
+{
+    UINT64 index;
+
+    index = GetPageIndex(Pool, Page);
+    ASSERT(Pool->ShareCounts[index] != 0);
+
+    if (Pool->ShareCounts[index] == 1)
+    {
+        FreePageTablePage(Pool, Page);
+        return;
+    }
+    Pool->ShareCounts[index]--;
+}
+
+/**
+ * @brief Returns the number of paging-structure entries referencing the page.
+ */
+UINT64
+GetPageTableShareCount (
+    IN CONST DMAR_PAGE_TABLE_POOL* Pool,
+    IN CONST VOID* Page
+    )
+{
+    return Pool->ShareCounts[GetPageIndex(Pool, Page)];
+}
+
+/**
+ * @brief Tests whether the address is within the reservation of the pool.
+ */
+BOOLEAN
+IsPageTablePoolPage (
+    IN CONST DMAR_PAGE_TABLE_POOL* Pool,
+    IN CONST VOID* Page
+    )
+{
+    return (((UINT64)Page >= (UINT64)Pool->Base) &&
+            ((UINT64)Page < ((UINT64)Pool->Base + Pool->PageCount * SIZE_4KB)));
+}
+
+/**
+ * @brief Logs the usage of the pool.
+ */
+VOID
+DumpPageTablePoolUsage (
+    IN CONST DMAR_PAGE_TABLE_POOL* Pool
+    )
+{
+    DEBUG((DEBUG_INFO,
+           "Page table pool at %p: %llu pages, %llu used, %llu peak, %llu allocations, %llu frees, %llu failures\n",
+           Pool->Base,
+           Pool->PageCount,
+           Pool->UnusedPageIndex - Pool->FreePageCount,
+           Pool->PeakUsedPageCount,
+           Pool->AllocationCount,
+           Pool->FreeCount,
+           Pool->AllocationFailureCount));
+}
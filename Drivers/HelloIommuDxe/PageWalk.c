@@ -0,0 +1,489 @@
+#include "HelloIommuDxe.h"
+
+/**
+ * @brief Walks the root table and context table for the source-id, and returns
+ *        the second-level PML4, or NULL for pass-through.
+ */
+static
+EFI_STATUS
+WalkLegacyModeTables (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN OUT DMAR_WALK_RESULT* Result,
+    OUT CONST VTD_SECOND_LEVEL_PAGING_ENTRY** Pml4
+    )
+{
+    CONST VTD_ROOT_ENTRY* rootEntry;
+    CONST VTD_CONTEXT_ENTRY* contextEntry;
+
+    *Pml4 = NULL;
+
+    rootEntry = &Translations->RootTable[(SourceId >> 8) & 0xff];
+    Result->EntriesRead++;
+    if (rootEntry->Bits.Present == FALSE)
+    {
+        return EFI_NOT_FOUND;
+    }
+
+    contextEntry = (CONST VTD_CONTEXT_ENTRY*)(((UINT64)rootEntry->Bits.ContextTablePointerLo << 12) |
+                                              ((UINT64)rootEntry->Bits.ContextTablePointerHi << 32));
+    contextEntry += (SourceId & 0xff);
+    Result->EntriesRead++;
+    if (contextEntry->Bits.Present == FALSE)
+    {
+        return EFI_NOT_FOUND;
+    }
+
+    Result->DomainId = (UINT16)contextEntry->Bits.DomainIdentifier;
+    if (contextEntry->Bits.TranslationType == V_CONTEXT_ENTRY_TT_PASSTHROUGH)
+    {
+        return EFI_SUCCESS;
+    }
+    if ((contextEntry->Bits.TranslationType != V_CONTEXT_ENTRY_TT_UNTRANSLATED) ||
+        (contextEntry->Bits.AddressWidth != V_CONTEXT_ENTRY_AW_48BIT))
+    {
+        return EFI_UNSUPPORTED;
+    }
+
+    *Pml4 = (CONST VTD_SECOND_LEVEL_PAGING_ENTRY*)
+        (((UINT64)contextEntry->Bits.SecondLevelPageTranslationPointerLo << 12) |
+         ((UINT64)contextEntry->Bits.SecondLevelPageTranslationPointerHi << 32));
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Walks the scalable-mode root table, context table, PASID directory
+ *        and PASID table for the requests without PASID from the source-id,
+ *        and returns the second-level PML4, or NULL for pass-through.
+ */
+static
+EFI_STATUS
+WalkScalableModeTables (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN OUT DMAR_WALK_RESULT* Result,
+    OUT CONST VTD_SECOND_LEVEL_PAGING_ENTRY** Pml4
+    )
+{
+    CONST VTD_SM_CONTEXT_ENTRY* contextEntry;
+    CONST VTD_PASID_DIRECTORY_ENTRY* directoryEntry;
+    CONST VTD_SM_PASID_ENTRY* pasidEntry;
+
+    *Pml4 = NULL;
+
+    contextEntry = GetScalableModeContextEntry(Translations, SourceId);
+    Result->EntriesRead++;
+    if (contextEntry == NULL)
+    {
+        return EFI_NOT_FOUND;
+    }
+    Result->EntriesRead++;
+    if (contextEntry->Bits.Present == FALSE)
+    {
+        return EFI_NOT_FOUND;
+    }
+
+    directoryEntry = GetPasidDirectoryEntry(contextEntry, contextEntry->Bits.RidPasid);
+    Result->EntriesRead++;
+    if (directoryEntry->Bits.Present == FALSE)
+    {
+        return EFI_NOT_FOUND;
+    }
+
+    pasidEntry = GetPasidTableEntry(directoryEntry, contextEntry->Bits.RidPasid);
+    Result->EntriesRead++;
+    if (pasidEntry->Bits.Present == FALSE)
+    {
+        return EFI_NOT_FOUND;
+    }
+
+    Result->DomainId = (UINT16)pasidEntry->Bits.DomainIdentifier;
+    if (pasidEntry->Bits.PASIDGranularTranslationType == V_PASID_ENTRY_PGTT_PASSTHROUGH)
+    {
+        return EFI_SUCCESS;
+    }
+    if ((pasidEntry->Bits.PASIDGranularTranslationType != V_PASID_ENTRY_PGTT_SECOND_LEVEL) ||
+        (pasidEntry->Bits.AddressWidth != V_PASID_ENTRY_AW_48BIT))
+    {
+        return EFI_UNSUPPORTED;
+    }
+
+    *Pml4 = (CONST VTD_SECOND_LEVEL_PAGING_ENTRY*)
+        (((UINT64)pasidEntry->Bits.SecondLevelPageTranslationPointerLo << 12) |
+         ((UINT64)pasidEntry->Bits.SecondLevelPageTranslationPointerHi << 32));
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Translates the device address issued by the source-id as hardware
+ *        would, walking the root table, context table and second-level paging
+ *        structures, or in scalable mode, the root table, context table, PASID
+ *        directory, PASID table for requests without PASID, and second-level
+ *        paging structures.
+ *
+ * @details Permissions are the intersection of the permissions of the entries
+ *          at all levels, and can be zero even if the walk succeeds. Caches of
+ *          hardware are not considered, that is, the result is what hardware
+ *          would observe after invalidation.
+ *
+ * @return EFI_SUCCESS if the address is translated, EFI_NOT_FOUND if any of the
+ *         entries is not present, or EFI_UNSUPPORTED if the context entry or
+ *         PASID entry is in the format the driver never builds.
+ */
+EFI_STATUS
+TranslateDmaAddress (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN UINT64 Address,
+    OUT DMAR_WALK_RESULT* Result
+    )
+{
+    EFI_STATUS status;
+    CONST VTD_SECOND_LEVEL_PAGING_ENTRY* table;
+    UINT64 level;
+
+    ZeroMem(Result, sizeof(*Result));
+
+    if (Translations->ScalableMode != FALSE)
+    {
+        status = WalkScalableModeTables(Translations, SourceId, Result, &table);
+    }
+    else
+    {
+        status = WalkLegacyModeTables(Translations, SourceId, Result, &table);
+    }
+    if (EFI_ERROR(status))
+    {
+        return status;
+    }
+    if (table == NULL)
+    {
+        Result->HostAddress = Address;
+        Result->Permissions = DMAR_ACCESS_READ | DMAR_ACCESS_WRITE;
+        Result->Passthrough = TRUE;
+        return EFI_SUCCESS;
+    }
+    if (Address >= BIT48)
+    {
+        return EFI_NOT_FOUND;
+    }
+
+    Result->Permissions = DMAR_ACCESS_READ | DMAR_ACCESS_WRITE;
+    for (level = SL_LEVEL_PML4; level >= SL_LEVEL_PT; --level)
+    {
+        CONST VTD_SECOND_LEVEL_PAGING_ENTRY* entry;
+        UINT64 regionSize;
+
+        entry = &table[RShiftU64(Address, (UINTN)(12 + 9 * (level - 1))) % SL_ENTRY_COUNT];
+        Result->EntriesRead++;
+        Result->PagingEntriesRead++;
+        if ((entry->Bits.Read == FALSE) && (entry->Bits.Write == FALSE))
+        {
+            return EFI_NOT_FOUND;
+        }
+        if (entry->Bits.Read == FALSE)
+        {
+            Result->Permissions &= ~DMAR_ACCESS_READ;
+        }
+        if (entry->Bits.Write == FALSE)
+        {
+            Result->Permissions &= ~DMAR_ACCESS_WRITE;
+        }
+
+        if ((level == SL_LEVEL_PT) || (entry->Bits.PageSize != FALSE))
+        {
+            regionSize = GetRegionSizeOfLevel(level);
+            Result->PageSize = regionSize;
+            Result->HostAddress = (GetEntryAddress(entry) & ~(regionSize - 1)) +
+                                  (Address & (regionSize - 1));
+            break;
+        }
+        table = (CONST VTD_SECOND_LEVEL_PAGING_ENTRY*)GetEntryAddress(entry);
+    }
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Allocates the entries of the set-associative cache model.
+ */
+static
+EFI_STATUS
+InitializeCacheModel (
+    OUT DMAR_CACHE_MODEL* Cache,
+    IN UINT64 SetCount,
+    IN UINT64 WayCount
+    )
+{
+    ZeroMem(Cache, sizeof(*Cache));
+
+    if ((SetCount == 0) || (WayCount == 0))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    Cache->Entries = AllocateZeroPool(SetCount * WayCount * sizeof(*Cache->Entries));
+    if (Cache->Entries == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    Cache->SetCount = SetCount;
+    Cache->WayCount = WayCount;
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Looks up the tag in the set of the cache model, and fills it in by
+ *        evicting the least recently used entry of the set if missed.
+ *
+ * @return TRUE if the tag was in the cache.
+ */
+static
+BOOLEAN
+LookUpCacheModel (
+    IN OUT DMAR_CACHE_MODEL* Cache,
+    IN UINT64 SetIndex,
+    IN UINT64 Tag
+    )
+{
+    DMAR_CACHE_MODEL_ENTRY* set;
+    DMAR_CACHE_MODEL_ENTRY* victim;
+
+    Cache->Lookups++;
+    Cache->UseCounter++;
+
+    set = &Cache->Entries[(SetIndex % Cache->SetCount) * Cache->WayCount];
+    victim = &set[0];
+    for (UINT64 i = 0; i < Cache->WayCount; ++i)
+    {
+        if ((set[i].Valid != FALSE) && (set[i].Tag == Tag))
+        {
+            set[i].LastUse = Cache->UseCounter;
+            Cache->Hits++;
+            return TRUE;
+        }
+        if ((set[i].Valid == FALSE) ||
+            ((victim->Valid != FALSE) && (set[i].LastUse < victim->LastUse)))
+        {
+            victim = &set[i];
+        }
+    }
+
+    victim->Valid = TRUE;
+    victim->Tag = Tag;
+    victim->LastUse = Cache->UseCounter;
+    return FALSE;
+}
+
+/**
+ * @brief Initializes the model of the IOTLB and the paging-structure cache of
+ *        PD entries (PDE cache) of a hardware unit, both set-associative with
+ *        LRU replacement.
+ */
+EFI_STATUS
+InitializeIotlbModel (
+    OUT DMAR_IOTLB_MODEL* Model,
+    IN UINT64 IotlbSetCount,
+    IN UINT64 IotlbWayCount,
+    IN UINT64 PdeCacheSetCount,
+    IN UINT64 PdeCacheWayCount
+    )
+{
+    EFI_STATUS status;
+
+    ZeroMem(Model, sizeof(*Model));
+
+    status = InitializeCacheModel(&Model->Iotlb, IotlbSetCount, IotlbWayCount);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+    status = InitializeCacheModel(&Model->PdeCache, PdeCacheSetCount, PdeCacheWayCount);
+    if (EFI_ERROR(status))
+    {
+        FreePool(Model->Iotlb.Entries);
+        goto Exit;
+    }
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Frees the entries allocated with InitializeIotlbModel.
+ */
+VOID
+FreeIotlbModel (
+    IN OUT DMAR_IOTLB_MODEL* Model
+    )
+{
+    FreePool(Model->Iotlb.Entries);
+    FreePool(Model->PdeCache.Entries);
+    ZeroMem(Model, sizeof(*Model));
+}
+
+/**
+ * @brief Runs the trace of DMA addresses issued by the source-id through the
+ *        model, counting hits of the caches and the paging-structure entries
+ *        read on misses.
+ *
+ * @details IOTLB entries are tagged with the domain ID and the page number in
+ *          the size of the leaf, so one entry covers the whole large page. On
+ *          a miss of a 4KB page, a hit of the PDE cache saves all but the read
+ *          of the PT entry. The context cache is assumed to always hit, and
+ *          pass-through accesses and faults bypass the model. In scalable
+ *          mode, the PASID cache is assumed to always hit as well.
+ */
+VOID
+SimulateDmaTrace (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN OUT DMAR_IOTLB_MODEL* Model,
+    IN UINT16 SourceId,
+    IN CONST UINT64* Addresses,
+    IN UINT64 AddressCount
+    )
+{
+    for (UINT64 i = 0; i < AddressCount; ++i)
+    {
+        EFI_STATUS status;
+        DMAR_WALK_RESULT walk;
+        UINT64 pageNumber;
+        UINT64 pdeNumber;
+
+        Model->Accesses++;
+        status = TranslateDmaAddress(Translations, SourceId, Addresses[i], &walk);
+        if (EFI_ERROR(status) || (walk.Permissions == 0))
+        {
+            Model->Faults++;
+            continue;
+        }
+        if (walk.Passthrough != FALSE)
+        {
+            Model->PassthroughAccesses++;
+            continue;
+        }
+
+        pageNumber = DivU64x64Remainder(Addresses[i], walk.PageSize, NULL);
+        if (LookUpCacheModel(&Model->Iotlb,
+                             pageNumber,
+                             LShiftU64(walk.DomainId, 48) |
+                             LShiftU64(pageNumber, 2) |
+                             ((UINT64)HighBitSet64(walk.PageSize) - 12) / 9) != FALSE)
+        {
+            continue;
+        }
+
+        //
+        // Root and context entries, and PASID directory and PASID table entries
+        // in scalable mode, are not read as the context cache and PASID cache
+        // hit. Only paging-structure entries are.
+        //
+        pdeNumber = RShiftU64(Addresses[i], 21);
+        if ((walk.PageSize == SIZE_4KB) &&
+            (LookUpCacheModel(&Model->PdeCache,
+                              pdeNumber,
+                              LShiftU64(walk.DomainId, 48) | pdeNumber) != FALSE))
+        {
+            Model->EntriesRead++;
+        }
+        else
+        {
+            Model->EntriesRead += walk.PagingEntriesRead;
+        }
+    }
+}
+
+/**
+ * @brief Logs the hit rates of the model.
+ */
+VOID
+DumpIotlbModelStatistics (
+    IN CONST DMAR_IOTLB_MODEL* Model
+    )
+{
+    DEBUG((DEBUG_INFO,
+           "IOTLB model: %llu accesses, %llu faults, %llu pass-through\n",
+           Model->Accesses,
+           Model->Faults,
+           Model->PassthroughAccesses));
+    DEBUG((DEBUG_INFO,
+           "IOTLB model: IOTLB %llu/%llu hits, PDE cache %llu/%llu hits, %llu entries read\n",
+           Model->Iotlb.Hits,
+           Model->Iotlb.Lookups,
+           Model->PdeCache.Hits,
+           Model->PdeCache.Lookups,
+           Model->EntriesRead));
+}
+
+/**
+ * @brief Verifies with the software walk that no device except pass-through
+ *        ones can access the range, and profiles the IOTLB reach of streaming
+ *        DMA over the 1GB region containing it.
+ *
+ * @details This walks the translations of every source-id and is meant for
+ *          debug builds.
+ *
+ * @return EFI_SECURITY_VIOLATION if any device can access the range.
+ */
+EFI_STATUS
+VerifyProtectedRange (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT64 Base,
+    IN UINT64 Length
+    )
+{
+    EFI_STATUS status;
+    DMAR_IOTLB_MODEL model;
+    UINT64 trace[SL_ENTRY_COUNT];
+    UINT64 regionBase;
+
+    for (UINT32 sourceId = 0; sourceId <= MAX_UINT16; ++sourceId)
+    {
+        for (UINT64 address = Base; address < (Base + Length); address += SIZE_4KB)
+        {
+            DMAR_WALK_RESULT walk;
+
+            status = TranslateDmaAddress(Translations, (UINT16)sourceId, address, &walk);
+            if (EFI_ERROR(status) || (walk.Passthrough != FALSE))
+            {
+                continue;
+            }
+            if (walk.Permissions != 0)
+            {
+                DEBUG((DEBUG_ERROR,
+                       "Source-id %04x can access %llx at %llx (%x)\n",
+                       sourceId,
+                       address,
+                       walk.HostAddress,
+                       walk.Permissions));
+                status = EFI_SECURITY_VIOLATION;
+                goto Exit;
+            }
+        }
+    }
+
+    //
+    // Profiling is informational. Use 64 sets of 4 ways for the IOTLB and 16
+    // sets of 4 ways for the PDE cache, roughly the size of client parts.
+    //
+    status = InitializeIotlbModel(&model, 64, 4, 16, 4);
+    if (EFI_ERROR(status))
+    {
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+    regionBase = Base & ~(UINT64)(SIZE_1GB - 1);
+    for (UINT64 offset = 0; offset < SIZE_1GB; offset += SIZE_2MB)
+    {
+        for (UINT64 i = 0; i < ARRAY_SIZE(trace); ++i)
+        {
+            trace[i] = regionBase + offset + i * SIZE_4KB;
+        }
+        SimulateDmaTrace(Translations, &model, 0, trace, ARRAY_SIZE(trace));
+    }
+    DumpIotlbModelStatistics(&model);
+    FreeIotlbModel(&model);
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
@@ -0,0 +1,396 @@
+#include "HelloIommuDxe.h"
+
+/**
+ * @brief Returns the scalable-mode context table referenced by the half of the
+ *        root entry for the device, or NULL if that half is not present.
+ *
+ * @details The lower half of the scalable-mode root entry references the
+ *          context table for devices 0-15, and the upper half, devices 16-31.
+ *          See 9.2 Scalable-Mode Root Entry.
+ */
+static
+VTD_SM_CONTEXT_ENTRY*
+GetScalableModeContextTable (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId
+    )
+{
+    CONST VTD_EXT_ROOT_ENTRY* rootEntry;
+
+    rootEntry = &((CONST VTD_EXT_ROOT_ENTRY*)Translations->RootTable)[(SourceId >> 8) & 0xff];
+    if ((SourceId & BIT7) == 0)
+    {
+        if (rootEntry->Bits.LowerPresent == FALSE)
+        {
+            return NULL;
+        }
+        return (VTD_SM_CONTEXT_ENTRY*)(((UINT64)rootEntry->Bits.LowerContextTablePointerLo << 12) |
+                                       ((UINT64)rootEntry->Bits.LowerContextTablePointerHi << 32));
+    }
+    if (rootEntry->Bits.UpperPresent == FALSE)
+    {
+        return NULL;
+    }
+    return (VTD_SM_CONTEXT_ENTRY*)(((UINT64)rootEntry->Bits.UpperContextTablePointerLo << 12) |
+                                   ((UINT64)rootEntry->Bits.UpperContextTablePointerHi << 32));
+}
+
+/**
+ * @brief Returns the scalable-mode context entry of the device, or NULL if the
+ *        root entry does not reference a context table for it.
+ */
+VTD_SM_CONTEXT_ENTRY*
+GetScalableModeContextEntry (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId
+    )
+{
+    VTD_SM_CONTEXT_ENTRY* contextTable;
+
+    ASSERT(Translations->ScalableMode != FALSE);
+
+    contextTable = GetScalableModeContextTable(Translations, SourceId);
+    return (contextTable == NULL) ? NULL : &contextTable[SourceId & 0x7f];
+}
+
+/**
+ * @brief Returns the PASID directory entry for the PASID referenced by the
+ *        context entry. The context entry must be present.
+ *
+ * @details The upper 14 bits of the PASID index the directory, and the lower 6
+ *          bits, the PASID table. See 3.4.3 Scalable-Mode Address Translation.
+ */
+VTD_PASID_DIRECTORY_ENTRY*
+GetPasidDirectoryEntry (
+    IN CONST VTD_SM_CONTEXT_ENTRY* ContextEntry,
+    IN UINT32 Pasid
+    )
+{
+    VTD_PASID_DIRECTORY_ENTRY* directory;
+
+    ASSERT(Pasid < DMAR_MAX_PASID_COUNT);
+
+    directory = (VTD_PASID_DIRECTORY_ENTRY*)(((UINT64)ContextEntry->Bits.PASIDDirectoryPointerLo << 12) |
+                                             ((UINT64)ContextEntry->Bits.PASIDDirectoryPointerHi << 32));
+    return &directory[Pasid / VTD_SM_PASID_ENTRY_NUMBER];
+}
+
+/**
+ * @brief Returns the PASID entry for the PASID referenced by the directory
+ *        entry. The directory entry must be present.
+ */
+VTD_SM_PASID_ENTRY*
+GetPasidTableEntry (
+    IN CONST VTD_PASID_DIRECTORY_ENTRY* DirectoryEntry,
+    IN UINT32 Pasid
+    )
+{
+    VTD_SM_PASID_ENTRY* pasidTable;
+
+    pasidTable = (VTD_SM_PASID_ENTRY*)(((UINT64)DirectoryEntry->Bits.PASIDTablePointerLo << 12) |
+                                       ((UINT64)DirectoryEntry->Bits.PASIDTablePointerHi << 32));
+    return &pasidTable[Pasid % VTD_SM_PASID_ENTRY_NUMBER];
+}
+
+/**
+ * @brief Returns the value of the PASID entry translating with the
+ *        second-level PML4 in the domain, or bypassing translation if Pml4 is
+ *        NULL. See 9.6 Scalable-Mode PASID-Table Entry.
+ *
+ * @details Page walks snoop processor caches only if all units walk coherently,
+ *          in which case, cache lines of the tables are not written back.
+ */
+VOID
+MakePasidEntry (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 DomainId,
+    IN CONST VTD_SECOND_LEVEL_PAGING_ENTRY* Pml4 OPTIONAL,
+    OUT VTD_SM_PASID_ENTRY* PasidEntry
+    )
+{
+    ZeroMem(PasidEntry, sizeof(*PasidEntry));
+    PasidEntry->Bits.DomainIdentifier = DomainId;
+    PasidEntry->Bits.PageWalkSnoop = (Translations->Writeback.Coherent != FALSE);
+    PasidEntry->Bits.AddressWidth = V_PASID_ENTRY_AW_48BIT;
+    if (Pml4 == NULL)
+    {
+        PasidEntry->Bits.PASIDGranularTranslationType = V_PASID_ENTRY_PGTT_PASSTHROUGH;
+    }
+    else
+    {
+        PasidEntry->Bits.PASIDGranularTranslationType = V_PASID_ENTRY_PGTT_SECOND_LEVEL;
+        PasidEntry->Bits.SecondLevelPageTranslationPointerLo = (UINT32)((UINT64)Pml4 >> 12);
+        PasidEntry->Bits.SecondLevelPageTranslationPointerHi = (UINT32)((UINT64)Pml4 >> 32);
+    }
+    PasidEntry->Bits.Present = TRUE;
+}
+
+/**
+ * @brief Fills out the scalable-mode root table, and the context table, PASID
+ *        directory and PASID table shared by all devices, so that requests
+ *        without PASID from any device are translated with the second-level
+ *        PML4 of UEFI_DOMAIN_ID.
+ *
+ * @details Every root entry references the same context table with both
+ *          halves, every context entry references the same PASID directory,
+ *          and only the first directory entry is present, referencing the
+ *          PASID table whose entry for DMAR_RID_PASID is the only one present.
+ *          Devices given their own domains or PASIDs later get private copies
+ *          of the tables on the path to their entries with GetPrivatePasidEntry.
+ *
+ * @param Translations - The translations object whose RootTable, ContextTable
+ *                       and SlPml4 are allocated.
+ */
+EFI_STATUS
+BuildScalableModeTables (
+    IN OUT DMAR_TRANSLATIONS* Translations
+    )
+{
+    VTD_EXT_ROOT_ENTRY defaultRootValue;
+    VTD_SM_CONTEXT_ENTRY defaultContextValue;
+    VTD_EXT_ROOT_ENTRY* rootTable;
+    VTD_SM_CONTEXT_ENTRY* contextTable;
+
+    ASSERT(Translations->ScalableMode != FALSE);
+
+    Translations->PasidDirectory = AllocatePageTablePage(&Translations->Pool);
+    Translations->PasidTable = AllocatePageTablePage(&Translations->Pool);
+    if ((Translations->PasidDirectory == NULL) || (Translations->PasidTable == NULL))
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    defaultRootValue.Uint128.Uint64Hi = defaultRootValue.Uint128.Uint64Lo = 0;
+    defaultRootValue.Bits.LowerContextTablePointerLo = (UINT32)((UINT64)Translations->ContextTable >> 12);
+    defaultRootValue.Bits.LowerContextTablePointerHi = (UINT32)((UINT64)Translations->ContextTable >> 32);
+    defaultRootValue.Bits.LowerPresent = TRUE;
+    defaultRootValue.Bits.UpperContextTablePointerLo = defaultRootValue.Bits.LowerContextTablePointerLo;
+    defaultRootValue.Bits.UpperContextTablePointerHi = defaultRootValue.Bits.LowerContextTablePointerHi;
+    defaultRootValue.Bits.UpperPresent = TRUE;
+    rootTable = (VTD_EXT_ROOT_ENTRY*)Translations->RootTable;
+    for (UINT64 bus = 0; bus < SIZE_4KB / sizeof(VTD_EXT_ROOT_ENTRY); bus++)
+    {
+        rootTable[bus] = defaultRootValue;
+    }
+
+    //
+    // PASIDs are not enabled until a device is given an address space for one,
+    // so requests with PASID are blocked. See 9.4 Scalable-Mode Context-Entry.
+    //
+    ZeroMem(&defaultContextValue, sizeof(defaultContextValue));
+    defaultContextValue.Bits.PASIDDirectorySize = DMAR_PASID_DIRECTORY_SIZE;
+    defaultContextValue.Bits.PASIDDirectoryPointerLo = (UINT32)((UINT64)Translations->PasidDirectory >> 12);
+    defaultContextValue.Bits.PASIDDirectoryPointerHi = (UINT32)((UINT64)Translations->PasidDirectory >> 32);
+    defaultContextValue.Bits.RidPasid = DMAR_RID_PASID;
+    defaultContextValue.Bits.Present = TRUE;
+    contextTable = (VTD_SM_CONTEXT_ENTRY*)Translations->ContextTable;
+    for (UINT64 i = 0; i < VTD_SM_CONTEXT_ENTRY_NUMBER; i++)
+    {
+        contextTable[i] = defaultContextValue;
+    }
+
+    Translations->PasidDirectory[0].Bits.PASIDTablePointerLo = (UINT32)((UINT64)Translations->PasidTable >> 12);
+    Translations->PasidDirectory[0].Bits.PASIDTablePointerHi = (UINT32)((UINT64)Translations->PasidTable >> 32);
+    Translations->PasidDirectory[0].Bits.Present = TRUE;
+    MakePasidEntry(Translations,
+                   UEFI_DOMAIN_ID,
+                   Translations->SlPml4,
+                   &Translations->PasidTable[DMAR_RID_PASID]);
+
+    MarkPagingStructureDirty(&Translations->Writeback, Translations->PasidTable, SIZE_4KB);
+    MarkPagingStructureDirty(&Translations->Writeback, Translations->PasidDirectory, SIZE_4KB);
+    return EFI_SUCCESS;
+}
+
+/**
+ * @brief Allocates a copy of the table, or a zeroed table if Table is NULL,
+ *        and writes it back.
+ */
+static
+VOID*
+CopyScalableModeTable (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN CONST VOID* Table OPTIONAL
+    )
+{
+    VOID* copy;
+
+    if (Table == NULL)
+    {
+        copy = AllocatePageTablePage(&Translations->Pool);
+    }
+    else
+    {
+        copy = AllocateUninitializedPageTablePage(&Translations->Pool);
+        if (copy != NULL)
+        {
+            CopyMem(copy, Table, SIZE_4KB);
+        }
+    }
+    if (copy != NULL)
+    {
+        WriteBackPagingStructure(&Translations->Writeback, copy, SIZE_4KB);
+    }
+    return copy;
+}
+
+/**
+ * @brief Returns the PASID entry of the device for the PASID, after making the
+ *        tables on the path to it private if they are still the shared ones.
+ *
+ * @details The tables are copied top-down: the context table of the half of
+ *          the bus, the PASID directory, and then the PASID table, or a zeroed
+ *          PASID table is allocated if the directory entry is not present. Each
+ *          copy translates the same as the original, and the single 64-bit
+ *          word referencing it is updated after the copy is written back, so
+ *          hardware walking the tables meanwhile sees no difference.
+ *
+ * @note The caller must invalidate the context-cache and PASID-cache with
+ *       InvalidateContextCacheForDevice, if DMA-remapping is already enabled,
+ *       which is done anyway after updating the PASID entry.
+ *
+ * @param ContextEntry - The context entry of the device.
+ * @param RootEntryUpdated - TRUE if the root entry of the bus is updated.
+ *
+ * @return The PASID entry, or NULL if the pool is exhausted.
+ */
+VTD_SM_PASID_ENTRY*
+GetPrivatePasidEntry (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN UINT32 Pasid,
+    OUT VTD_SM_CONTEXT_ENTRY** ContextEntry,
+    OUT BOOLEAN* RootEntryUpdated
+    )
+{
+    VTD_EXT_ROOT_ENTRY* rootEntry;
+    VTD_EXT_ROOT_ENTRY newRootEntry;
+    VTD_SM_CONTEXT_ENTRY* contextTable;
+    VTD_SM_CONTEXT_ENTRY* contextEntry;
+    VTD_SM_CONTEXT_ENTRY newContextEntry;
+    VTD_PASID_DIRECTORY_ENTRY* directoryEntry;
+    VTD_PASID_DIRECTORY_ENTRY* directory;
+    VTD_PASID_DIRECTORY_ENTRY newDirectoryEntry;
+    VTD_SM_PASID_ENTRY* pasidTable;
+
+    ASSERT(Translations->ScalableMode != FALSE);
+    ASSERT(Pasid < Translations->PasidLimit);
+
+    *ContextEntry = NULL;
+    *RootEntryUpdated = FALSE;
+
+    //
+    // The context table of the half of the bus. Only the 64-bit half of the
+    // root entry for the device is updated.
+    //
+    contextTable = GetScalableModeContextTable(Translations, SourceId);
+    if (contextTable == (VTD_SM_CONTEXT_ENTRY*)Translations->ContextTable)
+    {
+        contextTable = CopyScalableModeTable(Translations, contextTable);
+        if (contextTable == NULL)
+        {
+            return NULL;
+        }
+
+        rootEntry = &((VTD_EXT_ROOT_ENTRY*)Translations->RootTable)[(SourceId >> 8) & 0xff];
+        newRootEntry = *rootEntry;
+        if ((SourceId & BIT7) == 0)
+        {
+            newRootEntry.Bits.LowerContextTablePointerLo = (UINT32)((UINT64)contextTable >> 12);
+            newRootEntry.Bits.LowerContextTablePointerHi = (UINT32)((UINT64)contextTable >> 32);
+            rootEntry->Uint128.Uint64Lo = newRootEntry.Uint128.Uint64Lo;
+        }
+        else
+        {
+            newRootEntry.Bits.UpperContextTablePointerLo = (UINT32)((UINT64)contextTable >> 12);
+            newRootEntry.Bits.UpperContextTablePointerHi = (UINT32)((UINT64)contextTable >> 32);
+            rootEntry->Uint128.Uint64Hi = newRootEntry.Uint128.Uint64Hi;
+        }
+        MarkPagingStructureDirty(&Translations->Writeback, rootEntry, sizeof(*rootEntry));
+        *RootEntryUpdated = TRUE;
+    }
+    ASSERT(contextTable != NULL);
+    contextEntry = &contextTable[SourceId & 0x7f];
+    *ContextEntry = contextEntry;
+
+    //
+    // The PASID directory of the device. The pointer is in the lower 64 bits of
+    // the context entry, along with the present bit.
+    //
+    directoryEntry = GetPasidDirectoryEntry(contextEntry, Pasid);
+    directory = directoryEntry - (Pasid / VTD_SM_PASID_ENTRY_NUMBER);
+    if (directory == Translations->PasidDirectory)
+    {
+        directory = CopyScalableModeTable(Translations, directory);
+        if (directory == NULL)
+        {
+            return NULL;
+        }
+
+        newContextEntry = *contextEntry;
+        newContextEntry.Bits.PASIDDirectoryPointerLo = (UINT32)((UINT64)directory >> 12);
+        newContextEntry.Bits.PASIDDirectoryPointerHi = (UINT32)((UINT64)directory >> 32);
+        contextEntry->Uint256.Uint64_1 = newContextEntry.Uint256.Uint64_1;
+        MarkPagingStructureDirty(&Translations->Writeback, contextEntry, sizeof(*contextEntry));
+        directoryEntry = GetPasidDirectoryEntry(contextEntry, Pasid);
+    }
+
+    //
+    // The PASID table for the range of 64 PASIDs.
+    //
+    pasidTable = NULL;
+    if (directoryEntry->Bits.Present != FALSE)
+    {
+        pasidTable = GetPasidTableEntry(directoryEntry, 0);
+        if (pasidTable != Translations->PasidTable)
+        {
+            goto Exit;
+        }
+    }
+    pasidTable = CopyScalableModeTable(Translations, pasidTable);
+    if (pasidTable == NULL)
+    {
+        return NULL;
+    }
+    newDirectoryEntry.Uint64 = 0;
+    newDirectoryEntry.Bits.PASIDTablePointerLo = (UINT32)((UINT64)pasidTable >> 12);
+    newDirectoryEntry.Bits.PASIDTablePointerHi = (UINT32)((UINT64)pasidTable >> 32);
+    newDirectoryEntry.Bits.Present = TRUE;
+    directoryEntry->Uint64 = newDirectoryEntry.Uint64;
+    MarkPagingStructureDirty(&Translations->Writeback, directoryEntry, sizeof(*directoryEntry));
+
+Exit:
+    return GetPasidTableEntry(directoryEntry, Pasid);
+}
+
+/**
+ * @brief Updates the PASID entry with the new value.
+ *
+ * @details Hardware reads the 512-bit entry with multiple accesses, and only the
+ *          first 64 bits hold the present bit along with the second-level page
+ *          table pointer. Those are written last, after the rest of the entry.
+ *
+ * @param ClearPresentFirst - TRUE to make the entry non-present while the rest
+ *                            is updated. FALSE if the old and new values
+ *                            translate the same, so that either word may be
+ *                            observed first.
+ */
+VOID
+WritePasidEntry (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN OUT VTD_SM_PASID_ENTRY* PasidEntry,
+    IN CONST VTD_SM_PASID_ENTRY* NewPasidEntry,
+    IN BOOLEAN ClearPresentFirst
+    )
+{
+    if (ClearPresentFirst != FALSE)
+    {
+        PasidEntry->Bits.Present = FALSE;
+    }
+    for (UINT64 i = 1; i < ARRAY_SIZE(PasidEntry->Uint64); ++i)
+    {
+        PasidEntry->Uint64[i] = NewPasidEntry->Uint64[i];
+    }
+    PasidEntry->Uint64[0] = NewPasidEntry->Uint64[0];
+    MarkPagingStructureDirty(&Translations->Writeback, PasidEntry, sizeof(*PasidEntry));
+}
@@ -0,0 +1,58 @@
+#include "HelloIommuDxe.h"
+
+//
+// All accesses to the registers of hardware units go through the functions in
+// this file. The rest of the driver neither computes MMIO addresses nor calls
+// IoLib directly, so that this file alone can be replaced with a software model
+// of the registers to run the driver logic without hardware.
+//
+
+/**
+ * @brief Reads the 32-bit register at the offset from the register base.
+ */
+UINT32
+ReadDmarRegister32 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset
+    )
+{
+    return MmioRead32((UINTN)(RegisterBase + Offset));
+}
+
+/**
+ * @brief Reads the 64-bit register at the offset from the register base.
+ */
+UINT64
+ReadDmarRegister64 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset
+    )
+{
+    return MmioRead64((UINTN)(RegisterBase + Offset));
+}
+
+/**
+ * @brief Writes the 32-bit register at the offset from the register base.
+ */
+VOID
+WriteDmarRegister32 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset,
+    IN UINT32 Value
+    )
+{
+    MmioWrite32((UINTN)(RegisterBase + Offset), Value);
+}
+
+/**
+ * @brief Writes the 64-bit register at the offset from the register base.
+ */
+VOID
+WriteDmarRegister64 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset,
+    IN UINT64 Value
+    )
+{
+    MmioWrite64((UINTN)(RegisterBase + Offset), Value);
+}
@@ -0,0 +1,451 @@
+#include "HelloIommuDxe.h"
+
+//
+// The state of serializing the snapshot. If Buffer is NULL, records are only
+// counted to compute the size of the table. PendingRange is the range being
+// extended with adjacent leaf entries, not yet appended if its Length is zero.
+//
+typedef struct _SNAPSHOT_WRITER
+{
+    UINT8* Buffer;
+    UINT32 Capacity;
+    UINT32 Length;
+    UINT32 RecordCount;
+    HELLO_IOMMU_SNAPSHOT_RANGE PendingRange;
+} SNAPSHOT_WRITER;
+
+//
+// The snapshot currently installed, freed when replaced.
+//
+static HELLO_IOMMU_SNAPSHOT_HEADER* mSnapshot;
+
+/**
+ * @brief Appends the record to the snapshot, or only counts it if the buffer
+ *        is not given.
+ */
+static
+VOID
+AppendRecord (
+    IN OUT SNAPSHOT_WRITER* Writer,
+    IN UINT16 Type,
+    IN UINT16 Length,
+    IN OUT HELLO_IOMMU_SNAPSHOT_RECORD_HEADER* Record
+    )
+{
+    ASSERT((Length % sizeof(UINT64)) == 0);
+
+    Record->Type = Type;
+    Record->Length = Length;
+    Record->Reserved = 0;
+    if ((Writer->Buffer != NULL) && ((Writer->Length + Length) <= Writer->Capacity))
+    {
+        CopyMem(Writer->Buffer + Writer->Length, Record, Length);
+    }
+    Writer->Length += Length;
+    Writer->RecordCount++;
+}
+
+/**
+ * @brief Appends the pending range if any.
+ */
+static
+VOID
+FlushPendingRange (
+    IN OUT SNAPSHOT_WRITER* Writer
+    )
+{
+    if (Writer->PendingRange.Length != 0)
+    {
+        AppendRecord(Writer,
+                     HELLO_IOMMU_SNAPSHOT_RECORD_RANGE,
+                     sizeof(Writer->PendingRange),
+                     &Writer->PendingRange.Header);
+        Writer->PendingRange.Length = 0;
+    }
+}
+
+/**
+ * @brief Extends the pending range with the translation if it is contiguous in
+ *        both device and host addresses with the same permissions, or starts a
+ *        new range otherwise.
+ */
+static
+VOID
+AddTranslation (
+    IN OUT SNAPSHOT_WRITER* Writer,
+    IN UINT16 DomainId,
+    IN UINT64 DeviceAddress,
+    IN UINT64 HostAddress,
+    IN UINT64 Length,
+    IN UINT8 Permissions
+    )
+{
+    HELLO_IOMMU_SNAPSHOT_RANGE* range;
+
+    range = &Writer->PendingRange;
+    if ((range->Length != 0) &&
+        (range->DomainId == DomainId) &&
+        (range->Permissions == Permissions) &&
+        ((range->DeviceAddress + range->Length) == DeviceAddress) &&
+        ((range->HostAddress + range->Length) == HostAddress))
+    {
+        range->Length += Length;
+        return;
+    }
+
+    FlushPendingRange(Writer);
+    ZeroMem(range, sizeof(*range));
+    range->DomainId = DomainId;
+    range->Permissions = Permissions;
+    range->DeviceAddress = DeviceAddress;
+    range->HostAddress = HostAddress;
+    range->Length = Length;
+}
+
+/**
+ * @brief Adds the translations of the table at the level, and recursively,
+ *        the tables it references, in the ascending order of device addresses.
+ */
+static
+VOID
+AddTranslationsInTable (
+    IN OUT SNAPSHOT_WRITER* Writer,
+    IN UINT16 DomainId,
+    IN CONST VTD_SECOND_LEVEL_PAGING_ENTRY* Table,
+    IN UINT64 Level,
+    IN UINT64 Base,
+    IN UINT8 Permissions
+    )
+{
+    UINT64 regionSize;
+
+    regionSize = GetRegionSizeOfLevel(Level);
+    for (UINT64 i = 0; i < SL_ENTRY_COUNT; ++i)
+    {
+        CONST VTD_SECOND_LEVEL_PAGING_ENTRY* entry;
+        UINT64 address;
+        UINT8 permissions;
+
+        entry = &Table[i];
+        if ((entry->Bits.Read == FALSE) && (entry->Bits.Write == FALSE))
+        {
+            continue;
+        }
+
+        permissions = Permissions;
+        if (entry->Bits.Read == FALSE)
+        {
+            permissions &= ~DMAR_ACCESS_READ;
+        }
+        if (entry->Bits.Write == FALSE)
+        {
+            permissions &= ~DMAR_ACCESS_WRITE;
+        }
+
+        address = GetEntryAddress(entry);
+        if ((Level == SL_LEVEL_PT) || (entry->Bits.PageSize != FALSE))
+        {
+            if (permissions != 0)
+            {
+                AddTranslation(Writer,
+                               DomainId,
+                               Base + i * regionSize,
+                               address & ~(regionSize - 1),
+                               regionSize,
+                               permissions);
+            }
+            continue;
+        }
+        AddTranslationsInTable(Writer,
+                               DomainId,
+                               (CONST VTD_SECOND_LEVEL_PAGING_ENTRY*)address,
+                               Level - 1,
+                               Base + i * regionSize,
+                               permissions);
+    }
+}
+
+/**
+ * @brief Adds the device records of the legacy-mode tables. Only buses given a
+ *        private context table can have devices outside the default domain.
+ */
+static
+VOID
+AddLegacyModeDevices (
+    IN OUT SNAPSHOT_WRITER* Writer,
+    IN CONST DMAR_TRANSLATIONS* Translations
+    )
+{
+    for (UINT64 bus = 0; bus < (SIZE_4KB / sizeof(VTD_ROOT_ENTRY)); ++bus)
+    {
+        CONST VTD_ROOT_ENTRY* rootEntry;
+        CONST VTD_CONTEXT_ENTRY* contextTable;
+
+        rootEntry = &Translations->RootTable[bus];
+        contextTable = (CONST VTD_CONTEXT_ENTRY*)(((UINT64)rootEntry->Bits.ContextTablePointerLo << 12) |
+                                                  ((UINT64)rootEntry->Bits.ContextTablePointerHi << 32));
+        if ((rootEntry->Bits.Present == FALSE) || (contextTable == Translations->ContextTable))
+        {
+            continue;
+        }
+
+        for (UINT64 devfn = 0; devfn < (SIZE_4KB / sizeof(VTD_CONTEXT_ENTRY)); ++devfn)
+        {
+            HELLO_IOMMU_SNAPSHOT_DEVICE device;
+
+            if ((contextTable[devfn].Bits.Present == FALSE) ||
+                (contextTable[devfn].Bits.DomainIdentifier == UEFI_DOMAIN_ID))
+            {
+                continue;
+            }
+
+            ZeroMem(&device, sizeof(device));
+            device.SourceId = (UINT16)((bus << 8) | devfn);
+            device.DomainId = (UINT16)contextTable[devfn].Bits.DomainIdentifier;
+            AppendRecord(Writer, HELLO_IOMMU_SNAPSHOT_RECORD_DEVICE, sizeof(device), &device.Header);
+        }
+    }
+}
+
+/**
+ * @brief Adds the device and PASID records of the scalable-mode context entry
+ *        of the source-id. Only a context entry given a private PASID
+ *        directory can have address spaces outside the default domain.
+ */
+static
+VOID
+AddScalableModeDevice (
+    IN OUT SNAPSHOT_WRITER* Writer,
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN CONST VTD_SM_CONTEXT_ENTRY* ContextEntry
+    )
+{
+    if ((ContextEntry->Bits.Present == FALSE) ||
+        (GetPasidDirectoryEntry(ContextEntry, 0) == Translations->PasidDirectory))
+    {
+        return;
+    }
+
+    for (UINT32 pasid = 0; pasid < Translations->PasidLimit; ++pasid)
+    {
+        CONST VTD_PASID_DIRECTORY_ENTRY* directoryEntry;
+        CONST VTD_SM_PASID_ENTRY* pasidEntry;
+        UINT16 domainId;
+
+        directoryEntry = GetPasidDirectoryEntry(ContextEntry, pasid);
+        if (directoryEntry->Bits.Present == FALSE)
+        {
+            pasid += VTD_SM_PASID_ENTRY_NUMBER - 1;
+            continue;
+        }
+        pasidEntry = GetPasidTableEntry(directoryEntry, pasid);
+        if (pasidEntry->Bits.Present == FALSE)
+        {
+            continue;
+        }
+
+        domainId = (UINT16)pasidEntry->Bits.DomainIdentifier;
+        if (pasid == DMAR_RID_PASID)
+        {
+            HELLO_IOMMU_SNAPSHOT_DEVICE device;
+
+            if (domainId == UEFI_DOMAIN_ID)
+            {
+                continue;
+            }
+            ZeroMem(&device, sizeof(device));
+            device.SourceId = SourceId;
+            device.DomainId = domainId;
+            AppendRecord(Writer, HELLO_IOMMU_SNAPSHOT_RECORD_DEVICE, sizeof(device), &device.Header);
+        }
+        else
+        {
+            HELLO_IOMMU_SNAPSHOT_PASID pasidRecord;
+
+            ZeroMem(&pasidRecord, sizeof(pasidRecord));
+            pasidRecord.SourceId = SourceId;
+            pasidRecord.DomainId = domainId;
+            pasidRecord.Pasid = pasid;
+            AppendRecord(Writer, HELLO_IOMMU_SNAPSHOT_RECORD_PASID, sizeof(pasidRecord), &pasidRecord.Header);
+        }
+    }
+}
+
+/**
+ * @brief Adds the device and PASID records of the scalable-mode tables. Only
+ *        halves of buses given a private context table can have devices
+ *        outside the default domain.
+ */
+static
+VOID
+AddScalableModeDevices (
+    IN OUT SNAPSHOT_WRITER* Writer,
+    IN CONST DMAR_TRANSLATIONS* Translations
+    )
+{
+    for (UINT64 bus = 0; bus < (SIZE_4KB / sizeof(VTD_EXT_ROOT_ENTRY)); ++bus)
+    {
+        for (UINT64 devfn = 0; devfn < 256; devfn += VTD_SM_CONTEXT_ENTRY_NUMBER)
+        {
+            CONST VTD_SM_CONTEXT_ENTRY* contextEntry;
+
+            contextEntry = GetScalableModeContextEntry(Translations, (UINT16)((bus << 8) | devfn));
+            if ((contextEntry == NULL) || ((CONST VOID*)contextEntry == Translations->ContextTable))
+            {
+                continue;
+            }
+            for (UINT64 i = 0; i < VTD_SM_CONTEXT_ENTRY_NUMBER; ++i)
+            {
+                AddScalableModeDevice(Writer,
+                                      Translations,
+                                      (UINT16)((bus << 8) | (devfn + i)),
+                                      &contextEntry[i]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Serializes the configuration into the writer, after the header.
+ */
+static
+VOID
+WriteSnapshotRecords (
+    IN OUT SNAPSHOT_WRITER* Writer,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN CONST DMAR_TRANSLATIONS* Translations
+    )
+{
+    Writer->Length = sizeof(HELLO_IOMMU_SNAPSHOT_HEADER);
+    Writer->RecordCount = 0;
+    ZeroMem(&Writer->PendingRange, sizeof(Writer->PendingRange));
+
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        HELLO_IOMMU_SNAPSHOT_UNIT unit;
+
+        ZeroMem(&unit, sizeof(unit));
+        unit.RegisterBase = DmarUnits[i].RegisterBasePa;
+        unit.Capability = DmarUnits[i].Capability.Uint64;
+        unit.ExtendedCapability = DmarUnits[i].ExtendedCapability.Uint64;
+        unit.RootTable = (DmarUnits[i].Translations != NULL) ?
+            (UINT64)DmarUnits[i].Translations->RootTable :
+            (UINT64)Translations->RootTable;
+        AppendRecord(Writer, HELLO_IOMMU_SNAPSHOT_RECORD_UNIT, sizeof(unit), &unit.Header);
+    }
+
+    for (UINT64 domainId = 0; domainId < DMAR_MAX_DOMAIN_COUNT; ++domainId)
+    {
+        HELLO_IOMMU_SNAPSHOT_DOMAIN domain;
+
+        if ((Translations->DomainSlPml4s[domainId] == NULL) &&
+            ((domainId == 0) || (domainId != Translations->PassthroughDomainId)))
+        {
+            continue;
+        }
+
+        ZeroMem(&domain, sizeof(domain));
+        domain.DomainId = (UINT16)domainId;
+        domain.SlPml4 = (UINT64)Translations->DomainSlPml4s[domainId];
+        if (domainId == Translations->PassthroughDomainId)
+        {
+            domain.Flags |= HELLO_IOMMU_SNAPSHOT_DOMAIN_PASSTHROUGH;
+        }
+        AppendRecord(Writer, HELLO_IOMMU_SNAPSHOT_RECORD_DOMAIN, sizeof(domain), &domain.Header);
+    }
+
+    if (Translations->ScalableMode != FALSE)
+    {
+        AddScalableModeDevices(Writer, Translations);
+    }
+    else
+    {
+        AddLegacyModeDevices(Writer, Translations);
+    }
+
+    for (UINT64 domainId = 0; domainId < DMAR_MAX_DOMAIN_COUNT; ++domainId)
+    {
+        if (Translations->DomainSlPml4s[domainId] == NULL)
+        {
+            continue;
+        }
+        AddTranslationsInTable(Writer,
+                               (UINT16)domainId,
+                               Translations->DomainSlPml4s[domainId],
+                               SL_LEVEL_PML4,
+                               0,
+                               DMAR_ACCESS_READ | DMAR_ACCESS_WRITE);
+        FlushPendingRange(Writer);
+    }
+}
+
+/**
+ * @brief Installs, or replaces, the configuration table describing the active
+ *        configuration. See HelloIommuSnapshot.h for the format.
+ *
+ * @details The configuration is serialized twice: once to compute the size,
+ *          and once into the table allocated from runtime memory. Translations
+ *          are run-length encoded over ranges, so the size depends on how
+ *          fragmented they are rather than on the size of memory.
+ */
+EFI_STATUS
+PublishSnapshotTable (
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount,
+    IN CONST DMAR_TRANSLATIONS* Translations
+    )
+{
+    EFI_STATUS status;
+    SNAPSHOT_WRITER writer;
+    HELLO_IOMMU_SNAPSHOT_HEADER* snapshot;
+
+    ZeroMem(&writer, sizeof(writer));
+    WriteSnapshotRecords(&writer, DmarUnits, DmarUnitCount, Translations);
+
+    snapshot = AllocateRuntimeZeroPool(writer.Length);
+    if (snapshot == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    writer.Buffer = (UINT8*)snapshot;
+    writer.Capacity = writer.Length;
+    WriteSnapshotRecords(&writer, DmarUnits, DmarUnitCount, Translations);
+    ASSERT(writer.Length == writer.Capacity);
+
+    snapshot->Signature = HELLO_IOMMU_SNAPSHOT_SIGNATURE;
+    snapshot->Version = HELLO_IOMMU_SNAPSHOT_VERSION;
+    snapshot->Length = writer.Length;
+    snapshot->RecordCount = writer.RecordCount;
+    snapshot->RootTable = (UINT64)Translations->RootTable;
+    snapshot->PageTablePoolBase = (UINT64)Translations->Pool.Base;
+    snapshot->PageTablePoolPageCount = Translations->Pool.PageCount;
+    snapshot->DefaultDomainId = UEFI_DOMAIN_ID;
+    if (Translations->ScalableMode != FALSE)
+    {
+        snapshot->Flags |= HELLO_IOMMU_SNAPSHOT_SCALABLE_MODE;
+    }
+
+    status = gBS->InstallConfigurationTable(&gHelloIommuSnapshotTableGuid, snapshot);
+    if (EFI_ERROR(status))
+    {
+        FreePool(snapshot);
+        goto Exit;
+    }
+    if (mSnapshot != NULL)
+    {
+        FreePool(mSnapshot);
+    }
+    mSnapshot = snapshot;
+
+    DEBUG((DEBUG_INFO,
+           "Published the snapshot of %u records in %u bytes at %p\n",
+           snapshot->RecordCount,
+           snapshot->Length,
+           snapshot));
+
+Exit:
+    return status;
+}
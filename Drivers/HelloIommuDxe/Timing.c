@@ -0,0 +1,171 @@
+#include "HelloIommuDxe.h"
+
+//
+// The number of time stamp counter ticks per second. Zero until calibrated by
+// InitializeTiming.
+//
+static UINT64 mTimestampFrequency;
+
+/**
+ * @brief Calibrates the frequency of the time stamp counter against the Stall
+ *        boot service.
+ *
+ * @note This should be called once at the beginning of the entry point.
+ *       Elapsed time is reported as zero until it is called.
+ */
+VOID
+InitializeTiming (
+    VOID
+    )
+{
+    UINT64 startTimestamp;
+
+    startTimestamp = AsmReadTsc();
+    gBS->Stall(1000);
+    mTimestampFrequency = (AsmReadTsc() - startTimestamp) * 1000;
+
+    DEBUG((DEBUG_VERBOSE, "Time stamp counter frequency: %llu Hz\n", mTimestampFrequency));
+}
+
+/**
+ * @brief Returns the current value of the time stamp counter.
+ */
+UINT64
+GetTimestamp (
+    VOID
+    )
+{
+    return AsmReadTsc();
+}
+
+/**
+ * @brief Returns the microseconds elapsed since the time stamp taken with
+ *        GetTimestamp.
+ *
+ * @details Whole seconds are converted separately from the remainder, so that
+ *          multiplying ticks by 1000000 does not overflow however long ago the
+ *          time stamp was taken.
+ */
+UINT64
+GetElapsedMicroseconds (
+    IN UINT64 StartTimestamp
+    )
+{
+    UINT64 ticks;
+    UINT64 seconds;
+    UINT64 remainder;
+
+    if (mTimestampFrequency == 0)
+    {
+        return 0;
+    }
+    ticks = AsmReadTsc() - StartTimestamp;
+    seconds = DivU64x64Remainder(ticks, mTimestampFrequency, &remainder);
+    return MultU64x64(seconds, 1000000) +
+           DivU64x64Remainder(MultU64x64(remainder, 1000000), mTimestampFrequency, NULL);
+}
+
+/**
+ * @brief Adds the time elapsed since StartTimestamp to the record.
+ *
+ * @param SpinIterations - The number of polls made during the time, if it was
+ *                         spent waiting. Zero otherwise.
+ */
+VOID
+RecordTiming (
+    IN OUT HELLO_IOMMU_TIMING_RECORD* Record,
+    IN UINT64 StartTimestamp,
+    IN UINT64 SpinIterations
+    )
+{
+    UINT64 ticks;
+
+    ticks = AsmReadTsc() - StartTimestamp;
+    if (Record->Count == 0)
+    {
+        Record->MinimumTicks = ticks;
+        Record->MaximumTicks = ticks;
+    }
+    else
+    {
+        Record->MinimumTicks = MIN(Record->MinimumTicks, ticks);
+        Record->MaximumTicks = MAX(Record->MaximumTicks, ticks);
+    }
+    Record->Count++;
+    Record->TotalTicks += ticks;
+    Record->SpinIterations += SpinIterations;
+}
+
+/**
+ * @brief Installs the configuration table with the timing of each phase and of
+ *        the MMIO waits on each hardware unit recorded so far.
+ *
+ * @details The table is allocated from runtime memory so that it can be
+ *          inspected after ExitBootServices as well. Records not measured are
+ *          published with Count of zero and MinimumTicks of MAX_UINT64.
+ */
+EFI_STATUS
+PublishBootTimingTable (
+    IN CONST HELLO_IOMMU_TIMING_RECORD* PhaseTimings,
+    IN CONST DMAR_UNIT_INFORMATION* DmarUnits,
+    IN UINT64 DmarUnitCount
+    )
+{
+    EFI_STATUS status;
+    HELLO_IOMMU_BOOT_TIMING_TABLE* table;
+    UINTN tableSize;
+
+    tableSize = OFFSET_OF(HELLO_IOMMU_BOOT_TIMING_TABLE, Units) +
+                (UINTN)DmarUnitCount * sizeof(table->Units[0]);
+    table = AllocateRuntimeZeroPool(tableSize);
+    if (table == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    table->Signature = HELLO_IOMMU_BOOT_TIMING_TABLE_SIGNATURE;
+    table->Version = HELLO_IOMMU_BOOT_TIMING_TABLE_VERSION;
+    table->TimestampFrequency = mTimestampFrequency;
+    CopyMem(table->Phases, PhaseTimings, sizeof(table->Phases));
+    table->UnitCount = DmarUnitCount;
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        table->Units[i].RegisterBase = DmarUnits[i].RegisterBasePa;
+        CopyMem(table->Units[i].Waits, DmarUnits[i].WaitTimings, sizeof(table->Units[i].Waits));
+    }
+
+    //
+    // Mark records never measured so that readers can tell them from ones that
+    // took zero ticks.
+    //
+    for (UINT64 i = 0; i < HELLO_IOMMU_PHASE_COUNT; ++i)
+    {
+        if (table->Phases[i].Count == 0)
+        {
+            table->Phases[i].MinimumTicks = MAX_UINT64;
+        }
+    }
+    for (UINT64 i = 0; i < DmarUnitCount; ++i)
+    {
+        for (UINT64 j = 0; j < HELLO_IOMMU_WAIT_COUNT; ++j)
+        {
+            if (table->Units[i].Waits[j].Count == 0)
+            {
+                table->Units[i].Waits[j].MinimumTicks = MAX_UINT64;
+            }
+        }
+    }
+
+    status = gBS->InstallConfigurationTable(&gHelloIommuBootTimingTableGuid, table);
+    if (EFI_ERROR(status))
+    {
+        FreePool(table);
+        goto Exit;
+    }
+
+    DEBUG((DEBUG_INFO, "Published the boot timing table at %p\n", table));
+
+Exit:
+    return status;
+}
@@ -0,0 +1,2031 @@
+#include "HelloIommuDxe.h"
+
+/**
+ * @brief Returns the size of the region translated by the entry at the level.
+ */
+UINT64
+GetRegionSizeOfLevel (
+    IN UINT64 Level
+    )
+{
+    return LShiftU64(SIZE_4KB, (UINTN)(9 * (Level - 1)));
+}
+
+/**
+ * @brief Returns the physical address the paging-structure entry points to.
+ */
+UINT64
+GetEntryAddress (
+    IN CONST VTD_SECOND_LEVEL_PAGING_ENTRY* Entry
+    )
+{
+    return ((UINT64)Entry->Bits.AddressLo << 12) |
+           ((UINT64)Entry->Bits.AddressHi << 32);
+}
+
+/**
+ * @brief Returns the value of the leaf entry at the level translating to the
+ *        address with the permissions.
+ */
+UINT64
+MakeLeafEntry (
+    IN UINT64 Address,
+    IN BOOLEAN Readable,
+    IN BOOLEAN Writable,
+    IN UINT64 Level
+    )
+{
+    VTD_SECOND_LEVEL_PAGING_ENTRY entry;
+
+    entry.Uint64 = Address;
+    entry.Bits.Read = Readable;
+    entry.Bits.Write = Writable;
+    entry.Bits.PageSize = (Level != SL_LEVEL_PT);
+    return entry.Uint64;
+}
+
+/**
+ * @brief Fills the entries with the template whose address field advances by
+ *        Increment for each entry.
+ *
+ * @details The template is assembled once by the caller, so that each entry is
+ *          a single 64-bit store instead of a series of read-modify-writes of
+ *          bit fields. The loop is unrolled so that compilers emit wide stores
+ *          where available.
+ */
+VOID
+FillPagingEntries (
+    OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Entries,
+    IN UINT64 Count,
+    IN UINT64 Template,
+    IN UINT64 Increment
+    )
+{
+    UINT64 i;
+
+    for (i = 0; (i + 4) <= Count; i += 4)
+    {
+        Entries[i + 0].Uint64 = Template;
+        Entries[i + 1].Uint64 = Template + Increment;
+        Entries[i + 2].Uint64 = Template + Increment * 2;
+        Entries[i + 3].Uint64 = Template + Increment * 3;
+        Template += Increment * 4;
+    }
+    for (; i < Count; ++i)
+    {
+        Entries[i].Uint64 = Template;
+        Template += Increment;
+    }
+}
+
+/**
+ * @brief Splits the large page entry at the level into a new table made up of
+ *        512 entries of the next level, inheriting the access permissions.
+ *
+ * @note The entry is updated with a single write after the new table is filled
+ *       out and written back, so that hardware walking the tables concurrently
+ *       never observes an incomplete translation. The caller is responsible
+ *       for invalidation of IOTLB if DMA-remapping is already enabled.
+ */
+static
+VTD_SECOND_LEVEL_PAGING_ENTRY*
+SplitLargePage (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* LargePageEntry,
+    IN UINT64 Level
+    )
+{
+    UINT64 baseAddress;
+    UINT64 childRegionSize;
+    VTD_SECOND_LEVEL_PAGING_ENTRY* table;
+    VTD_SECOND_LEVEL_PAGING_ENTRY newEntry;
+
+    ASSERT(Level > SL_LEVEL_PT);
+    ASSERT(LargePageEntry->Bits.PageSize == TRUE);
+
+    //
+    // All entries are written below. Do not clear the page in vain.
+    //
+    table = AllocateUninitializedPageTablePage(Pool);
+    if (table == NULL)
+    {
+        goto Exit;
+    }
+
+    //
+    // Fill out the new table, inheriting the permissions of the large page.
+    // Entries are large pages too unless it is a PT.
+    //
+    baseAddress = GetEntryAddress(LargePageEntry);
+    childRegionSize = GetRegionSizeOfLevel(Level - 1);
+    FillPagingEntries(table,
+                      SL_ENTRY_COUNT,
+                      MakeLeafEntry(baseAddress,
+                                    (LargePageEntry->Bits.Read != FALSE),
+                                    (LargePageEntry->Bits.Write != FALSE),
+                                    Level - 1),
+                      childRegionSize);
+    WriteBackPagingStructure(Writeback, table, SIZE_4KB);
+
+    //
+    // The entry should no longer indicates large page.
+    //
+    newEntry.Uint64 = (UINT64)table;
+    newEntry.Bits.Read = TRUE;
+    newEntry.Bits.Write = TRUE;
+    LargePageEntry->Uint64 = newEntry.Uint64;
+
+Exit:
+    return table;
+}
+
+/**
+ * @brief Makes the non-present entry point to a new, empty table allocated from
+ *        the pool, or returns the table the entry already points to.
+ *
+ * @note The new table is written back before the entry is published, as with
+ *       SplitLargePage. The caller is responsible for writing back the entry.
+ */
+static
+VTD_SECOND_LEVEL_PAGING_ENTRY*
+GetOrAllocateTable (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Entry
+    )
+{
+    VTD_SECOND_LEVEL_PAGING_ENTRY* table;
+    VTD_SECOND_LEVEL_PAGING_ENTRY newEntry;
+
+    ASSERT(Entry->Bits.PageSize == FALSE);
+
+    if ((Entry->Bits.Read != FALSE) || (Entry->Bits.Write != FALSE))
+    {
+        return (VTD_SECOND_LEVEL_PAGING_ENTRY*)GetEntryAddress(Entry);
+    }
+
+    table = AllocatePageTablePage(Pool);
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    WriteBackPagingStructure(Writeback, table, SIZE_4KB);
+
+    newEntry.Uint64 = (UINT64)table;
+    newEntry.Bits.Read = TRUE;
+    newEntry.Bits.Write = TRUE;
+    Entry->Uint64 = newEntry.Uint64;
+    return table;
+}
+
+/**
+ * @brief Returns the table the entry at the level points to, after replacing it
+ *        with a private copy if the table is shared with other entries.
+ *
+ * @details Tables the copied table points to become shared by the original and
+ *          the copy. The copy is written back before the entry is published.
+ *          The caller is responsible for writing back the entry.
+ */
+static
+VTD_SECOND_LEVEL_PAGING_ENTRY*
+GetPrivateTable (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Entry,
+    IN UINT64 Level
+    )
+{
+    VTD_SECOND_LEVEL_PAGING_ENTRY* table;
+    VTD_SECOND_LEVEL_PAGING_ENTRY* copy;
+    VTD_SECOND_LEVEL_PAGING_ENTRY newEntry;
+
+    ASSERT(Level > SL_LEVEL_PT);
+    ASSERT(Entry->Bits.PageSize == FALSE);
+
+    table = (VTD_SECOND_LEVEL_PAGING_ENTRY*)GetEntryAddress(Entry);
+    if (GetPageTableShareCount(Pool, table) <= 1)
+    {
+        return table;
+    }
+
+    copy = AllocateUninitializedPageTablePage(Pool);
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    CopyMem(copy, table, SIZE_4KB);
+
+    //
+    // Non-leaf entries in the copy reference the same tables as the original.
+    //
+    if ((Level - 1) > SL_LEVEL_PT)
+    {
+        for (UINT64 i = 0; i < SL_ENTRY_COUNT; ++i)
+        {
+            if ((copy[i].Bits.PageSize == FALSE) &&
+                ((copy[i].Bits.Read != FALSE) || (copy[i].Bits.Write != FALSE)))
+            {
+                SharePageTablePage(Pool, (VOID*)GetEntryAddress(&copy[i]));
+            }
+        }
+    }
+    WriteBackPagingStructure(Writeback, copy, SIZE_4KB);
+
+    newEntry.Uint64 = (UINT64)copy;
+    newEntry.Bits.Read = TRUE;
+    newEntry.Bits.Write = TRUE;
+    Entry->Uint64 = newEntry.Uint64;
+    ReleasePageTablePage(Pool, table);
+    return copy;
+}
+
+/**
+ * @brief Updates the access permissions of the range within the table at the
+ *        level, and recursively, the tables it references.
+ *
+ * @details Leaf entries that are fully covered by the range are updated as-is,
+ *          regardless of their page size. Large pages partially covered by
+ *          the range, that is, at the head and tail of the range, are split.
+ *          Entries of a table updated are recorded as dirty once at the end,
+ *          since they are contiguous. Leaf entries are written to translate to
+ *          the address plus HostAddressOffset, that is, as identity mapping if
+ *          it is zero.
+ *
+ *          Only the ranges of leaf entries that were present are added to
+ *          DirtyRanges, as non-present entries are not cached by hardware
+ *          reporting CAP.CM of zero.
+ *
+ * @param CopyOnWrite - TRUE to copy tables shared with other domains before
+ *                      updating them, so that the update is visible only
+ *                      through Table. FALSE to update shared tables in place.
+ * @param MapNonPresent - TRUE to allocate tables for the range where non-leaf
+ *                        entries are not present, so that the range is mapped
+ *                        with 4KB pages there. FALSE to leave such parts of
+ *                        the range non-present. Ignored if Permissions is zero.
+ * @param HostAddressOffset - The value added to addresses in the range to get
+ *                            the host physical addresses leaf entries point to.
+ *                            Must be aligned to the size of leaf entries
+ *                            updated.
+ */
+static
+EFI_STATUS
+ChangePermissionOfRangeInTable (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Table,
+    IN UINT64 Level,
+    IN UINT64 Base,
+    IN UINT64 End,
+    IN UINT64 Permissions,
+    IN BOOLEAN CopyOnWrite,
+    IN BOOLEAN MapNonPresent,
+    IN UINT64 HostAddressOffset,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    )
+{
+    EFI_STATUS status;
+    UINT64 regionSize;
+    UINT64 regionBase;
+    UINT64 firstIndex;
+    UINT64 lastIndex;
+    UINT64 firstModifiedIndex;
+    UINT64 lastModifiedIndex;
+
+    status = EFI_SUCCESS;
+    regionSize = GetRegionSizeOfLevel(Level);
+    regionBase = Base & ~(regionSize - 1);
+    firstIndex = RShiftU64(Base, (UINTN)(12 + 9 * (Level - 1))) % SL_ENTRY_COUNT;
+    lastIndex = RShiftU64(End - 1, (UINTN)(12 + 9 * (Level - 1))) % SL_ENTRY_COUNT;
+    firstModifiedIndex = MAX_UINT64;
+    lastModifiedIndex = 0;
+
+    for (UINT64 index = firstIndex; index <= lastIndex; ++index, regionBase += regionSize)
+    {
+        VTD_SECOND_LEVEL_PAGING_ENTRY* entry;
+        VTD_SECOND_LEVEL_PAGING_ENTRY newEntry;
+        VTD_SECOND_LEVEL_PAGING_ENTRY* table;
+        UINT64 rangeBase;
+        UINT64 rangeEnd;
+
+        entry = &Table[index];
+        rangeBase = MAX(Base, regionBase);
+        rangeEnd = MIN(End, regionBase + regionSize);
+
+        if ((Level == SL_LEVEL_PT) || (entry->Bits.PageSize != FALSE))
+        {
+            //
+            // The leaf entry. Update it in place if the range covers the whole
+            // region, and else, split it and update the part of the new table.
+            //
+            if ((rangeBase == regionBase) && (rangeEnd == (regionBase + regionSize)))
+            {
+                ASSERT((HostAddressOffset % regionSize) == 0);
+                newEntry.Uint64 = regionBase + HostAddressOffset;
+                newEntry.Bits.Read = ((Permissions & DMAR_ACCESS_READ) != 0);
+                newEntry.Bits.Write = ((Permissions & DMAR_ACCESS_WRITE) != 0);
+                newEntry.Bits.PageSize = (Level != SL_LEVEL_PT);
+                if (newEntry.Uint64 != entry->Uint64)
+                {
+                    if ((entry->Bits.Read != FALSE) || (entry->Bits.Write != FALSE))
+                    {
+                        AddDirtyRange(DirtyRanges, rangeBase, rangeEnd - rangeBase);
+                    }
+                    entry->Uint64 = newEntry.Uint64;
+                    firstModifiedIndex = MIN(firstModifiedIndex, index);
+                    lastModifiedIndex = index;
+                }
+                continue;
+            }
+
+            if (SplitLargePage(Pool, Writeback, entry, Level) == NULL)
+            {
+                status = EFI_OUT_OF_RESOURCES;
+                goto Exit;
+            }
+            firstModifiedIndex = MIN(firstModifiedIndex, index);
+            lastModifiedIndex = index;
+
+            //
+            // The whole region has been replaced, including the cached entry.
+            //
+            AddDirtyRange(DirtyRanges, regionBase, regionSize);
+        }
+        else if ((entry->Bits.Read == FALSE) && (entry->Bits.Write == FALSE))
+        {
+            //
+            // Not present. Nothing is mapped to update, unless mapping is
+            // requested. The new table is private and needs no copying.
+            //
+            if ((MapNonPresent == FALSE) || (Permissions == 0))
+            {
+                continue;
+            }
+            if (GetOrAllocateTable(Pool, Writeback, entry) == NULL)
+            {
+                status = EFI_OUT_OF_RESOURCES;
+                goto Exit;
+            }
+            firstModifiedIndex = MIN(firstModifiedIndex, index);
+            lastModifiedIndex = index;
+        }
+
+        table = (VTD_SECOND_LEVEL_PAGING_ENTRY*)GetEntryAddress(entry);
+        if (CopyOnWrite != FALSE)
+        {
+            VTD_SECOND_LEVEL_PAGING_ENTRY* privateTable;
+
+            privateTable = GetPrivateTable(Pool, Writeback, entry, Level);
+            if (privateTable == NULL)
+            {
+                status = EFI_OUT_OF_RESOURCES;
+                goto Exit;
+            }
+            if (privateTable != table)
+            {
+                firstModifiedIndex = MIN(firstModifiedIndex, index);
+                lastModifiedIndex = index;
+                table = privateTable;
+            }
+        }
+
+        status = ChangePermissionOfRangeInTable(Pool,
+                                                Writeback,
+                                                table,
+                                                Level - 1,
+                                                rangeBase,
+                                                rangeEnd,
+                                                Permissions,
+                                                CopyOnWrite,
+                                                MapNonPresent,
+                                                HostAddressOffset,
+                                                DirtyRanges);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+
+Exit:
+    //
+    // Record updated entries to be written back to RAM, even on error, as
+    // splitting done so far is valid.
+    //
+    if (firstModifiedIndex != MAX_UINT64)
+    {
+        MarkPagingStructureDirty(Writeback,
+                                 &Table[firstModifiedIndex],
+                                 (lastModifiedIndex - firstModifiedIndex + 1) * sizeof(*Table));
+    }
+    return status;
+}
+
+/**
+ * @brief Tests whether the parameters of the permission change are valid.
+ */
+static
+BOOLEAN
+IsValidPermissionChange (
+    IN UINT64 Base,
+    IN UINT64 Length,
+    IN UINT64 Permissions
+    )
+{
+    return ((Length != 0) &&
+            ((Base % SIZE_4KB) == 0) &&
+            ((Length % SIZE_4KB) == 0) &&
+            ((Base + Length) > Base) &&
+            ((Base + Length) <= GetRegionSizeOfLevel(SL_LEVEL_PML4 + 1)) &&
+            ((Permissions & ~(UINT64)(DMAR_ACCESS_READ | DMAR_ACCESS_WRITE)) == 0));
+}
+
+/**
+ * @brief Updates the access permissions in the translations for the range.
+ *
+ * @details Large pages fully covered by the range are kept intact, and only
+ *          those partially covered at the head and tail of the range are split.
+ *          Each modified cache line is written back to RAM once, and only if
+ *          any hardware unit is not coherent.
+ *
+ * @note As the name suggests, this change is applied for all devices, that is,
+ *       for all domains. Tables shared between domains are updated in place.
+ *       Devices configured with SetDevicePassthrough are not affected.
+ *
+ * @note The modified ranges are added to DirtyRanges. The caller must invalidate
+ *       IOTLB for them with InvalidateDirtyRanges if DMA-remapping is already
+ *       enabled, with DMAR_DOMAIN_ID_ALL. Tables
+ *       needed for splitting are allocated from the pool of Translations.
+ */
+EFI_STATUS
+ChangePermissionOfRangeForAllDevices (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT64 Base,
+    IN UINT64 Length,
+    IN UINT64 Permissions,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    )
+{
+    EFI_STATUS status;
+
+    if (IsValidPermissionChange(Base, Length, Permissions) == FALSE)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    status = EFI_SUCCESS;
+    for (UINT64 domainId = 0; domainId < Translations->DomainIdLimit; ++domainId)
+    {
+        if (Translations->DomainSlPml4s[domainId] == NULL)
+        {
+            continue;
+        }
+
+        status = ChangePermissionOfRangeInTable(&Translations->Pool,
+                                                &Translations->Writeback,
+                                                Translations->DomainSlPml4s[domainId],
+                                                SL_LEVEL_PML4,
+                                                Base,
+                                                Base + Length,
+                                                Permissions,
+                                                FALSE,
+                                                FALSE,
+                                                0,
+                                                DirtyRanges);
+        if (EFI_ERROR(status))
+        {
+            break;
+        }
+    }
+    CommitPagingStructureWriteback(&Translations->Writeback);
+    return status;
+}
+
+/**
+ * @brief Updates the access permissions in the translations of the domain for
+ *        the range.
+ *
+ * @details Tables shared with other domains are copied before updated, so that
+ *          only devices in the domain are affected. Only tables on the path to
+ *          the range are copied, and everything else remains shared.
+ *
+ * @note The modified ranges are added to DirtyRanges. The caller must invalidate
+ *       IOTLB for them with InvalidateDirtyRanges for DomainId if DMA-remapping
+ *       is already enabled.
+ */
+EFI_STATUS
+ChangePermissionOfRangeForDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 DomainId,
+    IN UINT64 Base,
+    IN UINT64 Length,
+    IN UINT64 Permissions,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    )
+{
+    EFI_STATUS status;
+
+    if ((IsValidPermissionChange(Base, Length, Permissions) == FALSE) ||
+        (DomainId >= Translations->DomainIdLimit) ||
+        (Translations->DomainSlPml4s[DomainId] == NULL))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    status = ChangePermissionOfRangeInTable(&Translations->Pool,
+                                            &Translations->Writeback,
+                                            Translations->DomainSlPml4s[DomainId],
+                                            SL_LEVEL_PML4,
+                                            Base,
+                                            Base + Length,
+                                            Permissions,
+                                            TRUE,
+                                            FALSE,
+                                            0,
+                                            DirtyRanges);
+    CommitPagingStructureWriteback(&Translations->Writeback);
+    return status;
+}
+
+/**
+ * @brief Grants or revokes access to the range for the domain, mapping the range
+ *        to HostBase with 4KB pages where it is not mapped yet.
+ *
+ * @details Unlike ChangePermissionOfRangeForDomain, tables are allocated for
+ *          the range as needed, and the range may be translated to different
+ *          host physical addresses, such as for I/O virtual addresses.
+ *          Tables are never freed once allocated, so that granting access to
+ *          the same range again only updates the leaf entries. This is meant
+ *          for domains created empty with AssignDeviceDomain and managed one
+ *          mapping at a time.
+ *
+ * @note The modified ranges are added to DirtyRanges, except those that were
+ *       not present. The caller must invalidate IOTLB for them with
+ *       InvalidateDirtyRanges for DomainId if DMA-remapping is already enabled,
+ *       and for the whole range if any hardware unit reports CAP.CM.
+ */
+EFI_STATUS
+MapRangeForDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 DomainId,
+    IN UINT64 Base,
+    IN UINT64 Length,
+    IN UINT64 HostBase,
+    IN UINT64 Permissions,
+    IN OUT DMAR_DIRTY_RANGES* DirtyRanges
+    )
+{
+    EFI_STATUS status;
+
+    if ((IsValidPermissionChange(Base, Length, Permissions) == FALSE) ||
+        ((HostBase % SIZE_4KB) != 0) ||
+        (DomainId >= Translations->DomainIdLimit) ||
+        (Translations->DomainSlPml4s[DomainId] == NULL))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    status = ChangePermissionOfRangeInTable(&Translations->Pool,
+                                            &Translations->Writeback,
+                                            Translations->DomainSlPml4s[DomainId],
+                                            SL_LEVEL_PML4,
+                                            Base,
+                                            Base + Length,
+                                            Permissions,
+                                            TRUE,
+                                            TRUE,
+                                            HostBase - Base,
+                                            DirtyRanges);
+    CommitPagingStructureWriteback(&Translations->Writeback);
+    return status;
+}
+
+/**
+ * @brief Returns the context entry of the device, after making the context
+ *        table of the bus private if it is still the shared one.
+ *
+ * @details The private context table is a copy of the shared one, so that
+ *          updating the root entry does not change translations. Only the lower
+ *          64 bits of the root entry hold the present bit and the pointer, and
+ *          are updated with a single write.
+ */
+static
+VTD_CONTEXT_ENTRY*
+GetPrivateContextEntry (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    OUT BOOLEAN* RootEntryUpdated
+    )
+{
+    VTD_ROOT_ENTRY* rootEntry;
+    VTD_ROOT_ENTRY newRootEntry;
+    VTD_CONTEXT_ENTRY* contextTable;
+
+    *RootEntryUpdated = FALSE;
+
+    rootEntry = &Translations->RootTable[(SourceId >> 8) & 0xff];
+    contextTable = (VTD_CONTEXT_ENTRY*)(((UINT64)rootEntry->Bits.ContextTablePointerLo << 12) |
+                                        ((UINT64)rootEntry->Bits.ContextTablePointerHi << 32));
+    if (contextTable != Translations->ContextTable)
+    {
+        goto Exit;
+    }
+
+    contextTable = AllocateUninitializedPageTablePage(&Translations->Pool);
+    if (contextTable == NULL)
+    {
+        goto Exit;
+    }
+    CopyMem(contextTable, Translations->ContextTable, SIZE_4KB);
+    WriteBackPagingStructure(&Translations->Writeback, contextTable, SIZE_4KB);
+
+    newRootEntry = *rootEntry;
+    newRootEntry.Bits.ContextTablePointerLo = (UINT32)((UINT64)contextTable >> 12);
+    newRootEntry.Bits.ContextTablePointerHi = (UINT32)((UINT64)contextTable >> 32);
+    rootEntry->Uint128.Uint64Lo = newRootEntry.Uint128.Uint64Lo;
+    MarkPagingStructureDirty(&Translations->Writeback, rootEntry, sizeof(*rootEntry));
+    *RootEntryUpdated = TRUE;
+
+Exit:
+    return (contextTable == NULL) ? NULL : &contextTable[SourceId & 0xff];
+}
+
+/**
+ * @brief Releases the reference to the table at the level, and if it was the
+ *        last one, recursively, the tables it references.
+ */
+static
+VOID
+ReleaseTableTree (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Table,
+    IN UINT64 Level
+    )
+{
+    if ((Level > SL_LEVEL_PT) && (GetPageTableShareCount(Pool, Table) == 1))
+    {
+        for (UINT64 i = 0; i < SL_ENTRY_COUNT; ++i)
+        {
+            if (((Table[i].Bits.Read != FALSE) || (Table[i].Bits.Write != FALSE)) &&
+                (Table[i].Bits.PageSize == FALSE))
+            {
+                ReleaseTableTree(Pool, (VTD_SECOND_LEVEL_PAGING_ENTRY*)GetEntryAddress(&Table[i]), Level - 1);
+            }
+        }
+    }
+    ReleasePageTablePage(Pool, Table);
+}
+
+static
+EFI_STATUS
+MapIdentityRangeInTable (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Table,
+    IN UINT64 Level,
+    IN UINT64 Base,
+    IN UINT64 End,
+    IN UINT64 LargestPageLevel
+    );
+
+/**
+ * @brief Identity maps the reserved memory regions of the device in the empty
+ *        PML4, readable and writable, with the largest page sizes that fit.
+ *
+ * @details 1GB pages are used only if all hardware units support them, as
+ *          for the translations of UEFI_DOMAIN_ID. The number of table pages
+ *          the regions cost is logged.
+ */
+static
+EFI_STATUS
+MapReservedRanges (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Pml4,
+    IN CONST DMAR_ADDRESS_RANGE* ReservedRanges OPTIONAL,
+    IN UINT64 ReservedRangeCount,
+    IN UINT16 SourceId
+    )
+{
+    EFI_STATUS status;
+    UINT64 allocationCount;
+
+    allocationCount = Translations->Pool.AllocationCount;
+    status = EFI_SUCCESS;
+    for (UINT64 i = 0; (ReservedRanges != NULL) && (i < ReservedRangeCount); ++i)
+    {
+        ASSERT((ReservedRanges[i].Base % SIZE_4KB) == 0);
+        ASSERT((ReservedRanges[i].End % SIZE_4KB) == 0);
+        ASSERT(ReservedRanges[i].Base < ReservedRanges[i].End);
+        ASSERT((i == 0) || (ReservedRanges[i - 1].End < ReservedRanges[i].Base));
+
+        status = MapIdentityRangeInTable(&Translations->Pool,
+                                         &Translations->Writeback,
+                                         Pml4,
+                                         SL_LEVEL_PML4,
+                                         ReservedRanges[i].Base,
+                                         ReservedRanges[i].End,
+                                         (Translations->Use1GbPages != FALSE) ? SL_LEVEL_PDPT : SL_LEVEL_PD);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+
+    if (ReservedRangeCount != 0)
+    {
+        DEBUG((DEBUG_INFO,
+               "Mapped %llu reserved regions for %02x:%02x.%x with %llu table pages\n",
+               ReservedRangeCount,
+               (UINT32)((SourceId >> 8) & 0xff),
+               (UINT32)((SourceId >> 3) & 0x1f),
+               (UINT32)(SourceId & 0x7),
+               Translations->Pool.AllocationCount - allocationCount));
+    }
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Allocates the lowest domain ID not in use.
+ */
+static
+EFI_STATUS
+AllocateDomainId (
+    IN CONST DMAR_TRANSLATIONS* Translations,
+    OUT UINT16* DomainId
+    )
+{
+    for (UINT64 domainId = UEFI_DOMAIN_ID + 1; domainId < Translations->DomainIdLimit; ++domainId)
+    {
+        if ((Translations->DomainSlPml4s[domainId] == NULL) &&
+            (domainId != Translations->PassthroughDomainId))
+        {
+            *DomainId = (UINT16)domainId;
+            return EFI_SUCCESS;
+        }
+    }
+
+    DEBUG((DEBUG_ERROR, "All %llu domain IDs are in use.\n", Translations->DomainIdLimit));
+    return EFI_OUT_OF_RESOURCES;
+}
+
+/**
+ * @brief Frees the PML4 of a domain never published, and releases the tables
+ *        it references.
+ */
+static
+VOID
+FreeDomainPml4 (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Pml4
+    )
+{
+    for (UINT64 i = 0; i < SL_ENTRY_COUNT; ++i)
+    {
+        if ((Pml4[i].Bits.Read != FALSE) || (Pml4[i].Bits.Write != FALSE))
+        {
+            ReleaseTableTree(&Translations->Pool,
+                             (VTD_SECOND_LEVEL_PAGING_ENTRY*)GetEntryAddress(&Pml4[i]),
+                             SL_LEVEL_PDPT);
+        }
+    }
+    FreePageTablePage(&Translations->Pool, Pml4);
+}
+
+/**
+ * @brief Creates the PML4 of a new domain, as a copy of that of UEFI_DOMAIN_ID
+ *        sharing all PDPTs with it if translations are inherited, or as a table
+ *        identity mapping only the reserved memory regions otherwise.
+ */
+static
+EFI_STATUS
+CreateDomainPml4 (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN BOOLEAN InheritTranslations,
+    IN CONST DMAR_ADDRESS_RANGE* ReservedRanges OPTIONAL,
+    IN UINT64 ReservedRangeCount,
+    IN UINT16 SourceId,
+    OUT VTD_SECOND_LEVEL_PAGING_ENTRY** Pml4
+    )
+{
+    EFI_STATUS status;
+    VTD_SECOND_LEVEL_PAGING_ENTRY* pml4;
+
+    pml4 = AllocatePageTablePage(&Translations->Pool);
+    if (pml4 == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    if (InheritTranslations != FALSE)
+    {
+        CopyMem(pml4, Translations->SlPml4, SIZE_4KB);
+        for (UINT64 i = 0; i < SL_ENTRY_COUNT; ++i)
+        {
+            if ((pml4[i].Bits.Read != FALSE) || (pml4[i].Bits.Write != FALSE))
+            {
+                SharePageTablePage(&Translations->Pool, (VOID*)GetEntryAddress(&pml4[i]));
+            }
+        }
+    }
+    else
+    {
+        status = MapReservedRanges(Translations, pml4, ReservedRanges, ReservedRangeCount, SourceId);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+    WriteBackPagingStructure(&Translations->Writeback, pml4, SIZE_4KB);
+    status = EFI_SUCCESS;
+
+Exit:
+    if (EFI_ERROR(status) && (pml4 != NULL))
+    {
+        FreeDomainPml4(Translations, pml4);
+        pml4 = NULL;
+    }
+    *Pml4 = pml4;
+    return status;
+}
+
+/**
+ * @brief Publishes the domain created for the device or PASID.
+ */
+static
+VOID
+RegisterDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 DomainId,
+    IN VTD_SECOND_LEVEL_PAGING_ENTRY* Pml4,
+    IN UINT16 SourceId,
+    IN UINT32 Pasid
+    )
+{
+    Translations->DomainSlPml4s[DomainId] = Pml4;
+    Translations->DomainCount++;
+
+    DEBUG((DEBUG_VERBOSE,
+           "Assigned domain %u to %02x:%02x.%x PASID %u\n",
+           (UINT32)DomainId,
+           (UINT32)((SourceId >> 8) & 0xff),
+           (UINT32)((SourceId >> 3) & 0x1f),
+           (UINT32)(SourceId & 0x7),
+           Pasid));
+}
+
+/**
+ * @brief Gives the device its own domain in the PASID entry for DMAR_RID_PASID.
+ *        See AssignDeviceDomain.
+ */
+static
+EFI_STATUS
+AssignDeviceDomainInScalableMode (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN BOOLEAN InheritTranslations,
+    IN CONST DMAR_ADDRESS_RANGE* ReservedRanges OPTIONAL,
+    IN UINT64 ReservedRangeCount,
+    OUT UINT16* DomainId,
+    OUT UINT16* PreviousDomainId,
+    OUT BOOLEAN* RootEntryUpdated
+    )
+{
+    EFI_STATUS status;
+    VTD_SM_CONTEXT_ENTRY* contextEntry;
+    VTD_SM_PASID_ENTRY* pasidEntry;
+    VTD_SM_PASID_ENTRY newPasidEntry;
+    VTD_SECOND_LEVEL_PAGING_ENTRY* pml4;
+    UINT16 domainId;
+
+    pasidEntry = GetPrivatePasidEntry(Translations, SourceId, DMAR_RID_PASID, &contextEntry, RootEntryUpdated);
+    if (pasidEntry == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    if (pasidEntry->Bits.PASIDGranularTranslationType == V_PASID_ENTRY_PGTT_PASSTHROUGH)
+    {
+        status = EFI_UNSUPPORTED;
+        goto Exit;
+    }
+    *PreviousDomainId = (UINT16)pasidEntry->Bits.DomainIdentifier;
+    if (pasidEntry->Bits.DomainIdentifier != UEFI_DOMAIN_ID)
+    {
+        *DomainId = (UINT16)pasidEntry->Bits.DomainIdentifier;
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+
+    status = AllocateDomainId(Translations, &domainId);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    status = CreateDomainPml4(Translations,
+                              InheritTranslations,
+                              ReservedRanges,
+                              ReservedRangeCount,
+                              SourceId,
+                              &pml4);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // As with the context entry in legacy mode, the entry is made non-present
+    // while updated unless translations are inherited.
+    //
+    MakePasidEntry(Translations, domainId, pml4, &newPasidEntry);
+    WritePasidEntry(Translations, pasidEntry, &newPasidEntry, (InheritTranslations == FALSE));
+
+    RegisterDomain(Translations, domainId, pml4, SourceId, DMAR_RID_PASID);
+    *DomainId = domainId;
+    status = EFI_SUCCESS;
+
+Exit:
+    CommitPagingStructureWriteback(&Translations->Writeback);
+    return status;
+}
+
+/**
+ * @brief Gives the device its own domain, or returns the domain it already has.
+ *
+ * @details A new domain ID is allocated within the number of IDs all hardware
+ *          units support, and the PML4 of the domain is created as a copy of
+ *          that of UEFI_DOMAIN_ID, sharing all tables below it, or as an empty
+ *          table. Then, the context entry of the device is updated to point to
+ *          it. If the bus of the device still uses the shared context table, a
+ *          private copy of it is created and the root entry is updated first.
+ *          In scalable mode, the PASID entry for DMAR_RID_PASID is updated
+ *          instead, after making the tables on the path to it private.
+ *
+ *          If translations are inherited, the new domain translates exactly as
+ *          the old one at this point, and hardware observing the context entry
+ *          being updated never sees different translations. Otherwise, the
+ *          device loses access to all memory, and DMA in flight may fault.
+ *
+ * @note If a new domain is created and DMA-remapping is already enabled, the
+ *       caller must invalidate the context-cache, and then the IOTLB for the
+ *       previous domain, UEFI_DOMAIN_ID, with InvalidateContextCacheForDevice
+ *       and DomainLeft set. The new domain ID has never been used, but the
+ *       IOTLB may still hold translations the device used under the previous
+ *       one, which would keep granting access to all memory.
+ *
+ * @param SourceId - The source-id (bus:device:function) of the device.
+ * @param InheritTranslations - TRUE to start the new domain with translations
+ *                              of UEFI_DOMAIN_ID. FALSE to start it with no
+ *                              access. Ignored if the device has its own domain
+ *                              already.
+ * @param ReservedRanges - The reserved memory regions of the device reported by
+ *                         RMRR, identity mapped readable and writable in a new
+ *                         domain started with no access, before the device is
+ *                         switched to it. Those must be sorted, non-overlapping,
+ *                         non-adjacent and aligned to 4KB.
+ * @param ReservedRangeCount - The number of entries in ReservedRanges.
+ * @param DomainId - The domain ID of the device.
+ * @param PreviousDomainId - The domain ID the device belonged to before the
+ *                           call. The same as DomainId if the device had its
+ *                           own domain already.
+ * @param RootEntryUpdated - TRUE if the root entry of the bus is updated.
+ *
+ * @return EFI_UNSUPPORTED if the device is configured as pass-through.
+ */
+EFI_STATUS
+AssignDeviceDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN BOOLEAN InheritTranslations,
+    IN CONST DMAR_ADDRESS_RANGE* ReservedRanges OPTIONAL,
+    IN UINT64 ReservedRangeCount,
+    OUT UINT16* DomainId,
+    OUT UINT16* PreviousDomainId,
+    OUT BOOLEAN* RootEntryUpdated
+    )
+{
+    EFI_STATUS status;
+    VTD_CONTEXT_ENTRY* contextEntry;
+    VTD_CONTEXT_ENTRY newContextEntry;
+    VTD_SECOND_LEVEL_PAGING_ENTRY* pml4;
+    UINT16 domainId;
+
+    *RootEntryUpdated = FALSE;
+
+    if (Translations->ScalableMode != FALSE)
+    {
+        return AssignDeviceDomainInScalableMode(Translations,
+                                                SourceId,
+                                                InheritTranslations,
+                                                ReservedRanges,
+                                                ReservedRangeCount,
+                                                DomainId,
+                                                PreviousDomainId,
+                                                RootEntryUpdated);
+    }
+
+    contextEntry = GetPrivateContextEntry(Translations, SourceId, RootEntryUpdated);
+    if (contextEntry == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    if (contextEntry->Bits.TranslationType == V_CONTEXT_ENTRY_TT_PASSTHROUGH)
+    {
+        status = EFI_UNSUPPORTED;
+        goto Exit;
+    }
+    *PreviousDomainId = (UINT16)contextEntry->Bits.DomainIdentifier;
+    if (contextEntry->Bits.DomainIdentifier != UEFI_DOMAIN_ID)
+    {
+        *DomainId = (UINT16)contextEntry->Bits.DomainIdentifier;
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+
+    //
+    // Allocate a domain ID only now, so that devices with their own domain get
+    // it even after all IDs are in use.
+    //
+    status = AllocateDomainId(Translations, &domainId);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Create the PML4 of the domain. If inherited, all PDPTs are shared with
+    // UEFI_DOMAIN_ID.
+    //
+    status = CreateDomainPml4(Translations,
+                              InheritTranslations,
+                              ReservedRanges,
+                              ReservedRangeCount,
+                              SourceId,
+                              &pml4);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Update the context entry. Either half may be observed first if inherited,
+    // as both domains translate the same. Otherwise, the entry is made
+    // non-present while the upper half is updated, so that translations of the
+    // old tables are never cached with the new domain ID.
+    //
+    newContextEntry = *contextEntry;
+    newContextEntry.Bits.DomainIdentifier = domainId;
+    newContextEntry.Bits.SecondLevelPageTranslationPointerLo = (UINT32)((UINT64)pml4 >> 12);
+    newContextEntry.Bits.SecondLevelPageTranslationPointerHi = (UINT32)((UINT64)pml4 >> 32);
+    if (InheritTranslations == FALSE)
+    {
+        contextEntry->Bits.Present = FALSE;
+    }
+    contextEntry->Uint128.Uint64Hi = newContextEntry.Uint128.Uint64Hi;
+    contextEntry->Uint128.Uint64Lo = newContextEntry.Uint128.Uint64Lo;
+    MarkPagingStructureDirty(&Translations->Writeback, contextEntry, sizeof(*contextEntry));
+
+    RegisterDomain(Translations, domainId, pml4, SourceId, DMAR_RID_PASID);
+    *DomainId = domainId;
+    status = EFI_SUCCESS;
+
+Exit:
+    CommitPagingStructureWriteback(&Translations->Writeback);
+    return status;
+}
+
+/**
+ * @brief Gives the device an address space for the PASID, or returns the domain
+ *        it already has, so that requests with the PASID are translated
+ *        separately from requests without PASID. Scalable mode only.
+ *
+ * @details A new domain starting with no access is allocated as with
+ *          AssignDeviceDomain, and the PASID entry is made to reference its
+ *          PML4. Only the PASID table for the range of 64 PASIDs is made
+ *          private in addition to the context table and PASID directory, so
+ *          address spaces for many PASIDs cost a page each, plus their paging
+ *          structures. Once the entry is present, PASIDs are enabled in the
+ *          context entry of the device.
+ *
+ *          The domain is populated with MapRangeForDomain and
+ *          ChangePermissionOfRangeForDomain, the same as those of devices.
+ *
+ * @note The caller must invalidate the context-cache and PASID-cache with
+ *       InvalidateContextCacheForDevice for the returned domain ID, if
+ *       DMA-remapping is already enabled. Unlike AssignDeviceDomain, the IOTLB
+ *       needs no invalidation, as there is no previous domain: the PASID entry
+ *       was not present, so no translation was cached for the PASID under any
+ *       domain ID.
+ *
+ * @param SourceId - The source-id (bus:device:function) of the device.
+ * @param Pasid - The PASID, other than DMAR_RID_PASID, below PasidLimit.
+ * @param DomainId - The domain ID of the address space for the PASID.
+ * @param RootEntryUpdated - TRUE if the root entry of the bus is updated.
+ *
+ * @return EFI_UNSUPPORTED if not in scalable mode, or the PASID is not
+ *         supported by all hardware units.
+ */
+EFI_STATUS
+AssignPasidDomain (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN UINT32 Pasid,
+    OUT UINT16* DomainId,
+    OUT BOOLEAN* RootEntryUpdated
+    )
+{
+    EFI_STATUS status;
+    VTD_SM_CONTEXT_ENTRY* contextEntry;
+    VTD_SM_CONTEXT_ENTRY newContextEntry;
+    VTD_SM_PASID_ENTRY* pasidEntry;
+    VTD_SM_PASID_ENTRY newPasidEntry;
+    VTD_SECOND_LEVEL_PAGING_ENTRY* pml4;
+    UINT16 domainId;
+
+    *RootEntryUpdated = FALSE;
+
+    if ((Translations->ScalableMode == FALSE) ||
+        (Pasid == DMAR_RID_PASID) ||
+        (Pasid >= Translations->PasidLimit))
+    {
+        status = EFI_UNSUPPORTED;
+        goto Exit;
+    }
+
+    pasidEntry = GetPrivatePasidEntry(Translations, SourceId, Pasid, &contextEntry, RootEntryUpdated);
+    if (pasidEntry == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    if (pasidEntry->Bits.Present != FALSE)
+    {
+        *DomainId = (UINT16)pasidEntry->Bits.DomainIdentifier;
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+
+    status = AllocateDomainId(Translations, &domainId);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    status = CreateDomainPml4(Translations, FALSE, NULL, 0, SourceId, &pml4);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+    MakePasidEntry(Translations, domainId, pml4, &newPasidEntry);
+    WritePasidEntry(Translations, pasidEntry, &newPasidEntry, FALSE);
+
+    //
+    // Requests with PASID are blocked until PASIDE is set. It is in the same
+    // 64 bits as the present bit and the PASID directory pointer.
+    //
+    if (contextEntry->Bits.PASIDEnable == FALSE)
+    {
+        newContextEntry = *contextEntry;
+        newContextEntry.Bits.PASIDEnable = TRUE;
+        contextEntry->Uint256.Uint64_1 = newContextEntry.Uint256.Uint64_1;
+        MarkPagingStructureDirty(&Translations->Writeback, contextEntry, sizeof(*contextEntry));
+    }
+
+    RegisterDomain(Translations, domainId, pml4, SourceId, Pasid);
+    *DomainId = domainId;
+    status = EFI_SUCCESS;
+
+Exit:
+    CommitPagingStructureWriteback(&Translations->Writeback);
+    return status;
+}
+
+/**
+ * @brief Configures the device to bypass translation (pass-through), that is,
+ *        the Translation Type 10b, so that DMA from it is neither translated
+ *        nor restricted. See 9.3 Context Entry.
+ *
+ * @details The context entry does not reference any second-level table, so no
+ *          page walk or IOTLB miss happens for DMA from the device. All
+ *          pass-through devices share a single domain ID allocated on the first
+ *          call.
+ *
+ * @note All hardware units must report ECAP.PT. Changes in permissions with
+ *       ChangePermissionOfRangeForAllDevices do not affect pass-through
+ *       devices. Only trusted devices should be configured so.
+ *
+ * @note The caller must invalidate the context-cache with
+ *       InvalidateContextCacheForDevice for the previous domain ID, if
+ *       DMA-remapping is already enabled.
+ *
+ * @param SourceId - The source-id (bus:device:function) of the device.
+ * @param AddressWidth - The largest AGAW all hardware units support, in the
+ *                       encoding of SAGAW bit positions.
+ * @param RootEntryUpdated - TRUE if the root entry of the bus is updated.
+ *
+ * @return EFI_UNSUPPORTED if the device already has its own domain.
+ */
+EFI_STATUS
+SetDevicePassthrough (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN UINT16 SourceId,
+    IN UINT8 AddressWidth,
+    OUT BOOLEAN* RootEntryUpdated
+    )
+{
+    EFI_STATUS status;
+    VTD_CONTEXT_ENTRY* contextEntry;
+    VTD_CONTEXT_ENTRY newContextEntry;
+    VTD_SM_CONTEXT_ENTRY* smContextEntry;
+    VTD_SM_PASID_ENTRY* pasidEntry;
+    VTD_SM_PASID_ENTRY newPasidEntry;
+
+    *RootEntryUpdated = FALSE;
+
+    if (Translations->PassthroughDomainId == 0)
+    {
+        status = AllocateDomainId(Translations, &Translations->PassthroughDomainId);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+
+    //
+    // In scalable mode, the PASID entry for DMAR_RID_PASID is switched to the
+    // pass-through PGTT instead. See 9.6 Scalable-Mode PASID-Table Entry.
+    //
+    if (Translations->ScalableMode != FALSE)
+    {
+        pasidEntry = GetPrivatePasidEntry(Translations,
+                                          SourceId,
+                                          DMAR_RID_PASID,
+                                          &smContextEntry,
+                                          RootEntryUpdated);
+        if (pasidEntry == NULL)
+        {
+            status = EFI_OUT_OF_RESOURCES;
+            goto Exit;
+        }
+        if (pasidEntry->Bits.PASIDGranularTranslationType == V_PASID_ENTRY_PGTT_PASSTHROUGH)
+        {
+            status = EFI_SUCCESS;
+            goto Exit;
+        }
+        if (pasidEntry->Bits.DomainIdentifier != UEFI_DOMAIN_ID)
+        {
+            status = EFI_UNSUPPORTED;
+            goto Exit;
+        }
+        MakePasidEntry(Translations, Translations->PassthroughDomainId, NULL, &newPasidEntry);
+        WritePasidEntry(Translations, pasidEntry, &newPasidEntry, TRUE);
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+
+    contextEntry = GetPrivateContextEntry(Translations, SourceId, RootEntryUpdated);
+    if (contextEntry == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+    if (contextEntry->Bits.TranslationType == V_CONTEXT_ENTRY_TT_PASSTHROUGH)
+    {
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+    if (contextEntry->Bits.DomainIdentifier != UEFI_DOMAIN_ID)
+    {
+        status = EFI_UNSUPPORTED;
+        goto Exit;
+    }
+
+    //
+    // The second-level page table pointer is ignored with pass-through, and AW
+    // must indicate the largest AGAW supported. Unlike AssignDeviceDomain, the
+    // halves of the entry are not interchangeable here, so the entry is made
+    // non-present while the upper half is updated.
+    //
+    newContextEntry = *contextEntry;
+    newContextEntry.Bits.TranslationType = V_CONTEXT_ENTRY_TT_PASSTHROUGH;
+    newContextEntry.Bits.SecondLevelPageTranslationPointerLo = 0;
+    newContextEntry.Bits.SecondLevelPageTranslationPointerHi = 0;
+    newContextEntry.Bits.AddressWidth = AddressWidth;
+    newContextEntry.Bits.DomainIdentifier = Translations->PassthroughDomainId;
+    contextEntry->Bits.Present = FALSE;
+    contextEntry->Uint128.Uint64Hi = newContextEntry.Uint128.Uint64Hi;
+    contextEntry->Uint128.Uint64Lo = newContextEntry.Uint128.Uint64Lo;
+    MarkPagingStructureDirty(&Translations->Writeback, contextEntry, sizeof(*contextEntry));
+    status = EFI_SUCCESS;
+
+    DEBUG((DEBUG_VERBOSE,
+           "Configured %02x:%02x.%x as pass-through\n",
+           (UINT32)((SourceId >> 8) & 0xff),
+           (UINT32)((SourceId >> 3) & 0x1f),
+           (UINT32)(SourceId & 0x7)));
+
+Exit:
+    CommitPagingStructureWriteback(&Translations->Writeback);
+    return status;
+}
+
+/**
+ * @brief Fills out the table at the level to translate the range to the same
+ *        physical addresses, readable and writable, and recursively, the tables
+ *        it references.
+ *
+ * @details Each region fully covered by the range is mapped with a single leaf
+ *          entry if the level is LargestPageLevel or below, and consecutive such
+ *          entries are filled out at once. Otherwise, a table of the next level
+ *          is allocated from the pool. The updated entries are recorded as dirty
+ *          once at the end.
+ */
+static
+EFI_STATUS
+MapIdentityRangeInTable (
+    IN OUT DMAR_PAGE_TABLE_POOL* Pool,
+    IN OUT DMAR_CACHE_WRITEBACK* Writeback,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Table,
+    IN UINT64 Level,
+    IN UINT64 Base,
+    IN UINT64 End,
+    IN UINT64 LargestPageLevel
+    )
+{
+    EFI_STATUS status;
+    UINT64 regionSize;
+    UINT64 regionBase;
+    UINT64 firstIndex;
+    UINT64 lastIndex;
+    UINT64 index;
+
+    status = EFI_SUCCESS;
+    regionSize = GetRegionSizeOfLevel(Level);
+    regionBase = Base & ~(regionSize - 1);
+    firstIndex = RShiftU64(Base, (UINTN)(12 + 9 * (Level - 1))) % SL_ENTRY_COUNT;
+    lastIndex = RShiftU64(End - 1, (UINTN)(12 + 9 * (Level - 1))) % SL_ENTRY_COUNT;
+
+    for (index = firstIndex; index <= lastIndex; ++index, regionBase += regionSize)
+    {
+        VTD_SECOND_LEVEL_PAGING_ENTRY* entry;
+        VTD_SECOND_LEVEL_PAGING_ENTRY* table;
+        UINT64 rangeBase;
+        UINT64 rangeEnd;
+
+        entry = &Table[index];
+        rangeBase = MAX(Base, regionBase);
+        rangeEnd = MIN(End, regionBase + regionSize);
+
+        if ((Level <= LargestPageLevel) &&
+            (rangeBase == regionBase) &&
+            (rangeEnd == (regionBase + regionSize)))
+        {
+            UINT64 leafCount;
+
+            leafCount = MIN(lastIndex - index + 1,
+                            RShiftU64(End - regionBase, (UINTN)(12 + 9 * (Level - 1))));
+            FillPagingEntries(entry, leafCount, MakeLeafEntry(regionBase, TRUE, TRUE, Level), regionSize);
+            index += leafCount - 1;
+            regionBase += (leafCount - 1) * regionSize;
+            continue;
+        }
+
+        ASSERT(Level > SL_LEVEL_PT);
+        table = GetOrAllocateTable(Pool, Writeback, entry);
+        if (table == NULL)
+        {
+            status = EFI_OUT_OF_RESOURCES;
+            goto Exit;
+        }
+
+        status = MapIdentityRangeInTable(Pool,
+                                         Writeback,
+                                         table,
+                                         Level - 1,
+                                         rangeBase,
+                                         rangeEnd,
+                                         LargestPageLevel);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+
+Exit:
+    //
+    // Record the entries updated so far to be written back to RAM, even on error.
+    //
+    MarkPagingStructureDirty(Writeback,
+                             &Table[firstIndex],
+                             (MIN(index, lastIndex) - firstIndex + 1) * sizeof(*Table));
+    return status;
+}
+
+/**
+ * @brief Returns the number of pages BuildPassthroughTranslations allocates from
+ *        the pool for the ranges.
+ *
+ * @details The root table, context table and PML4 are always needed. Below
+ *          them, a table is needed for each region of the parent entry that the
+ *          ranges touch, unless the region is fully covered by a range and can
+ *          be mapped with a large page.
+ *
+ * @param Ranges - The sorted, non-overlapping and non-adjacent ranges to map.
+ *                 Each range must be aligned to 4KB.
+ * @param RangeCount - The number of entries in Ranges.
+ * @param Use1GbPages - TRUE to map with 1GB large pages where possible.
+ */
+UINT64
+GetPassthroughTranslationsPageCount (
+    IN CONST DMAR_ADDRESS_RANGE* Ranges,
+    IN UINT64 RangeCount,
+    IN BOOLEAN Use1GbPages
+    )
+{
+    UINT64 pageCount;
+    UINT64 largestPageLevel;
+
+    pageCount = 3;
+    largestPageLevel = (Use1GbPages != FALSE) ? SL_LEVEL_PDPT : SL_LEVEL_PD;
+
+    for (UINT64 level = SL_LEVEL_PDPT; level >= SL_LEVEL_PT; --level)
+    {
+        UINT64 parentRegionSize;
+        UINT64 nextIndex;
+
+        //
+        // Ranges are sorted. Track the lowest index of the parent regions not
+        // counted yet so that regions shared by multiple ranges are counted once.
+        //
+        parentRegionSize = GetRegionSizeOfLevel(level + 1);
+        nextIndex = 0;
+        for (UINT64 i = 0; i < RangeCount; ++i)
+        {
+            UINT64 firstIndex;
+            UINT64 lastIndex;
+
+            firstIndex = RShiftU64(Ranges[i].Base, (UINTN)(12 + 9 * level));
+            lastIndex = RShiftU64(Ranges[i].End - 1, (UINTN)(12 + 9 * level));
+
+            if ((level + 1) > largestPageLevel)
+            {
+                //
+                // The parent entry cannot be a large page. All regions need a table.
+                //
+                firstIndex = MAX(firstIndex, nextIndex);
+                if (firstIndex <= lastIndex)
+                {
+                    pageCount += lastIndex - firstIndex + 1;
+                    nextIndex = lastIndex + 1;
+                }
+                continue;
+            }
+
+            //
+            // Only the regions partially covered at the head and tail need a table.
+            //
+            if (((Ranges[i].Base % parentRegionSize) != 0) && (firstIndex >= nextIndex))
+            {
+                pageCount++;
+                nextIndex = firstIndex + 1;
+            }
+            if (((Ranges[i].End % parentRegionSize) != 0) && (lastIndex >= nextIndex))
+            {
+                pageCount++;
+                nextIndex = lastIndex + 1;
+            }
+        }
+    }
+    return pageCount;
+}
+
+/**
+ * @brief Fills out the root table and the context table shared by all devices
+ *        in the legacy formats, so that all devices are translated with the
+ *        second-level PML4 of UEFI_DOMAIN_ID.
+ */
+static
+VOID
+BuildLegacyModeTables (
+    IN OUT DMAR_TRANSLATIONS* Translations
+    )
+{
+    VTD_ROOT_ENTRY defaultRootValue;
+    VTD_CONTEXT_ENTRY defaultContextValue;
+
+    //
+    // Fill out the root table. All root entries point to the same context table.
+    //
+    defaultRootValue.Uint128.Uint64Hi = defaultRootValue.Uint128.Uint64Lo = 0;
+    defaultRootValue.Bits.ContextTablePointerLo = (UINT32)((UINT64)Translations->ContextTable >> 12);
+    defaultRootValue.Bits.ContextTablePointerHi = (UINT32)((UINT64)Translations->ContextTable >> 32);
+    defaultRootValue.Bits.Present = TRUE;
+    for (UINT64 bus = 0; bus < SIZE_4KB / sizeof(VTD_ROOT_ENTRY); bus++)
+    {
+        Translations->RootTable[bus] = defaultRootValue;
+    }
+
+    //
+    // Fill out the context table. All context entries point to the same
+    // second-level PML4.
+    //
+    // Trusted devices may later be switched to hardware pass-through with
+    // SetDevicePassthrough, instead of using the second-level page tables.
+    //
+    defaultContextValue.Uint128.Uint64Hi = defaultContextValue.Uint128.Uint64Lo = 0;
+    defaultContextValue.Bits.DomainIdentifier = UEFI_DOMAIN_ID;
+    defaultContextValue.Bits.AddressWidth = BIT1;  // 010b: 48-bit AGAW (4-level page table)
+    defaultContextValue.Bits.SecondLevelPageTranslationPointerLo = (UINT32)((UINT64)Translations->SlPml4 >> 12);
+    defaultContextValue.Bits.SecondLevelPageTranslationPointerHi = (UINT32)((UINT64)Translations->SlPml4 >> 32);
+    defaultContextValue.Bits.Present = TRUE;
+    for (UINT64 i = 0; i < SIZE_4KB / sizeof(VTD_CONTEXT_ENTRY); i++)
+    {
+        Translations->ContextTable[i] = defaultContextValue;
+    }
+}
+
+/**
+ * @brief Builds identity mapping of the ranges for all PCI devices. Addresses
+ *        outside the ranges are left non-present.
+ *
+ * @details As many PML4 entries as needed are filled out, and tables below them
+ *          are allocated only for the ranges to map. The largest page size
+ *          available is used.
+ *
+ * @param Translations - The translations object whose pool is initialized with
+ *                       at least GetPassthroughTranslationsPageCount pages, and
+ *                       DomainIdLimit is set.
+ * @param Ranges - The sorted, non-overlapping and non-adjacent ranges to map.
+ *                 Each range must be aligned to 4KB and below 256TB, the limit
+ *                 of the 4-level page table.
+ * @param RangeCount - The number of entries in Ranges.
+ * @param Use1GbPages - TRUE to map with 1GB large pages where possible. All
+ *                      hardware units must support them.
+ */
+EFI_STATUS
+BuildPassthroughTranslations (
+    IN OUT DMAR_TRANSLATIONS* Translations,
+    IN CONST DMAR_ADDRESS_RANGE* Ranges,
+    IN UINT64 RangeCount,
+    IN BOOLEAN Use1GbPages
+    )
+{
+    EFI_STATUS status;
+
+    ASSERT(Translations->DomainIdLimit > UEFI_DOMAIN_ID);
+    ASSERT(Translations->DomainIdLimit <= DMAR_MAX_DOMAIN_COUNT);
+
+    Translations->Use1GbPages = Use1GbPages;
+    Translations->RootTable = AllocatePageTablePage(&Translations->Pool);
+    Translations->ContextTable = AllocatePageTablePage(&Translations->Pool);
+    Translations->SlPml4 = AllocatePageTablePage(&Translations->Pool);
+    if ((Translations->RootTable == NULL) ||
+        (Translations->ContextTable == NULL) ||
+        (Translations->SlPml4 == NULL))
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // In scalable mode, the root table, context table, PASID directory and PASID
+    // table are filled out in their formats, all referencing the same PML4.
+    //
+    if (Translations->ScalableMode != FALSE)
+    {
+        status = BuildScalableModeTables(Translations);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+    else
+    {
+        BuildLegacyModeTables(Translations);
+    }
+
+    //
+    // Fill out the second level page tables. All entries indicates readable and
+    // writable, and translations are identity mapping. Second-level page tables
+    // are used only where ranges are not aligned to large pages. PDPTEs are
+    // configured for 1GB large pages if possible, and otherwise, PDEs are
+    // configured for 2MB large pages.
+    //
+    for (UINT64 i = 0; i < RangeCount; ++i)
+    {
+        ASSERT((Ranges[i].Base % SIZE_4KB) == 0);
+        ASSERT((Ranges[i].End % SIZE_4KB) == 0);
+        ASSERT(Ranges[i].Base < Ranges[i].End);
+        ASSERT(Ranges[i].End <= GetRegionSizeOfLevel(SL_LEVEL_PML4 + 1));
+
+        status = MapIdentityRangeInTable(&Translations->Pool,
+                                         &Translations->Writeback,
+                                         Translations->SlPml4,
+                                         SL_LEVEL_PML4,
+                                         Ranges[i].Base,
+                                         Ranges[i].End,
+                                         (Use1GbPages != FALSE) ? SL_LEVEL_PDPT : SL_LEVEL_PD);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+
+    //
+    // Write-back the root and context tables to RAM. This flushing cache line is
+    // not required if the C: Page-walk Coherency bit is set, and skipped then.
+    // Same as other flush in this project. All author's units did not set this
+    // bit.
+    //
+    MarkPagingStructureDirty(&Translations->Writeback, Translations->ContextTable, SIZE_4KB);
+    MarkPagingStructureDirty(&Translations->Writeback, Translations->RootTable, SIZE_4KB);
+
+    Translations->DomainSlPml4s[UEFI_DOMAIN_ID] = Translations->SlPml4;
+    Translations->DomainCount = 1;
+
+Exit:
+    CommitPagingStructureWriteback(&Translations->Writeback);
+    return status;
+}
+
+//
+// The state of relocating pointers of tables copied into another pool. Visited
+// has a bit set for each page whose entries are already relocated, so that
+// tables shared by multiple domains are relocated once.
+//
+typedef struct _RELOCATION_CONTEXT
+{
+    CONST DMAR_PAGE_TABLE_POOL* SourcePool;
+    DMAR_PAGE_TABLE_POOL* DestinationPool;
+    UINT8* Visited;
+} RELOCATION_CONTEXT;
+
+/**
+ * @brief Returns the address in the destination pool corresponding to the
+ *        page in the source pool.
+ */
+static
+UINT64
+RelocateAddress (
+    IN CONST RELOCATION_CONTEXT* Context,
+    IN UINT64 Address
+    )
+{
+    ASSERT(IsPageTablePoolPage(Context->SourcePool, (VOID*)Address));
+
+    return Address - (UINT64)Context->SourcePool->Base + (UINT64)Context->DestinationPool->Base;
+}
+
+/**
+ * @brief Marks the page in the destination pool as visited, and returns TRUE if
+ *        it already was.
+ */
+static
+BOOLEAN
+TestAndSetVisited (
+    IN OUT RELOCATION_CONTEXT* Context,
+    IN CONST VOID* Page
+    )
+{
+    UINT64 index;
+    BOOLEAN visited;
+
+    index = ((UINT64)Page - (UINT64)Context->DestinationPool->Base) / SIZE_4KB;
+    visited = ((Context->Visited[index / 8] & (1 << (index % 8))) != 0);
+    Context->Visited[index / 8] |= (UINT8)(1 << (index % 8));
+    return visited;
+}
+
+/**
+ * @brief Relocates the pointers to tables in the copied table at the level,
+ *        and recursively, the tables it references. Leaf entries translate to
+ *        host memory and are left as-is.
+ */
+static
+VOID
+RelocatePagingStructure (
+    IN OUT RELOCATION_CONTEXT* Context,
+    IN OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Table,
+    IN UINT64 Level
+    )
+{
+    if ((Level == SL_LEVEL_PT) || (TestAndSetVisited(Context, Table) != FALSE))
+    {
+        return;
+    }
+
+    for (UINT64 i = 0; i < SL_ENTRY_COUNT; ++i)
+    {
+        VTD_SECOND_LEVEL_PAGING_ENTRY* entry;
+        UINT64 address;
+
+        entry = &Table[i];
+        if (((entry->Bits.Read == FALSE) && (entry->Bits.Write == FALSE)) ||
+            (entry->Bits.PageSize != FALSE))
+        {
+            continue;
+        }
+
+        address = RelocateAddress(Context, GetEntryAddress(entry));
+        entry->Bits.AddressLo = (UINT32)(address >> 12);
+        entry->Bits.AddressHi = (UINT32)(address >> 32);
+        RelocatePagingStructure(Context, (VTD_SECOND_LEVEL_PAGING_ENTRY*)address, Level - 1);
+    }
+}
+
+/**
+ * @brief Relocates the pointers in the copied context table, and the paging
+ *        structures it references.
+ */
+static
+VOID
+RelocateContextTable (
+    IN OUT RELOCATION_CONTEXT* Context,
+    IN OUT VTD_CONTEXT_ENTRY* ContextTable
+    )
+{
+    if (TestAndSetVisited(Context, ContextTable) != FALSE)
+    {
+        return;
+    }
+
+    for (UINT64 i = 0; i < (SIZE_4KB / sizeof(VTD_CONTEXT_ENTRY)); ++i)
+    {
+        VTD_CONTEXT_ENTRY* entry;
+        UINT64 address;
+
+        entry = &ContextTable[i];
+        if ((entry->Bits.Present == FALSE) ||
+            (entry->Bits.TranslationType == V_CONTEXT_ENTRY_TT_PASSTHROUGH))
+        {
+            continue;
+        }
+
+        address = ((UINT64)entry->Bits.SecondLevelPageTranslationPointerLo << 12) |
+                  ((UINT64)entry->Bits.SecondLevelPageTranslationPointerHi << 32);
+        address = RelocateAddress(Context, address);
+        entry->Bits.SecondLevelPageTranslationPointerLo = (UINT32)(address >> 12);
+        entry->Bits.SecondLevelPageTranslationPointerHi = (UINT32)(address >> 32);
+        RelocatePagingStructure(Context, (VTD_SECOND_LEVEL_PAGING_ENTRY*)address, SL_LEVEL_PML4);
+    }
+}
+
+/**
+ * @brief Relocates the pointers in the copied root table, and the tables they
+ *        reference.
+ */
+static
+VOID
+RelocateRootTable (
+    IN OUT RELOCATION_CONTEXT* Context,
+    IN OUT VTD_ROOT_ENTRY* RootTable
+    )
+{
+    for (UINT64 bus = 0; bus < (SIZE_4KB / sizeof(VTD_ROOT_ENTRY)); ++bus)
+    {
+        UINT64 address;
+
+        if (RootTable[bus].Bits.Present == FALSE)
+        {
+            continue;
+        }
+        address = ((UINT64)RootTable[bus].Bits.ContextTablePointerLo << 12) |
+                  ((UINT64)RootTable[bus].Bits.ContextTablePointerHi << 32);
+        address = RelocateAddress(Context, address);
+        RootTable[bus].Bits.ContextTablePointerLo = (UINT32)(address >> 12);
+        RootTable[bus].Bits.ContextTablePointerHi = (UINT32)(address >> 32);
+        RelocateContextTable(Context, (VTD_CONTEXT_ENTRY*)address);
+    }
+}
+
+/**
+ * @brief Relocates the pointer in the copied PASID table, and the paging
+ *        structures it references.
+ */
+static
+VOID
+RelocatePasidTable (
+    IN OUT RELOCATION_CONTEXT* Context,
+    IN OUT VTD_SM_PASID_ENTRY* PasidTable
+    )
+{
+    if (TestAndSetVisited(Context, PasidTable) != FALSE)
+    {
+        return;
+    }
+
+    for (UINT64 i = 0; i < VTD_SM_PASID_ENTRY_NUMBER; ++i)
+    {
+        VTD_SM_PASID_ENTRY* entry;
+        UINT64 address;
+
+        entry = &PasidTable[i];
+        if ((entry->Bits.Present == FALSE) ||
+            (entry->Bits.PASIDGranularTranslationType == V_PASID_ENTRY_PGTT_PASSTHROUGH))
+        {
+            continue;
+        }
+
+        address = ((UINT64)entry->Bits.SecondLevelPageTranslationPointerLo << 12) |
+                  ((UINT64)entry->Bits.SecondLevelPageTranslationPointerHi << 32);
+        address = RelocateAddress(Context, address);
+        entry->Bits.SecondLevelPageTranslationPointerLo = (UINT32)(address >> 12);
+        entry->Bits.SecondLevelPageTranslationPointerHi = (UINT32)(address >> 32);
+        RelocatePagingStructure(Context, (VTD_SECOND_LEVEL_PAGING_ENTRY*)address, SL_LEVEL_PML4);
+    }
+}
+
+/**
+ * @brief Relocates the pointers in the copied scalable-mode context table, and
+ *        the PASID directories, PASID tables and paging structures they
+ *        reference.
+ */
+static
+VOID
+RelocateScalableModeContextTable (
+    IN OUT RELOCATION_CONTEXT* Context,
+    IN OUT VTD_SM_CONTEXT_ENTRY* ContextTable
+    )
+{
+    if (TestAndSetVisited(Context, ContextTable) != FALSE)
+    {
+        return;
+    }
+
+    for (UINT64 i = 0; i < VTD_SM_CONTEXT_ENTRY_NUMBER; ++i)
+    {
+        VTD_SM_CONTEXT_ENTRY* entry;
+        VTD_PASID_DIRECTORY_ENTRY* directory;
+        UINT64 address;
+
+        entry = &ContextTable[i];
+        if (entry->Bits.Present == FALSE)
+        {
+            continue;
+        }
+
+        address = ((UINT64)entry->Bits.PASIDDirectoryPointerLo << 12) |
+                  ((UINT64)entry->Bits.PASIDDirectoryPointerHi << 32);
+        address = RelocateAddress(Context, address);
+        entry->Bits.PASIDDirectoryPointerLo = (UINT32)(address >> 12);
+        entry->Bits.PASIDDirectoryPointerHi = (UINT32)(address >> 32);
+
+        directory = (VTD_PASID_DIRECTORY_ENTRY*)address;
+        if (TestAndSetVisited(Context, directory) != FALSE)
+        {
+            continue;
+        }
+        for (UINT64 j = 0; j < VTD_PASID_DIRECTORY_ENTRY_NUMBER; ++j)
+        {
+            if (directory[j].Bits.Present == FALSE)
+            {
+                continue;
+            }
+            address = ((UINT64)directory[j].Bits.PASIDTablePointerLo << 12) |
+                      ((UINT64)directory[j].Bits.PASIDTablePointerHi << 32);
+            address = RelocateAddress(Context, address);
+            directory[j].Bits.PASIDTablePointerLo = (UINT32)(address >> 12);
+            directory[j].Bits.PASIDTablePointerHi = (UINT32)(address >> 32);
+            RelocatePasidTable(Context, (VTD_SM_PASID_ENTRY*)address);
+        }
+    }
+}
+
+/**
+ * @brief Relocates the pointers in the copied scalable-mode root table, and
+ *        the tables both halves of each entry reference.
+ */
+static
+VOID
+RelocateScalableModeRootTable (
+    IN OUT RELOCATION_CONTEXT* Context,
+    IN OUT VTD_EXT_ROOT_ENTRY* RootTable
+    )
+{
+    for (UINT64 bus = 0; bus < (SIZE_4KB / sizeof(VTD_EXT_ROOT_ENTRY)); ++bus)
+    {
+        UINT64 address;
+
+        if (RootTable[bus].Bits.LowerPresent != FALSE)
+        {
+            address = ((UINT64)RootTable[bus].Bits.LowerContextTablePointerLo << 12) |
+                      ((UINT64)RootTable[bus].Bits.LowerContextTablePointerHi << 32);
+            address = RelocateAddress(Context, address);
+            RootTable[bus].Bits.LowerContextTablePointerLo = (UINT32)(address >> 12);
+            RootTable[bus].Bits.LowerContextTablePointerHi = (UINT32)(address >> 32);
+            RelocateScalableModeContextTable(Context, (VTD_SM_CONTEXT_ENTRY*)address);
+        }
+        if (RootTable[bus].Bits.UpperPresent != FALSE)
+        {
+            address = ((UINT64)RootTable[bus].Bits.UpperContextTablePointerLo << 12) |
+                      ((UINT64)RootTable[bus].Bits.UpperContextTablePointerHi << 32);
+            address = RelocateAddress(Context, address);
+            RootTable[bus].Bits.UpperContextTablePointerLo = (UINT32)(address >> 12);
+            RootTable[bus].Bits.UpperContextTablePointerHi = (UINT32)(address >> 32);
+            RelocateScalableModeContextTable(Context, (VTD_SM_CONTEXT_ENTRY*)address);
+        }
+    }
+}
+
+/**
+ * @brief Makes a replica of the translations in another pool, such as one in
+ *        the memory local to some of the hardware units.
+ *
+ * @details All pages of the source pool are copied to the same indexes in the
+ *          destination pool, and then pointers between tables are relocated by
+ *          walking them from the root table. The replica translates exactly as
+ *          the source does, with the same domain IDs, and as long as the same
+ *          changes are applied to both, they stay identical.
+ *
+ * @param Source - The translations to copy, built with
+ *                 BuildPassthroughTranslations.
+ * @param Destination - The translations whose pool is initialized with the
+ *                      same number of pages as the source one, but not used,
+ *                      and Writeback is initialized.
+ */
+EFI_STATUS
+CopyTranslations (
+    IN CONST DMAR_TRANSLATIONS* Source,
+    IN OUT DMAR_TRANSLATIONS* Destination
+    )
+{
+    EFI_STATUS status;
+    RELOCATION_CONTEXT context;
+    VTD_ROOT_ENTRY* rootTable;
+
+    ASSERT(Destination->Pool.PageCount == Source->Pool.PageCount);
+
+    context.SourcePool = &Source->Pool;
+    context.DestinationPool = &Destination->Pool;
+    context.Visited = AllocateZeroPool((UINTN)(Source->Pool.PageCount + 7) / 8);
+    if (context.Visited == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    CopyPageTablePool(&Destination->Pool, &Source->Pool);
+
+    rootTable = (VTD_ROOT_ENTRY*)RelocateAddress(&context, (UINT64)Source->RootTable);
+    if (Source->ScalableMode != FALSE)
+    {
+        RelocateScalableModeRootTable(&context, (VTD_EXT_ROOT_ENTRY*)rootTable);
+    }
+    else
+    {
+        RelocateRootTable(&context, rootTable);
+    }
+
+    //
+    // Domains without any device yet are not reachable from the root table.
+    //
+    for (UINT64 domainId = 0; domainId < DMAR_MAX_DOMAIN_COUNT; ++domainId)
+    {
+        Destination->DomainSlPml4s[domainId] = NULL;
+        if (Source->DomainSlPml4s[domainId] == NULL)
+        {
+            continue;
+        }
+        Destination->DomainSlPml4s[domainId] = (VTD_SECOND_LEVEL_PAGING_ENTRY*)RelocateAddress(
+                                                    &context,
+                                                    (UINT64)Source->DomainSlPml4s[domainId]);
+        RelocatePagingStructure(&context, Destination->DomainSlPml4s[domainId], SL_LEVEL_PML4);
+    }
+
+    Destination->RootTable = rootTable;
+    Destination->ContextTable = (VTD_CONTEXT_ENTRY*)RelocateAddress(&context,
+                                                                    (UINT64)Source->ContextTable);
+    Destination->SlPml4 = (VTD_SECOND_LEVEL_PAGING_ENTRY*)RelocateAddress(&context,
+                                                                          (UINT64)Source->SlPml4);
+    Destination->DomainIdLimit = Source->DomainIdLimit;
+    Destination->DomainCount = Source->DomainCount;
+    Destination->PassthroughDomainId = Source->PassthroughDomainId;
+    Destination->ScalableMode = Source->ScalableMode;
+    Destination->PasidLimit = Source->PasidLimit;
+    Destination->Use1GbPages = Source->Use1GbPages;
+    if (Source->ScalableMode != FALSE)
+    {
+        Destination->PasidDirectory = (VTD_PASID_DIRECTORY_ENTRY*)RelocateAddress(
+                                            &context,
+                                            (UINT64)Source->PasidDirectory);
+        Destination->PasidTable = (VTD_SM_PASID_ENTRY*)RelocateAddress(&context,
+                                                                       (UINT64)Source->PasidTable);
+    }
+
+    //
+    // Hardware has never seen the copy, so write back all of it at once.
+    //
+    WriteBackPagingStructure(&Destination->Writeback,
+                             Destination->Pool.Base,
+                             Destination->Pool.UnusedPageIndex * SIZE_4KB);
+    status = EFI_SUCCESS;
+
+Exit:
+    if (context.Visited != NULL)
+    {
+        FreePool(context.Visited);
+    }
+    return status;
+}
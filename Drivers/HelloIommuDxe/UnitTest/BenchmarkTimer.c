@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <time.h>
+#include "BenchmarkTimer.h"
+
+/**
+ * @brief Returns the current time in nanoseconds from the wall clock of the
+ *        host.
+ *
+ * @details The time stamp counter is not used, as its frequency is not
+ *          calibrated in host builds.
+ */
+UINT64
+GetBenchmarkNanoseconds (
+    VOID
+    )
+{
+    struct timespec now;
+
+    timespec_get(&now, TIME_UTC);
+    return (UINT64)now.tv_sec * 1000000000ull + (UINT64)now.tv_nsec;
+}
+
+/**
+ * @brief Prints the average time of an iteration of the benchmark.
+ */
+VOID
+ReportBenchmark (
+    IN CONST CHAR8* Name,
+    IN UINT64 Iterations,
+    IN UINT64 Nanoseconds
+    )
+{
+    printf("%-48s %10llu iterations %12.1f ns/iteration\n",
+           Name,
+           (unsigned long long)Iterations,
+           (double)Nanoseconds / (double)Iterations);
+}
@@ -0,0 +1,18 @@
+#ifndef __BENCHMARK_TIMER_H__
+#define __BENCHMARK_TIMER_H__
+
+#include <Base.h>
+
+UINT64
+GetBenchmarkNanoseconds (
+    VOID
+    );
+
+VOID
+ReportBenchmark (
+    IN CONST CHAR8* Name,
+    IN UINT64 Iterations,
+    IN UINT64 Nanoseconds
+    );
+
+#endif
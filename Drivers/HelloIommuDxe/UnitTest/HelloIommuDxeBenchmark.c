@@ -0,0 +1,846 @@
+#include <stdio.h>
+#include "TestEnvironment.h"
+#include "BenchmarkTimer.h"
+
+//
+// The memory map of the build benchmarks. 512GB fills a whole PML4 entry.
+//
+static CONST DMAR_ADDRESS_RANGE mBenchmarkRanges[] =
+{
+    { 0, SIZE_512GB },
+};
+
+//
+// The number of splits made on an environment before it runs out of the extra
+// pages in the pool and is created again.
+//
+#define SPLITS_PER_ENVIRONMENT  (TEST_EXTRA_PAGE_COUNT - 16)
+
+//
+// The source-id of the device mappings are made for, 01:00.0.
+//
+#define BENCHMARK_SOURCE_ID     0x0100
+
+//
+// The number of ranges each client of the IOVA stress benchmark keeps
+// allocated, and the most clients the benchmark runs with.
+//
+#define IOVA_RANGES_PER_CLIENT  64
+#define IOVA_MAX_CLIENT_COUNT   64
+
+//
+// The shape of the synthetic DMAR tables. Each unit lists its devices as
+// endpoints starting at bus 1, followed by an INCLUDE_PCI_ALL unit, and each
+// RMRR lists SYNTHETIC_RMRR_SCOPE_COUNT devices spread over all units.
+//
+#define SYNTHETIC_UNIT_COUNT        8
+#define SYNTHETIC_RMRR_COUNT        16
+#define SYNTHETIC_RMRR_SCOPE_COUNT  1024
+
+/**
+ * @brief Measures BuildPassthroughTranslations for the whole map, excluding
+ *        initialization of the pool.
+ */
+static
+VOID
+BenchmarkBuildPassthroughTranslations (
+    IN BOOLEAN Use1GbPages,
+    IN UINT64 Iterations
+    )
+{
+    EFI_STATUS status;
+    SIMULATED_DMAR_UNIT unit;
+    DMAR_UNIT_INFORMATION dmarUnit;
+    DMAR_TRANSLATIONS* translations;
+    UINT64 pageCount;
+    UINT64 elapsed;
+
+    InitializeSimulatedDmarUnit(&unit, TRUE, 0);
+    InitializeDmarUnitInformation(&dmarUnit, &unit);
+    translations = AllocatePool(sizeof(*translations));
+    ASSERT(translations != NULL);
+
+    pageCount = GetPassthroughTranslationsPageCount(mBenchmarkRanges,
+                                                    ARRAY_SIZE(mBenchmarkRanges),
+                                                    Use1GbPages);
+    elapsed = 0;
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        UINT64 start;
+
+        ZeroMem(translations, sizeof(*translations));
+        translations->ProximityDomain = MAX_UINT32;
+        translations->DomainIdLimit = DMAR_MAX_DOMAIN_COUNT;
+        status = InitializePageTablePool(&translations->Pool, pageCount);
+        ASSERT_EFI_ERROR(status);
+        InitializeCacheWriteback(&translations->Writeback, &dmarUnit, 1);
+
+        start = GetBenchmarkNanoseconds();
+        status = BuildPassthroughTranslations(translations,
+                                              mBenchmarkRanges,
+                                              ARRAY_SIZE(mBenchmarkRanges),
+                                              Use1GbPages);
+        elapsed += GetBenchmarkNanoseconds() - start;
+        ASSERT_EFI_ERROR(status);
+
+        FreePageTablePool(&translations->Pool);
+    }
+    ReportBenchmark((Use1GbPages != FALSE) ?
+                        "BuildPassthroughTranslations 512GB, 1GB pages" :
+                        "BuildPassthroughTranslations 512GB, 2MB pages",
+                    Iterations,
+                    elapsed);
+    FreePool(translations);
+}
+
+/**
+ * @brief Measures making a 4KB page read-only in a 2MB page not split yet, that
+ *        is, SplitLargePage and the update of the entry in the new table.
+ */
+static
+VOID
+BenchmarkSplitLargePage (
+    IN UINT64 Iterations
+    )
+{
+    EFI_STATUS status;
+    TEST_CONFIGURATION configuration;
+    TEST_ENVIRONMENT* environment;
+    DMAR_DIRTY_RANGES dirtyRanges;
+    UINT64 elapsed;
+
+    ZeroMem(&configuration, sizeof(configuration));
+    configuration.UnitCount = 1;
+    configuration.QueuedInvalidation = TRUE;
+    configuration.Ranges = mBenchmarkRanges;
+    configuration.RangeCount = ARRAY_SIZE(mBenchmarkRanges);
+
+    environment = NULL;
+    elapsed = 0;
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        UINT64 index;
+        UINT64 start;
+
+        index = i % SPLITS_PER_ENVIRONMENT;
+        if (index == 0)
+        {
+            if (environment != NULL)
+            {
+                DestroyTestEnvironment(environment);
+            }
+            status = CreateTestEnvironment(&configuration, &environment);
+            ASSERT_EFI_ERROR(status);
+        }
+
+        ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+        start = GetBenchmarkNanoseconds();
+        status = ChangePermissionOfRangeForAllDevices(&environment->Translations,
+                                                      index * SIZE_2MB,
+                                                      SIZE_4KB,
+                                                      DMAR_ACCESS_READ,
+                                                      &dirtyRanges);
+        elapsed += GetBenchmarkNanoseconds() - start;
+        ASSERT_EFI_ERROR(status);
+    }
+    ReportBenchmark("Split a 2MB page for a 4KB permission change", Iterations, elapsed);
+    DestroyTestEnvironment(environment);
+}
+
+/**
+ * @brief Fills the entries by setting bit fields of each, as SplitLargePage and
+ *        MapIdentityRangeInTable did before FillPagingEntries. The baseline of
+ *        BenchmarkFillPagingEntries.
+ */
+static
+VOID
+FillPagingEntriesPerField (
+    OUT VTD_SECOND_LEVEL_PAGING_ENTRY* Entries,
+    IN UINT64 Count,
+    IN UINT64 Address,
+    IN BOOLEAN Readable,
+    IN BOOLEAN Writable,
+    IN UINT64 Level
+    )
+{
+    UINT64 regionSize;
+
+    regionSize = GetRegionSizeOfLevel(Level);
+    for (UINT64 i = 0; i < Count; ++i)
+    {
+        Entries[i].Uint64 = Address;
+        Entries[i].Bits.Read = Readable;
+        Entries[i].Bits.Write = Writable;
+        Entries[i].Bits.PageSize = (Level != SL_LEVEL_PT);
+        Address += regionSize;
+    }
+}
+
+/**
+ * @brief Measures filling a table of 512 readable and writable leaf entries at
+ *        the level, by setting bit fields of each entry and with
+ *        FillPagingEntries.
+ *
+ * @details Splitting a 2MB page fills PTEs. Splitting a 1GB page and building
+ *          translations with 2MB pages fill PDEs, and building them with 1GB
+ *          pages fills PDPTEs.
+ *
+ * @param Name - The entries and the paths filling them.
+ */
+static
+VOID
+BenchmarkFillPagingEntries (
+    IN CONST CHAR8* Name,
+    IN UINT64 Level,
+    IN UINT64 Iterations
+    )
+{
+    VTD_SECOND_LEVEL_PAGING_ENTRY* table;
+    VTD_SECOND_LEVEL_PAGING_ENTRY* expectedTable;
+    UINT64 regionSize;
+    UINT64 start;
+    UINT64 elapsed;
+    CHAR8 name[80];
+
+    table = AllocatePages(1);
+    expectedTable = AllocatePages(1);
+    ASSERT((table != NULL) && (expectedTable != NULL));
+    regionSize = GetRegionSizeOfLevel(Level);
+
+    start = GetBenchmarkNanoseconds();
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        FillPagingEntriesPerField(expectedTable,
+                                  SL_ENTRY_COUNT,
+                                  i * regionSize * SL_ENTRY_COUNT,
+                                  TRUE,
+                                  TRUE,
+                                  Level);
+    }
+    elapsed = GetBenchmarkNanoseconds() - start;
+    snprintf(name, sizeof(name), "%s, per field", Name);
+    ReportBenchmark(name, Iterations, elapsed);
+
+    start = GetBenchmarkNanoseconds();
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        FillPagingEntries(table,
+                          SL_ENTRY_COUNT,
+                          MakeLeafEntry(i * regionSize * SL_ENTRY_COUNT, TRUE, TRUE, Level),
+                          regionSize);
+    }
+    elapsed = GetBenchmarkNanoseconds() - start;
+    snprintf(name, sizeof(name), "%s, FillPagingEntries", Name);
+    ReportBenchmark(name, Iterations, elapsed);
+
+    //
+    // Both filled the table for the last iteration.
+    //
+    ASSERT(CompareMem(table, expectedTable, SIZE_4KB) == 0);
+
+    FreePages(expectedTable, 1);
+    FreePages(table, 1);
+}
+
+/**
+ * @brief Measures EnableDmaRemappingForAllUnits on four units, and reports the
+ *        MMIO accesses it made per unit.
+ *
+ * @param CompletionLatency - The number of reads of status registers before
+ *                            commands complete on the simulated units.
+ */
+static
+VOID
+BenchmarkEnableDmaRemapping (
+    IN BOOLEAN QueuedInvalidation,
+    IN UINT64 CompletionLatency,
+    IN UINT64 Iterations
+    )
+{
+    EFI_STATUS status;
+    TEST_CONFIGURATION configuration;
+    TEST_ENVIRONMENT* environment;
+    UINT64 elapsed;
+    UINT64 mmioReads;
+    UINT64 mmioWrites;
+    CHAR8 name[64];
+
+    ZeroMem(&configuration, sizeof(configuration));
+    configuration.UnitCount = 4;
+    configuration.QueuedInvalidation = QueuedInvalidation;
+    configuration.CompletionLatency = CompletionLatency;
+    configuration.Ranges = mBenchmarkRanges;
+    configuration.RangeCount = 1;
+    configuration.Use1GbPages = TRUE;
+
+    elapsed = 0;
+    mmioReads = 0;
+    mmioWrites = 0;
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        UINT64 start;
+
+        status = CreateTestEnvironment(&configuration, &environment);
+        ASSERT_EFI_ERROR(status);
+
+        start = GetBenchmarkNanoseconds();
+        status = EnableDmaRemappingForAllUnits(environment->DmarUnits, environment->DmarUnitCount);
+        elapsed += GetBenchmarkNanoseconds() - start;
+        ASSERT_EFI_ERROR(status);
+        ASSERT(GetTestViolationCount(environment) == 0);
+
+        mmioReads = environment->SimulatedUnits[0].MmioReads;
+        mmioWrites = environment->SimulatedUnits[0].MmioWrites;
+        DestroyTestEnvironment(environment);
+    }
+    snprintf(name,
+             sizeof(name),
+             "Enable 4 units, %s, latency %llu",
+             (QueuedInvalidation != FALSE) ? "QI" : "registers",
+             (unsigned long long)CompletionLatency);
+    ReportBenchmark(name, Iterations, elapsed);
+    printf("    %llu MMIO reads and %llu MMIO writes per unit\n",
+           (unsigned long long)mmioReads,
+           (unsigned long long)mmioWrites);
+}
+
+/**
+ * @brief Measures a batch of page-selective IOTLB invalidations on a unit with
+ *        DMA-remapping enabled, and reports the MMIO accesses per batch.
+ *
+ * @details With queued invalidation, the batch is queued and submitted with a
+ *          single write to the tail register, and completion is observed in
+ *          memory. With register-based invalidation, each invalidation is
+ *          written to the registers and polled for completion in turn.
+ */
+static
+VOID
+BenchmarkInvalidationBatch (
+    IN BOOLEAN QueuedInvalidation,
+    IN UINT64 CompletionLatency,
+    IN UINT64 BatchSize,
+    IN UINT64 Iterations
+    )
+{
+    EFI_STATUS status;
+    TEST_CONFIGURATION configuration;
+    TEST_ENVIRONMENT* environment;
+    DMAR_UNIT_INFORMATION* dmarUnit;
+    UINT64 elapsed;
+    CHAR8 name[64];
+
+    ZeroMem(&configuration, sizeof(configuration));
+    configuration.UnitCount = 1;
+    configuration.QueuedInvalidation = QueuedInvalidation;
+    configuration.CompletionLatency = CompletionLatency;
+    configuration.Ranges = mBenchmarkRanges;
+    configuration.RangeCount = 1;
+    configuration.Use1GbPages = TRUE;
+
+    status = CreateTestEnvironment(&configuration, &environment);
+    ASSERT_EFI_ERROR(status);
+    status = EnableDmaRemappingForAllUnits(environment->DmarUnits, environment->DmarUnitCount);
+    ASSERT_EFI_ERROR(status);
+    ResetTestStatistics(environment);
+
+    dmarUnit = &environment->DmarUnits[0];
+    elapsed = 0;
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        UINT64 start;
+
+        start = GetBenchmarkNanoseconds();
+        for (UINT64 j = 0; j < BatchSize; ++j)
+        {
+            InvalidateIotlb(dmarUnit, DMAR_GRANULARITY_PAGE, UEFI_DOMAIN_ID, j * SIZE_4KB, 0);
+        }
+        status = CommitInvalidations(dmarUnit);
+        elapsed += GetBenchmarkNanoseconds() - start;
+        ASSERT_EFI_ERROR(status);
+    }
+    ASSERT(GetTestViolationCount(environment) == 0);
+
+    snprintf(name,
+             sizeof(name),
+             "Invalidate %llu pages, %s, latency %llu",
+             (unsigned long long)BatchSize,
+             (QueuedInvalidation != FALSE) ? "QI" : "registers",
+             (unsigned long long)CompletionLatency);
+    ReportBenchmark(name, Iterations, elapsed);
+    printf("    %.1f MMIO reads and %.1f MMIO writes per batch\n",
+           (double)environment->SimulatedUnits[0].MmioReads / (double)Iterations,
+           (double)environment->SimulatedUnits[0].MmioWrites / (double)Iterations);
+    DestroyTestEnvironment(environment);
+}
+
+/**
+ * @brief Measures a Map and Unmap pair as PCI I/O drives the IOMMU protocol
+ *        with PcdIovaMapping set, and reports the MMIO accesses per pair.
+ *
+ * @details Each pair allocates device addresses, grants access to them with
+ *          MapRangeForDomain, revokes the access and invalidates it as
+ *          SetAttribute does, and frees the addresses. The device is given its
+ *          own domain beforehand. The protocol functions themselves are not
+ *          linked, as they depend on UefiLib and the PCI I/O protocol.
+ */
+static
+VOID
+BenchmarkMapUnmap (
+    IN BOOLEAN QueuedInvalidation,
+    IN UINT64 Pages,
+    IN UINT64 Iterations
+    )
+{
+    EFI_STATUS status;
+    TEST_CONFIGURATION configuration;
+    TEST_ENVIRONMENT* environment;
+    DMAR_IOVA_ALLOCATOR allocator;
+    DMAR_DIRTY_RANGES dirtyRanges;
+    UINT16 domainId;
+    UINT16 previousDomainId;
+    BOOLEAN rootEntryUpdated;
+    UINT64 elapsed;
+    CHAR8 name[64];
+
+    ZeroMem(&configuration, sizeof(configuration));
+    configuration.UnitCount = 1;
+    configuration.QueuedInvalidation = QueuedInvalidation;
+    configuration.CompletionLatency = 100;
+    configuration.Ranges = mBenchmarkRanges;
+    configuration.RangeCount = 1;
+    configuration.Use1GbPages = TRUE;
+
+    status = CreateTestEnvironment(&configuration, &environment);
+    ASSERT_EFI_ERROR(status);
+    status = EnableDmaRemappingForAllUnits(environment->DmarUnits, environment->DmarUnitCount);
+    ASSERT_EFI_ERROR(status);
+    status = InitializeIovaAllocator(&allocator, SIZE_4GB, SIZE_1GB);
+    ASSERT_EFI_ERROR(status);
+    status = AssignDeviceDomain(&environment->Translations,
+                                BENCHMARK_SOURCE_ID,
+                                FALSE,
+                                NULL,
+                                0,
+                                &domainId,
+                                &previousDomainId,
+                                &rootEntryUpdated);
+    ASSERT_EFI_ERROR(status);
+    status = InvalidateContextCacheForDevice(environment->DmarUnits,
+                                             environment->DmarUnitCount,
+                                             BENCHMARK_SOURCE_ID,
+                                             previousDomainId,
+                                             rootEntryUpdated,
+                                             TRUE);
+    ASSERT_EFI_ERROR(status);
+    ResetTestStatistics(environment);
+
+    elapsed = 0;
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        UINT64 start;
+        UINT64 iova;
+
+        start = GetBenchmarkNanoseconds();
+        status = AllocateIova(&allocator, Pages, &iova);
+        ASSERT_EFI_ERROR(status);
+
+        ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+        status = MapRangeForDomain(&environment->Translations,
+                                   domainId,
+                                   iova,
+                                   EFI_PAGES_TO_SIZE(Pages),
+                                   SIZE_2GB,
+                                   DMAR_ACCESS_READ | DMAR_ACCESS_WRITE,
+                                   &dirtyRanges);
+        ASSERT_EFI_ERROR(status);
+        status = InvalidateDirtyRanges(environment->DmarUnits,
+                                       environment->DmarUnitCount,
+                                       domainId,
+                                       &dirtyRanges);
+        ASSERT_EFI_ERROR(status);
+
+        status = MapRangeForDomain(&environment->Translations,
+                                   domainId,
+                                   iova,
+                                   EFI_PAGES_TO_SIZE(Pages),
+                                   SIZE_2GB,
+                                   0,
+                                   &dirtyRanges);
+        ASSERT_EFI_ERROR(status);
+        status = InvalidateDirtyRanges(environment->DmarUnits,
+                                       environment->DmarUnitCount,
+                                       domainId,
+                                       &dirtyRanges);
+        ASSERT_EFI_ERROR(status);
+
+        FreeIova(&allocator, iova, Pages);
+        elapsed += GetBenchmarkNanoseconds() - start;
+    }
+    ASSERT(GetTestViolationCount(environment) == 0);
+
+    snprintf(name,
+             sizeof(name),
+             "Map and unmap %llu pages, %s",
+             (unsigned long long)Pages,
+             (QueuedInvalidation != FALSE) ? "QI" : "registers");
+    ReportBenchmark(name, Iterations, elapsed);
+    printf("    %.0f pairs per second, %.1f MMIO reads and %.1f MMIO writes per pair\n",
+           (double)Iterations * 1000000000.0 / (double)elapsed,
+           (double)environment->SimulatedUnits[0].MmioReads / (double)Iterations,
+           (double)environment->SimulatedUnits[0].MmioWrites / (double)Iterations);
+
+    FreeIovaAllocator(&allocator);
+    DestroyTestEnvironment(environment);
+}
+
+/**
+ * @brief Returns the next value of the xorshift generator, so that runs are
+ *        repeatable.
+ */
+static
+UINT64
+GetNextRandom (
+    IN OUT UINT64* State
+    )
+{
+    *State ^= *State << 13;
+    *State ^= *State >> 7;
+    *State ^= *State << 17;
+    return *State;
+}
+
+/**
+ * @brief Returns the number of pages in the longest run free in the bitmap.
+ */
+static
+UINT64
+GetLargestFreeIovaRun (
+    IN CONST DMAR_IOVA_ALLOCATOR* Allocator
+    )
+{
+    UINT64 largest;
+    UINT64 current;
+
+    largest = 0;
+    current = 0;
+    for (UINT64 i = 0; i < Allocator->PageCount; ++i)
+    {
+        if ((Allocator->Bitmap[i / 64] & LShiftU64(1, (UINTN)(i % 64))) != 0)
+        {
+            current = 0;
+            continue;
+        }
+        current++;
+        largest = MAX(largest, current);
+    }
+    return largest;
+}
+
+/**
+ * @brief Measures AllocateIova and FreeIova with clients allocating and freeing
+ *        ranges interleaved, and reports fragmentation of the window left.
+ *
+ * @details Each client keeps IOVA_RANGES_PER_CLIENT ranges allocated, and in
+ *          turn frees its oldest range and allocates a new one. Three of four
+ *          ranges are of up to 8 pages, as for command buffers, and the rest
+ *          are of up to 256 pages, as for data buffers. Clients are interleaved
+ *          on one thread, as the protocol serializes calls at raised TPL.
+ *          Fragmentation is the share of free pages outside the longest free
+ *          run, with ranges cached in the magazines counted as allocated.
+ */
+static
+VOID
+BenchmarkIovaStress (
+    IN UINT64 ClientCount,
+    IN UINT64 Iterations
+    )
+{
+    EFI_STATUS status;
+    DMAR_IOVA_ALLOCATOR allocator;
+    UINT64 (*iovas)[IOVA_RANGES_PER_CLIENT];
+    UINT64 (*pages)[IOVA_RANGES_PER_CLIENT];
+    UINT64 random;
+    UINT64 largestFreeRun;
+    UINT64 start;
+    UINT64 elapsed;
+    CHAR8 name[64];
+
+    ASSERT(ClientCount <= IOVA_MAX_CLIENT_COUNT);
+
+    iovas = AllocateZeroPool(sizeof(*iovas) * ClientCount);
+    pages = AllocateZeroPool(sizeof(*pages) * ClientCount);
+    ASSERT((iovas != NULL) && (pages != NULL));
+    status = InitializeIovaAllocator(&allocator, SIZE_1GB, SIZE_1GB);
+    ASSERT_EFI_ERROR(status);
+
+    random = 0x9E3779B97F4A7C15ull;
+    start = GetBenchmarkNanoseconds();
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        UINT64 client;
+        UINT64 slot;
+
+        client = i % ClientCount;
+        slot = (i / ClientCount) % IOVA_RANGES_PER_CLIENT;
+        if (pages[client][slot] != 0)
+        {
+            FreeIova(&allocator, iovas[client][slot], pages[client][slot]);
+        }
+
+        pages[client][slot] = ((GetNextRandom(&random) % 4) != 0) ?
+                              (GetNextRandom(&random) % 8) + 1 :
+                              (GetNextRandom(&random) % 256) + 1;
+        status = AllocateIova(&allocator, pages[client][slot], &iovas[client][slot]);
+        ASSERT_EFI_ERROR(status);
+    }
+    elapsed = GetBenchmarkNanoseconds() - start;
+    largestFreeRun = GetLargestFreeIovaRun(&allocator);
+
+    snprintf(name, sizeof(name), "IOVA stress, %llu clients", (unsigned long long)ClientCount);
+    ReportBenchmark(name, Iterations, elapsed);
+    printf("    %.0f allocations per second, %.1f%% from magazines, %.1f%% fragmented (%llu of %llu pages free in one run)\n",
+           (double)Iterations * 1000000000.0 / (double)elapsed,
+           (double)allocator.MagazineHitCount * 100.0 / (double)allocator.AllocationCount,
+           (double)(allocator.FreePageCount - largestFreeRun) * 100.0 / (double)allocator.FreePageCount,
+           (unsigned long long)largestFreeRun,
+           (unsigned long long)allocator.FreePageCount);
+
+    FreeIovaAllocator(&allocator);
+    FreePool(pages);
+    FreePool(iovas);
+}
+
+/**
+ * @brief Returns the source-id of the device with the index in the synthetic
+ *        DMAR table.
+ */
+static
+UINT16
+GetSyntheticSourceId (
+    IN UINT64 DeviceIndex
+    )
+{
+    return (UINT16)(((1 + DeviceIndex / DMAR_DEVFN_COUNT) << 8) | (DeviceIndex % DMAR_DEVFN_COUNT));
+}
+
+/**
+ * @brief Appends the endpoint device scope of the device to the structure.
+ *
+ * @return The end of the scope appended.
+ */
+static
+VOID*
+AppendSyntheticDeviceScope (
+    IN OUT VOID* Scope,
+    IN UINT64 DeviceIndex
+    )
+{
+    EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER* scope;
+    EFI_ACPI_DMAR_PCI_PATH* path;
+    UINT16 sourceId;
+
+    sourceId = GetSyntheticSourceId(DeviceIndex);
+    scope = (EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER*)Scope;
+    scope->Type = EFI_ACPI_DEVICE_SCOPE_ENTRY_TYPE_PCI_ENDPOINT;
+    scope->Length = sizeof(*scope) + sizeof(*path);
+    scope->StartBusNumber = (UINT8)(sourceId >> 8);
+    path = (EFI_ACPI_DMAR_PCI_PATH*)(scope + 1);
+    path->Device = (UINT8)((sourceId >> 3) & 0x1f);
+    path->Function = (UINT8)(sourceId & 0x7);
+    return path + 1;
+}
+
+/**
+ * @brief Creates the DMAR table with SYNTHETIC_UNIT_COUNT units listing
+ *        ScopesPerUnit devices each, an INCLUDE_PCI_ALL unit, and
+ *        SYNTHETIC_RMRR_COUNT RMRRs.
+ *
+ * @details Device scopes have a path of one entry, so that they are resolved
+ *          without reading configuration space of bridges.
+ */
+static
+EFI_ACPI_DMAR_HEADER*
+CreateSyntheticDmarTable (
+    IN UINT64 ScopesPerUnit
+    )
+{
+    EFI_ACPI_DMAR_HEADER* dmarTable;
+    EFI_ACPI_DMAR_STRUCTURE_HEADER* dmarHeader;
+    UINT64 scopeLength;
+    UINT64 drhdLength;
+    UINT64 rmrrLength;
+    UINT64 deviceCount;
+
+    scopeLength = sizeof(EFI_ACPI_DMAR_DEVICE_SCOPE_STRUCTURE_HEADER) + sizeof(EFI_ACPI_DMAR_PCI_PATH);
+    drhdLength = sizeof(EFI_ACPI_DMAR_DRHD_HEADER) + scopeLength * ScopesPerUnit;
+    rmrrLength = sizeof(EFI_ACPI_DMAR_RMRR_HEADER) + scopeLength * SYNTHETIC_RMRR_SCOPE_COUNT;
+    deviceCount = SYNTHETIC_UNIT_COUNT * ScopesPerUnit;
+    ASSERT((drhdLength <= MAX_UINT16) && (rmrrLength <= MAX_UINT16));
+    ASSERT(deviceCount <= (MAX_UINT8 - 1) * DMAR_DEVFN_COUNT);
+
+    dmarTable = AllocateZeroPool(sizeof(*dmarTable) +
+                                 drhdLength * SYNTHETIC_UNIT_COUNT +
+                                 sizeof(EFI_ACPI_DMAR_DRHD_HEADER) +
+                                 rmrrLength * SYNTHETIC_RMRR_COUNT);
+    ASSERT(dmarTable != NULL);
+    dmarTable->Header.Signature = EFI_ACPI_4_0_DMA_REMAPPING_TABLE_SIGNATURE;
+    dmarTable->HostAddressWidth = 45;
+
+    dmarHeader = (EFI_ACPI_DMAR_STRUCTURE_HEADER*)(dmarTable + 1);
+    for (UINT64 i = 0; i <= SYNTHETIC_UNIT_COUNT; ++i)
+    {
+        EFI_ACPI_DMAR_DRHD_HEADER* drhd;
+        VOID* scope;
+
+        drhd = (EFI_ACPI_DMAR_DRHD_HEADER*)dmarHeader;
+        dmarHeader->Type = EFI_ACPI_DMAR_TYPE_DRHD;
+        dmarHeader->Length = sizeof(*drhd);
+        drhd->RegisterBaseAddress = 0xfed90000 + i * SIZE_4KB;
+        if (i == SYNTHETIC_UNIT_COUNT)
+        {
+            drhd->Flags = EFI_ACPI_DMAR_DRHD_FLAGS_INCLUDE_PCI_ALL;
+        }
+        else
+        {
+            scope = drhd + 1;
+            for (UINT64 j = 0; j < ScopesPerUnit; ++j)
+            {
+                scope = AppendSyntheticDeviceScope(scope, i * ScopesPerUnit + j);
+            }
+            dmarHeader->Length = (UINT16)drhdLength;
+        }
+        dmarHeader = Add2Ptr(dmarHeader, dmarHeader->Length);
+    }
+
+    for (UINT64 i = 0; i < SYNTHETIC_RMRR_COUNT; ++i)
+    {
+        EFI_ACPI_DMAR_RMRR_HEADER* rmrr;
+        VOID* scope;
+
+        rmrr = (EFI_ACPI_DMAR_RMRR_HEADER*)dmarHeader;
+        dmarHeader->Type = EFI_ACPI_DMAR_TYPE_RMRR;
+        dmarHeader->Length = (UINT16)rmrrLength;
+        rmrr->ReservedMemoryRegionBaseAddress = SIZE_2GB + i * SIZE_1MB;
+        rmrr->ReservedMemoryRegionLimitAddress = rmrr->ReservedMemoryRegionBaseAddress + SIZE_64KB - 1;
+        scope = rmrr + 1;
+        for (UINT64 j = 0; j < SYNTHETIC_RMRR_SCOPE_COUNT; ++j)
+        {
+            scope = AppendSyntheticDeviceScope(scope, (i * SYNTHETIC_RMRR_SCOPE_COUNT + j * 7) % deviceCount);
+        }
+        dmarHeader = Add2Ptr(dmarHeader, dmarHeader->Length);
+    }
+
+    dmarTable->Header.Length = (UINT32)((UINT64)dmarHeader - (UINT64)dmarTable);
+    return dmarTable;
+}
+
+/**
+ * @brief Measures BuildDmarTopology for the synthetic DMAR table, the lookup
+ *        of the owner of every device listed in it, and the page count of the
+ *        reserved memory regions of all devices.
+ */
+static
+VOID
+BenchmarkDmarTopology (
+    IN UINT64 ScopesPerUnit,
+    IN UINT64 Iterations
+    )
+{
+    EFI_STATUS status;
+    EFI_ACPI_DMAR_HEADER* dmarTable;
+    DMAR_TOPOLOGY topology;
+    UINT64 deviceCount;
+    UINT64 pageCount;
+    UINT64 start;
+    UINT64 elapsed;
+    CHAR8 name[64];
+
+    dmarTable = CreateSyntheticDmarTable(ScopesPerUnit);
+    deviceCount = SYNTHETIC_UNIT_COUNT * ScopesPerUnit;
+
+    start = GetBenchmarkNanoseconds();
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        status = BuildDmarTopology(dmarTable, SYNTHETIC_UNIT_COUNT + 1, &topology);
+        ASSERT_EFI_ERROR(status);
+        FreeDmarTopology(&topology);
+    }
+    elapsed = GetBenchmarkNanoseconds() - start;
+    snprintf(name, sizeof(name), "Build DMAR topology, %llu scopes", (unsigned long long)deviceCount);
+    ReportBenchmark(name, Iterations, elapsed);
+
+    status = BuildDmarTopology(dmarTable, SYNTHETIC_UNIT_COUNT + 1, &topology);
+    ASSERT_EFI_ERROR(status);
+
+    start = GetBenchmarkNanoseconds();
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        for (UINT64 j = 0; j < deviceCount; ++j)
+        {
+            UINT8 unitIndex;
+
+            unitIndex = GetDmarUnitIndexOfDevice(&topology, 0, GetSyntheticSourceId(j));
+            ASSERT(unitIndex == j / ScopesPerUnit);
+        }
+        ASSERT(GetDmarUnitIndexOfDevice(&topology, 0, 0x00f8) == SYNTHETIC_UNIT_COUNT);
+    }
+    elapsed = GetBenchmarkNanoseconds() - start;
+    snprintf(name, sizeof(name), "Look up owners, %llu scopes", (unsigned long long)deviceCount);
+    ReportBenchmark(name, Iterations * deviceCount, elapsed);
+
+    start = GetBenchmarkNanoseconds();
+    for (UINT64 i = 0; i < Iterations; ++i)
+    {
+        status = GetReservedMemoryTablePageCount(&topology, TRUE, &pageCount);
+        ASSERT_EFI_ERROR(status);
+    }
+    elapsed = GetBenchmarkNanoseconds() - start;
+    snprintf(name, sizeof(name), "Count RMRR table pages, %llu scopes", (unsigned long long)deviceCount);
+    ReportBenchmark(name, Iterations, elapsed);
+    printf("    %llu table pages for %u RMRRs of %u scopes each\n",
+           (unsigned long long)pageCount,
+           SYNTHETIC_RMRR_COUNT,
+           SYNTHETIC_RMRR_SCOPE_COUNT);
+
+    FreeDmarTopology(&topology);
+    FreePool(dmarTable);
+}
+
+/**
+ * @brief The entry point of the host application.
+ */
+int
+main (
+    int argc,
+    char* argv[]
+    )
+{
+    BenchmarkBuildPassthroughTranslations(FALSE, 100);
+    BenchmarkBuildPassthroughTranslations(TRUE, 10000);
+    BenchmarkSplitLargePage(10000);
+    BenchmarkFillPagingEntries("512 PTEs, split 2MB", SL_LEVEL_PT, 1000000);
+    BenchmarkFillPagingEntries("512 PDEs, split 1GB/build 2MB", SL_LEVEL_PD, 1000000);
+    BenchmarkFillPagingEntries("512 PDPTEs, build 1GB", SL_LEVEL_PDPT, 1000000);
+    BenchmarkEnableDmaRemapping(TRUE, 0, 1000);
+    BenchmarkEnableDmaRemapping(TRUE, 1000, 1000);
+    BenchmarkEnableDmaRemapping(FALSE, 0, 1000);
+    BenchmarkEnableDmaRemapping(FALSE, 1000, 1000);
+    for (UINT64 batchSize = 1; batchSize <= 64; batchSize *= 8)
+    {
+        BenchmarkInvalidationBatch(TRUE, 100, batchSize, 10000);
+        BenchmarkInvalidationBatch(FALSE, 100, batchSize, 10000);
+    }
+    BenchmarkMapUnmap(TRUE, 1, 100000);
+    BenchmarkMapUnmap(FALSE, 1, 100000);
+    BenchmarkMapUnmap(TRUE, 16, 100000);
+    BenchmarkMapUnmap(FALSE, 16, 100000);
+    for (UINT64 clientCount = 1; clientCount <= IOVA_MAX_CLIENT_COUNT; clientCount *= 4)
+    {
+        BenchmarkIovaStress(clientCount, 1000000);
+    }
+    for (UINT64 scopesPerUnit = 250; scopesPerUnit <= 8000; scopesPerUnit *= 2)
+    {
+        BenchmarkDmarTopology(scopesPerUnit, 100);
+    }
+    return 0;
+}
@@ -0,0 +1,1055 @@
+#include <Library/UnitTestLib.h>
+#include "TestEnvironment.h"
+
+#define UNIT_TEST_NAME      "HelloIommuDxe Unit Tests"
+#define UNIT_TEST_VERSION   "1.0"
+
+//
+// The memory map the tests build translations for. The second range ends in
+// the middle of a 1GB region, so that 1GB-page builds also use a PD.
+//
+static CONST DMAR_ADDRESS_RANGE mTestRanges[] =
+{
+    { 0, SIZE_4GB },
+    { SIZE_16GB, SIZE_16GB + SIZE_1GB + SIZE_2MB },
+};
+
+//
+// The source-id of the device given its own domain, 01:00.0.
+//
+#define TEST_SOURCE_ID      0x0100
+
+//
+// The shapes of the environment tests run against.
+//
+static CONST TEST_CONFIGURATION mQueuedInvalidationConfiguration =
+{
+    2, TRUE, FALSE, 3, mTestRanges, ARRAY_SIZE(mTestRanges), FALSE
+};
+
+static CONST TEST_CONFIGURATION mRegisterInvalidationConfiguration =
+{
+    2, FALSE, FALSE, 3, mTestRanges, ARRAY_SIZE(mTestRanges), FALSE
+};
+
+static CONST TEST_CONFIGURATION mScalableModeConfiguration =
+{
+    2, TRUE, TRUE, 3, mTestRanges, ARRAY_SIZE(mTestRanges), FALSE
+};
+
+static CONST TEST_CONFIGURATION m1GbPageConfiguration =
+{
+    1, TRUE, FALSE, 0, mTestRanges, ARRAY_SIZE(mTestRanges), TRUE
+};
+
+/**
+ * @brief Enables DMA-remapping on the environment of the context and verifies
+ *        the sequence against the simulated registers.
+ *
+ * @details Each unit must end with the root table of the translations, and TE
+ *          and RTPS set, without any access the specification does not allow.
+ *          The global invalidations are made through the queue as one batch if
+ *          queued invalidation is enabled, and through the registers otherwise.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+EnableDmaRemappingTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    CONST TEST_CONFIGURATION* configuration;
+    TEST_ENVIRONMENT* environment;
+
+    configuration = (CONST TEST_CONFIGURATION*)Context;
+    status = CreateTestEnvironment(configuration, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    status = EnableDmaRemappingForAllUnits(environment->DmarUnits, environment->DmarUnitCount);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(GetTestViolationCount(environment), 0);
+
+    for (UINT64 i = 0; i < environment->DmarUnitCount; ++i)
+    {
+        CONST SIMULATED_DMAR_UNIT* unit;
+        VTD_ROOT_TABLE_ADDRESS_REGISTER rootTableAddressReg;
+
+        unit = &environment->SimulatedUnits[i];
+        rootTableAddressReg.AsUInt64 = unit->RootTableAddress;
+        UT_ASSERT_TRUE(environment->DmarUnits[i].DmaRemappingEnabled);
+        UT_ASSERT_EQUAL(rootTableAddressReg.Bits.RootTable,
+                        (UINT64)environment->Translations.RootTable >> 12);
+        UT_ASSERT_EQUAL(rootTableAddressReg.Bits.TranslationTableMode,
+                        (configuration->ScalableMode != FALSE) ?
+                            V_RTADDR_REG_TTM_SCALABLE :
+                            V_RTADDR_REG_TTM_LEGACY);
+        UT_ASSERT_TRUE((unit->GlobalStatus & B_GSTS_REG_TE) != 0);
+        UT_ASSERT_TRUE((unit->GlobalStatus & B_GSTS_REG_RTPS) != 0);
+        UT_ASSERT_EQUAL(unit->FaultStatus, 0);
+
+        if (configuration->QueuedInvalidation != FALSE)
+        {
+            UT_ASSERT_TRUE((unit->GlobalStatus & B_GSTS_REG_QIES) != 0);
+            UT_ASSERT_EQUAL(unit->Doorbells, 1);
+            UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_CONTEXT_CACHE], 1);
+            UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_PASID_CACHE],
+                            (configuration->ScalableMode != FALSE) ? 1 : 0);
+            UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_IOTLB], 1);
+            UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_WAIT], 1);
+            UT_ASSERT_EQUAL(unit->ContextInvalidations, 0);
+            UT_ASSERT_EQUAL(unit->IotlbInvalidations, 0);
+        }
+        else
+        {
+            UT_ASSERT_TRUE((unit->GlobalStatus & B_GSTS_REG_QIES) == 0);
+            UT_ASSERT_EQUAL(unit->Doorbells, 0);
+            UT_ASSERT_EQUAL(unit->ContextInvalidations, 1);
+            UT_ASSERT_EQUAL(unit->IotlbInvalidations, 1);
+        }
+    }
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies that the translations use no more pages than estimated, and
+ *        that the software walk finds identity mapping with the expected page
+ *        sizes inside the ranges, and nothing outside them.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+BuildPassthroughTranslationsTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    CONST TEST_CONFIGURATION* configuration;
+    TEST_ENVIRONMENT* environment;
+    DMAR_WALK_RESULT walk;
+    UINT64 largePageSize;
+
+    configuration = (CONST TEST_CONFIGURATION*)Context;
+    status = CreateTestEnvironment(configuration, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    //
+    // The pool also holds the invalidation queues, and in scalable mode, the
+    // PASID directory and table.
+    //
+    UT_ASSERT_TRUE(environment->Translations.Pool.UnusedPageIndex <=
+                   GetPassthroughTranslationsPageCount(configuration->Ranges,
+                                                       configuration->RangeCount,
+                                                       configuration->Use1GbPages) +
+                   environment->DmarUnitCount +
+                   ((configuration->ScalableMode != FALSE) ? DMAR_SCALABLE_MODE_EXTRA_PAGE_COUNT : 0));
+
+    largePageSize = (configuration->Use1GbPages != FALSE) ? SIZE_1GB : SIZE_2MB;
+    status = TranslateDmaAddress(&environment->Translations, 0, SIZE_1GB + 0x1234, &walk);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(walk.HostAddress, SIZE_1GB + 0x1234);
+    UT_ASSERT_EQUAL(walk.PageSize, largePageSize);
+    UT_ASSERT_EQUAL(walk.Permissions, DMAR_ACCESS_READ | DMAR_ACCESS_WRITE);
+
+    //
+    // The 2MB region past the last 1GB boundary is mapped with a 2MB page.
+    //
+    status = TranslateDmaAddress(&environment->Translations, 0, SIZE_16GB + SIZE_1GB + 0x5678, &walk);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(walk.HostAddress, SIZE_16GB + SIZE_1GB + 0x5678);
+    UT_ASSERT_EQUAL(walk.PageSize, SIZE_2MB);
+
+    status = TranslateDmaAddress(&environment->Translations, 0, SIZE_8GB, &walk);
+    UT_ASSERT_STATUS_EQUAL(status, EFI_NOT_FOUND);
+    status = TranslateDmaAddress(&environment->Translations, 0, SIZE_16GB + SIZE_1GB + SIZE_2MB, &walk);
+    UT_ASSERT_STATUS_EQUAL(status, EFI_NOT_FOUND);
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies the entries the software walk reads for the shared domain,
+ *        and that a device given its own domain translates only what is mapped
+ *        for it, with the permissions mapped.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+TranslateDmaAddressTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    CONST TEST_CONFIGURATION* configuration;
+    TEST_ENVIRONMENT* environment;
+    DMAR_DIRTY_RANGES dirtyRanges;
+    DMAR_WALK_RESULT walk;
+    UINT64 contextEntriesRead;
+    UINT16 domainId;
+    UINT16 previousDomainId;
+    BOOLEAN rootEntryUpdated;
+
+    configuration = (CONST TEST_CONFIGURATION*)Context;
+    status = CreateTestEnvironment(configuration, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    //
+    // The root and context entries, and in scalable mode, the PASID directory
+    // and PASID table entries as well, precede the paging-structure entries.
+    //
+    contextEntriesRead = (configuration->ScalableMode != FALSE) ? 4 : 2;
+
+    status = TranslateDmaAddress(&environment->Translations, 0, SIZE_1GB + 0x1234, &walk);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_FALSE(walk.Passthrough);
+    UT_ASSERT_EQUAL(walk.DomainId, UEFI_DOMAIN_ID);
+    UT_ASSERT_EQUAL(walk.PageSize, SIZE_2MB);
+    UT_ASSERT_EQUAL(walk.PagingEntriesRead, 3);
+    UT_ASSERT_EQUAL(walk.EntriesRead, contextEntriesRead + 3);
+
+    status = AssignDeviceDomain(&environment->Translations,
+                                TEST_SOURCE_ID,
+                                FALSE,
+                                NULL,
+                                0,
+                                &domainId,
+                                &previousDomainId,
+                                &rootEntryUpdated);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_NOT_EQUAL(domainId, UEFI_DOMAIN_ID);
+    UT_ASSERT_EQUAL(previousDomainId, UEFI_DOMAIN_ID);
+
+    status = TranslateDmaAddress(&environment->Translations, TEST_SOURCE_ID, SIZE_1GB, &walk);
+    UT_ASSERT_STATUS_EQUAL(status, EFI_NOT_FOUND);
+
+    ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+    status = MapRangeForDomain(&environment->Translations,
+                               domainId,
+                               SIZE_4GB,
+                               SIZE_8KB,
+                               SIZE_2GB,
+                               DMAR_ACCESS_READ,
+                               &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    status = TranslateDmaAddress(&environment->Translations, TEST_SOURCE_ID, SIZE_4GB + SIZE_4KB + 0x10, &walk);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(walk.DomainId, domainId);
+    UT_ASSERT_EQUAL(walk.HostAddress, SIZE_2GB + SIZE_4KB + 0x10);
+    UT_ASSERT_EQUAL(walk.PageSize, SIZE_4KB);
+    UT_ASSERT_EQUAL(walk.Permissions, DMAR_ACCESS_READ);
+    UT_ASSERT_EQUAL(walk.PagingEntriesRead, 4);
+    UT_ASSERT_EQUAL(walk.EntriesRead, contextEntriesRead + 4);
+
+    status = TranslateDmaAddress(&environment->Translations, TEST_SOURCE_ID, SIZE_4GB + SIZE_8KB, &walk);
+    UT_ASSERT_STATUS_EQUAL(status, EFI_NOT_FOUND);
+
+    status = MapRangeForDomain(&environment->Translations,
+                               domainId,
+                               SIZE_4GB,
+                               SIZE_8KB,
+                               SIZE_2GB,
+                               0,
+                               &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    status = TranslateDmaAddress(&environment->Translations, TEST_SOURCE_ID, SIZE_4GB, &walk);
+    UT_ASSERT_STATUS_EQUAL(status, EFI_NOT_FOUND);
+
+    //
+    // The other devices keep the shared domain.
+    //
+    status = TranslateDmaAddress(&environment->Translations, 0, SIZE_4GB - SIZE_4KB, &walk);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(walk.DomainId, UEFI_DOMAIN_ID);
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies the hits and the paging-structure entries read the IOTLB
+ *        model counts for a trace over 2MB pages, and over 4KB pages of a split
+ *        one.
+ *
+ * @details The IOTLB has a single set of two ways and the PDE cache a single
+ *          entry, so that LRU replacement decides every lookup. The counts are
+ *          the same in scalable mode, as only paging-structure entries are read
+ *          on misses.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+IotlbModelTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    TEST_ENVIRONMENT* environment;
+    DMAR_DIRTY_RANGES dirtyRanges;
+    DMAR_IOTLB_MODEL model;
+    UINT64 largePageTrace[] =
+    {
+        SIZE_1GB,                   // Miss
+        SIZE_1GB + SIZE_4KB,        // Hit in the same 2MB page
+        SIZE_1GB + SIZE_2MB,        // Miss
+        SIZE_1GB,                   // Hit
+        SIZE_1GB + SIZE_4MB,        // Miss, evicting SIZE_1GB + SIZE_2MB
+        SIZE_1GB + SIZE_2MB,        // Miss, evicting SIZE_1GB
+        SIZE_8GB,                   // Fault
+    };
+    UINT64 smallPageTrace[] =
+    {
+        SIZE_1GB + SIZE_8MB,            // Miss of both caches
+        SIZE_1GB + SIZE_8MB + SIZE_4KB, // Miss of the IOTLB, hit of the PDE cache
+        SIZE_1GB + SIZE_8MB,            // Hit
+    };
+
+    status = CreateTestEnvironment((CONST TEST_CONFIGURATION*)Context, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    status = InitializeIotlbModel(&model, 1, 2, 1, 1);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    SimulateDmaTrace(&environment->Translations, &model, 0, largePageTrace, ARRAY_SIZE(largePageTrace));
+    UT_ASSERT_EQUAL(model.Accesses, 7);
+    UT_ASSERT_EQUAL(model.Faults, 1);
+    UT_ASSERT_EQUAL(model.PassthroughAccesses, 0);
+    UT_ASSERT_EQUAL(model.Iotlb.Lookups, 6);
+    UT_ASSERT_EQUAL(model.Iotlb.Hits, 2);
+    UT_ASSERT_EQUAL(model.PdeCache.Lookups, 0);
+    UT_ASSERT_EQUAL(model.EntriesRead, 4 * 3);
+    FreeIotlbModel(&model);
+
+    ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+    status = ChangePermissionOfRangeForAllDevices(&environment->Translations,
+                                                  SIZE_1GB + SIZE_8MB,
+                                                  SIZE_8KB,
+                                                  DMAR_ACCESS_READ,
+                                                  &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    status = InitializeIotlbModel(&model, 1, 2, 1, 1);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    SimulateDmaTrace(&environment->Translations, &model, 0, smallPageTrace, ARRAY_SIZE(smallPageTrace));
+    UT_ASSERT_EQUAL(model.Accesses, 3);
+    UT_ASSERT_EQUAL(model.Faults, 0);
+    UT_ASSERT_EQUAL(model.Iotlb.Hits, 1);
+    UT_ASSERT_EQUAL(model.PdeCache.Lookups, 2);
+    UT_ASSERT_EQUAL(model.PdeCache.Hits, 1);
+    UT_ASSERT_EQUAL(model.EntriesRead, 4 + 1);
+    FreeIotlbModel(&model);
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies that a device with its own domain keeps getting it after all
+ *        domain IDs are in use, and that only a new domain fails then.
+ *
+ * @details The limit is lowered to four IDs, that is, the reserved ID 0,
+ *          UEFI_DOMAIN_ID and two for devices.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+DomainIdExhaustionTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    TEST_ENVIRONMENT* environment;
+    UINT16 domainIds[2];
+    UINT16 domainId;
+    UINT16 previousDomainId;
+    BOOLEAN rootEntryUpdated;
+
+    status = CreateTestEnvironment((CONST TEST_CONFIGURATION*)Context, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    environment->Translations.DomainIdLimit = 4;
+
+    for (UINT64 i = 0; i < ARRAY_SIZE(domainIds); ++i)
+    {
+        status = AssignDeviceDomain(&environment->Translations,
+                                    (UINT16)(TEST_SOURCE_ID + i),
+                                    FALSE,
+                                    NULL,
+                                    0,
+                                    &domainIds[i],
+                                    &previousDomainId,
+                                    &rootEntryUpdated);
+        UT_ASSERT_NOT_EFI_ERROR(status);
+    }
+    UT_ASSERT_NOT_EQUAL(domainIds[0], domainIds[1]);
+
+    status = AssignDeviceDomain(&environment->Translations,
+                                TEST_SOURCE_ID + ARRAY_SIZE(domainIds),
+                                FALSE,
+                                NULL,
+                                0,
+                                &domainId,
+                                &previousDomainId,
+                                &rootEntryUpdated);
+    UT_ASSERT_STATUS_EQUAL(status, EFI_OUT_OF_RESOURCES);
+
+    for (UINT64 i = 0; i < ARRAY_SIZE(domainIds); ++i)
+    {
+        status = AssignDeviceDomain(&environment->Translations,
+                                    (UINT16)(TEST_SOURCE_ID + i),
+                                    FALSE,
+                                    NULL,
+                                    0,
+                                    &domainId,
+                                    &previousDomainId,
+                                    &rootEntryUpdated);
+        UT_ASSERT_NOT_EFI_ERROR(status);
+        UT_ASSERT_EQUAL(domainId, domainIds[i]);
+        UT_ASSERT_EQUAL(previousDomainId, domainIds[i]);
+    }
+    UT_ASSERT_EQUAL(environment->Translations.DomainCount, 1 + ARRAY_SIZE(domainIds));
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies that changing the permission of a 4KB page inside a large
+ *        page splits it, leaving the neighbouring pages as they were, and that
+ *        the change is recorded as a dirty range.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+SplitLargePageTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    TEST_ENVIRONMENT* environment;
+    DMAR_DIRTY_RANGES dirtyRanges;
+    DMAR_WALK_RESULT walk;
+    UINT64 address;
+
+    status = CreateTestEnvironment((CONST TEST_CONFIGURATION*)Context, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    address = SIZE_1GB + SIZE_2MB + SIZE_8KB;
+    ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+    status = ChangePermissionOfRangeForAllDevices(&environment->Translations,
+                                                  address,
+                                                  SIZE_4KB,
+                                                  DMAR_ACCESS_READ,
+                                                  &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(dirtyRanges.Count, 1);
+    UT_ASSERT_FALSE(dirtyRanges.Overflowed);
+
+    status = TranslateDmaAddress(&environment->Translations, 0, address, &walk);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(walk.HostAddress, address);
+    UT_ASSERT_EQUAL(walk.PageSize, SIZE_4KB);
+    UT_ASSERT_EQUAL(walk.Permissions, DMAR_ACCESS_READ);
+
+    status = TranslateDmaAddress(&environment->Translations, 0, address + SIZE_4KB, &walk);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(walk.HostAddress, address + SIZE_4KB);
+    UT_ASSERT_EQUAL(walk.PageSize, SIZE_4KB);
+    UT_ASSERT_EQUAL(walk.Permissions, DMAR_ACCESS_READ | DMAR_ACCESS_WRITE);
+
+    status = TranslateDmaAddress(&environment->Translations, 0, address + SIZE_2MB, &walk);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(walk.PageSize, SIZE_2MB);
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies that invalidation of a modified range after enabling uses
+ *        one page-selective invalidation per unit, and that the MMIO accesses
+ *        the driver accounts for match those the simulated units observed.
+ *
+ * @details The 16KB range is in a 2MB page, which is split for the change, so
+ *          that the whole 2MB region is invalidated (AM of 9).
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+InvalidateDirtyRangesTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    CONST TEST_CONFIGURATION* configuration;
+    TEST_ENVIRONMENT* environment;
+    DMAR_DIRTY_RANGES dirtyRanges;
+
+    configuration = (CONST TEST_CONFIGURATION*)Context;
+    status = CreateTestEnvironment(configuration, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    status = EnableDmaRemappingForAllUnits(environment->DmarUnits, environment->DmarUnitCount);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    ResetTestStatistics(environment);
+
+    ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+    status = ChangePermissionOfRangeForAllDevices(&environment->Translations,
+                                                  SIZE_1GB,
+                                                  SIZE_16KB,
+                                                  DMAR_ACCESS_READ,
+                                                  &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    status = InvalidateDirtyRanges(environment->DmarUnits,
+                                   environment->DmarUnitCount,
+                                   UEFI_DOMAIN_ID,
+                                   &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(GetTestViolationCount(environment), 0);
+    UT_ASSERT_EQUAL(dirtyRanges.Count, 0);
+
+    for (UINT64 i = 0; i < environment->DmarUnitCount; ++i)
+    {
+        CONST SIMULATED_DMAR_UNIT* unit;
+        CONST DMAR_INVALIDATION_STATISTICS* statistics;
+
+        unit = &environment->SimulatedUnits[i];
+        statistics = &environment->DmarUnits[i].InvalidationStatistics;
+        UT_ASSERT_EQUAL(statistics->Invalidations, 1);
+        UT_ASSERT_EQUAL(statistics->Batches, 1);
+        UT_ASSERT_EQUAL(statistics->MmioReads, unit->MmioReads);
+        UT_ASSERT_EQUAL(statistics->MmioWrites, unit->MmioWrites);
+        if (configuration->QueuedInvalidation != FALSE)
+        {
+            UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_IOTLB], 1);
+            UT_ASSERT_EQUAL(unit->Doorbells, 1);
+        }
+        else
+        {
+            UT_ASSERT_EQUAL(unit->IotlbInvalidations, 1);
+            UT_ASSERT_EQUAL(unit->InvalidateAddress, SIZE_1GB | 9);
+        }
+    }
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies that each unit received Count IOTLB invalidations, the last
+ *        of which has the granularity.
+ */
+static
+UNIT_TEST_STATUS
+AssertIotlbInvalidations (
+    IN CONST TEST_CONFIGURATION* Configuration,
+    IN CONST TEST_ENVIRONMENT* Environment,
+    IN UINT64 Granularity,
+    IN UINT64 Count
+    )
+{
+    for (UINT64 i = 0; i < Environment->DmarUnitCount; ++i)
+    {
+        CONST SIMULATED_DMAR_UNIT* unit;
+
+        unit = &Environment->SimulatedUnits[i];
+        if (Configuration->QueuedInvalidation != FALSE)
+        {
+            UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_IOTLB], Count);
+            UT_ASSERT_EQUAL((unit->LastDescriptors[V_INV_DESC_TYPE_IOTLB].Uint128.Uint64Lo >> 4) & 0x3,
+                            Granularity);
+            UT_ASSERT_EQUAL(unit->Doorbells, 1);
+        }
+        else
+        {
+            UT_ASSERT_EQUAL(unit->IotlbInvalidations, Count);
+            UT_ASSERT_EQUAL((unit->IotlbInvalidate >> 60) & 0x3, Granularity);
+        }
+    }
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies that invalidation of a range modified for all domains uses
+ *        page-selective invalidation for each domain with tables, falls back
+ *        to domain-selective invalidation for each, and uses the global
+ *        invalidation only when domains are too many.
+ *
+ * @details A pass-through device is configured too, whose domain is skipped.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+InvalidateAllDomainsTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    UNIT_TEST_STATUS testStatus;
+    CONST TEST_CONFIGURATION* configuration;
+    TEST_ENVIRONMENT* environment;
+    DMAR_DIRTY_RANGES dirtyRanges;
+    UINT16 domainId;
+    UINT16 previousDomainId;
+    BOOLEAN rootEntryUpdated;
+    UINT64 domainCount;
+
+    configuration = (CONST TEST_CONFIGURATION*)Context;
+    status = CreateTestEnvironment(configuration, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    status = SetDevicePassthrough(&environment->Translations, TEST_SOURCE_ID, 2, &rootEntryUpdated);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    for (domainCount = 1; domainCount < 3; ++domainCount)
+    {
+        status = AssignDeviceDomain(&environment->Translations,
+                                    (UINT16)(TEST_SOURCE_ID + domainCount),
+                                    TRUE,
+                                    NULL,
+                                    0,
+                                    &domainId,
+                                    &previousDomainId,
+                                    &rootEntryUpdated);
+        UT_ASSERT_NOT_EFI_ERROR(status);
+    }
+    status = EnableDmaRemappingForAllUnits(environment->DmarUnits, environment->DmarUnitCount);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    //
+    // One page-selective invalidation (AM of 9) for each of 3 domains.
+    //
+    ResetTestStatistics(environment);
+    ZeroMem(&dirtyRanges, sizeof(dirtyRanges));
+    status = ChangePermissionOfRangeForAllDevices(&environment->Translations,
+                                                  SIZE_1GB,
+                                                  SIZE_16KB,
+                                                  DMAR_ACCESS_READ,
+                                                  &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    status = InvalidateDirtyRanges(environment->DmarUnits,
+                                   environment->DmarUnitCount,
+                                   DMAR_DOMAIN_ID_ALL,
+                                   &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(GetTestViolationCount(environment), 0);
+    testStatus = AssertIotlbInvalidations(configuration, environment, DMAR_GRANULARITY_PAGE, domainCount);
+    UT_ASSERT_EQUAL(testStatus, UNIT_TEST_PASSED);
+
+    //
+    // Too many ranges to track. One domain-selective invalidation for each.
+    //
+    ResetTestStatistics(environment);
+    dirtyRanges.Overflowed = TRUE;
+    status = InvalidateDirtyRanges(environment->DmarUnits,
+                                   environment->DmarUnitCount,
+                                   DMAR_DOMAIN_ID_ALL,
+                                   &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    testStatus = AssertIotlbInvalidations(configuration, environment, DMAR_GRANULARITY_DOMAIN, domainCount);
+    UT_ASSERT_EQUAL(testStatus, UNIT_TEST_PASSED);
+
+    //
+    // Too many domains even for domain-selective invalidations.
+    //
+    for (; domainCount <= DMAR_MAX_PAGE_SELECTIVE_INVALIDATIONS; ++domainCount)
+    {
+        status = AssignDeviceDomain(&environment->Translations,
+                                    (UINT16)(TEST_SOURCE_ID + domainCount),
+                                    TRUE,
+                                    NULL,
+                                    0,
+                                    &domainId,
+                                    &previousDomainId,
+                                    &rootEntryUpdated);
+        UT_ASSERT_NOT_EFI_ERROR(status);
+    }
+    ResetTestStatistics(environment);
+    AddDirtyRange(&dirtyRanges, SIZE_1GB, SIZE_4KB);
+    status = InvalidateDirtyRanges(environment->DmarUnits,
+                                   environment->DmarUnitCount,
+                                   DMAR_DOMAIN_ID_ALL,
+                                   &dirtyRanges);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    testStatus = AssertIotlbInvalidations(configuration, environment, DMAR_GRANULARITY_GLOBAL, 1);
+    UT_ASSERT_EQUAL(testStatus, UNIT_TEST_PASSED);
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies that when the device moves from UEFI_DOMAIN_ID to its own
+ *        domain, the IOTLB of the unit owning it is invalidated for
+ *        UEFI_DOMAIN_ID, in the same batch as the context-cache.
+ *
+ * @details Only the first unit is passed as the owner. In scalable mode, the
+ *          PASID-based IOTLB invalidation for DMAR_RID_PASID is queued as well.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+DomainSwitchInvalidationTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    CONST TEST_CONFIGURATION* configuration;
+    TEST_ENVIRONMENT* environment;
+    CONST SIMULATED_DMAR_UNIT* unit;
+    UINT16 domainId;
+    UINT16 previousDomainId;
+    BOOLEAN rootEntryUpdated;
+
+    configuration = (CONST TEST_CONFIGURATION*)Context;
+    status = CreateTestEnvironment(configuration, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    status = EnableDmaRemappingForAllUnits(environment->DmarUnits, environment->DmarUnitCount);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+
+    status = AssignDeviceDomain(&environment->Translations,
+                                TEST_SOURCE_ID,
+                                FALSE,
+                                NULL,
+                                0,
+                                &domainId,
+                                &previousDomainId,
+                                &rootEntryUpdated);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(previousDomainId, UEFI_DOMAIN_ID);
+    ResetTestStatistics(environment);
+
+    status = InvalidateContextCacheForDevice(environment->DmarUnits,
+                                             1,
+                                             TEST_SOURCE_ID,
+                                             previousDomainId,
+                                             rootEntryUpdated,
+                                             TRUE);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(GetTestViolationCount(environment), 0);
+
+    unit = &environment->SimulatedUnits[0];
+    if (configuration->QueuedInvalidation != FALSE)
+    {
+        UINT64 iotlbDescriptor;
+
+        iotlbDescriptor = unit->LastDescriptors[V_INV_DESC_TYPE_IOTLB].Uint128.Uint64Lo;
+        UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_CONTEXT_CACHE], 1);
+        UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_IOTLB], 1);
+        UT_ASSERT_EQUAL((iotlbDescriptor >> 4) & 0x3, DMAR_GRANULARITY_DOMAIN);
+        UT_ASSERT_EQUAL((iotlbDescriptor >> 16) & 0xffff, UEFI_DOMAIN_ID);
+        UT_ASSERT_EQUAL(unit->Doorbells, 1);
+        if (configuration->ScalableMode != FALSE)
+        {
+            UINT64 pasidIotlbDescriptor;
+
+            pasidIotlbDescriptor = unit->LastDescriptors[V_INV_DESC_TYPE_PASID_IOTLB].Uint128.Uint64Lo;
+            UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_PASID_IOTLB], 1);
+            UT_ASSERT_EQUAL((pasidIotlbDescriptor >> 4) & 0x3, V_INV_DESC_PASID_IOTLB_G_PASID);
+            UT_ASSERT_EQUAL((pasidIotlbDescriptor >> 16) & 0xffff, UEFI_DOMAIN_ID);
+            UT_ASSERT_EQUAL((pasidIotlbDescriptor >> 32) & 0xfffff, DMAR_RID_PASID);
+        }
+        else
+        {
+            UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_PASID_IOTLB], 0);
+        }
+    }
+    else
+    {
+        UT_ASSERT_EQUAL(unit->ContextInvalidations, 1);
+        UT_ASSERT_EQUAL(unit->IotlbInvalidations, 1);
+        UT_ASSERT_EQUAL((unit->IotlbInvalidate >> 60) & 0x3, DMAR_GRANULARITY_DOMAIN);
+        UT_ASSERT_EQUAL((unit->IotlbInvalidate >> 32) & 0xffff, UEFI_DOMAIN_ID);
+    }
+
+    //
+    // The other unit does not own the device, and is left alone.
+    //
+    unit = &environment->SimulatedUnits[1];
+    UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_IOTLB], 0);
+    UT_ASSERT_EQUAL(unit->IotlbInvalidations, 0);
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Verifies that a batch of invalidations costs one write to the tail
+ *        register and no register reads with queued invalidation, and a write
+ *        and polls per invalidation with register-based invalidation.
+ */
+static
+UNIT_TEST_STATUS
+EFIAPI
+InvalidationBatchTest (
+    IN UNIT_TEST_CONTEXT Context
+    )
+{
+    EFI_STATUS status;
+    CONST TEST_CONFIGURATION* configuration;
+    TEST_ENVIRONMENT* environment;
+    CONST SIMULATED_DMAR_UNIT* unit;
+    UINT64 batchSize;
+
+    configuration = (CONST TEST_CONFIGURATION*)Context;
+    status = CreateTestEnvironment(configuration, &environment);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    status = EnableDmaRemappingForAllUnits(environment->DmarUnits, environment->DmarUnitCount);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    ResetTestStatistics(environment);
+
+    batchSize = 16;
+    for (UINT64 i = 0; i < batchSize; ++i)
+    {
+        InvalidateIotlb(&environment->DmarUnits[0], DMAR_GRANULARITY_PAGE, UEFI_DOMAIN_ID, i * SIZE_4KB, 0);
+    }
+    status = CommitInvalidations(&environment->DmarUnits[0]);
+    UT_ASSERT_NOT_EFI_ERROR(status);
+    UT_ASSERT_EQUAL(GetTestViolationCount(environment), 0);
+
+    unit = &environment->SimulatedUnits[0];
+    if (configuration->QueuedInvalidation != FALSE)
+    {
+        UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_IOTLB], batchSize);
+        UT_ASSERT_EQUAL(unit->Descriptors[V_INV_DESC_TYPE_WAIT], 1);
+        UT_ASSERT_EQUAL(unit->MmioWrites, 1);
+        UT_ASSERT_EQUAL(unit->MmioReads, 0);
+    }
+    else
+    {
+        UT_ASSERT_EQUAL(unit->IotlbInvalidations, batchSize);
+        UT_ASSERT_EQUAL(unit->MmioWrites, batchSize * 2);
+        UT_ASSERT_EQUAL(unit->MmioReads, batchSize * configuration->CompletionLatency);
+    }
+    UT_ASSERT_EQUAL(environment->DmarUnits[0].InvalidationStatistics.MmioWrites, unit->MmioWrites);
+    UT_ASSERT_EQUAL(environment->DmarUnits[0].InvalidationStatistics.MmioReads, unit->MmioReads);
+
+    DestroyTestEnvironment(environment);
+    return UNIT_TEST_PASSED;
+}
+
+/**
+ * @brief Registers the test cases and runs them.
+ */
+static
+EFI_STATUS
+EFIAPI
+UefiTestMain (
+    VOID
+    )
+{
+    EFI_STATUS status;
+    UNIT_TEST_FRAMEWORK_HANDLE framework;
+    UNIT_TEST_SUITE_HANDLE enableSuite;
+    UNIT_TEST_SUITE_HANDLE translationsSuite;
+    UNIT_TEST_SUITE_HANDLE walkSuite;
+    UNIT_TEST_SUITE_HANDLE invalidationSuite;
+
+    framework = NULL;
+    DEBUG((DEBUG_INFO, "%a v%a\n", UNIT_TEST_NAME, UNIT_TEST_VERSION));
+
+    status = InitUnitTestFramework(&framework, UNIT_TEST_NAME, gEfiCallerBaseName, UNIT_TEST_VERSION);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "InitUnitTestFramework failed : %r\n", status));
+        goto Exit;
+    }
+
+    status = CreateUnitTestSuite(&enableSuite, framework, "Enabling DMA-remapping", "Enable", NULL, NULL);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+    AddTestCase(enableSuite,
+                "Enabling with queued invalidation",
+                "QueuedInvalidation",
+                EnableDmaRemappingTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(enableSuite,
+                "Enabling with register-based invalidation",
+                "RegisterInvalidation",
+                EnableDmaRemappingTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mRegisterInvalidationConfiguration);
+    AddTestCase(enableSuite,
+                "Enabling in scalable mode",
+                "ScalableMode",
+                EnableDmaRemappingTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mScalableModeConfiguration);
+
+    status = CreateUnitTestSuite(&translationsSuite, framework, "Translations", "Translations", NULL, NULL);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+    AddTestCase(translationsSuite,
+                "Building with 2MB pages",
+                "Build2Mb",
+                BuildPassthroughTranslationsTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(translationsSuite,
+                "Building with 1GB pages",
+                "Build1Gb",
+                BuildPassthroughTranslationsTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&m1GbPageConfiguration);
+    AddTestCase(translationsSuite,
+                "Building in scalable mode",
+                "BuildScalableMode",
+                BuildPassthroughTranslationsTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mScalableModeConfiguration);
+    AddTestCase(translationsSuite,
+                "Splitting a 2MB page",
+                "Split",
+                SplitLargePageTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+
+    AddTestCase(translationsSuite,
+                "Reusing domains after all domain IDs are in use",
+                "DomainIdExhaustion",
+                DomainIdExhaustionTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(translationsSuite,
+                "Reusing domains after all domain IDs are in use in scalable mode",
+                "DomainIdExhaustionScalableMode",
+                DomainIdExhaustionTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mScalableModeConfiguration);
+
+    status = CreateUnitTestSuite(&walkSuite, framework, "Software walk", "PageWalk", NULL, NULL);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+    AddTestCase(walkSuite,
+                "Translating device addresses",
+                "Translate",
+                TranslateDmaAddressTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(walkSuite,
+                "Translating device addresses in scalable mode",
+                "TranslateScalableMode",
+                TranslateDmaAddressTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mScalableModeConfiguration);
+    AddTestCase(walkSuite,
+                "Simulating a DMA trace through the IOTLB model",
+                "IotlbModel",
+                IotlbModelTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(walkSuite,
+                "Simulating a DMA trace through the IOTLB model in scalable mode",
+                "IotlbModelScalableMode",
+                IotlbModelTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mScalableModeConfiguration);
+
+    status = CreateUnitTestSuite(&invalidationSuite, framework, "Invalidation", "Invalidation", NULL, NULL);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+    AddTestCase(invalidationSuite,
+                "Invalidating a range with queued invalidation",
+                "QueuedInvalidation",
+                InvalidateDirtyRangesTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(invalidationSuite,
+                "Invalidating a range with register-based invalidation",
+                "RegisterInvalidation",
+                InvalidateDirtyRangesTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mRegisterInvalidationConfiguration);
+    AddTestCase(invalidationSuite,
+                "Invalidating a range of all domains with queued invalidation",
+                "QueuedInvalidationAllDomains",
+                InvalidateAllDomainsTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(invalidationSuite,
+                "Invalidating a range of all domains with register-based invalidation",
+                "RegisterInvalidationAllDomains",
+                InvalidateAllDomainsTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mRegisterInvalidationConfiguration);
+    AddTestCase(invalidationSuite,
+                "Leaving a domain with queued invalidation",
+                "QueuedDomainSwitch",
+                DomainSwitchInvalidationTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(invalidationSuite,
+                "Leaving a domain with register-based invalidation",
+                "RegisterDomainSwitch",
+                DomainSwitchInvalidationTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mRegisterInvalidationConfiguration);
+    AddTestCase(invalidationSuite,
+                "Leaving a domain in scalable mode",
+                "ScalableDomainSwitch",
+                DomainSwitchInvalidationTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mScalableModeConfiguration);
+    AddTestCase(invalidationSuite,
+                "Batching invalidations with queued invalidation",
+                "QueuedInvalidationBatch",
+                InvalidationBatchTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mQueuedInvalidationConfiguration);
+    AddTestCase(invalidationSuite,
+                "Batching invalidations with register-based invalidation",
+                "RegisterInvalidationBatch",
+                InvalidationBatchTest,
+                NULL,
+                NULL,
+                (UNIT_TEST_CONTEXT)&mRegisterInvalidationConfiguration);
+
+    status = RunAllTestSuites(framework);
+
+Exit:
+    if (framework != NULL)
+    {
+        FreeUnitTestFramework(framework);
+    }
+    return status;
+}
+
+/**
+ * @brief The entry point of the host application.
+ */
+int
+main (
+    int argc,
+    char* argv[]
+    )
+{
+    return UefiTestMain();
+}
@@ -0,0 +1,403 @@
+#include "SimulatedRegisters.h"
+
+//
+// The offset of the IOTLB registers used by the model, in the unit of 16 bytes
+// as reported in ECAP.IRO.
+//
+#define SIMULATED_IRO               0x10
+
+//
+// The Descriptor Width (DW) bit of the Invalidation Queue Address Register.
+//
+#define B_IQA_REG_DW                BIT11
+
+//
+// The one-shot commands of the Global Command Register the model completes.
+//
+#define B_GMCD_REG_ONE_SHOT_MASK    (B_GMCD_REG_SRTP | B_GMCD_REG_WBF)
+
+/**
+ * @brief Initializes the model of a unit supporting 4-level paging, 2MB and
+ *        1GB pages, 256 domains and page-selective invalidation, and if
+ *        specified, queued invalidation.
+ *
+ * @param CompletionLatency - The number of reads of the status register before
+ *                            a command completes. Zero completes commands as
+ *                            soon as they are issued.
+ */
+VOID
+InitializeSimulatedDmarUnit (
+    OUT SIMULATED_DMAR_UNIT* Unit,
+    IN BOOLEAN QueuedInvalidation,
+    IN UINT64 CompletionLatency
+    )
+{
+    ZeroMem(Unit, sizeof(*Unit));
+
+    Unit->Capability.Bits.ND = 2;
+    Unit->Capability.Bits.SAGAW = BIT2;
+    Unit->Capability.Bits.MGAW = 47;
+    Unit->Capability.Bits.SLLPS = BIT0 | BIT1;
+    Unit->Capability.Bits.PSI = TRUE;
+    Unit->Capability.Bits.MAMV = 9;
+    Unit->Capability.Bits.DRD = TRUE;
+    Unit->Capability.Bits.DWD = TRUE;
+    Unit->ExtendedCapability.Bits.QI = QueuedInvalidation;
+    Unit->ExtendedCapability.Bits.PT = TRUE;
+    Unit->ExtendedCapability.Bits.IRO = SIMULATED_IRO;
+    Unit->CompletionLatency = CompletionLatency;
+}
+
+/**
+ * @brief Fills out the unit information the driver would read for the model.
+ */
+VOID
+InitializeDmarUnitInformation (
+    OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN SIMULATED_DMAR_UNIT* Unit
+    )
+{
+    ZeroMem(DmarUnit, sizeof(*DmarUnit));
+    DmarUnit->RegisterBasePa = (UINT64)Unit;
+    DmarUnit->RegisterBaseVa = (UINT64)Unit;
+    DmarUnit->Capability = Unit->Capability;
+    DmarUnit->ExtendedCapability = Unit->ExtendedCapability;
+}
+
+/**
+ * @brief Clears the statistics of the model, leaving the registers as they are.
+ */
+VOID
+ResetSimulatedDmarUnitStatistics (
+    IN OUT SIMULATED_DMAR_UNIT* Unit
+    )
+{
+    Unit->MmioReads = 0;
+    Unit->MmioWrites = 0;
+    Unit->GlobalCommands = 0;
+    Unit->ContextInvalidations = 0;
+    Unit->IotlbInvalidations = 0;
+    ZeroMem(Unit->Descriptors, sizeof(Unit->Descriptors));
+    ZeroMem(Unit->LastDescriptors, sizeof(Unit->LastDescriptors));
+    Unit->Doorbells = 0;
+    Unit->Violations = 0;
+}
+
+/**
+ * @brief Counts down the reads left for the command, and returns TRUE when the
+ *        command completes with this read.
+ */
+static
+BOOLEAN
+PollCommand (
+    IN OUT UINT64* PollsLeft
+    )
+{
+    if (*PollsLeft == 0)
+    {
+        return FALSE;
+    }
+    (*PollsLeft)--;
+    return (*PollsLeft == 0);
+}
+
+/**
+ * @brief Starts the command written to the Global Command Register.
+ *
+ * @details Feature bits (TE and QIE) are compared with the current status to
+ *          tell which feature is being changed. Only one change is allowed at
+ *          a time, and as the driver never disables features, clearing one is
+ *          counted as a violation, as is issuing a command before the previous
+ *          one completed. See 10.4.4 Global Command Register.
+ */
+static
+VOID
+WriteGlobalCommand (
+    IN OUT SIMULATED_DMAR_UNIT* Unit,
+    IN UINT32 Value
+    )
+{
+    UINT32 changed;
+    UINT32 newStatus;
+
+    changed = ((Value ^ Unit->GlobalStatus) & (B_GMCD_REG_TE | B_GMCD_REG_QIE)) |
+              (Value & B_GMCD_REG_ONE_SHOT_MASK);
+    if ((changed == 0) ||
+        ((changed & (changed - 1)) != 0) ||
+        ((Unit->GlobalStatus & ~Value & (B_GMCD_REG_TE | B_GMCD_REG_QIE)) != 0) ||
+        (Unit->GlobalCommandPolls != 0))
+    {
+        Unit->Violations++;
+    }
+    if (((changed & B_GMCD_REG_QIE) != 0) && (Unit->QueueTail != 0))
+    {
+        Unit->Violations++;
+    }
+    Unit->GlobalCommands++;
+
+    newStatus = Unit->GlobalStatus & ~(B_GSTS_REG_TE | B_GSTS_REG_QIES);
+    newStatus |= Value & (B_GMCD_REG_TE | B_GMCD_REG_QIE);
+    if ((Value & B_GMCD_REG_SRTP) != 0)
+    {
+        newStatus |= B_GSTS_REG_RTPS;
+        Unit->GlobalStatus &= ~B_GSTS_REG_RTPS;
+    }
+    if ((changed & B_GMCD_REG_QIE) != 0)
+    {
+        Unit->QueueHead = 0;
+    }
+
+    Unit->PendingGlobalStatus = newStatus;
+    Unit->GlobalCommandPolls = Unit->CompletionLatency;
+    if (Unit->GlobalCommandPolls == 0)
+    {
+        Unit->GlobalStatus = newStatus;
+    }
+}
+
+/**
+ * @brief Processes the descriptors from the head to the new tail of the queue.
+ *
+ * @details The invalidation wait descriptor with SW set writes its status data
+ *          to the address in the upper half. A descriptor of an unknown type
+ *          sets FSTS.IQE and stops processing with the head pointing to it.
+ *          See 6.5.2 Queued Invalidation Interface.
+ */
+static
+VOID
+ProcessInvalidationQueue (
+    IN OUT SIMULATED_DMAR_UNIT* Unit
+    )
+{
+    UINT64 shift;
+    UINT64 entryCount;
+    UINT8* base;
+
+    shift = ((Unit->QueueAddress & B_IQA_REG_DW) != 0) ? 5 : 4;
+    entryCount = SIZE_4KB >> shift;
+    base = (UINT8*)(UINTN)(Unit->QueueAddress & ~(UINT64)(SIZE_4KB - 1));
+    Unit->Doorbells++;
+
+    while (Unit->QueueHead != Unit->QueueTail)
+    {
+        CONST VTD_INVALIDATION_DESCRIPTOR* descriptor;
+        UINT64 type;
+
+        descriptor = (CONST VTD_INVALIDATION_DESCRIPTOR*)(base + Unit->QueueHead);
+        type = descriptor->Uint128.Uint64Lo & 0xf;
+        if ((type != V_INV_DESC_TYPE_CONTEXT_CACHE) &&
+            (type != V_INV_DESC_TYPE_IOTLB) &&
+            (type != V_INV_DESC_TYPE_WAIT) &&
+            (type != V_INV_DESC_TYPE_PASID_IOTLB) &&
+            (type != V_INV_DESC_TYPE_PASID_CACHE))
+        {
+            Unit->FaultStatus |= B_FSTS_REG_IQE;
+            return;
+        }
+        if (((type == V_INV_DESC_TYPE_PASID_IOTLB) || (type == V_INV_DESC_TYPE_PASID_CACHE)) &&
+            (shift != 5))
+        {
+            Unit->FaultStatus |= B_FSTS_REG_IQE;
+            return;
+        }
+
+        Unit->Descriptors[type]++;
+        Unit->LastDescriptors[type] = *descriptor;
+        if ((type == V_INV_DESC_TYPE_WAIT) &&
+            ((descriptor->Uint128.Uint64Lo & B_INV_DESC_WAIT_SW) != 0))
+        {
+            *(volatile UINT32*)(UINTN)(descriptor->Uint128.Uint64Hi & ~(UINT64)0x3) =
+                (UINT32)RShiftU64(descriptor->Uint128.Uint64Lo, 32);
+        }
+        Unit->QueueHead = (Unit->QueueHead + LShiftU64(1, (UINTN)shift)) % (entryCount << shift);
+    }
+}
+
+/**
+ * @brief Returns the value of the 64-bit register, advancing commands waiting
+ *        for reads of it.
+ */
+static
+UINT64
+ReadSimulatedRegister (
+    IN OUT SIMULATED_DMAR_UNIT* Unit,
+    IN UINT64 Offset
+    )
+{
+    Unit->MmioReads++;
+    switch (Offset)
+    {
+    case R_CAP_REG:
+        return Unit->Capability.Uint64;
+    case R_ECAP_REG:
+        return Unit->ExtendedCapability.Uint64;
+    case R_GSTS_REG:
+        if (PollCommand(&Unit->GlobalCommandPolls) != FALSE)
+        {
+            Unit->GlobalStatus = Unit->PendingGlobalStatus;
+        }
+        return Unit->GlobalStatus;
+    case R_RTADDR_REG:
+        return Unit->RootTableAddress;
+    case R_CCMD_REG:
+        if (PollCommand(&Unit->ContextCommandPolls) != FALSE)
+        {
+            Unit->ContextCommand &= ~B_CCMD_REG_ICC;
+        }
+        return Unit->ContextCommand;
+    case R_FSTS_REG:
+        return Unit->FaultStatus;
+    case R_IQH_REG:
+        return Unit->QueueHead;
+    case R_IQT_REG:
+        return Unit->QueueTail;
+    case R_IQA_REG:
+        return Unit->QueueAddress;
+    case SIMULATED_IRO * 16 + R_IVA_REG:
+        return Unit->InvalidateAddress;
+    case SIMULATED_IRO * 16 + R_IOTLB_REG:
+        if (PollCommand(&Unit->IotlbPolls) != FALSE)
+        {
+            Unit->IotlbInvalidate &= ~B_IOTLB_REG_IVT;
+        }
+        return Unit->IotlbInvalidate;
+    default:
+        Unit->Violations++;
+        return 0;
+    }
+}
+
+/**
+ * @brief Updates the 64-bit register, starting the command written if any.
+ *
+ * @details Register-based invalidation while queued invalidation is enabled is
+ *          counted as a violation. See 6.5.2 Queued Invalidation Interface.
+ */
+static
+VOID
+WriteSimulatedRegister (
+    IN OUT SIMULATED_DMAR_UNIT* Unit,
+    IN UINT64 Offset,
+    IN UINT64 Value
+    )
+{
+    Unit->MmioWrites++;
+    switch (Offset)
+    {
+    case R_GCMD_REG:
+        WriteGlobalCommand(Unit, (UINT32)Value);
+        break;
+    case R_RTADDR_REG:
+        Unit->RootTableAddress = Value;
+        break;
+    case R_CCMD_REG:
+        if (((Unit->GlobalStatus & B_GSTS_REG_QIES) != 0) || (Unit->ContextCommandPolls != 0))
+        {
+            Unit->Violations++;
+        }
+        Unit->ContextCommand = Value;
+        if ((Value & B_CCMD_REG_ICC) != 0)
+        {
+            Unit->ContextInvalidations++;
+            Unit->ContextCommandPolls = Unit->CompletionLatency;
+            if (Unit->ContextCommandPolls == 0)
+            {
+                Unit->ContextCommand &= ~B_CCMD_REG_ICC;
+            }
+        }
+        break;
+    case R_FSTS_REG:
+        Unit->FaultStatus &= ~(UINT32)Value;
+        break;
+    case R_IQT_REG:
+        Unit->QueueTail = Value;
+        if ((Unit->GlobalStatus & B_GSTS_REG_QIES) != 0)
+        {
+            ProcessInvalidationQueue(Unit);
+        }
+        else if (Value != 0)
+        {
+            Unit->Violations++;
+        }
+        break;
+    case R_IQA_REG:
+        if ((Unit->GlobalStatus & B_GSTS_REG_QIES) != 0)
+        {
+            Unit->Violations++;
+        }
+        Unit->QueueAddress = Value;
+        break;
+    case SIMULATED_IRO * 16 + R_IVA_REG:
+        Unit->InvalidateAddress = Value;
+        break;
+    case SIMULATED_IRO * 16 + R_IOTLB_REG:
+        if (((Unit->GlobalStatus & B_GSTS_REG_QIES) != 0) || (Unit->IotlbPolls != 0))
+        {
+            Unit->Violations++;
+        }
+        Unit->IotlbInvalidate = Value;
+        if ((Value & B_IOTLB_REG_IVT) != 0)
+        {
+            Unit->IotlbInvalidations++;
+            Unit->IotlbPolls = Unit->CompletionLatency;
+            if (Unit->IotlbPolls == 0)
+            {
+                Unit->IotlbInvalidate &= ~B_IOTLB_REG_IVT;
+            }
+        }
+        break;
+    default:
+        Unit->Violations++;
+        break;
+    }
+}
+
+/**
+ * @brief Reads the 32-bit register at the offset from the register base.
+ */
+UINT32
+ReadDmarRegister32 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset
+    )
+{
+    return (UINT32)ReadSimulatedRegister((SIMULATED_DMAR_UNIT*)(UINTN)RegisterBase, Offset);
+}
+
+/**
+ * @brief Reads the 64-bit register at the offset from the register base.
+ */
+UINT64
+ReadDmarRegister64 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset
+    )
+{
+    return ReadSimulatedRegister((SIMULATED_DMAR_UNIT*)(UINTN)RegisterBase, Offset);
+}
+
+/**
+ * @brief Writes the 32-bit register at the offset from the register base.
+ */
+VOID
+WriteDmarRegister32 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset,
+    IN UINT32 Value
+    )
+{
+    WriteSimulatedRegister((SIMULATED_DMAR_UNIT*)(UINTN)RegisterBase, Offset, Value);
+}
+
+/**
+ * @brief Writes the 64-bit register at the offset from the register base.
+ */
+VOID
+WriteDmarRegister64 (
+    IN UINT64 RegisterBase,
+    IN UINT64 Offset,
+    IN UINT64 Value
+    )
+{
+    WriteSimulatedRegister((SIMULATED_DMAR_UNIT*)(UINTN)RegisterBase, Offset, Value);
+}
@@ -0,0 +1,83 @@
+#ifndef __SIMULATED_REGISTERS_H__
+#define __SIMULATED_REGISTERS_H__
+
+#include "../HelloIommuDxe.h"
+
+//
+// The software model of the registers of a hardware unit, standing in for
+// Registers.c in host builds. The address of the model is used as the register
+// base, so that DMAR_UNIT_INFORMATION.RegisterBaseVa identifies the model
+// without any lookup.
+//
+// Commands issued through the Global Command Register, the Context Command
+// Register and the IOTLB Invalidate Register complete after the register
+// reporting their completion is read CompletionLatency times, as if hardware
+// took that long. Descriptors in the invalidation queue are processed as soon
+// as the Invalidation Queue Tail Register is written, as their completion is
+// observed through memory rather than registers.
+//
+// Accesses the specification does not allow are counted in Violations instead
+// of being rejected, so that tests can assert none happened.
+//
+typedef struct _SIMULATED_DMAR_UNIT
+{
+    //
+    // The values of the registers as software reads them.
+    //
+    VTD_CAP_REG Capability;
+    VTD_ECAP_REG ExtendedCapability;
+    UINT32 GlobalStatus;
+    UINT64 RootTableAddress;
+    UINT64 ContextCommand;
+    UINT64 InvalidateAddress;
+    UINT64 IotlbInvalidate;
+    UINT32 FaultStatus;
+    UINT64 QueueHead;
+    UINT64 QueueTail;
+    UINT64 QueueAddress;
+
+    //
+    // The number of reads of the status register before a command completes,
+    // and for each kind of command in progress, the reads still needed. The
+    // Global Status Register then takes PendingGlobalStatus.
+    //
+    UINT64 CompletionLatency;
+    UINT64 GlobalCommandPolls;
+    UINT32 PendingGlobalStatus;
+    UINT64 ContextCommandPolls;
+    UINT64 IotlbPolls;
+
+    //
+    // Statistics. Descriptors are counted by their type, such as
+    // V_INV_DESC_TYPE_IOTLB, and the last one of each type is kept.
+    //
+    UINT64 MmioReads;
+    UINT64 MmioWrites;
+    UINT64 GlobalCommands;
+    UINT64 ContextInvalidations;
+    UINT64 IotlbInvalidations;
+    UINT64 Descriptors[16];
+    VTD_INVALIDATION_DESCRIPTOR LastDescriptors[16];
+    UINT64 Doorbells;
+    UINT64 Violations;
+} SIMULATED_DMAR_UNIT;
+
+VOID
+InitializeSimulatedDmarUnit (
+    OUT SIMULATED_DMAR_UNIT* Unit,
+    IN BOOLEAN QueuedInvalidation,
+    IN UINT64 CompletionLatency
+    );
+
+VOID
+InitializeDmarUnitInformation (
+    OUT DMAR_UNIT_INFORMATION* DmarUnit,
+    IN SIMULATED_DMAR_UNIT* Unit
+    );
+
+VOID
+ResetSimulatedDmarUnitStatistics (
+    IN OUT SIMULATED_DMAR_UNIT* Unit
+    );
+
+#endif
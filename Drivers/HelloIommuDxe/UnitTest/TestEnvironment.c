@@ -0,0 +1,205 @@
+#include "TestEnvironment.h"
+
+/**
+ * @brief Reports that no handle supports the protocol, as no PCI root bridge
+ *        exists in host builds.
+ */
+static
+EFI_STATUS
+EFIAPI
+TestLocateHandleBuffer (
+    IN EFI_LOCATE_SEARCH_TYPE SearchType,
+    IN EFI_GUID* Protocol OPTIONAL,
+    IN VOID* SearchKey OPTIONAL,
+    OUT UINTN* NoHandles,
+    OUT EFI_HANDLE** Buffer
+    )
+{
+    *NoHandles = 0;
+    *Buffer = NULL;
+    return EFI_NOT_FOUND;
+}
+
+/**
+ * @brief Returns immediately. Elapsed time is not calibrated in host builds.
+ */
+static
+EFI_STATUS
+EFIAPI
+TestStall (
+    IN UINTN Microseconds
+    )
+{
+    return EFI_SUCCESS;
+}
+
+//
+// The boot services the code under test uses. Others are left NULL.
+//
+static EFI_BOOT_SERVICES mTestBootServices =
+{
+    .Stall = TestStall,
+    .LocateHandleBuffer = TestLocateHandleBuffer,
+};
+
+EFI_BOOT_SERVICES* gBS = &mTestBootServices;
+
+/**
+ * @brief Creates simulated hardware units and builds passthrough translations
+ *        for them as the entry point does, including allocation of the
+ *        invalidation queues.
+ *
+ * @note DMA-remapping is not enabled. Call EnableDmaRemappingForAllUnits with
+ *       DmarUnits to do so.
+ */
+EFI_STATUS
+CreateTestEnvironment (
+    IN CONST TEST_CONFIGURATION* Configuration,
+    OUT TEST_ENVIRONMENT** Environment
+    )
+{
+    EFI_STATUS status;
+    TEST_ENVIRONMENT* environment;
+    DMAR_TRANSLATIONS* translations;
+    UINT64 poolPageCount;
+
+    ASSERT(Configuration->UnitCount <= TEST_MAX_UNIT_COUNT);
+    ASSERT((Configuration->ScalableMode == FALSE) || (Configuration->QueuedInvalidation != FALSE));
+
+    environment = AllocateZeroPool(sizeof(*environment));
+    if (environment == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    environment->DmarUnitCount = Configuration->UnitCount;
+    for (UINT64 i = 0; i < environment->DmarUnitCount; ++i)
+    {
+        SIMULATED_DMAR_UNIT* unit;
+
+        unit = &environment->SimulatedUnits[i];
+        InitializeSimulatedDmarUnit(unit,
+                                    Configuration->QueuedInvalidation,
+                                    Configuration->CompletionLatency);
+        if (Configuration->ScalableMode != FALSE)
+        {
+            unit->ExtendedCapability.Bits.SMTS = TRUE;
+            unit->ExtendedCapability.Bits.SLTS = TRUE;
+            unit->ExtendedCapability.Bits.SMPASID = TRUE;
+            unit->ExtendedCapability.Bits.PSS = 19;
+        }
+        InitializeDmarUnitInformation(&environment->DmarUnits[i], unit);
+    }
+
+    //
+    // Mirror the entry point. The domain ID limit follows ND of the model.
+    //
+    translations = &environment->Translations;
+    translations->ProximityDomain = MAX_UINT32;
+    translations->DomainIdLimit = MIN(DMAR_MAX_DOMAIN_COUNT,
+                                      LShiftU64(1, 4 + 2 * environment->DmarUnits[0].Capability.Bits.ND));
+    if (Configuration->ScalableMode != FALSE)
+    {
+        translations->ScalableMode = TRUE;
+        translations->PasidLimit = DMAR_MAX_PASID_COUNT;
+    }
+
+    poolPageCount = GetPassthroughTranslationsPageCount(Configuration->Ranges,
+                                                        Configuration->RangeCount,
+                                                        Configuration->Use1GbPages) +
+                    environment->DmarUnitCount +
+                    TEST_EXTRA_PAGE_COUNT;
+    if (Configuration->ScalableMode != FALSE)
+    {
+        poolPageCount += DMAR_SCALABLE_MODE_EXTRA_PAGE_COUNT;
+    }
+    status = InitializePageTablePool(&translations->Pool, poolPageCount);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+    InitializeCacheWriteback(&translations->Writeback, environment->DmarUnits, environment->DmarUnitCount);
+    status = BuildPassthroughTranslations(translations,
+                                          Configuration->Ranges,
+                                          Configuration->RangeCount,
+                                          Configuration->Use1GbPages);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    for (UINT64 i = 0; i < environment->DmarUnitCount; ++i)
+    {
+        environment->DmarUnits[i].Translations = translations;
+        status = AllocateInvalidationQueue(&environment->DmarUnits[i], &translations->Pool);
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+
+    *Environment = environment;
+
+Exit:
+    if (EFI_ERROR(status))
+    {
+        if (environment != NULL)
+        {
+            DestroyTestEnvironment(environment);
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Frees the environment created by CreateTestEnvironment.
+ */
+VOID
+DestroyTestEnvironment (
+    IN OUT TEST_ENVIRONMENT* Environment
+    )
+{
+    for (UINT64 i = 0; i < Environment->DmarUnitCount; ++i)
+    {
+        FreeInvalidationQueue(&Environment->DmarUnits[i], &Environment->Translations.Pool);
+    }
+    FreePageTablePool(&Environment->Translations.Pool);
+    FreePool(Environment);
+}
+
+/**
+ * @brief Clears the statistics of the simulated units and of the driver about
+ *        them, so that the next operation can be measured on its own.
+ */
+VOID
+ResetTestStatistics (
+    IN OUT TEST_ENVIRONMENT* Environment
+    )
+{
+    for (UINT64 i = 0; i < Environment->DmarUnitCount; ++i)
+    {
+        ResetSimulatedDmarUnitStatistics(&Environment->SimulatedUnits[i]);
+        ZeroMem(&Environment->DmarUnits[i].InvalidationStatistics,
+                sizeof(Environment->DmarUnits[i].InvalidationStatistics));
+    }
+}
+
+/**
+ * @brief Returns the number of register accesses not allowed by the
+ *        specification on all simulated units.
+ */
+UINT64
+GetTestViolationCount (
+    IN CONST TEST_ENVIRONMENT* Environment
+    )
+{
+    UINT64 violationCount;
+
+    violationCount = 0;
+    for (UINT64 i = 0; i < Environment->DmarUnitCount; ++i)
+    {
+        violationCount += Environment->SimulatedUnits[i].Violations;
+    }
+    return violationCount;
+}
@@ -0,0 +1,64 @@
+#ifndef __TEST_ENVIRONMENT_H__
+#define __TEST_ENVIRONMENT_H__
+
+#include "SimulatedRegisters.h"
+
+//
+// The maximum number of simulated hardware units in an environment.
+//
+#define TEST_MAX_UNIT_COUNT         8
+
+//
+// The number of pages reserved in the pool in addition to the passthrough
+// translations, for tables allocated for splitting and device domains.
+//
+#define TEST_EXTRA_PAGE_COUNT       256
+
+//
+// The shape of the environment to create.
+//
+typedef struct _TEST_CONFIGURATION
+{
+    UINT64 UnitCount;
+    BOOLEAN QueuedInvalidation;
+    BOOLEAN ScalableMode;
+    UINT64 CompletionLatency;
+    CONST DMAR_ADDRESS_RANGE* Ranges;
+    UINT64 RangeCount;
+    BOOLEAN Use1GbPages;
+} TEST_CONFIGURATION;
+
+//
+// Simulated hardware units and the translations built for them, set up the way
+// the entry point does for real hardware, short of enabling DMA-remapping.
+//
+typedef struct _TEST_ENVIRONMENT
+{
+    SIMULATED_DMAR_UNIT SimulatedUnits[TEST_MAX_UNIT_COUNT];
+    DMAR_UNIT_INFORMATION DmarUnits[TEST_MAX_UNIT_COUNT];
+    UINT64 DmarUnitCount;
+    DMAR_TRANSLATIONS Translations;
+} TEST_ENVIRONMENT;
+
+EFI_STATUS
+CreateTestEnvironment (
+    IN CONST TEST_CONFIGURATION* Configuration,
+    OUT TEST_ENVIRONMENT** Environment
+    );
+
+VOID
+DestroyTestEnvironment (
+    IN OUT TEST_ENVIRONMENT* Environment
+    );
+
+VOID
+ResetTestStatistics (
+    IN OUT TEST_ENVIRONMENT* Environment
+    );
+
+UINT64
+GetTestViolationCount (
+    IN CONST TEST_ENVIRONMENT* Environment
+    );
+
+#endif
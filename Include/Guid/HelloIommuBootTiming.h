@@ -0,0 +1,69 @@
+#ifndef __HELLO_IOMMU_BOOT_TIMING_H__
+#define __HELLO_IOMMU_BOOT_TIMING_H__
+
+//
+// The GUID of the configuration table HelloIommuDxe installs to publish how
+// long each phase of bringing up DMA-remapping took.
+//
+#define HELLO_IOMMU_BOOT_TIMING_TABLE_GUID \
+    { 0x0c673a07, 0xed2f, 0x4434, { 0xb8, 0x94, 0xf6, 0xcb, 0xb6, 0x92, 0xa8, 0xbc } }
+
+#define HELLO_IOMMU_BOOT_TIMING_TABLE_SIGNATURE     SIGNATURE_32('H', 'I', 'B', 'T')
+#define HELLO_IOMMU_BOOT_TIMING_TABLE_VERSION       1
+
+//
+// The phases of the entry point.
+//
+#define HELLO_IOMMU_PHASE_PROCESS_DMAR_TABLE        0
+#define HELLO_IOMMU_PHASE_BUILD_TRANSLATIONS        1
+#define HELLO_IOMMU_PHASE_ENABLE_DMA_REMAPPING      2
+#define HELLO_IOMMU_PHASE_CHANGE_PERMISSION         3
+#define HELLO_IOMMU_PHASE_COUNT                     4
+
+//
+// The kinds of waits for completion of MMIO operations on each unit.
+//
+#define HELLO_IOMMU_WAIT_ROOT_TABLE_POINTER         0   // GSTS.RTPS
+#define HELLO_IOMMU_WAIT_QUEUED_INVALIDATION_ENABLE 1   // GSTS.QIES
+#define HELLO_IOMMU_WAIT_TRANSLATION_ENABLE         2   // GSTS.TES
+#define HELLO_IOMMU_WAIT_CONTEXT_COMMAND            3   // CCMD.ICC
+#define HELLO_IOMMU_WAIT_IOTLB_INVALIDATE           4   // IOTLB.IVT
+#define HELLO_IOMMU_WAIT_INVALIDATION_QUEUE         5   // Invalidation wait descriptor
+#define HELLO_IOMMU_WAIT_COUNT                      6
+
+//
+// The statistics of one kind of measurement, in time stamp counter ticks.
+// MinimumTicks is MAX_UINT64 if Count is zero. SpinIterations is the total
+// number of polls made while waiting.
+//
+typedef struct _HELLO_IOMMU_TIMING_RECORD
+{
+    UINT64 Count;
+    UINT64 TotalTicks;
+    UINT64 MinimumTicks;
+    UINT64 MaximumTicks;
+    UINT64 SpinIterations;
+} HELLO_IOMMU_TIMING_RECORD;
+
+typedef struct _HELLO_IOMMU_UNIT_TIMING
+{
+    UINT64 RegisterBase;
+    HELLO_IOMMU_TIMING_RECORD Waits[HELLO_IOMMU_WAIT_COUNT];
+} HELLO_IOMMU_UNIT_TIMING;
+
+//
+// The configuration table. Units holds UnitCount entries.
+//
+typedef struct _HELLO_IOMMU_BOOT_TIMING_TABLE
+{
+    UINT32 Signature;
+    UINT32 Version;
+    UINT64 TimestampFrequency;
+    HELLO_IOMMU_TIMING_RECORD Phases[HELLO_IOMMU_PHASE_COUNT];
+    UINT64 UnitCount;
+    HELLO_IOMMU_UNIT_TIMING Units[1];
+} HELLO_IOMMU_BOOT_TIMING_TABLE;
+
+extern EFI_GUID gHelloIommuBootTimingTableGuid;
+
+#endif
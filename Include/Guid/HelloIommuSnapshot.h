@@ -0,0 +1,135 @@
+#ifndef __HELLO_IOMMU_SNAPSHOT_H__
+#define __HELLO_IOMMU_SNAPSHOT_H__
+
+//
+// The GUID of the configuration table HelloIommuDxe installs to describe the
+// active DMA-remapping configuration, so that an IOMMU-aware OS loader can
+// adopt the live tables instead of rebuilding them. The table is refreshed at
+// ReadyToBoot and remains after ExitBootServices.
+//
+#define HELLO_IOMMU_SNAPSHOT_TABLE_GUID \
+    { 0x0f34c756, 0x7bb4, 0x4e43, { 0xb5, 0x05, 0xcf, 0xf3, 0xde, 0xd0, 0x3d, 0xe2 } }
+
+#define HELLO_IOMMU_SNAPSHOT_SIGNATURE          SIGNATURE_32('H', 'I', 'S', 'N')
+#define HELLO_IOMMU_SNAPSHOT_VERSION            1
+
+//
+// The types of records following the header.
+//
+#define HELLO_IOMMU_SNAPSHOT_RECORD_UNIT        1
+#define HELLO_IOMMU_SNAPSHOT_RECORD_DOMAIN      2
+#define HELLO_IOMMU_SNAPSHOT_RECORD_DEVICE      3
+#define HELLO_IOMMU_SNAPSHOT_RECORD_RANGE       4
+#define HELLO_IOMMU_SNAPSHOT_RECORD_PASID       5
+
+//
+// The flags of the header.
+//
+#define HELLO_IOMMU_SNAPSHOT_SCALABLE_MODE      BIT0
+
+//
+// The flags of the domain record.
+//
+#define HELLO_IOMMU_SNAPSHOT_DOMAIN_PASSTHROUGH BIT0
+
+//
+// The header of the table, followed by RecordCount records in Length bytes in
+// total, including the header. Every page the live tables reference is within
+// the page table pool, which is the range the OS must preserve to adopt them.
+// Source-ids without a device record are in DefaultDomainId. RootTable is in
+// the scalable-mode format if Flags has HELLO_IOMMU_SNAPSHOT_SCALABLE_MODE.
+//
+typedef struct _HELLO_IOMMU_SNAPSHOT_HEADER
+{
+    UINT32 Signature;
+    UINT32 Version;
+    UINT32 Length;
+    UINT32 RecordCount;
+    UINT64 RootTable;
+    UINT64 PageTablePoolBase;
+    UINT64 PageTablePoolPageCount;
+    UINT16 DefaultDomainId;
+    UINT16 Flags;
+    UINT16 Reserved[2];
+} HELLO_IOMMU_SNAPSHOT_HEADER;
+
+//
+// The header of each record. Length is the size of the record including this
+// header, and a multiple of 8 bytes, so that unknown types can be skipped.
+//
+typedef struct _HELLO_IOMMU_SNAPSHOT_RECORD_HEADER
+{
+    UINT16 Type;
+    UINT16 Length;
+    UINT32 Reserved;
+} HELLO_IOMMU_SNAPSHOT_RECORD_HEADER;
+
+//
+// A hardware unit with DMA-remapping enabled on RootTable. This is the root
+// table in the header, or a replica of the tables in the memory local to the
+// unit, translating the same way and in a reservation of the same size.
+//
+typedef struct _HELLO_IOMMU_SNAPSHOT_UNIT
+{
+    HELLO_IOMMU_SNAPSHOT_RECORD_HEADER Header;
+    UINT64 RegisterBase;
+    UINT64 Capability;
+    UINT64 ExtendedCapability;
+    UINT64 RootTable;
+} HELLO_IOMMU_SNAPSHOT_UNIT;
+
+//
+// A domain, and the second-level PML4 of it. SlPml4 is zero for the
+// pass-through domain.
+//
+typedef struct _HELLO_IOMMU_SNAPSHOT_DOMAIN
+{
+    HELLO_IOMMU_SNAPSHOT_RECORD_HEADER Header;
+    UINT16 DomainId;
+    UINT16 Flags;
+    UINT32 Reserved;
+    UINT64 SlPml4;
+} HELLO_IOMMU_SNAPSHOT_DOMAIN;
+
+//
+// A source-id (bus << 8 | device << 3 | function) not in the default domain.
+//
+typedef struct _HELLO_IOMMU_SNAPSHOT_DEVICE
+{
+    HELLO_IOMMU_SNAPSHOT_RECORD_HEADER Header;
+    UINT16 SourceId;
+    UINT16 DomainId;
+    UINT32 Reserved;
+} HELLO_IOMMU_SNAPSHOT_DEVICE;
+
+//
+// A PASID of the source-id with its own address space, in scalable mode.
+// Requests without PASID are in the domain of the device record instead.
+//
+typedef struct _HELLO_IOMMU_SNAPSHOT_PASID
+{
+    HELLO_IOMMU_SNAPSHOT_RECORD_HEADER Header;
+    UINT16 SourceId;
+    UINT16 DomainId;
+    UINT32 Pasid;
+} HELLO_IOMMU_SNAPSHOT_PASID;
+
+//
+// A run of device addresses of the domain translated to contiguous host
+// addresses with the same permissions (BIT0: read, BIT1: write). Device
+// addresses not covered by any range of the domain are not accessible.
+//
+typedef struct _HELLO_IOMMU_SNAPSHOT_RANGE
+{
+    HELLO_IOMMU_SNAPSHOT_RECORD_HEADER Header;
+    UINT16 DomainId;
+    UINT8 Permissions;
+    UINT8 Reserved[5];
+    UINT64 DeviceAddress;
+    UINT64 HostAddress;
+    UINT64 Length;
+} HELLO_IOMMU_SNAPSHOT_RANGE;
+
+extern EFI_GUID gHelloIommuSnapshotTableGuid;
+
+#endif
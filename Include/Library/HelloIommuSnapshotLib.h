@@ -0,0 +1,71 @@
+#ifndef __HELLO_IOMMU_SNAPSHOT_LIB_H__
+#define __HELLO_IOMMU_SNAPSHOT_LIB_H__
+
+#include <Guid/HelloIommuSnapshot.h>
+
+//
+// The library to parse the snapshot table installed by HelloIommuDxe. It
+// depends on nothing but base types, so that OS loaders and host tools can
+// build it as well.
+//
+
+/**
+ * @brief Validates the header and the bounds of all records of the snapshot.
+ *
+ * @param Snapshot - The snapshot table.
+ * @param Size - The number of bytes readable at Snapshot.
+ *
+ * @return RETURN_SUCCESS if all records can be walked safely, or
+ *         RETURN_INCOMPATIBLE_VERSION if the version is not supported.
+ */
+RETURN_STATUS
+EFIAPI
+ValidateHelloIommuSnapshot (
+    IN CONST VOID* Snapshot,
+    IN UINTN Size
+    );
+
+/**
+ * @brief Returns the record following the given one, or the first record if
+ *        Record is NULL.
+ *
+ * @return The record, or NULL if no more record exists.
+ */
+CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER*
+EFIAPI
+GetNextHelloIommuSnapshotRecord (
+    IN CONST HELLO_IOMMU_SNAPSHOT_HEADER* Snapshot,
+    IN CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER* Record OPTIONAL
+    );
+
+/**
+ * @brief Returns the domain ID the source-id is in.
+ */
+UINT16
+EFIAPI
+GetHelloIommuSnapshotDomainOfDevice (
+    IN CONST HELLO_IOMMU_SNAPSHOT_HEADER* Snapshot,
+    IN UINT16 SourceId
+    );
+
+/**
+ * @brief Translates the device address issued by the source-id according to
+ *        the snapshot.
+ *
+ * @param HostAddress - The host address the device address translates to.
+ * @param Permissions - BIT0 if readable, and BIT1 if writable.
+ *
+ * @return RETURN_SUCCESS if translated, or RETURN_NOT_FOUND if the device
+ *         cannot access the address.
+ */
+RETURN_STATUS
+EFIAPI
+TranslateWithHelloIommuSnapshot (
+    IN CONST HELLO_IOMMU_SNAPSHOT_HEADER* Snapshot,
+    IN UINT16 SourceId,
+    IN UINT64 DeviceAddress,
+    OUT UINT64* HostAddress,
+    OUT UINT8* Permissions
+    );
+
+#endif
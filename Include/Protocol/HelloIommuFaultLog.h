@@ -0,0 +1,138 @@
+#ifndef __HELLO_IOMMU_FAULT_LOG_H__
+#define __HELLO_IOMMU_FAULT_LOG_H__
+
+//
+// The protocol HelloIommuDxe installs to hand out DMA-remapping faults drained
+// from the fault-recording registers of all hardware units.
+//
+#define HELLO_IOMMU_FAULT_LOG_PROTOCOL_GUID \
+    { 0x3d01a6c4, 0x366b, 0x4922, { 0xae, 0xc5, 0xc4, 0x46, 0x23, 0xfa, 0x23, 0x33 } }
+
+//
+// The GUID of the configuration table holding per source-id statistics of
+// faults. The table remains after ExitBootServices, as of the last drain.
+//
+#define HELLO_IOMMU_FAULT_STATISTICS_TABLE_GUID \
+    { 0xe3d5c212, 0x4c3b, 0x4714, { 0xb0, 0xbd, 0xba, 0x13, 0x61, 0xa1, 0xb7, 0xfe } }
+
+#define HELLO_IOMMU_FAULT_LOG_PROTOCOL_REVISION     2
+
+#define HELLO_IOMMU_FAULT_STATISTICS_TABLE_SIGNATURE    SIGNATURE_32('H', 'I', 'F', 'S')
+#define HELLO_IOMMU_FAULT_STATISTICS_TABLE_VERSION      1
+
+typedef struct _HELLO_IOMMU_FAULT_LOG_PROTOCOL HELLO_IOMMU_FAULT_LOG_PROTOCOL;
+
+//
+// A decoded primary fault record. See 10.4.14 Fault Recording Registers.
+//
+typedef struct _HELLO_IOMMU_FAULT_RECORD
+{
+    UINT64 RegisterBase;    // The hardware unit that recorded the fault
+    UINT64 Address;         // The page address of the faulting request
+    UINT16 SourceId;        // The requester (bus << 8 | device << 3 | function)
+    UINT8 Reason;           // The fault reason. See 7.1.3 Fault Conditions
+    BOOLEAN Read;           // TRUE for a read request, FALSE for a write
+} HELLO_IOMMU_FAULT_RECORD;
+
+//
+// The counts kept regardless of records lost. TotalFaults is the number of
+// records drained from hardware, DroppedRecords is the number of those not
+// queued because the queue was full, and HardwareOverflows is the number of
+// times hardware reported losing records (FSTS.PFO).
+//
+typedef struct _HELLO_IOMMU_FAULT_SUMMARY
+{
+    UINT64 TotalFaults;
+    UINT64 DroppedRecords;
+    UINT64 HardwareOverflows;
+} HELLO_IOMMU_FAULT_SUMMARY;
+
+//
+// The aggregated faults caused by a single source-id. An entry with Count of
+// zero is unused.
+//
+typedef struct _HELLO_IOMMU_SOURCE_FAULT_STATISTICS
+{
+    UINT16 SourceId;
+    UINT8 LastReason;
+    UINT8 Reserved[5];
+    UINT64 Count;
+    UINT64 FirstAddress;
+    UINT64 LastAddress;
+} HELLO_IOMMU_SOURCE_FAULT_STATISTICS;
+
+//
+// The configuration table. Entries is a hash table of EntryCount entries keyed
+// by the source-id. UntrackedFaults counts faults of source-ids that did not
+// fit in the table.
+//
+typedef struct _HELLO_IOMMU_FAULT_STATISTICS_TABLE
+{
+    UINT32 Signature;
+    UINT32 Version;
+    UINT64 EntryCount;
+    UINT64 UntrackedFaults;
+    HELLO_IOMMU_SOURCE_FAULT_STATISTICS Entries[1];
+} HELLO_IOMMU_FAULT_STATISTICS_TABLE;
+
+/**
+ * @brief Drains the fault-recording registers of all hardware units now,
+ *        instead of waiting for the periodic drain.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *HELLO_IOMMU_FAULT_LOG_DRAIN) (
+    IN HELLO_IOMMU_FAULT_LOG_PROTOCOL* This
+    );
+
+/**
+ * @brief Removes the oldest record from the queue.
+ *
+ * @details Multiple consumers may call this concurrently, and each record is
+ *          returned to exactly one of them.
+ *
+ * @return EFI_NOT_FOUND if the queue is empty.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *HELLO_IOMMU_FAULT_LOG_GET_RECORD) (
+    IN HELLO_IOMMU_FAULT_LOG_PROTOCOL* This,
+    OUT HELLO_IOMMU_FAULT_RECORD* Record
+    );
+
+/**
+ * @brief Returns the counts of faults since the driver started.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *HELLO_IOMMU_FAULT_LOG_GET_SUMMARY) (
+    IN HELLO_IOMMU_FAULT_LOG_PROTOCOL* This,
+    OUT HELLO_IOMMU_FAULT_SUMMARY* Summary
+    );
+
+/**
+ * @brief Returns the statistics of faults caused by the source-id.
+ *
+ * @return EFI_NOT_FOUND if no fault from the source-id is tracked.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *HELLO_IOMMU_FAULT_LOG_GET_SOURCE_STATISTICS) (
+    IN HELLO_IOMMU_FAULT_LOG_PROTOCOL* This,
+    IN UINT16 SourceId,
+    OUT HELLO_IOMMU_SOURCE_FAULT_STATISTICS* Statistics
+    );
+
+struct _HELLO_IOMMU_FAULT_LOG_PROTOCOL
+{
+    UINT64 Revision;
+    HELLO_IOMMU_FAULT_LOG_DRAIN Drain;
+    HELLO_IOMMU_FAULT_LOG_GET_RECORD GetRecord;
+    HELLO_IOMMU_FAULT_LOG_GET_SUMMARY GetSummary;
+    HELLO_IOMMU_FAULT_LOG_GET_SOURCE_STATISTICS GetSourceStatistics;  // Revision 2
+};
+
+extern EFI_GUID gHelloIommuFaultLogProtocolGuid;
+extern EFI_GUID gHelloIommuFaultStatisticsTableGuid;
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __HELLO_IOMMU_PASID_H__
+#define __HELLO_IOMMU_PASID_H__
+
+//
+// The protocol HelloIommuDxe installs when the tables are in the scalable-mode
+// format, to give devices separate address spaces for requests with PASIDs,
+// such as those of clients of an accelerator. Requests without PASID remain
+// managed through EDKII_IOMMU_PROTOCOL.
+//
+#define HELLO_IOMMU_PASID_PROTOCOL_GUID \
+    { 0x9888061c, 0x6394, 0x4ccd, { 0x88, 0x1d, 0x3b, 0xf2, 0x08, 0x47, 0x2d, 0x6d } }
+
+#define HELLO_IOMMU_PASID_PROTOCOL_REVISION     1
+
+typedef struct _HELLO_IOMMU_PASID_PROTOCOL HELLO_IOMMU_PASID_PROTOCOL;
+
+/**
+ * @brief Grants or revokes access of the device with the PASID to the pages.
+ *
+ * @details The device is given the address space for the PASID on the first
+ *          call, starting with no access, and requests with the PASID are
+ *          translated with it from then. DeviceAddress, HostAddress and
+ *          NumberOfBytes must be aligned to 4KB. IoMmuAccess is a combination
+ *          of EDKII_IOMMU_ACCESS_READ and EDKII_IOMMU_ACCESS_WRITE, or zero to
+ *          revoke access.
+ *
+ * @return EFI_UNSUPPORTED if the PASID is zero, which is used for requests
+ *         without PASID, or not below MaxPasid.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *HELLO_IOMMU_PASID_SET_ATTRIBUTE) (
+    IN HELLO_IOMMU_PASID_PROTOCOL* This,
+    IN EFI_HANDLE DeviceHandle,
+    IN UINT32 Pasid,
+    IN UINT64 DeviceAddress,
+    IN UINT64 HostAddress,
+    IN UINT64 NumberOfBytes,
+    IN UINT64 IoMmuAccess
+    );
+
+struct _HELLO_IOMMU_PASID_PROTOCOL
+{
+    UINT64 Revision;
+    UINT32 MaxPasid;    // The number of PASIDs all hardware units support
+    HELLO_IOMMU_PASID_SET_ATTRIBUTE SetAttribute;
+};
+
+extern EFI_GUID gHelloIommuPasidProtocolGuid;
+
+#endif
@@ -0,0 +1,199 @@
+#include <Base.h>
+#include <Library/HelloIommuSnapshotLib.h>
+
+/**
+ * @brief Returns the minimum length of the record of the type, or the size of
+ *        the record header for unknown types.
+ */
+static
+UINTN
+GetMinimumRecordLength (
+    IN UINT16 Type
+    )
+{
+    switch (Type)
+    {
+    case HELLO_IOMMU_SNAPSHOT_RECORD_UNIT:
+        return sizeof(HELLO_IOMMU_SNAPSHOT_UNIT);
+    case HELLO_IOMMU_SNAPSHOT_RECORD_DOMAIN:
+        return sizeof(HELLO_IOMMU_SNAPSHOT_DOMAIN);
+    case HELLO_IOMMU_SNAPSHOT_RECORD_DEVICE:
+        return sizeof(HELLO_IOMMU_SNAPSHOT_DEVICE);
+    case HELLO_IOMMU_SNAPSHOT_RECORD_RANGE:
+        return sizeof(HELLO_IOMMU_SNAPSHOT_RANGE);
+    case HELLO_IOMMU_SNAPSHOT_RECORD_PASID:
+        return sizeof(HELLO_IOMMU_SNAPSHOT_PASID);
+    default:
+        return sizeof(HELLO_IOMMU_SNAPSHOT_RECORD_HEADER);
+    }
+}
+
+/**
+ * @brief Validates the header and the bounds of all records of the snapshot.
+ *
+ * @details Records of unknown types are allowed and skipped by readers, so
+ *          that new types can be added without changing the version.
+ */
+RETURN_STATUS
+EFIAPI
+ValidateHelloIommuSnapshot (
+    IN CONST VOID* Snapshot,
+    IN UINTN Size
+    )
+{
+    CONST HELLO_IOMMU_SNAPSHOT_HEADER* header;
+    UINTN offset;
+
+    header = (CONST HELLO_IOMMU_SNAPSHOT_HEADER*)Snapshot;
+    if ((Snapshot == NULL) ||
+        (Size < sizeof(*header)) ||
+        (header->Signature != HELLO_IOMMU_SNAPSHOT_SIGNATURE) ||
+        (header->Length < sizeof(*header)) ||
+        (header->Length > Size))
+    {
+        return RETURN_INVALID_PARAMETER;
+    }
+    if (header->Version != HELLO_IOMMU_SNAPSHOT_VERSION)
+    {
+        return RETURN_INCOMPATIBLE_VERSION;
+    }
+
+    offset = sizeof(*header);
+    for (UINT32 i = 0; i < header->RecordCount; ++i)
+    {
+        CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER* record;
+
+        if ((header->Length - offset) < sizeof(*record))
+        {
+            return RETURN_INVALID_PARAMETER;
+        }
+        record = (CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER*)((CONST UINT8*)Snapshot + offset);
+        if ((record->Length < GetMinimumRecordLength(record->Type)) ||
+            ((record->Length % sizeof(UINT64)) != 0) ||
+            (record->Length > (header->Length - offset)))
+        {
+            return RETURN_INVALID_PARAMETER;
+        }
+        offset += record->Length;
+    }
+    return (offset == header->Length) ? RETURN_SUCCESS : RETURN_INVALID_PARAMETER;
+}
+
+/**
+ * @brief Returns the record following the given one, or the first record if
+ *        Record is NULL.
+ *
+ * @note The snapshot must be validated with ValidateHelloIommuSnapshot.
+ */
+CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER*
+EFIAPI
+GetNextHelloIommuSnapshotRecord (
+    IN CONST HELLO_IOMMU_SNAPSHOT_HEADER* Snapshot,
+    IN CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER* Record OPTIONAL
+    )
+{
+    UINTN offset;
+
+    if (Record == NULL)
+    {
+        offset = sizeof(*Snapshot);
+    }
+    else
+    {
+        offset = (UINTN)((CONST UINT8*)Record - (CONST UINT8*)Snapshot) + Record->Length;
+    }
+    if (offset >= Snapshot->Length)
+    {
+        return NULL;
+    }
+    return (CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER*)((CONST UINT8*)Snapshot + offset);
+}
+
+/**
+ * @brief Returns the domain ID the source-id is in, that is, the one of its
+ *        device record if any, or the default domain.
+ */
+UINT16
+EFIAPI
+GetHelloIommuSnapshotDomainOfDevice (
+    IN CONST HELLO_IOMMU_SNAPSHOT_HEADER* Snapshot,
+    IN UINT16 SourceId
+    )
+{
+    CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER* record;
+
+    for (record = GetNextHelloIommuSnapshotRecord(Snapshot, NULL);
+         record != NULL;
+         record = GetNextHelloIommuSnapshotRecord(Snapshot, record))
+    {
+        CONST HELLO_IOMMU_SNAPSHOT_DEVICE* device;
+
+        if (record->Type != HELLO_IOMMU_SNAPSHOT_RECORD_DEVICE)
+        {
+            continue;
+        }
+        device = (CONST HELLO_IOMMU_SNAPSHOT_DEVICE*)record;
+        if (device->SourceId == SourceId)
+        {
+            return device->DomainId;
+        }
+    }
+    return Snapshot->DefaultDomainId;
+}
+
+/**
+ * @brief Translates the device address issued by the source-id according to
+ *        the snapshot.
+ *
+ * @details Devices in the pass-through domain access host addresses as-is.
+ *          Otherwise, the range of the domain containing the address is
+ *          looked up.
+ */
+RETURN_STATUS
+EFIAPI
+TranslateWithHelloIommuSnapshot (
+    IN CONST HELLO_IOMMU_SNAPSHOT_HEADER* Snapshot,
+    IN UINT16 SourceId,
+    IN UINT64 DeviceAddress,
+    OUT UINT64* HostAddress,
+    OUT UINT8* Permissions
+    )
+{
+    CONST HELLO_IOMMU_SNAPSHOT_RECORD_HEADER* record;
+    UINT16 domainId;
+
+    domainId = GetHelloIommuSnapshotDomainOfDevice(Snapshot, SourceId);
+    for (record = GetNextHelloIommuSnapshotRecord(Snapshot, NULL);
+         record != NULL;
+         record = GetNextHelloIommuSnapshotRecord(Snapshot, record))
+    {
+        if (record->Type == HELLO_IOMMU_SNAPSHOT_RECORD_DOMAIN)
+        {
+            CONST HELLO_IOMMU_SNAPSHOT_DOMAIN* domain;
+
+            domain = (CONST HELLO_IOMMU_SNAPSHOT_DOMAIN*)record;
+            if ((domain->DomainId == domainId) &&
+                ((domain->Flags & HELLO_IOMMU_SNAPSHOT_DOMAIN_PASSTHROUGH) != 0))
+            {
+                *HostAddress = DeviceAddress;
+                *Permissions = BIT0 | BIT1;
+                return RETURN_SUCCESS;
+            }
+        }
+        else if (record->Type == HELLO_IOMMU_SNAPSHOT_RECORD_RANGE)
+        {
+            CONST HELLO_IOMMU_SNAPSHOT_RANGE* range;
+
+            range = (CONST HELLO_IOMMU_SNAPSHOT_RANGE*)record;
+            if ((range->DomainId == domainId) &&
+                (DeviceAddress >= range->DeviceAddress) &&
+                ((DeviceAddress - range->DeviceAddress) < range->Length))
+            {
+                *HostAddress = range->HostAddress + (DeviceAddress - range->DeviceAddress);
+                *Permissions = range->Permissions;
+                return RETURN_SUCCESS;
+            }
+        }
+    }
+    return RETURN_NOT_FOUND;
+}